@@ -0,0 +1,160 @@
+/**
+ * @file access.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief access log module implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "access.h"
+#include "cache.h"
+#include "debug.h"
+#include "log.h"
+#include "request.h"
+#include "response.h"
+
+#define ACCESS_URI_MAX 512
+#define ACCESS_TIME_SIZE 32
+
+static log_s *access_log = NULL;
+static char *access_path = NULL;
+
+/* The formatted time is cached per thread and rebuilt when the second
+   changes, as for the Date header. */
+static __thread time_t access_time = 0;
+static __thread char access_time_str[ACCESS_TIME_SIZE];
+
+static const char *encoding_name(http_response_s *response);
+static size_t escape_uri(char *buffer, size_t size, const char *uri);
+static const char *format_time(void);
+
+int access_init(const char *path, const char *app_name) {
+    debug_enter();
+    FILE *fs = fopen(path, "a");
+    if (fs == NULL) {
+        debug_return 1;
+    }
+    access_path = strdup(path);
+    if (access_path == NULL) {
+        fclose(fs);
+        debug_return 1;
+    }
+    access_log = log_init(LOG_INFO, app_name, fs);
+    if (access_log == NULL) {
+        fclose(fs);
+        free(access_path);
+        access_path = NULL;
+        debug_return 1;
+    }
+    debug_return 0;
+}
+
+void access_write(http_client_s *client, request_s *request, http_response_s *response, const struct timespec *start) {
+    debug_enter();
+    if (access_log == NULL) {
+        debug_return;
+    }
+    char uri[ACCESS_URI_MAX + 8];
+    const char *method = "-";
+    if (request != NULL && request->uri != NULL) {
+        method = request_method_str[request->method];
+        escape_uri(uri, sizeof(uri), request->uri);
+    } else {
+        strcpy(uri, "-");
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long duration = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+    log_write_raw(access_log, "{\"time\":\"%s\",\"client\":\"%s\",\"method\":\"%s\",\"uri\":\"%s\",\"status\":%.3s,\"bytes\":%zu,\"encoding\":\"%s\",\"cache\":\"%s\",\"keepalive\":%s,\"duration_us\":%lld}",
+        format_time(),
+        client->ip,
+        method,
+        uri,
+        response_code_str[response->code],
+        response->sent,
+        encoding_name(response),
+        (response->code == HTTP_RESPONSE_200 || response->code == HTTP_RESPONSE_206 || response->code == HTTP_RESPONSE_304) && response->element != NULL ? "hit" : "miss",
+        client->keep_alive ? "true" : "false",
+        duration);
+    debug_return;
+}
+
+void access_reopen(void) {
+    debug_enter();
+    if (access_log != NULL) {
+        log_reopen(access_log, access_path);
+    }
+    debug_return;
+}
+
+void access_cleanup(void) {
+    debug_enter();
+    if (access_log != NULL) {
+        log_cleanup(access_log);
+        access_log = NULL;
+    }
+    free(access_path);
+    access_path = NULL;
+    debug_return;
+}
+
+/**
+ * @brief Returns the name of the content encoding of the body sent.
+ */
+static const char *encoding_name(http_response_s *response) {
+    if (response->variant != NULL && response->element != NULL) {
+        for (int i = 0; i < CACHE_ENCODING_COUNT; i++) {
+            if (response->element->variants[i] == response->variant) {
+                return cache_encoding_str[i];
+            }
+        }
+    }
+    return cache_encoding_str[CACHE_ENCODING_IDENTITY];
+}
+
+/**
+ * @brief Copies uri into buffer as the contents of a JSON string, escaping
+ * quotes, backslashes and control characters. Long URIs are truncated at
+ * ACCESS_URI_MAX bytes. Returns the length copied.
+ */
+static size_t escape_uri(char *buffer, size_t size, const char *uri) {
+    static const char hex[] = "0123456789abcdef";
+    size_t len = 0;
+    for (const unsigned char *p = (const unsigned char *)uri; *p != '\0' && len < ACCESS_URI_MAX && len + 7 < size; p++) {
+        if (*p == '"' || *p == '\\') {
+            buffer[len++] = '\\';
+            buffer[len++] = *p;
+        } else if (*p < 0x20 || *p == 0x7f) {
+            buffer[len++] = '\\';
+            buffer[len++] = 'u';
+            buffer[len++] = '0';
+            buffer[len++] = '0';
+            buffer[len++] = hex[*p >> 4];
+            buffer[len++] = hex[*p & 0x0f];
+        } else {
+            buffer[len++] = *p;
+        }
+    }
+    buffer[len] = '\0';
+    return len;
+}
+
+/**
+ * @brief Returns the current time in ISO 8601 format, UTC.
+ */
+static const char *format_time(void) {
+    time_t now = time(NULL);
+    if (now != access_time) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(access_time_str, sizeof(access_time_str), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        access_time = now;
+    }
+    return access_time_str;
+}
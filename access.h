@@ -0,0 +1,52 @@
+/**
+ * @file access.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief access log module declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef ACCESS_H
+#define ACCESS_H
+
+#include "http.h"
+
+/**
+ * @brief Opens the access log. Every response sent is recorded as one line
+ * of JSON: time, client, method, uri, status, bytes sent, content encoding,
+ * whether the resource was found in the cache, whether the connection was 
+ * kept alive and the time from receiving the request to sending the last 
+ * byte in microseconds. The access log has its own queue and writer thread, separate
+ * from the server log, and logging a request never blocks.
+ * @param path Path of the file to append to.
+ * @param app_name Application name, as for log_init().
+ * @return 0 on success.
+ */
+extern int access_init(const char *path, const char *app_name);
+
+/**
+ * @brief Records a response just sent to the client. Does nothing if the
+ * access log is not open.
+ * @param client The client.
+ * @param request The request answered, the client's own or an HTTP/2
+ * stream's.
+ * @param response The response sent.
+ * @param start When the request arrived, which the duration is counted from.
+ * @return nothing
+ */
+extern void access_write(http_client_s *client, struct request_s *request, http_response_s *response, const struct timespec *start);
+
+/**
+ * @brief Reopens the access log file by the same path, for log rotation.
+ * @return nothing
+ */
+extern void access_reopen(void);
+
+/**
+ * @brief Flushes and closes the access log.
+ * @return nothing
+ */
+extern void access_cleanup(void);
+
+#endif // ACCESS_H
@@ -0,0 +1,757 @@
+/**
+ * @file bench.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Microbenchmarks for the request parser, cache lookup, response
+ * headers, per-client limits and the log, linked against the server's own
+ * objects.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "debug.h"
+#include "http.h"
+#include "limit.h"
+#include "log.h"
+#include "option.h"
+#include "request.h"
+#include "response.h"
+
+#define BENCH_SEQUENCE_SIZE 65536
+#define BENCH_FILES_PER_DIR 100
+#define BENCH_THREADS_MAX 64
+#define BENCH_SCALING_FILES 1000
+#define BENCH_PASS_LOOKUPS 64
+#define BENCH_LIMIT_ADDRESSES 4096
+
+const char const *program_name = "nvbench";
+
+static const size_t docroot_sizes[] = {100, 1000, 10000, 100000};
+
+/**
+ * @brief One request of the corpus, with CRLF line endings.
+ */
+typedef struct corpus_entry_s {
+    char *data;
+    size_t len;
+} corpus_entry_s;
+
+/**
+ * @brief Work for one cache lookup thread: count lookups through the paths
+ * in sequence, starting at offset. pass is how many lookups are made in 
+ * each cache pass, as a worker makes them, or 0 for lookups outside a pass
+ * that take and release a reference.
+ */
+typedef struct cache_job_s {
+    char **sequence;
+    size_t offset;
+    size_t count;
+    size_t pass;
+    pthread_t thread;
+} cache_job_s;
+
+/**
+ * @brief A thread reloading the cache from dir until stop is set, to time
+ * lookups while the table is being replaced.
+ */
+typedef struct reload_job_s {
+    const char *dir;
+    log_s *log;
+    atomic_bool stop;
+    size_t count;
+    pthread_t thread;
+} reload_job_s;
+
+/**
+ * @brief Work for one limits thread: count connections opened and closed
+ * from the addresses in addrs, starting at offset.
+ */
+typedef struct limit_job_s {
+    struct sockaddr_storage *addrs;
+    size_t offset;
+    size_t count;
+    pthread_t thread;
+} limit_job_s;
+
+/**
+ * @brief Work for one log writer thread.
+ */
+typedef struct log_job_s {
+    log_s *log;
+    size_t count;
+    pthread_t thread;
+} log_job_s;
+
+static option_s option_h = {
+    .name = "h",
+    .description = "Show this help text",
+    .arg_type = option_arg_none,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_n = {
+    .name = "n",
+    .description = "Iterations of each benchmark, default 1000000",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_r = {
+    .name = "r",
+    .description = "Request corpus, requests separated by blank lines, default bench/requests.txt",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_t = {
+    .name = "t",
+    .description = "Most threads for the threaded benchmarks, default 8",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s *options[] = {
+    &option_h,
+    &option_n,
+    &option_r,
+    &option_t,
+    NULL
+};
+
+static size_t iterations = 1000000;
+static int threads_max = 8;
+static volatile size_t sink = 0;
+
+static int bench_cache(void);
+static void bench_headers(void);
+static int bench_limit(void);
+static int bench_log(void);
+static int bench_parse(const char *corpus_path);
+static void *cache_worker(void *arg);
+static void *limit_worker(void *arg);
+static corpus_entry_s *load_corpus(const char *path, size_t *count);
+static void *log_worker(void *arg);
+static char **make_docroot(const char *dir, size_t count);
+static uint64_t next_random(uint64_t *state);
+static uint64_t now_ns(void);
+static void *reload_worker(void *arg);
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+static void report(const char *name, size_t ops, uint64_t ns);
+static uint64_t run_cache_lookups(char **sequence, int threads, size_t pass);
+
+int main(int argc, char *argv[]) {
+    debug_enter();
+    int rc = 1;
+    if (option_parse_args(options, argc, argv) != 0 || option_h.present) {
+        option_show_help(options);
+        goto term;
+    }
+    if (option_n.present) {
+        iterations = strtoul(option_n.value, NULL, 10);
+    }
+    if (option_t.present) {
+        threads_max = atoi(option_t.value);
+    }
+    if (iterations == 0 || threads_max < 1 || threads_max > BENCH_THREADS_MAX) {
+        fprintf(stderr, "iterations must be positive and threads 1 to %d\n", BENCH_THREADS_MAX);
+        goto term;
+    }
+    printf("%-40s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "Mops/s");
+    if (bench_parse(option_r.present ? option_r.value : "bench/requests.txt") != 0) {
+        goto term;
+    }
+    if (bench_cache() != 0) {
+        goto term;
+    }
+    bench_headers();
+    if (bench_limit() != 0) {
+        goto term;
+    }
+    if (bench_log() != 0) {
+        goto term;
+    }
+    rc = 0;
+term:
+    debug_return rc;
+}
+
+/**
+ * @brief Times cache_find() and cache_release() over docroots of several
+ * sizes, with paths drawn uniformly, from a Zipf distribution (a few hot
+ * files, as real traffic has) and from paths that are not cached, on one
+ * thread and on threads_max threads. For the docroot of
+ * BENCH_SCALING_FILES, uniform lookups are also timed on 1 to
+ * BENCH_THREADS_MAX threads whatever threads_max is, alone and with
+ * another thread reloading the cache throughout, and so are lookups of a
+ * single hot file, outside a pass and in passes of BENCH_PASS_LOOKUPS 
+ * lookups, where threads share the element's cache line only by reading
+ * it.
+ */
+static int bench_cache(void) {
+    debug_enter();
+    int rc = 1;
+    log_s *log = log_init(LOG_ERROR, program_name, stderr);
+    char dir[] = "/tmp/nvbench.XXXXXX";
+    char **paths = NULL;
+    char **sequence = malloc(BENCH_SEQUENCE_SIZE * sizeof(char *));
+    char **missing = calloc(BENCH_SEQUENCE_SIZE, sizeof(char *));
+    double *cdf = NULL;
+    if (log == NULL || sequence == NULL || missing == NULL || mkdtemp(dir) == NULL) {
+        fprintf(stderr, "cache benchmark setup failed: %s\n", strerror(errno));
+        goto term;
+    }
+    for (size_t i = 0; i < BENCH_SEQUENCE_SIZE; i++) {
+        if (asprintf(&missing[i], "/missing/f%05zu.html", i) < 0) {
+            missing[i] = NULL;
+            fprintf(stderr, "asprintf failed\n");
+            goto term;
+        }
+    }
+    cache_config_s config = {
+        .sendfile_threshold = 0,
+        .compress = false,
+        .headers = "",
+        .cache_control = NULL,
+        .cache_control_count = 0
+    };
+    cache_init(&config);
+    uint64_t random = 0x9e3779b97f4a7c15ULL;
+    for (size_t s = 0; s < sizeof(docroot_sizes) / sizeof(docroot_sizes[0]); s++) {
+        size_t count = docroot_sizes[s];
+        if ((paths = make_docroot(dir, count)) == NULL) {
+            fprintf(stderr, "unable to create a docroot of %zu files in %s: %s\n", count, dir, strerror(errno));
+            goto term;
+        }
+        if (cache_load(dir, log) != 0) {
+            fprintf(stderr, "cache load of %s failed\n", dir);
+            goto term;
+        }
+        char name[64];
+        for (size_t i = 0; i < BENCH_SEQUENCE_SIZE; i++) {
+            sequence[i] = paths[next_random(&random) % count];
+        }
+        for (int threads = 1; threads <= threads_max; threads = threads < threads_max && threads * 2 > threads_max ? threads_max : threads * 2) {
+            snprintf(name, sizeof(name), "cache_find/%zu/uniform/%dt", count, threads);
+            report(name, iterations, run_cache_lookups(sequence, threads, 0));
+        }
+        for (int threads = 1; count == BENCH_SCALING_FILES && threads <= BENCH_THREADS_MAX; threads *= 2) {
+            snprintf(name, sizeof(name), "cache_find/%zu/scaling/%dt", count, threads);
+            report(name, iterations, run_cache_lookups(sequence, threads, 0));
+            reload_job_s reload = { .dir = dir, .log = log, .count = 0 };
+            atomic_init(&reload.stop, false);
+            if (pthread_create(&reload.thread, NULL, reload_worker, &reload) != 0) {
+                fprintf(stderr, "unable to start the reload thread\n");
+                goto term;
+            }
+            uint64_t ns = run_cache_lookups(sequence, threads, 0);
+            atomic_store(&reload.stop, true);
+            pthread_join(reload.thread, NULL);
+            snprintf(name, sizeof(name), "cache_find/%zu/reloading/%dt", count, threads);
+            report(name, iterations, ns);
+            snprintf(name, sizeof(name), "cache_load/%zu/reloading/%dt", count, threads);
+            report(name, reload.count, ns);
+        }
+        if (count == BENCH_SCALING_FILES) {
+            for (size_t i = 0; i < BENCH_SEQUENCE_SIZE; i++) {
+                sequence[i] = paths[0];
+            }
+            for (int threads = 1; threads <= BENCH_THREADS_MAX; threads *= 2) {
+                snprintf(name, sizeof(name), "cache_find/%zu/hot/%dt", count, threads);
+                report(name, iterations, run_cache_lookups(sequence, threads, 0));
+                snprintf(name, sizeof(name), "cache_find/%zu/hot/pass/%dt", count, threads);
+                report(name, iterations, run_cache_lookups(sequence, threads, BENCH_PASS_LOOKUPS));
+            }
+        }
+        // Zipf with exponent 1: the file of rank k is requested with
+        // probability proportional to 1/k. The sequence is drawn by
+        // inverting the cumulative distribution.
+        free(cdf);
+        if ((cdf = malloc(count * sizeof(double))) == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            goto term;
+        }
+        double total = 0;
+        for (size_t k = 0; k < count; k++) {
+            total += 1.0 / (double)(k + 1);
+            cdf[k] = total;
+        }
+        for (size_t i = 0; i < BENCH_SEQUENCE_SIZE; i++) {
+            double u = (double)(next_random(&random) >> 11) / (double)(1ULL << 53) * total;
+            size_t lo = 0, hi = count - 1;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (cdf[mid] < u) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            sequence[i] = paths[lo];
+        }
+        for (int threads = 1; threads <= threads_max; threads = threads < threads_max && threads * 2 > threads_max ? threads_max : threads * 2) {
+            snprintf(name, sizeof(name), "cache_find/%zu/zipf/%dt", count, threads);
+            report(name, iterations, run_cache_lookups(sequence, threads, 0));
+        }
+        snprintf(name, sizeof(name), "cache_find/%zu/miss/1t", count);
+        report(name, iterations, run_cache_lookups(missing, 1, 0));
+        for (size_t i = 0; i < count; i++) {
+            free(paths[i]);
+        }
+        free(paths);
+        paths = NULL;
+        nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        mkdir(dir, 0700);
+    }
+    rc = 0;
+term:
+    if (paths != NULL) {
+        for (size_t i = 0; paths[i] != NULL; i++) {
+            free(paths[i]);
+        }
+        free(paths);
+    }
+    if (missing != NULL) {
+        for (size_t i = 0; i < BENCH_SEQUENCE_SIZE && missing[i] != NULL; i++) {
+            free(missing[i]);
+        }
+        free(missing);
+    }
+    free(sequence);
+    free(cdf);
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    log_cleanup(log);
+    debug_return rc;
+}
+
+/**
+ * @brief Times building an entity header and completing the response header
+ * around it, which formats the Date.
+ */
+static void bench_headers(void) {
+    debug_enter();
+    const char *additional = "Server: nvhttpd\r\nContent-Language: en-US\r\n";
+    size_t len;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        char *header = response_entity_header("text/html", 1000 + (i & 1023), i & 1 ? "gzip" : NULL, true, additional, &len);
+        sink += len;
+        free(header);
+    }
+    report("response_entity_header", iterations, now_ns() - start);
+    http_response_s response;
+    memset(&response, 0, sizeof(response));
+    char *header = response_entity_header("text/html", 1000, NULL, false, additional, &len);
+    start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        response_set_header(&response, HTTP_RESPONSE_200, header, len, i & 1);
+        sink += response.header_len;
+    }
+    report("response_set_header", iterations, now_ns() - start);
+    free(header);
+    debug_return;
+}
+
+/**
+ * @brief Times limit_acquire() and limit_release() for connections from
+ * BENCH_LIMIT_ADDRESSES addresses on 1 to threads_max threads, with limits
+ * set that none of them reach, and then limit_acquire() turning away a 
+ * client at its connection limit.
+ */
+static int bench_limit(void) {
+    debug_enter();
+    limit_job_s jobs[BENCH_THREADS_MAX];
+    struct sockaddr_storage *addrs = calloc(BENCH_LIMIT_ADDRESSES, sizeof(struct sockaddr_storage));
+    limit_config_s config = {
+        .connections = BENCH_THREADS_MAX,
+        .rate = 1e12,
+        .clients = LIMIT_CLIENTS_DEFAULT,
+        .ipv6_prefix = LIMIT_IPV6_PREFIX_DEFAULT,
+    };
+    if (addrs == NULL || limit_init(&config) != 0) {
+        fprintf(stderr, "limit benchmark setup failed: %s\n", strerror(errno));
+        free(addrs);
+        debug_return 1;
+    }
+    for (size_t i = 0; i < BENCH_LIMIT_ADDRESSES; i++) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&addrs[i];
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(0x0a000000 | i);
+    }
+    char name[64];
+    for (int threads = 1; threads <= threads_max; threads = threads < threads_max && threads * 2 > threads_max ? threads_max : threads * 2) {
+        uint64_t start = now_ns();
+        for (int i = 0; i < threads; i++) {
+            jobs[i].addrs = addrs;
+            jobs[i].offset = (size_t)i * (BENCH_LIMIT_ADDRESSES / threads);
+            jobs[i].count = iterations / threads;
+            pthread_create(&jobs[i].thread, NULL, limit_worker, &jobs[i]);
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+        snprintf(name, sizeof(name), "limit_acquire/%d/%dt", BENCH_LIMIT_ADDRESSES, threads);
+        report(name, (iterations / threads) * threads, now_ns() - start);
+    }
+    limit_cleanup();
+    config.connections = 1;
+    limit_client_s *held;
+    if (limit_init(&config) != 0 || limit_acquire(&addrs[0], &held) != LIMIT_OK) {
+        fprintf(stderr, "limit benchmark setup failed\n");
+        limit_cleanup();
+        free(addrs);
+        debug_return 1;
+    }
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        limit_client_s *client;
+        sink += limit_acquire(&addrs[0], &client) == LIMIT_CONNECTIONS;
+    }
+    report("limit_acquire/rejected/1t", iterations, now_ns() - start);
+    limit_release(held);
+    limit_cleanup();
+    free(addrs);
+    debug_return 0;
+}
+
+/**
+ * @brief Times log_write() from 1 to threads_max threads. The queue drops
+ * messages rather than block when the writer falls behind, so the lines
+ * actually written are counted and reported after the enqueue rate.
+ */
+static int bench_log(void) {
+    debug_enter();
+    log_job_s jobs[BENCH_THREADS_MAX];
+    for (int threads = 1; threads <= threads_max; threads = threads < threads_max && threads * 2 > threads_max ? threads_max : threads * 2) {
+        int fd = memfd_create("nvbench-log", 0);
+        FILE *fs = fd < 0 ? NULL : fdopen(dup(fd), "w");
+        log_s *log = fs == NULL ? NULL : log_init(LOG_INFO, program_name, fs);
+        if (log == NULL) {
+            fprintf(stderr, "log benchmark setup failed: %s\n", strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            debug_return 1;
+        }
+        uint64_t start = now_ns();
+        for (int i = 0; i < threads; i++) {
+            jobs[i].log = log;
+            jobs[i].count = iterations / threads;
+            pthread_create(&jobs[i].thread, NULL, log_worker, &jobs[i]);
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+        uint64_t enqueued = now_ns() - start;
+        log_cleanup(log);
+        uint64_t drained = now_ns() - start;
+        size_t lines = 0;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            char *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                for (off_t i = 0; i < st.st_size; i++) {
+                    lines += p[i] == '\n';
+                }
+                munmap(p, st.st_size);
+            }
+        }
+        close(fd);
+        char name[64];
+        snprintf(name, sizeof(name), "log_write/enqueue/%dt", threads);
+        report(name, (iterations / threads) * threads, enqueued);
+        snprintf(name, sizeof(name), "log_write/written/%dt", threads);
+        report(name, lines, drained);
+    }
+    debug_return 0;
+}
+
+/**
+ * @brief Times request_parse() over the corpus, round robin, and then the
+ * header lookups that follow every parse in the server.
+ */
+static int bench_parse(const char *corpus_path) {
+    debug_enter();
+    int rc = 1;
+    size_t count;
+    corpus_entry_s *corpus = load_corpus(corpus_path, &count);
+    if (corpus == NULL) {
+        debug_return 1;
+    }
+    log_s *log = log_init(LOG_ERROR, program_name, stderr);
+    http_server_s server;
+    http_client_s client;
+    memset(&server, 0, sizeof(server));
+    memset(&client, 0, sizeof(client));
+    server.log = log;
+    client.server = &server;
+    client.fd = -1;
+    strcpy(client.ip, "127.0.0.1");
+    request_s *request = malloc(sizeof(request_s));
+    if (log == NULL || request == NULL) {
+        fprintf(stderr, "parser benchmark setup failed\n");
+        goto term;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < iterations; i++) {
+            corpus_entry_s *entry = &corpus[i % count];
+            request_init(request, &client);
+            memcpy(request->buffer, entry->data, entry->len);
+            request->buffer_len = entry->len;
+            // The whole header is already in the buffer, so this only scans
+            // for its end, as it does after the last recv().
+            if (request_read(request) != REQUEST_READ_COMPLETE || request_parse(request) != REQUEST_PARSE_OK) {
+                fprintf(stderr, "corpus request %zu did not parse\n", i % count);
+                goto term;
+            }
+            if (pass == 1) {
+                sink += request_keep_alive(request);
+                sink += request_token_quality(request, REQUEST_HEADER_ACCEPT_ENCODING, "br");
+                sink += request_header(request, REQUEST_HEADER_IF_NONE_MATCH) != NULL;
+                sink += request_find_header(request, "User-Agent") != NULL;
+            }
+        }
+        report(pass == 0 ? "request_parse" : "request_parse+headers", iterations, now_ns() - start);
+    }
+    rc = 0;
+term:
+    for (size_t i = 0; i < count; i++) {
+        free(corpus[i].data);
+    }
+    free(corpus);
+    free(request);
+    log_cleanup(log);
+    debug_return rc;
+}
+
+static void *cache_worker(void *arg) {
+    cache_job_s *job = arg;
+    for (size_t i = 0; i < job->count; i++) {
+        if (job->pass > 0 && i % job->pass == 0) {
+            cache_pass_begin();
+        }
+        cache_element_s *e = cache_find(job->sequence[(job->offset + i) & (BENCH_SEQUENCE_SIZE - 1)]);
+        sink += e != NULL;
+        if (job->pass == 0) {
+            cache_release(e);
+        } else if ((i + 1) % job->pass == 0 || i + 1 == job->count) {
+            cache_pass_end();
+        }
+    }
+    return NULL;
+}
+
+static void *limit_worker(void *arg) {
+    limit_job_s *job = arg;
+    for (size_t i = 0; i < job->count; i++) {
+        limit_client_s *client;
+        sink += limit_acquire(&job->addrs[(job->offset + i) & (BENCH_LIMIT_ADDRESSES - 1)], &client) == LIMIT_OK;
+        limit_release(client);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads the corpus: requests written with LF line endings and
+ * separated by blank lines, each returned with CRLF line endings and the
+ * blank line that ends it.
+ */
+static corpus_entry_s *load_corpus(const char *path, size_t *count) {
+    debug_enter();
+    FILE *fs = fopen(path, "r");
+    corpus_entry_s *corpus = NULL;
+    size_t size = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *ts = NULL;
+    *count = 0;
+    if (fs == NULL) {
+        fprintf(stderr, "unable to open request corpus %s: %s\n", path, strerror(errno));
+        debug_return NULL;
+    }
+    ssize_t n;
+    do {
+        n = getline(&line, &line_size, fs);
+        if (n > 0 && line[n - 1] == '\n') {
+            line[--n] = '\0';
+        }
+        if (n > 0) {
+            if (ts == NULL && (ts = open_memstream(&text, &text_len)) == NULL) {
+                goto error;
+            }
+            fprintf(ts, "%s\r\n", line);
+        } else if (ts != NULL) {
+            fputs("\r\n", ts);
+            fclose(ts);
+            ts = NULL;
+            if (*count == size) {
+                size = size == 0 ? 16 : size * 2;
+                corpus_entry_s *p = realloc(corpus, size * sizeof(corpus_entry_s));
+                if (p == NULL) {
+                    free(text);
+                    goto error;
+                }
+                corpus = p;
+            }
+            if (text_len > REQUEST_BUFFER_SIZE) {
+                fprintf(stderr, "skipping corpus request %zu: %zu bytes does not fit the inline buffer\n", *count, text_len);
+                free(text);
+            } else {
+                corpus[(*count)++] = (corpus_entry_s){.data = text, .len = text_len};
+            }
+            text = NULL;
+        }
+    } while (n >= 0);
+    free(line);
+    fclose(fs);
+    if (*count == 0) {
+        fprintf(stderr, "no requests in corpus %s\n", path);
+        free(corpus);
+        debug_return NULL;
+    }
+    debug_return corpus;
+error:
+    fprintf(stderr, "out of memory reading %s\n", path);
+    for (size_t i = 0; i < *count; i++) {
+        free(corpus[i].data);
+    }
+    free(corpus);
+    free(line);
+    fclose(fs);
+    debug_return NULL;
+}
+
+static void *log_worker(void *arg) {
+    log_job_s *job = arg;
+    for (size_t i = 0; i < job->count; i++) {
+        log_info(job->log, "handling new client request %zu from %s for %s", i, "127.0.0.1", "/index.html");
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fills dir with count small HTML files, BENCH_FILES_PER_DIR to a
+ * directory, and returns their paths as the cache keys them, NULL
+ * terminated.
+ */
+static char **make_docroot(const char *dir, size_t count) {
+    debug_enter();
+    char **paths = calloc(count + 1, sizeof(char *));
+    char file[PATH_MAX];
+    if (paths == NULL) {
+        debug_return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (i % BENCH_FILES_PER_DIR == 0) {
+            snprintf(file, sizeof(file), "%s/d%04zu", dir, i / BENCH_FILES_PER_DIR);
+            if (mkdir(file, 0700) != 0 && errno != EEXIST) {
+                goto error;
+            }
+        }
+        if (asprintf(&paths[i], "/d%04zu/f%06zu.html", i / BENCH_FILES_PER_DIR, i) < 0) {
+            paths[i] = NULL;
+            goto error;
+        }
+        snprintf(file, sizeof(file), "%s%s", dir, paths[i]);
+        FILE *fs = fopen(file, "w");
+        if (fs == NULL) {
+            goto error;
+        }
+        fprintf(fs, "<!DOCTYPE html><html><body>file %zu</body></html>\n", i);
+        fclose(fs);
+    }
+    debug_return paths;
+error:
+    for (size_t i = 0; i < count && paths[i] != NULL; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    debug_return NULL;
+}
+
+/**
+ * @brief xorshift64*, good enough to pick paths and cheap enough not to
+ * show in the timings.
+ */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *reload_worker(void *arg) {
+    reload_job_s *job = arg;
+    while (!atomic_load(&job->stop)) {
+        if (cache_load(job->dir, job->log) == 0) {
+            job->count++;
+        }
+    }
+    return NULL;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+/**
+ * @brief Prints one result line. ns is the wall time for all ops, so for
+ * threaded benchmarks ns/op is the inverse of aggregate throughput.
+ */
+static void report(const char *name, size_t ops, uint64_t ns) {
+    double per_op = ops == 0 ? 0 : (double)ns / (double)ops;
+    printf("%-40s %12zu %12.1f %12.3f\n", name, ops, per_op, per_op == 0 ? 0 : 1e3 / per_op);
+    fflush(stdout);
+}
+
+/**
+ * @brief Runs iterations lookups of the paths in sequence, split across
+ * threads, in passes of pass lookups if it isn't 0. Returns the wall time
+ * in nanoseconds.
+ */
+static uint64_t run_cache_lookups(char **sequence, int threads, size_t pass) {
+    cache_job_s jobs[BENCH_THREADS_MAX];
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        jobs[i].sequence = sequence;
+        jobs[i].offset = (size_t)i * (BENCH_SEQUENCE_SIZE / threads);
+        jobs[i].count = iterations / threads;
+        jobs[i].pass = pass;
+        pthread_create(&jobs[i].thread, NULL, cache_worker, &jobs[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(jobs[i].thread, NULL);
+    }
+    return now_ns() - start;
+}
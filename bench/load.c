@@ -0,0 +1,452 @@
+/**
+ * @file load.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Closed loop load generator. Each connection sends a request, waits
+ * for the whole response, then sends the next, and the latency of every
+ * request is kept to report percentiles.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "option.h"
+
+#define LOAD_BUFFER_SIZE 65536
+#define LOAD_CONNECTIONS_MAX 4096
+
+const char const *program_name = "nvload";
+
+/**
+ * @brief State of one connection's thread: its socket and TLS session, the
+ * session kept for resuming when connections are not kept alive, and the
+ * latencies recorded, in nanoseconds. closing is set when the server says it
+ * will close the connection after the response just read.
+ */
+typedef struct load_conn_s {
+    pthread_t thread;
+    int fd;
+    SSL *ssl;
+    SSL_SESSION *session;
+    uint64_t *samples;
+    size_t samples_count;
+    size_t samples_size;
+    size_t errors;
+    bool closing;
+    char buffer[LOAD_BUFFER_SIZE];
+} load_conn_s;
+
+static option_s option_c = {
+    .name = "c",
+    .description = "Concurrent connections, default 64",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_close = {
+    .name = "close",
+    .description = "Send Connection: close and reconnect for every request",
+    .arg_type = option_arg_none,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_d = {
+    .name = "d",
+    .description = "Duration in seconds, default 10",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_h = {
+    .name = "h",
+    .description = "Show this help text",
+    .arg_type = option_arg_none,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_host = {
+    .name = "host",
+    .description = "Server address, default 127.0.0.1",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_port = {
+    .name = "port",
+    .description = "Server port, default 80, or 443 with -tls",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_tls = {
+    .name = "tls",
+    .description = "Connect with TLS",
+    .arg_type = option_arg_none,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s option_u = {
+    .name = "u",
+    .description = "Path to request, default /",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
+static option_s *options[] = {
+    &option_c,
+    &option_close,
+    &option_d,
+    &option_h,
+    &option_host,
+    &option_port,
+    &option_tls,
+    &option_u,
+    NULL
+};
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static SSL_CTX *ssl_ctx = NULL;
+static bool keep_alive = true;
+static char request[1024];
+static size_t request_len;
+static atomic_bool stop = false;
+
+static int compare_samples(const void *a, const void *b);
+static void conn_close(load_conn_s *conn);
+static int conn_open(load_conn_s *conn);
+static ssize_t conn_read(load_conn_s *conn, char *buffer, size_t len);
+static int conn_write(load_conn_s *conn, const char *buffer, size_t len);
+static uint64_t now_ns(void);
+static double percentile(uint64_t *samples, size_t count, double p);
+static int read_response(load_conn_s *conn);
+static int record(load_conn_s *conn, uint64_t ns);
+static void *run(void *arg);
+
+int main(int argc, char *argv[]) {
+    debug_enter();
+    int rc = 1;
+    int connections = 64;
+    int duration = 10;
+    const char *host = "127.0.0.1";
+    const char *uri = "/";
+    load_conn_s *conns = NULL;
+    if (option_parse_args(options, argc, argv) != 0 || option_h.present) {
+        option_show_help(options);
+        goto term;
+    }
+    if (option_c.present) {
+        connections = atoi(option_c.value);
+    }
+    if (option_d.present) {
+        duration = atoi(option_d.value);
+    }
+    if (option_host.present) {
+        host = option_host.value;
+    }
+    if (option_u.present) {
+        uri = option_u.value;
+    }
+    keep_alive = !option_close.present;
+    const char *port = option_port.present ? option_port.value : option_tls.present ? "443" : "80";
+    if (connections < 1 || connections > LOAD_CONNECTIONS_MAX || duration < 1) {
+        fprintf(stderr, "connections must be 1 to %d and the duration positive\n", LOAD_CONNECTIONS_MAX);
+        goto term;
+    }
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *ai;
+    int err = getaddrinfo(host, port, &hints, &ai);
+    if (err != 0) {
+        fprintf(stderr, "unable to resolve %s port %s: %s\n", host, port, gai_strerror(err));
+        goto term;
+    }
+    memcpy(&server_addr, ai->ai_addr, ai->ai_addrlen);
+    server_addr_len = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\nAccept: */*\r\nAccept-Encoding: gzip, br\r\n%s\r\n", uri, host, program_name, keep_alive ? "" : "Connection: close\r\n");
+    if (request_len >= sizeof(request)) {
+        fprintf(stderr, "path too long\n");
+        goto term;
+    }
+    if (option_tls.present) {
+        if ((ssl_ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+            fprintf(stderr, "unable to create ssl context: %s\n", ERR_reason_error_string(ERR_get_error()));
+            goto term;
+        }
+        // The benchmark server uses a throwaway self-signed certificate.
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+        SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT);
+    }
+    if ((conns = calloc(connections, sizeof(load_conn_s))) == NULL) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        goto term;
+    }
+    uint64_t start = now_ns();
+    int started = 0;
+    for (; started < connections; started++) {
+        conns[started].fd = -1;
+        if (pthread_create(&conns[started].thread, NULL, run, &conns[started]) != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(errno));
+            break;
+        }
+    }
+    struct timespec ts = {.tv_sec = duration, .tv_nsec = 0};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+    atomic_store(&stop, true);
+    size_t total = 0, errors = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(conns[i].thread, NULL);
+        total += conns[i].samples_count;
+        errors += conns[i].errors;
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    uint64_t *samples = malloc((total + 1) * sizeof(uint64_t));
+    if (samples == NULL) {
+        fprintf(stderr, "malloc failed: %s\n", strerror(errno));
+        goto term;
+    }
+    size_t n = 0;
+    for (int i = 0; i < started; i++) {
+        memcpy(samples + n, conns[i].samples, conns[i].samples_count * sizeof(uint64_t));
+        n += conns[i].samples_count;
+    }
+    qsort(samples, total, sizeof(uint64_t), compare_samples);
+    printf("%s %s %d connections %.1f s: %zu requests, %zu errors, %.1f req/s, latency us p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+        option_tls.present ? "https" : "http",
+        keep_alive ? "keep-alive" : "close",
+        started, elapsed, total, errors, (double)total / elapsed,
+        percentile(samples, total, 0.50) / 1e3,
+        percentile(samples, total, 0.99) / 1e3,
+        percentile(samples, total, 0.999) / 1e3,
+        total > 0 ? (double)samples[total - 1] / 1e3 : 0);
+    free(samples);
+    rc = errors > 0 || total == 0;
+term:
+    if (conns != NULL) {
+        for (int i = 0; i < connections; i++) {
+            free(conns[i].samples);
+        }
+        free(conns);
+    }
+    SSL_CTX_free(ssl_ctx);
+    debug_return rc;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Closes the connection, keeping its TLS session to resume on the
+ * next one.
+ */
+static void conn_close(load_conn_s *conn) {
+    if (conn->ssl != NULL) {
+        SSL_SESSION *session = SSL_get1_session(conn->ssl);
+        if (session != NULL) {
+            SSL_SESSION_free(conn->session);
+            conn->session = session;
+        }
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+/**
+ * @brief Connects, and for TLS completes the handshake, resuming the last
+ * session when there is one, as a browser would.
+ */
+static int conn_open(load_conn_s *conn) {
+    if ((conn->fd = socket(server_addr.ss_family, SOCK_STREAM, 0)) < 0) {
+        return 1;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn->fd, (struct sockaddr *)&server_addr, server_addr_len) != 0) {
+        return 1;
+    }
+    if (ssl_ctx != NULL) {
+        if ((conn->ssl = SSL_new(ssl_ctx)) == NULL) {
+            return 1;
+        }
+        SSL_set_fd(conn->ssl, conn->fd);
+        if (conn->session != NULL) {
+            SSL_set_session(conn->ssl, conn->session);
+        }
+        if (SSL_connect(conn->ssl) != 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static ssize_t conn_read(load_conn_s *conn, char *buffer, size_t len) {
+    if (conn->ssl != NULL) {
+        int n = SSL_read(conn->ssl, buffer, len);
+        return n > 0 ? n : SSL_get_error(conn->ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+    ssize_t n;
+    while ((n = recv(conn->fd, buffer, len, 0)) < 0 && errno == EINTR) {
+    }
+    return n;
+}
+
+static int conn_write(load_conn_s *conn, const char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = conn->ssl != NULL ? SSL_write(conn->ssl, buffer, len) : send(conn->fd, buffer, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (conn->ssl == NULL && n < 0 && errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the sample at or above the fraction p of the sorted
+ * samples, in nanoseconds.
+ */
+static double percentile(uint64_t *samples, size_t count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (double)count + 0.999999);
+    if (i > 0) {
+        i--;
+    }
+    if (i >= count) {
+        i = count - 1;
+    }
+    return (double)samples[i];
+}
+
+/**
+ * @brief Reads one response: the header up to the blank line, then as many
+ * body bytes as Content-Length gives. Returns 0 on a 2xx or 3xx response.
+ */
+static int read_response(load_conn_s *conn) {
+    size_t len = 0;
+    char *end = NULL;
+    while (end == NULL) {
+        if (len == sizeof(conn->buffer) - 1) {
+            return 1;
+        }
+        ssize_t n = conn_read(conn, conn->buffer + len, sizeof(conn->buffer) - 1 - len);
+        if (n <= 0) {
+            return 1;
+        }
+        len += n;
+        conn->buffer[len] = '\0';
+        end = strstr(conn->buffer, "\r\n\r\n");
+    }
+    int status = 0;
+    if (sscanf(conn->buffer, "HTTP/%*d.%*d %d", &status) != 1 || status < 200 || status >= 400) {
+        return 1;
+    }
+    *end = '\0';
+    conn->closing = strcasestr(conn->buffer, "\r\nConnection: close") != NULL;
+    const char *cl = strcasestr(conn->buffer, "\r\nContent-Length:");
+    if (cl == NULL) {
+        return 1;
+    }
+    size_t body = strtoul(cl + 17, NULL, 10);
+    size_t have = len - (end + 4 - conn->buffer);
+    while (have < body) {
+        size_t want = body - have < sizeof(conn->buffer) ? body - have : sizeof(conn->buffer);
+        ssize_t n = conn_read(conn, conn->buffer, want);
+        if (n <= 0) {
+            return 1;
+        }
+        have += n;
+    }
+    return 0;
+}
+
+static int record(load_conn_s *conn, uint64_t ns) {
+    if (conn->samples_count == conn->samples_size) {
+        size_t size = conn->samples_size == 0 ? 4096 : conn->samples_size * 2;
+        uint64_t *samples = realloc(conn->samples, size * sizeof(uint64_t));
+        if (samples == NULL) {
+            return 1;
+        }
+        conn->samples = samples;
+        conn->samples_size = size;
+    }
+    conn->samples[conn->samples_count++] = ns;
+    return 0;
+}
+
+/**
+ * @brief One connection's loop. Without keep-alive every request opens a
+ * new connection, and the connect and handshake count towards its latency.
+ */
+static void *run(void *arg) {
+    load_conn_s *conn = arg;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        uint64_t start = now_ns();
+        if (conn->fd < 0 && conn_open(conn) != 0) {
+            conn->errors++;
+            conn_close(conn);
+            continue;
+        }
+        if (conn_write(conn, request, request_len) != 0 || read_response(conn) != 0) {
+            conn->errors++;
+            conn_close(conn);
+            continue;
+        }
+        if (record(conn, now_ns() - start) != 0) {
+            break;
+        }
+        if (!keep_alive || conn->closing) {
+            conn_close(conn);
+        }
+    }
+    conn_close(conn);
+    SSL_SESSION_free(conn->session);
+    return NULL;
+}
@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# bench/run.sh
+#
+# Runs the microbenchmarks, then starts nvhttpd on loopback with a throwaway
+# certificate and drives it with nvload, with keep-alive on and off, over
+# plain HTTP and TLS, then over plain HTTP again against a second nvhttpd on
+# the io_uring backend. Run from the top of the tree; make bench does.
+#
+# Environment:
+#   BENCH_ITERATIONS   iterations of each microbenchmark, default 1000000
+#   BENCH_THREADS      most threads for the threaded microbenchmarks,
+#                      default 8
+#   BENCH_CONNECTIONS  concurrent load generator connections, default 64
+#   BENCH_DURATION     seconds for each load run, default 10
+#   BENCH_PORT         plain HTTP port, default 18880; TLS uses the next one
+#                      and the io_uring server the one after that
+#   BENCH_URI          path requested, default /index.html
+#   BENCH_WORKERS      server workers, default 0 (one per CPU)
+#
+# Exits non-zero if a benchmark fails or any load run sees an error.
+#
+
+iterations=${BENCH_ITERATIONS:-1000000}
+threads=${BENCH_THREADS:-8}
+connections=${BENCH_CONNECTIONS:-64}
+duration=${BENCH_DURATION:-10}
+port=${BENCH_PORT:-18880}
+ssl_port=$((port + 1))
+uring_port=$((port + 2))
+uri=${BENCH_URI:-/index.html}
+workers=${BENCH_WORKERS:-0}
+
+dir=$(mktemp -d /tmp/nvhttpd-bench.XXXXXX) || exit 1
+servers=
+cleanup() {
+    for server in $servers; do
+        kill -INT "$server" 2>/dev/null
+        wait "$server" 2>/dev/null
+    done
+    rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+# start NAME IO LISTENERS starts a server named NAME on the given I/O
+# backend with the given [listeners] lines, and waits until it serves on
+# the first of them.
+start() {
+    cat > "$dir/$1.conf" <<EOF
+[server]
+html_path = $(pwd)/html
+workers = $workers
+max_connections = 65536
+keepalive_requests = 1000000000
+io = $2
+[listeners]
+$3
+[response-headers]
+Server = nvhttpd
+[cache]
+watch = false
+[SSL]
+ecdsa_certificate = $dir/cert.pem
+ecdsa_key = $dir/key.pem
+[logging]
+file = $dir/$1.log
+level = error
+pid = $dir/$1.pid
+EOF
+    ./nvhttpd -c "$dir/$1.conf" &
+    server=$!
+    servers="$servers $server"
+    first=$(echo "$3" | sed -n '1s/.*:\([0-9]*\).*/\1/p')
+    for i in $(seq 50); do
+        if bench/nvload -port "$first" -u "$uri" -c 1 -d 1 >/dev/null 2>&1; then
+            return 0
+        fi
+        kill -0 "$server" 2>/dev/null || break
+    done
+    echo "nvhttpd did not start, see $dir/$1.log" >&2
+    cat "$dir/$1.log" >&2
+    exit 1
+}
+
+echo "== microbenchmarks"
+bench/nvbench -n "$iterations" -t "$threads" -r bench/requests.txt || exit 1
+
+if ! openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes \
+    -subj /CN=localhost -days 2 -keyout "$dir/key.pem" -out "$dir/cert.pem" \
+    >/dev/null 2>&1; then
+    echo "unable to generate a certificate with openssl" >&2
+    exit 1
+fi
+start nvhttpd epoll "http = \"127.0.0.1:$port\"
+https = \"127.0.0.1:$ssl_port ssl\""
+start uring io_uring "http = \"127.0.0.1:$uring_port\""
+
+echo "== load, $connections connections, $duration s per run, $uri"
+rc=0
+bench/nvload -port "$port" -u "$uri" -c "$connections" -d "$duration" || rc=1
+bench/nvload -port "$port" -u "$uri" -c "$connections" -d "$duration" -close || rc=1
+bench/nvload -port "$ssl_port" -u "$uri" -c "$connections" -d "$duration" -tls || rc=1
+bench/nvload -port "$ssl_port" -u "$uri" -c "$connections" -d "$duration" -tls -close || rc=1
+echo "== io_uring backend"
+bench/nvload -port "$uring_port" -u "$uri" -c "$connections" -d "$duration" || rc=1
+bench/nvload -port "$uring_port" -u "$uri" -c "$connections" -d "$duration" -close || rc=1
+exit $rc
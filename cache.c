@@ -7,393 +7,1653 @@
  * @copyright Copyright (c) 2024
  */
 
+#include <brotli/encode.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "cache.h"
 #include "debug.h"
+#include "hpack.h"
+#include "response.h"
 
-static const int max_cache_elements = 65534;
+#define COMPRESS_MIN_SIZE 256
+#define INDEX_FILE "index.html"
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define WATCH_BUFFER_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define IMAGE_MAGIC "NVHTTPDC"
+#define IMAGE_VERSION 3
+#define IMAGE_ALIGN 16
+#define EVICT_INTERVAL_MS 1000
+#define EVICT_PROMOTE_HITS 2
+#define EVICT_HITS_MAX 255
+#define EVICT_REVOLUTIONS 9
+#define EVICT_LINE 64
+#define READERS_MAX 1024
 
+const char const *cache_encoding_str[] = {
+    "identity",
+    "gzip",
+    "br",
+};
+
+static const char const *encoding_suffix[] = {
+    "",
+    ".gz",
+    ".br",
+};
+
+/**
+ * @brief One slot of the open addressing table. The full hash is kept next
+ * to the element pointer so probing compares integers without touching the
+ * element. Lookups read slots while the writer fills them, so the element
+ * is stored after the hash with release ordering and loaded with acquire.
+ */
+typedef struct cache_slot_s {
+    atomic_size_t hash;
+    _Atomic(cache_element_s *) element;
+} cache_slot_s;
+
+/**
+ * @brief A cache table. resident is the number of bytes of file contents
+ * held in memory, kept while loading and recounted by the evictor. hits 
+ * holds each reader's lookups by slot since the evictor's last pass, when
+ * a memory budget is set: a reader allocates its array on its first hit 
+ * in the table and only it writes the array, but for the evictor taking 
+ * the counts once a second. The arrays go with the table. A slot index is
+ * a stable key for the table's life: a path keeps its slot until it is 
+ * removed, which copies the table, and the element in it is only ever 
+ * replaced in place by a newer one for the same path, as for evict_move()
+ * and the watcher, so counts taken against an element land on the one 
+ * that replaced it. A new table starts with no counts, losing at most a 
+ * pass's worth.
+ */
 typedef struct cache_s {
     log_s *log;
     size_t capacity;
     size_t mask;
     size_t count;
-    cache_element_s *data;
+    size_t resident;
+    cache_slot_s *slots;
+    _Atomic(atomic_uchar *) hits[READERS_MAX];
 } cache_s;
 
-static cache_s *cache = NULL;
-static pthread_rwlock_t cache_rw_lock;
+/**
+ * @brief State of the evictor thread. hand is the CLOCK hand, a slot index
+ * that wraps with the table's mask, so it survives the table being 
+ * replaced or grown.
+ */
+typedef struct cache_evict_s {
+    log_s *log;
+    char *base_path;
+    pthread_t thread;
+    int event_fd;
+    size_t hand;
+} cache_evict_s;
+
+/**
+ * @brief State of the inotify watcher thread. dirs maps watch descriptors to
+ * directory paths relative to base_path ("" for base_path itself).
+ */
+typedef struct cache_watch_s {
+    log_s *log;
+    char *base_path;
+    pthread_t thread;
+    int inotify_fd;
+    int event_fd;
+    char **dirs;
+    size_t dirs_size;
+} cache_watch_s;
+
+/**
+ * @brief Start of a cache image. entry_size is sizeof(image_entry_s), so an
+ * image from a build with a different layout is refused. size is the size
+ * of the whole file, to detect truncation.
+ */
+typedef struct image_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t slots_offset;
+    uint64_t entries_offset;
+    uint64_t size;
+} image_header_s;
+
+/**
+ * @brief A slot of the image's hash table, laid out as in the cache table.
+ * entry is the index of the entry plus one, 0 for an empty slot. An 
+ * element with an alias has two slots naming the same entry.
+ */
+typedef struct image_slot_s {
+    uint64_t hash;
+    uint64_t entry;
+} image_slot_s;
+
+/**
+ * @brief An element in the image. path, alias, mime, data, headers and hpack are
+ * file offsets, 0 for none; variants are entry indexes plus one, 0 for none.
+ * Compressed variants built at load time are entries without a slot.
+ */
+typedef struct image_entry_s {
+    uint64_t hash;
+    uint64_t len;
+    uint64_t path;
+    uint64_t alias;
+    uint64_t mime;
+    uint64_t data;
+    int64_t mtime;
+    uint64_t variants[CACHE_ENCODING_COUNT];
+    uint64_t headers[CACHE_ENCODING_COUNT];
+    uint64_t headers_len[CACHE_ENCODING_COUNT];
+    uint64_t hpack[CACHE_ENCODING_COUNT];
+    uint64_t hpack_len[CACHE_ENCODING_COUNT];
+    char etag[CACHE_ENCODING_COUNT][CACHE_ETAG_SIZE];
+    char last_modified[CACHE_DATE_SIZE];
+} image_entry_s;
+
+/**
+ * @brief A mapped cache image and the elements pointing into it. Every 
+ * element holds a reference, so the image is unmapped when the last 
+ * element is freed.
+ */
+typedef struct cache_image_s {
+    void *map;
+    size_t size;
+    atomic_size_t refs;
+    cache_element_s elements[];
+} cache_image_s;
+
+/**
+ * @brief A thread's announcement that it is inside a lookup. seq is odd 
+ * while it is; a writer that has unlinked something waits for each odd 
+ * seq to change before freeing it. Each reader has its own cache line, so
+ * lookups write nothing another thread reads in the common case.
+ */
+typedef struct cache_reader_s {
+    atomic_uint_fast64_t seq;
+    atomic_bool used;
+} __attribute__((aligned(64))) cache_reader_s;
+
+/**
+ * @brief An entry of the MIME type table: a lowercase extension, the type
+ * files with it are served as, and whether they are worth compressing.
+ */
+typedef struct mime_entry_s {
+    char extension[CACHE_EXTENSION_MAX];
+    const char *mime;
+    bool compress;
+} mime_entry_s;
+
+/* The built-in MIME types, sorted by extension. cache_init() adds the
+   configured ones and sorts the result. */
+static const mime_entry_s mime_defaults[] = {
+    { "avif", "image/avif", false },
+    { "css", "text/css", true },
+    { "csv", "text/csv", true },
+    { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document", false },
+    { "gif", "image/gif", false },
+    { "gz", "application/gzip", false },
+    { "htm", "text/html; charset=UTF-8", true },
+    { "html", "text/html; charset=UTF-8", true },
+    { "ico", "image/x-icon", true },
+    { "jpeg", "image/jpeg", false },
+    { "jpg", "image/jpeg", false },
+    { "js", "application/javascript", true },
+    { "json", "application/json", true },
+    { "map", "application/json", true },
+    { "md", "text/markdown", true },
+    { "mjs", "application/javascript", true },
+    { "mp3", "audio/mpeg", false },
+    { "mp4", "video/mp4", false },
+    { "ogg", "audio/ogg", false },
+    { "otf", "font/otf", true },
+    { "pdf", "application/pdf", false },
+    { "png", "image/png", false },
+    { "svg", "image/svg+xml", true },
+    { "ttf", "font/ttf", true },
+    { "txt", "text/plain; charset=UTF-8", true },
+    { "wasm", "application/wasm", true },
+    { "webm", "video/webm", false },
+    { "webmanifest", "application/manifest+json", true },
+    { "webp", "image/webp", false },
+    { "woff", "font/woff", false },
+    { "woff2", "font/woff2", false },
+    { "xml", "text/xml", true },
+    { "zip", "application/zip", false },
+};
+
+/* The live table. Lookups load it without a lock; writers replace it, or
+   change its slots in ways a concurrent lookup can't misread, and free 
+   what they unlink only after synchronize(). */
+static _Atomic(cache_s *) cache = NULL;
+static cache_config_s cache_config;
+static mime_entry_s *mime_table = NULL;
+static size_t mime_count = 0;
+static size_t not_found_hash = 0;
+static cache_watch_s *watch = NULL;
+static cache_evict_s *evict = NULL;
+
+/* Serializes writers: cache_load(), the watcher and the evictor. Holding it
+   allows reading the table as a lookup would, since nothing else modifies
+   it. */
+static pthread_mutex_t cache_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reader slots, claimed by a thread's first lookup and given back when it 
+   exits. Threads past READERS_MAX share overflow_readers, a counter. A 
+   thread can nest lookups inside a pass, which reader_depth counts, and 
+   pass says lookups borrow elements instead of taking references. */
+static cache_reader_s readers[READERS_MAX];
+static cache_reader_s reader_shared;
+static atomic_size_t overflow_readers = 0;
+static __thread cache_reader_s *reader = NULL;
+static __thread unsigned reader_depth = 0;
+static __thread bool pass = false;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
 
-static const char *determine_mime(cache_element_s *e);
+static int compare_elements(const void *a, const void *b);
+static int compare_mime(const void *a, const void *b);
+static cache_element_s *compress_element(cache_s *cache, cache_element_s *e, cache_encoding_e encoding);
+static const char *cache_control_for(cache_element_s *e);
+static bool compressible(const char *mime);
+static inline void count_hit(cache_s *cache, size_t index);
+static const mime_entry_s *determine_mime(cache_element_s *e);
+static bool evict_eligible(cache_s *cache, cache_element_s *e);
+static void evict_fold(void);
+static bool evict_move(cache_evict_s *ev, cache_element_s *e, bool resident);
+static bool evict_room(cache_evict_s *ev, size_t need, size_t revolutions, size_t *resident);
+static void *evict_run(void *arg);
+static void evict_sweep(cache_evict_s *ev);
 static void free_cache(cache_s *cache);
+static void free_element(cache_element_s *e);
+static void free_table(cache_s *cache);
 static inline size_t hash(const char *key);
-static int init_element(cache_element_s *e);
-static cache_element_s *insert(const char *path, size_t full_hash);
+static const char *image_pointer(cache_image_s *image, uint64_t offset, uint64_t len, bool string);
+static void image_release(cache_image_s *image);
+static int image_write_blob(FILE *fs, const char *data, int fd, size_t len, uint64_t *offset);
+static int init_element(cache_s *cache, cache_element_s *e);
+static void init_headers(cache_s *cache, cache_element_s *e);
+static void init_variants(cache_s *cache, cache_element_s *e);
 static int load_dir(cache_s *cache, cache_element_s **list, const char const *base_path, const char const *path);
+static cache_element_s *load_file(cache_s *cache, const char *base_path, const char *full_path);
+static cache_element_s *lookup(cache_s *cache, const char *path, size_t full_hash);
+static bool mime_key(char *key, const char *extension);
+static bool overloaded(size_t count, size_t capacity);
+static int read_data(cache_s *cache, cache_element_s *e, int fd, const char *name);
+static cache_reader_s *reader_claim(void);
+static inline cache_s *reader_enter(void);
+static inline void reader_exit(void);
+static void reader_key_create(void);
+static void reader_release(void *arg);
+static size_t slot_find(cache_s *cache, const char *path, size_t full_hash);
+static void synchronize(void);
+static cache_s *table_copy(cache_s *from, size_t capacity, cache_element_s **skip, size_t skip_count);
+static int table_drop(cache_element_s **elements, size_t count);
+static int table_grow(void);
+static int table_insert(cache_element_s *e, cache_element_s **old);
+static void table_publish(cache_s *new);
+static cache_element_s *table_remove(const char *path);
+static int watch_dir(cache_watch_s *w, const char *rel);
+static bool watch_event(cache_watch_s *w, const struct inotify_event *ev);
+static void watch_publish(cache_watch_s *w, cache_element_s *e);
+static void watch_refresh_parent(cache_watch_s *w, const char *rel);
+static void watch_remove_dir(cache_watch_s *w, const char *rel);
+static void watch_remove_file(cache_watch_s *w, const char *rel);
+static void *watch_run(void *arg);
+static void watch_update_dir(cache_watch_s *w, const char *rel);
+static void watch_update_file(cache_watch_s *w, const char *rel);
+
+int cache_evict_start(const char const *path, log_s *log) {
+    debug_enter();
+    if (evict != NULL) {
+        debug_return 0;
+    }
+    cache_evict_s *ev = calloc(1, sizeof(cache_evict_s));
+    if (ev == NULL) {
+        log_error(log, "Error allocating cache evictor: %s", strerror(errno));
+        debug_return 1;
+    }
+    ev->log = log;
+    ev->event_fd = -1;
+    if ((ev->base_path = strdup(path)) == NULL) {
+        log_error(log, "Error allocating cache evictor: %s", strerror(errno));
+        goto error;
+    }
+    if ((ev->event_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        log_error(log, "Error creating eventfd: %s", strerror(errno));
+        goto error;
+    }
+    if (pthread_create(&ev->thread, NULL, evict_run, ev) != 0) {
+        log_error(log, "Error starting cache evictor thread");
+        goto error;
+    }
+    log_info(log, "Keeping at most %zu bytes of %s in memory", cache_config.memory_budget, path);
+    evict = ev;
+    debug_return 0;
+error:
+    if (ev->event_fd >= 0) {
+        close(ev->event_fd);
+    }
+    free(ev->base_path);
+    free(ev);
+    debug_return 1;
+}
+
+void cache_evict_stop(void) {
+    debug_enter();
+    if (evict == NULL) {
+        debug_return;
+    }
+    uint64_t one = 1;
+    if (write(evict->event_fd, &one, sizeof(one)) != sizeof(one)) {
+        log_error(evict->log, "Error signalling cache evictor: %s", strerror(errno));
+    }
+    pthread_join(evict->thread, NULL);
+    close(evict->event_fd);
+    free(evict->base_path);
+    free(evict);
+    evict = NULL;
+    debug_return;
+}
 
 cache_element_s *cache_find(const char const *path) {
     debug_enter();
     cache_element_s *p = NULL;
-    cache_element_s *r = NULL;
     size_t full_hash = hash(path);
-    log_debug(cache->log, "Looking up hash %04x for path %s", full_hash, path);
-    pthread_rwlock_rdlock(&cache_rw_lock);
-    if (cache == NULL) {
+    cache_s *table = reader_enter();
+    if (table == NULL) {
         goto term;
     }
-    size_t index = full_hash & cache->mask;
-    size_t index_original = index;
-    while (cache->data[index].path != NULL) {
-        if (strcmp(cache->data[index].path, path) == 0) {
-            debug("cache hit for path %s\n", path);
-            p = &cache->data[index];
-            goto term;
+    log_debug(table->log, "Looking up hash %016zx for path %s", full_hash, path);
+    size_t index = slot_find(table, path, full_hash);
+    p = table->slots[index].element;
+    if (p != NULL) {
+        debug("cache hit for path %s\n", path);
+        if (!pass) {
+            atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
         }
-        index = (index + 1) & cache->mask;
-        if (index == index_original) {
-            break;
+        if (cache_config.memory_budget > 0) {
+            count_hit(table, index);
         }
     }
 term:
-    if (p == NULL) {
-        log_debug(cache->log, "Hash entry %04x not found in cache", full_hash);
-    } else {
-        size_t p_len = strlen(p->path) + 1;
-        r = malloc(sizeof(cache_element_s) + p->len + p_len);
-        r->next = NULL;
-        r->hash = p->hash;
-        r->len = p->len;
-        r->path = (char *)r + sizeof(cache_element_s);
-        r->mime = p->mime;
-        r->data = r->path + p_len;
-        memcpy(r->path, p->path, p_len);
-        memcpy(r->data, p->data, r->len);
-        log_debug(cache->log, "Found hash entry %04x: %s", full_hash, p->path);
+    if (table != NULL) {
+        if (p == NULL) {
+            log_debug(table->log, "Hash entry %016zx not found in cache", full_hash);
+        } else {
+            log_debug(table->log, "Found hash entry %016zx: %s", full_hash, p->path);
+        }
     }
-    pthread_rwlock_unlock(&cache_rw_lock);
-    debug_return r;
+    reader_exit();
+    debug_return p;
 }
 
-int cache_init(void) {
-    debug_enter();
-    pthread_rwlock_init(&cache_rw_lock, NULL);
-    debug_return 0;
+void cache_hold(cache_element_s *e) {
+    if (e != NULL) {
+        atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+    }
 }
 
-int cache_load(const char const *path, log_s *log) {
+int cache_image_load(const char *path, log_s *log) {
     debug_enter();
-    log_info(log, "Loading cache from %s", path);
     int rc = 1;
-    cache_s *new = malloc(sizeof(cache_s));
-    cache_element_s *file_list = NULL;
-    if (new == NULL) {
+    cache_image_s *image = NULL;
+    cache_s *new = NULL;
+    void *map = MAP_FAILED;
+    struct stat statbuf;
+    pthread_mutex_lock(&cache_write_mutex);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error(log, "Error opening cache image %s: %s", path, strerror(errno));
         goto term;
     }
-    new->log = log;
-    new->mask = 0;
-    new->count = 0;
-    new->data = NULL;
-    if (load_dir(new, &file_list, path, path) != 0) {
-        free(new);
-        new = NULL;
+    if (fstat(fd, &statbuf) != 0 || (size_t)statbuf.st_size < sizeof(image_header_s)) {
+        log_error(log, "Cache image %s is too short", path);
         goto term;
     }
-    if (new->count > max_cache_elements) {
-        debug("maximum cache capacity %d exceeded: %d", max_cache_elements, new->count);
-        log_error(log, "number of files %d exceeds maximum cache capacity %d", new->count, max_cache_elements);
-        free(new);
+    if ((map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        log_error(log, "Error mapping cache image %s: %s", path, strerror(errno));
         goto term;
     }
-    debug("caching %d files\n", new->count);
-    if (new->count == 0) {
-        free(new);
-        new = NULL;
+    const image_header_s *header = map;
+    size_t size = statbuf.st_size;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->version != IMAGE_VERSION || header->entry_size != sizeof(image_entry_s)) {
+        log_error(log, "%s is not a cache image for this build", path);
         goto term;
     }
-    uint16_t capacity = new->count - 1;
-    capacity |= capacity >> 1;
-    capacity |= capacity >> 2;
-    capacity |= capacity >> 3;
-    capacity |= capacity >> 4;
-    capacity |= capacity >> 5;
-    capacity |= capacity >> 6;
-    capacity |= capacity >> 7;
-    capacity |= capacity >> 8;
-    capacity |= capacity >> 9;
-    capacity |= capacity >> 10;
-    capacity |= capacity >> 11;
-    capacity |= capacity >> 12;
-    capacity |= capacity >> 13;
-    capacity |= capacity >> 14;
-    capacity |= capacity >> 15;
-    capacity |= capacity >> 16;
-    new->mask = capacity;
-    capacity++;
-    new->capacity = capacity;
-    debug("cache capacity = %d elements\n", capacity);
-    if ((new->data = calloc(capacity, sizeof(cache_element_s))) == NULL) {
-        free(new);
-        new = NULL;
+    if (header->size != size || header->count == 0 || header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+        header->slots_offset > size || header->capacity > (size - header->slots_offset) / sizeof(image_slot_s) ||
+        header->entries_offset > size || header->count > (size - header->entries_offset) / sizeof(image_entry_s)) {
+        log_error(log, "Cache image %s is truncated or corrupt", path);
         goto term;
     }
-    if (file_list != NULL) {
-        while (file_list) {
-            size_t index = file_list->hash & new->mask;
-            if (new->data[index].path == NULL) {
-                new->data[index].path = file_list->path;
-                file_list->path = NULL;
-                new->data[index].data = file_list->data;
-                file_list->data = NULL;
-                new->data[index].len = file_list->len;
-                new->data[index].mime = file_list->mime;
-                new->data[index].next = NULL;
-                new->data[index].hash = file_list->hash;
-                debug("inserting %s, hash = %04x\n", new->data[index].path, new->data[index].hash);
-            } else {
-                while (new->data[index].path != NULL && strcmp(new->data[index].path, file_list->path) != 0) {
-                    index = (index + 1) & new->mask;
-                }
-                if (new->data[index].path == NULL) {
-                    new->data[index].path = file_list->path;
-                    file_list->path = NULL;
-                    new->data[index].data = file_list->data;
-                    file_list->data = NULL;
-                    new->data[index].len = file_list->len;
-                    new->data[index].mime = file_list->mime;
-                    new->data[index].next = NULL;
-                    new->data[index].hash = file_list->hash;
-                    debug("inserting %s, hash = %04x\n", new->data[index].path, new->data[index].hash);
-                }
+    if ((image = calloc(1, sizeof(cache_image_s) + header->count * sizeof(cache_element_s))) == NULL ||
+        (new = calloc(1, sizeof(cache_s))) == NULL ||
+        (new->slots = calloc(header->capacity, sizeof(cache_slot_s))) == NULL) {
+        log_error(log, "Error allocating cache for image %s: %s", path, strerror(errno));
+        goto term;
+    }
+    image->map = map;
+    image->size = size;
+    new->log = log;
+    new->capacity = header->capacity;
+    new->mask = header->capacity - 1;
+    const image_entry_s *entries = (const image_entry_s *)((const char *)map + header->entries_offset);
+    for (size_t i = 0; i < header->count; i++) {
+        const image_entry_s *entry = &entries[i];
+        cache_element_s *e = &image->elements[i];
+        e->hash = entry->hash;
+        e->len = entry->len;
+        e->fd = -1;
+        e->mtime = entry->mtime;
+        e->image = image;
+        e->path = entry->path != 0 ? (char *)image_pointer(image, entry->path, 0, true) : NULL;
+        e->alias = entry->alias != 0 ? (char *)image_pointer(image, entry->alias, 0, true) : NULL;
+        e->mime = image_pointer(image, entry->mime, 0, true);
+        e->data = (char *)image_pointer(image, entry->data, entry->len, false);
+        if ((entry->path != 0 && e->path == NULL) || (entry->alias != 0 && e->alias == NULL) || e->mime == NULL || (e->data == NULL && entry->len > 0)) {
+            log_error(log, "Cache image %s has a corrupt entry %zu", path, i);
+            goto term;
+        }
+        for (int encoding = 0; encoding < CACHE_ENCODING_COUNT; encoding++) {
+            if (entry->variants[encoding] > header->count || (entry->headers[encoding] != 0 && (e->headers[encoding] = (char *)image_pointer(image, entry->headers[encoding], entry->headers_len[encoding], false)) == NULL) ||
+                (entry->hpack[encoding] != 0 && (e->hpack[encoding] = (char *)image_pointer(image, entry->hpack[encoding], entry->hpack_len[encoding], false)) == NULL)) {
+                log_error(log, "Cache image %s has a corrupt entry %zu", path, i);
+                goto term;
+            }
+            e->headers_len[encoding] = e->headers[encoding] != NULL ? entry->headers_len[encoding] : 0;
+            e->hpack_len[encoding] = e->hpack[encoding] != NULL ? entry->hpack_len[encoding] : 0;
+            e->variants[encoding] = entry->variants[encoding] != 0 ? &image->elements[entry->variants[encoding] - 1] : NULL;
+            memcpy(e->etag[encoding], entry->etag[encoding], CACHE_ETAG_SIZE);
+            e->etag[encoding][CACHE_ETAG_SIZE - 1] = '\0';
+        }
+        memcpy(e->last_modified, entry->last_modified, sizeof(e->last_modified));
+        e->last_modified[CACHE_DATE_SIZE - 1] = '\0';
+    }
+    // Each element is referenced by its slots, if it has any, and by every
+    // element it is a variant of, as when loading from files.
+    const image_slot_s *slots = (const image_slot_s *)((const char *)map + header->slots_offset);
+    for (size_t i = 0; i < header->capacity; i++) {
+        if (slots[i].entry == 0) {
+            continue;
+        }
+        if (slots[i].entry > header->count || image->elements[slots[i].entry - 1].path == NULL) {
+            log_error(log, "Cache image %s has a corrupt slot %zu", path, i);
+            goto term;
+        }
+        new->slots[i].hash = slots[i].hash;
+        new->slots[i].element = &image->elements[slots[i].entry - 1];
+        atomic_fetch_add_explicit(&new->slots[i].element->refs, 1, memory_order_relaxed);
+        new->count++;
+    }
+    size_t refs = header->count;
+    for (size_t i = 0; i < header->count; i++) {
+        for (int encoding = 0; encoding < CACHE_ENCODING_COUNT; encoding++) {
+            if (image->elements[i].variants[encoding] != NULL) {
+                atomic_fetch_add_explicit(&image->elements[i].variants[encoding]->refs, 1, memory_order_relaxed);
             }
-            cache_element_s *e = file_list->next;
-            free(file_list);
-            file_list = e;
         }
     }
-    cache_s *old = cache;
-    pthread_rwlock_wrlock(&cache_rw_lock);
-    cache = new;
+    for (size_t i = 0; i < header->count; i++) {
+        if (atomic_load_explicit(&image->elements[i].refs, memory_order_relaxed) == 0) {
+            refs--;
+        }
+    }
+    if (new->count == 0 || refs == 0) {
+        log_error(log, "Cache image %s has no files", path);
+        goto term;
+    }
+    atomic_init(&image->refs, refs);
+    log_info(log, "Mapped cache image %s: %zu paths, %zu bytes", path, new->count, size);
+    cache_s *old = atomic_exchange(&cache, new);
+    synchronize();
     free_cache(old);
-    pthread_rwlock_unlock(&cache_rw_lock);
+    new = NULL;
+    image = NULL;
+    map = MAP_FAILED;
     rc = 0;
 term:
-    if (file_list != NULL) {
-        cache_element_s *e = file_list->next;
-        if (file_list->data) {
-            free((void *)file_list->data);
-        }
-        if (file_list->path) {
-            free((void *)file_list->path);
-        }
-        free(file_list);
-        file_list = e;
+    if (new != NULL) {
+        free(new->slots);
+        free(new);
+    }
+    free(image);
+    if (map != MAP_FAILED) {
+        munmap(map, statbuf.st_size);
+    }
+    if (fd >= 0) {
+        close(fd);
     }
+    pthread_mutex_unlock(&cache_write_mutex);
     debug_return rc;
 }
 
-static const char *determine_mime(cache_element_s *e) {
+int cache_image_write(const char *path, log_s *log) {
     debug_enter();
-    const char *cp = strrchr(e->path, '.');
-    if (cp == NULL || *(cp + 1) == '\0') {
-        debug_return "application/octet-stream";
+    int rc = 1;
+    size_t *slot_entry = NULL;
+    cache_element_s **elements = NULL;
+    image_entry_s *entries = NULL;
+    image_slot_s *slots = NULL;
+    FILE *fs = NULL;
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+        log_error(log, "Cache image path too long: %s", path);
+        debug_return 1;
+    }
+    // Holding the write mutex keeps the table still while it is written.
+    pthread_mutex_lock(&cache_write_mutex);
+    if (cache == NULL) {
+        log_error(log, "No cache loaded to write to %s", path);
+        goto term;
+    }
+    // Entries are the elements in the table, in the order of their path 
+    // slots, followed by the compressed variants, which have no path and no
+    // slot. A variant with a path is a precompressed sibling file and has 
+    // its own slot. Alias slots name the entry of their element's path slot.
+    size_t count = 0;
+    for (size_t i = 0; i < cache->capacity; i++) {
+        cache_element_s *e = cache->slots[i].element;
+        if (e != NULL && cache->slots[i].hash == e->hash) {
+            count++;
+            for (int encoding = 0; encoding < CACHE_ENCODING_COUNT; encoding++) {
+                count += e->variants[encoding] != NULL && e->variants[encoding]->path == NULL;
+            }
+        }
     }
-    cp++;
-    if (strcasecmp(cp, "css") == 0) {
-        debug_return "text/css";
-    } 
-    if (strcasecmp(cp, "docx") == 0) {
-        debug_return "application/vnd.openxmlformats-officedocument.wordprocessingml.document";
+    if ((slot_entry = calloc(cache->capacity, sizeof(size_t))) == NULL ||
+        (elements = calloc(count, sizeof(cache_element_s *))) == NULL ||
+        (entries = calloc(count, sizeof(image_entry_s))) == NULL ||
+        (slots = calloc(cache->capacity, sizeof(image_slot_s))) == NULL) {
+        log_error(log, "Error allocating cache image: %s", strerror(errno));
+        goto term;
     }
-    if (strcasecmp(cp, "html") == 0) {
-        debug_return "text/html; charset=UTF-8";
+    size_t n = 0;
+    for (size_t i = 0; i < cache->capacity; i++) {
+        cache_element_s *e = cache->slots[i].element;
+        if (e != NULL && cache->slots[i].hash == e->hash) {
+            elements[n++] = e;
+            slot_entry[i] = n;
+            slots[i].hash = cache->slots[i].hash;
+            slots[i].entry = n;
+        }
     }
-    if (strcasecmp(cp, "ico") == 0) {
-        debug_return "image/x-icon";
+    for (size_t i = 0; i < cache->capacity; i++) {
+        cache_element_s *e = cache->slots[i].element;
+        if (e != NULL && cache->slots[i].hash != e->hash) {
+            slots[i].hash = cache->slots[i].hash;
+            slots[i].entry = slot_entry[slot_find(cache, e->path, e->hash)];
+        }
     }
-    if (strcasecmp(cp, "jpg") == 0 || strcasecmp(cp, "jpeg") == 0) {
-        debug_return "image/jpeg";
+    size_t tabled = n;
+    for (size_t i = 0; i < tabled; i++) {
+        for (int encoding = 0; encoding < CACHE_ENCODING_COUNT; encoding++) {
+            cache_element_s *v = elements[i]->variants[encoding];
+            if (v == NULL) {
+                continue;
+            }
+            if (v->path == NULL) {
+                elements[n++] = v;
+                entries[i].variants[encoding] = n;
+            } else {
+                entries[i].variants[encoding] = slot_entry[slot_find(cache, v->path, v->hash)];
+            }
+        }
     }
-    if (strcasecmp(cp, "js") == 0) {
-        debug_return "application/javascript";
+    if ((fs = fopen(tmp, "w")) == NULL) {
+        log_error(log, "Error creating cache image %s: %s", tmp, strerror(errno));
+        goto term;
     }
-    if (strcasecmp(cp, "md") == 0) {
-        debug_return "text/markdown";
+    image_header_s header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.entry_size = sizeof(image_entry_s);
+    header.count = count;
+    header.capacity = cache->capacity;
+    // The header, slots and entries are written first as placeholders so 
+    // the blobs can be written in one pass, recording their offsets.
+    if (image_write_blob(fs, (const char *)&header, -1, sizeof(header), NULL) != 0 ||
+        image_write_blob(fs, (const char *)slots, -1, cache->capacity * sizeof(image_slot_s), &header.slots_offset) != 0 ||
+        image_write_blob(fs, (const char *)entries, -1, count * sizeof(image_entry_s), &header.entries_offset) != 0) {
+        goto write_error;
     }
-    if (strcasecmp(cp, "pdf") == 0) {
-        debug_return "application/pdf";
+    for (size_t i = 0; i < count; i++) {
+        cache_element_s *e = elements[i];
+        image_entry_s *entry = &entries[i];
+        entry->hash = e->hash;
+        entry->len = e->len;
+        entry->mtime = e->mtime;
+        memcpy(entry->etag, e->etag, sizeof(entry->etag));
+        memcpy(entry->last_modified, e->last_modified, sizeof(entry->last_modified));
+        if ((e->path != NULL && image_write_blob(fs, e->path, -1, strlen(e->path) + 1, &entry->path) != 0) ||
+            (e->alias != NULL && image_write_blob(fs, e->alias, -1, strlen(e->alias) + 1, &entry->alias) != 0) ||
+            image_write_blob(fs, e->mime != NULL ? e->mime : "application/octet-stream", -1, strlen(e->mime != NULL ? e->mime : "application/octet-stream") + 1, &entry->mime) != 0 ||
+            image_write_blob(fs, e->data, e->fd, e->len, &entry->data) != 0) {
+            goto write_error;
+        }
+        for (int encoding = 0; encoding < CACHE_ENCODING_COUNT; encoding++) {
+            if (e->headers[encoding] != NULL) {
+                if (image_write_blob(fs, e->headers[encoding], -1, e->headers_len[encoding], &entry->headers[encoding]) != 0) {
+                    goto write_error;
+                }
+                entry->headers_len[encoding] = e->headers_len[encoding];
+            }
+            if (e->hpack[encoding] != NULL) {
+                if (image_write_blob(fs, e->hpack[encoding], -1, e->hpack_len[encoding], &entry->hpack[encoding]) != 0) {
+                    goto write_error;
+                }
+                entry->hpack_len[encoding] = e->hpack_len[encoding];
+            }
+        }
     }
-    if (strcasecmp(cp, "png") == 0) {
-        debug_return "image/png";
+    off_t size = ftello(fs);
+    header.size = size;
+    if (size < 0 || fseeko(fs, header.entries_offset, SEEK_SET) != 0 || fwrite(entries, sizeof(image_entry_s), count, fs) != count ||
+        fseeko(fs, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fs) != 1 || fflush(fs) != 0 || fsync(fileno(fs)) != 0) {
+        goto write_error;
     }
-    if (strcasecmp(cp, "svg") == 0) {
-        debug_return "image/svg+xml";    
+    if (fclose(fs) != 0) {
+        fs = NULL;
+        goto write_error;
     }
-    if (strcasecmp(cp, "webmanifest") == 0) {
-        debug_return "application/manifest+json";
+    fs = NULL;
+    if (rename(tmp, path) != 0) {
+        log_error(log, "Error renaming %s to %s: %s", tmp, path, strerror(errno));
+        unlink(tmp);
+        goto term;
     }
-    if (strcasecmp(cp, "xml") == 0) {
-        debug_return "text/xml";
+    log_info(log, "Wrote cache image %s: %zu files, %zu entries, %lld bytes", path, tabled, count, (long long)size);
+    rc = 0;
+    goto term;
+write_error:
+    log_error(log, "Error writing cache image %s: %s", tmp, strerror(errno));
+    if (fs != NULL) {
+        fclose(fs);
+        fs = NULL;
     }
-    debug_return "application/octet-stream";
+    unlink(tmp);
+term:
+    pthread_mutex_unlock(&cache_write_mutex);
+    free(slot_entry);
+    free(elements);
+    free(entries);
+    free(slots);
+    debug_return rc;
 }
 
-static void free_cache(cache_s *cache) {
+int cache_init(const cache_config_s *config) {
     debug_enter();
-    if (cache == NULL) {
+    size_t defaults = sizeof(mime_defaults) / sizeof(mime_defaults[0]);
+    mime_entry_s *table = malloc((defaults + config->mime_types_count) * sizeof(mime_entry_s));
+    if (table == NULL) {
+        debug_return 1;
+    }
+    memcpy(table, mime_defaults, sizeof(mime_defaults));
+    size_t count = defaults;
+    for (size_t i = 0; i < config->mime_types_count; i++) {
+        const cache_mime_type_s *type = &config->mime_types[i];
+        char key[CACHE_EXTENSION_MAX];
+        if (!mime_key(key, type->extension)) {
+            free(table);
+            debug_return 1;
+        }
+        size_t j = 0;
+        while (j < count && strcmp(table[j].extension, key) != 0) {
+            j++;
+        }
+        if (j == count) {
+            memcpy(table[count++].extension, key, sizeof(key));
+        }
+        table[j].mime = type->mime;
+        table[j].compress = type->compress < 0 ? compressible(type->mime) : type->compress != 0;
+    }
+    qsort(table, count, sizeof(mime_entry_s), compare_mime);
+    free(mime_table);
+    mime_table = table;
+    mime_count = count;
+    cache_config = *config;
+    if (cache_config.not_found != NULL) {
+        not_found_hash = hash(cache_config.not_found);
+    }
+    debug_return 0;
+}
+
+void cache_release(cache_element_s *e) {
+    if (e == NULL) {
         return;
     }
-    if (cache->data == NULL) {
+    if (atomic_fetch_sub_explicit(&e->refs, 1, memory_order_acq_rel) == 1) {
+        free_element(e);
+    }
+}
+
+cache_element_s *cache_resolve(const char *path, bool *found) {
+    debug_enter();
+    cache_element_s *p = NULL;
+    size_t full_hash = hash(path);
+    *found = false;
+    cache_s *table = reader_enter();
+    if (table == NULL) {
         goto term;
     }
-    for (size_t i = 0; i < cache->capacity; i++) {
-        if (cache->data[i].path != NULL) {
-            free((char *)cache->data[i].path);
-        }
-        if (cache->data[i].data != NULL) {
-            free((char *)cache->data[i].data);
+    size_t index = slot_find(table, path, full_hash);
+    if ((p = table->slots[index].element) != NULL) {
+        *found = true;
+        if (cache_config.memory_budget > 0) {
+            count_hit(table, index);
         }
+    } else if (cache_config.not_found != NULL) {
+        log_debug(table->log, "Path %s not found in cache, using %s", path, cache_config.not_found);
+        p = lookup(table, cache_config.not_found, not_found_hash);
     }
-term:
-    if (cache->data != NULL) {
-        free(cache->data);
+    if (p != NULL && !pass) {
+        atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
     }
-    free(cache);
-    cache = NULL;
-    debug_return;
+term:
+    reader_exit();
+    debug_return p;
 }
 
-static inline size_t hash(const char *key) {
-    debug_enter();
-    size_t hash = 0;
-    for (size_t i = 0; key[i] != '\0'; i++) {
-        hash = ((hash << 5) - hash) + key[i];
+void cache_pass_begin(void) {
+    reader_enter();
+    pass = true;
+}
+
+void cache_pass_end(void) {
+    pass = false;
+    reader_exit();
+}
+
+cache_element_s *cache_variant(cache_element_s *e, cache_encoding_e encoding) {
+    if (e == NULL || encoding <= CACHE_ENCODING_IDENTITY || encoding >= CACHE_ENCODING_COUNT) {
+        return NULL;
     }
-    debug_return hash;
+    cache_element_s *v = e->variants[encoding];
+    if (v != NULL && !pass) {
+        atomic_fetch_add_explicit(&v->refs, 1, memory_order_relaxed);
+    }
+    return v;
 }
 
-static int init_element(cache_element_s *e) {
+int cache_watch_start(const char const *path, log_s *log) {
     debug_enter();
     int rc = 1;
-    e->len = 0;
-    e->data = NULL;
-    e->mime = NULL;
-    FILE *f = fopen(e->path, "r");
-    if (f == NULL) {
-        log_error(cache->log, "Error opening file %s: %s", e->path, strerror(errno));
+    if (watch != NULL) {
+        debug_return 0;
+    }
+    cache_watch_s *w = calloc(1, sizeof(cache_watch_s));
+    if (w == NULL) {
+        log_error(log, "Error allocating cache watcher: %s", strerror(errno));
+        debug_return 1;
+    }
+    w->log = log;
+    w->inotify_fd = -1;
+    w->event_fd = -1;
+    if ((w->base_path = strdup(path)) == NULL) {
+        log_error(log, "Error allocating cache watcher: %s", strerror(errno));
         goto term;
     }
-    if (fseek(f, 0, SEEK_END)) {
-        log_error(cache->log, "Error seeking file %s: %s", e->path, strerror(errno));
+    if ((w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        log_error(log, "Error initializing inotify: %s", strerror(errno));
         goto term;
     }
-    e->len = ftell(f);
-    e->data = malloc(e->len);
-    if (e->data == NULL) {
-        log_error(cache->log, "Error allocating %d bytes for cache data: %s", e->len, strerror(errno));
+    if ((w->event_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        log_error(log, "Error creating eventfd: %s", strerror(errno));
         goto term;
     }
-    if (fseek(f, 0, SEEK_SET)) {
-        log_error(cache->log, "Error seeking file %s: %s", e->path, strerror(errno));
+    if (watch_dir(w, "") != 0) {
         goto term;
     }
-    if (fread((char *)e->data, 1, e->len, f) != e->len) {
-        log_error(cache->log, "Error reading file %s: %s", e->path, strerror(errno));
+    if (pthread_create(&w->thread, NULL, watch_run, w) != 0) {
+        log_error(log, "Error starting cache watcher thread");
         goto term;
     }
-    fclose(f);
-    f = NULL;
-    e->mime = determine_mime(e);
+    log_info(log, "Watching %s for changes", path);
+    watch = w;
+    w = NULL;
     rc = 0;
 term:
-    if (e->data != NULL && rc != 0) {
-        free((char *)e->data);
-        e->len = 0;
+    if (w != NULL) {
+        if (w->inotify_fd >= 0) {
+            close(w->inotify_fd);
+        }
+        if (w->event_fd >= 0) {
+            close(w->event_fd);
+        }
+        for (size_t i = 0; i < w->dirs_size; i++) {
+            free(w->dirs[i]);
+        }
+        free(w->dirs);
+        free(w->base_path);
+        free(w);
     }
-    if (f != NULL) {
-        fclose(f);
+    debug_return rc;
+}
+
+void cache_watch_stop(void) {
+    debug_enter();
+    if (watch == NULL) {
+        debug_return;
     }
-    if (rc != 0) {
-        e->mime = NULL;
+    uint64_t one = 1;
+    if (write(watch->event_fd, &one, sizeof(one)) != sizeof(one)) {
+        log_error(watch->log, "Error signalling cache watcher: %s", strerror(errno));
     }
-    debug_return rc;
+    pthread_join(watch->thread, NULL);
+    close(watch->inotify_fd);
+    close(watch->event_fd);
+    for (size_t i = 0; i < watch->dirs_size; i++) {
+        free(watch->dirs[i]);
+    }
+    free(watch->dirs);
+    free(watch->base_path);
+    free(watch);
+    watch = NULL;
+    debug_return;
 }
 
-static int load_dir(cache_s *cache, cache_element_s **list, const char const *base_path, const char const *path) {
+int cache_load(const char const *path, log_s *log) {
     debug_enter();
-    if (cache == NULL) {
-        debug_return 1;
+    log_info(log, "Loading cache from %s", path);
+    int rc = 1;
+    pthread_mutex_lock(&cache_write_mutex);
+    cache_s *new = calloc(1, sizeof(cache_s));
+    cache_element_s *file_list = NULL;
+    if (new == NULL) {
+        goto term;
     }
-    debug("cache->log = %p\n", cache->log);
-    if (path == NULL) {
-        log_error(cache->log, "path is NULL");
-        debug_return 1;
+    new->log = log;
+    if (load_dir(new, &file_list, path, path) != 0) {
+        free(new);
+        new = NULL;
+        goto term;
     }
-    debug("base_path = %s, path = %s\n", base_path, path);
-    struct dirent *entry;
-    DIR *dp = opendir(path);
-    if (dp == NULL) {
-        log_error(cache->log, "Error opening directory %s: %s", path, strerror(errno));
-        debug_return 1;
+    debug("caching %d files\n", new->count);
+    if (new->count == 0) {
+        free(new);
+        new = NULL;
+        goto term;
     }
-    while ((entry = readdir(dp)) != NULL) {
-        if (entry->d_name[0] == '.') {
-            debug("skipping dot file: %s/%s\n", path, entry->d_name);
+    size_t capacity = 1;
+    while (overloaded(new->count, capacity)) {
+        capacity <<= 1;
+    }
+    new->mask = capacity - 1;
+    new->capacity = capacity;
+    debug("cache capacity = %d elements\n", capacity);
+    if ((new->slots = calloc(capacity, sizeof(cache_slot_s))) == NULL) {
+        free(new);
+        new = NULL;
+        goto term;
+    }
+    while (file_list) {
+        cache_element_s *e = file_list;
+        file_list = e->next;
+        e->next = NULL;
+        size_t index = slot_find(new, e->path, e->hash);
+        if (new->slots[index].element != NULL) {
+            cache_release(e);
             continue;
         }
-        debug("processing %s/%s\n", path, entry->d_name);
-        char *full_path = malloc(strlen(path) + strlen(entry->d_name) + 2);
-        if (full_path == NULL) {
-            log_error(cache->log, "Error allocating memory for full path: %s", strerror(errno));
-            closedir(dp);
-            debug_return 1;
+        new->slots[index].hash = e->hash;
+        new->slots[index].element = e;
+        debug("inserting %s, hash = %016zx\n", e->path, e->hash);
+        if (e->alias != NULL) {
+            size_t alias_hash = hash(e->alias);
+            index = slot_find(new, e->alias, alias_hash);
+            new->slots[index].hash = alias_hash;
+            new->slots[index].element = e;
+            atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
         }
-        strcpy(full_path, path);
-        strcat(full_path, "/");
-        strcat(full_path, entry->d_name);
-        struct stat statbuf;
-        if (stat(full_path, &statbuf) == -1) {
-            log_error(cache->log, "Could not stat file %s: %s", full_path, strerror(errno));
-            free(full_path);
-            closedir(dp);
-            debug_return 1;
+    }
+    for (size_t i = 0; i < new->capacity; i++) {
+        if (new->slots[i].element != NULL && new->slots[i].hash == new->slots[i].element->hash) {
+            init_variants(new, new->slots[i].element);
+            init_headers(new, new->slots[i].element);
         }
-        if (S_ISDIR(statbuf.st_mode)) {
-            if (load_dir(cache, list, base_path, full_path)) {
-                free(full_path);
-                closedir(dp);
-                debug_return 1;
-            }
-        } else {
-            debug("inserting new cache element for %s\n", full_path);
-            cache_element_s *new_element = malloc(sizeof(cache_element_s));
-            if (new_element == NULL) {
+    }
+    cache_s *old = atomic_exchange(&cache, new);
+    synchronize();
+    free_cache(old);
+    rc = 0;
+term:
+    while (file_list != NULL) {
+        cache_element_s *e = file_list->next;
+        cache_release(file_list);
+        file_list = e;
+    }
+    pthread_mutex_unlock(&cache_write_mutex);
+    debug_return rc;
+}
+
+/**
+ * @brief Orders element pointers by address, for bsearch().
+ */
+static int compare_elements(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(cache_element_s *const *)a;
+    uintptr_t y = (uintptr_t)*(cache_element_s *const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Orders MIME type table entries by extension, for qsort() and 
+ * bsearch().
+ */
+static int compare_mime(const void *a, const void *b) {
+    return strcmp(((const mime_entry_s *)a)->extension, ((const mime_entry_s *)b)->extension);
+}
+
+/**
+ * @brief Builds a compressed copy of an in-memory element. Returns NULL if
+ * compression fails or doesn't make the file smaller.
+ */
+static cache_element_s *compress_element(cache_s *cache, cache_element_s *e, cache_encoding_e encoding) {
+    debug_enter();
+    cache_element_s *v = calloc(1, sizeof(cache_element_s));
+    if (v == NULL) {
+        log_error(cache->log, "Error allocating cache variant: %s", strerror(errno));
+        debug_return NULL;
+    }
+    v->fd = -1;
+    v->mime = e->mime;
+    atomic_init(&v->refs, 1);
+    if (encoding == CACHE_ENCODING_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+            goto fail;
+        }
+        size_t bound = deflateBound(&zs, e->len);
+        if ((v->data = malloc(bound)) == NULL) {
+            deflateEnd(&zs);
+            goto fail;
+        }
+        zs.next_in = (Bytef *)e->data;
+        zs.avail_in = e->len;
+        zs.next_out = (Bytef *)v->data;
+        zs.avail_out = bound;
+        int zrc = deflate(&zs, Z_FINISH);
+        v->len = zs.total_out;
+        deflateEnd(&zs);
+        if (zrc != Z_STREAM_END) {
+            goto fail;
+        }
+    } else if (encoding == CACHE_ENCODING_BR) {
+        size_t bound = BrotliEncoderMaxCompressedSize(e->len);
+        if (bound == 0 || (v->data = malloc(bound)) == NULL) {
+            goto fail;
+        }
+        v->len = bound;
+        if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, e->len, (const uint8_t *)e->data, &v->len, (uint8_t *)v->data)) {
+            goto fail;
+        }
+    } else {
+        goto fail;
+    }
+    if (v->len >= e->len) {
+        debug("%s variant of %s is no smaller, dropping\n", cache_encoding_str[encoding], e->path);
+        cache_release(v);
+        debug_return NULL;
+    }
+    char *data = realloc(v->data, v->len);
+    if (data != NULL) {
+        v->data = data;
+    }
+    log_debug(cache->log, "Compressed %s with %s: %ld -> %ld bytes", e->path, cache_encoding_str[encoding], e->len, v->len);
+    debug_return v;
+fail:
+    log_warn(cache->log, "Could not build %s variant of %s", cache_encoding_str[encoding], e->path);
+    cache_release(v);
+    debug_return NULL;
+}
+
+/**
+ * @brief Picks the Cache-Control value for an element from the configured
+ * rules, or NULL if none apply.
+ */
+static const char *cache_control_for(cache_element_s *e) {
+    const cache_control_rule_s *path_rule = NULL;
+    const cache_control_rule_s *mime_rule = NULL;
+    const cache_control_rule_s *wildcard_rule = NULL;
+    const cache_control_rule_s *default_rule = NULL;
+    size_t path_len = 0;
+    size_t mime_len = e->mime != NULL ? strcspn(e->mime, ";") : 0;
+    while (mime_len > 0 && e->mime[mime_len - 1] == ' ') {
+        mime_len--;
+    }
+    for (size_t i = 0; i < cache_config.cache_control_count; i++) {
+        const cache_control_rule_s *rule = &cache_config.cache_control[i];
+        size_t len = strlen(rule->match);
+        if (rule->match[0] == '/') {
+            if (len > path_len && strncmp(e->path, rule->match, len) == 0) {
+                path_rule = rule;
+                path_len = len;
+            }
+        } else if (strcasecmp(rule->match, "default") == 0) {
+            default_rule = rule;
+        } else if (e->mime == NULL) {
+            continue;
+        } else if (len == mime_len && strncasecmp(e->mime, rule->match, len) == 0) {
+            mime_rule = rule;
+        } else if (len >= 2 && rule->match[len - 1] == '*' && rule->match[len - 2] == '/' && strncasecmp(e->mime, rule->match, len - 1) == 0) {
+            wildcard_rule = rule;
+        }
+    }
+    const cache_control_rule_s *rule = path_rule != NULL ? path_rule : mime_rule != NULL ? mime_rule : wildcard_rule != NULL ? wildcard_rule : default_rule;
+    return rule != NULL ? rule->value : NULL;
+}
+
+/**
+ * @brief Determines whether files of the given mime type are worth 
+ * compressing, for configured types that don't say. Image, audio and
+ * archive formats are already compressed.
+ */
+static bool compressible(const char *mime) {
+    return strncmp(mime, "text/", 5) == 0 ||
+           strstr(mime, "javascript") != NULL ||
+           strstr(mime, "json") != NULL ||
+           strstr(mime, "xml") != NULL;
+}
+
+/**
+ * @brief Counts a lookup of a slot for the evictor, in the calling 
+ * thread's own array for the table, so a hit writes no line another 
+ * thread writes. Threads without a reader slot of their own don't count.
+ * The evictor may take the count between the load and the store, losing 
+ * the increment, which only makes the count approximate.
+ */
+static inline void count_hit(cache_s *cache, size_t index) {
+    if (reader == &reader_shared) {
+        return;
+    }
+    _Atomic(atomic_uchar *) *own = &cache->hits[reader - readers];
+    atomic_uchar *hits = atomic_load_explicit(own, memory_order_relaxed);
+    if (hits == NULL) {
+        size_t size = (cache->capacity + EVICT_LINE - 1) & ~(size_t)(EVICT_LINE - 1);
+        if ((hits = aligned_alloc(EVICT_LINE, size)) == NULL) {
+            return;
+        }
+        for (size_t i = 0; i < cache->capacity; i++) {
+            atomic_init(&hits[i], 0);
+        }
+        atomic_store_explicit(own, hits, memory_order_release);
+    }
+    unsigned char n = atomic_load_explicit(&hits[index], memory_order_relaxed);
+    if (n < EVICT_HITS_MAX) {
+        atomic_store_explicit(&hits[index], n + 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Looks up the MIME type of an element by its extension.
+ * @return The table entry, or NULL for a file without a known extension.
+ */
+static const mime_entry_s *determine_mime(cache_element_s *e) {
+    debug_enter();
+    const char *cp = strrchr(e->path, '.');
+    mime_entry_s key;
+    if (cp == NULL || strchr(cp, '/') != NULL || !mime_key(key.extension, cp + 1)) {
+        debug_return NULL;
+    }
+    debug_return bsearch(&key, mime_table, mime_count, sizeof(mime_entry_s), compare_mime);
+}
+
+/**
+ * @brief Determines whether the evictor may move a file between memory and
+ * a descriptor: a file loaded from the docroot, not empty, under the 
+ * sendfile threshold, and not a precompressed sibling held by its parent
+ * as a variant, which would keep the old copy alive.
+ */
+static bool evict_eligible(cache_s *cache, cache_element_s *e) {
+    if (e->image != NULL || e->len == 0 || (cache_config.sendfile_threshold > 0 && e->len >= cache_config.sendfile_threshold)) {
+        return false;
+    }
+    size_t len = strlen(e->path);
+    for (int encoding = CACHE_ENCODING_GZIP; encoding < CACHE_ENCODING_COUNT; encoding++) {
+        size_t suffix_len = strlen(encoding_suffix[encoding]);
+        if (len > suffix_len && strcmp(e->path + len - suffix_len, encoding_suffix[encoding]) == 0) {
+            char parent[len + 1];
+            snprintf(parent, sizeof(parent), "%.*s", (int)(len - suffix_len), e->path);
+            cache_element_s *p = lookup(cache, parent, hash(parent));
+            if (p != NULL && p->variants[encoding] == e) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Takes the hits each reader counted in the live table since the 
+ * last pass and adds them to the elements in the slots they were counted
+ * against, an element with an alias getting the hits of both its slots. 
+ * Only counters that moved are written. Called with the write mutex held.
+ */
+static void evict_fold(void) {
+    for (size_t r = 0; r < READERS_MAX; r++) {
+        atomic_uchar *hits = atomic_load_explicit(&cache->hits[r], memory_order_acquire);
+        if (hits == NULL) {
+            continue;
+        }
+        for (size_t i = 0; i < cache->capacity; i++) {
+            if (atomic_load_explicit(&hits[i], memory_order_relaxed) == 0) {
+                continue;
+            }
+            unsigned n = atomic_exchange_explicit(&hits[i], 0, memory_order_relaxed);
+            cache_element_s *e = cache->slots[i].element;
+            if (e != NULL) {
+                e->hits = e->hits + n < EVICT_HITS_MAX ? e->hits + n : EVICT_HITS_MAX;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Reloads a file into a new element held in memory or on an open 
+ * descriptor, and swaps it in for e. The variants are shared with e; a 
+ * file moving into memory that has none gets them built. Nothing is done
+ * if the file changed since e was loaded, which the watcher or a reload
+ * takes care of. Called with the write mutex held.
+ */
+static bool evict_move(cache_evict_s *ev, cache_element_s *e, bool resident) {
+    debug_enter();
+    bool moved = false;
+    cache_element_s *n = NULL;
+    cache_element_s *old = NULL;
+    char full[PATH_MAX];
+    struct stat statbuf;
+    if (snprintf(full, sizeof(full), "%s%s", ev->base_path, e->path) >= sizeof(full)) {
+        debug_return false;
+    }
+    int fd = open(full, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &statbuf) != 0 || (size_t)statbuf.st_size != e->len || statbuf.st_mtime != e->mtime) {
+        debug("not moving %s, changed since it was loaded\n", full);
+        goto term;
+    }
+    if ((n = calloc(1, sizeof(cache_element_s))) == NULL || (n->path = strdup(e->path)) == NULL ||
+        (e->alias != NULL && (n->alias = strdup(e->alias)) == NULL)) {
+        log_error(ev->log, "Error moving %s: no memory", e->path);
+        goto term;
+    }
+    n->hash = e->hash;
+    n->len = e->len;
+    n->mime = e->mime;
+    n->compress = e->compress;
+    n->mtime = e->mtime;
+    n->fd = -1;
+    memcpy(n->etag, e->etag, sizeof(n->etag));
+    memcpy(n->last_modified, e->last_modified, sizeof(n->last_modified));
+    atomic_init(&n->refs, 1);
+    n->hits = e->hits;
+    if (resident) {
+        if (read_data(cache, n, fd, full) != 0) {
+            goto term;
+        }
+    } else {
+        n->fd = fd;
+        fd = -1;
+    }
+    bool variants = false;
+    for (int encoding = CACHE_ENCODING_GZIP; encoding < CACHE_ENCODING_COUNT; encoding++) {
+        if ((n->variants[encoding] = e->variants[encoding]) != NULL) {
+            atomic_fetch_add_explicit(&n->variants[encoding]->refs, 1, memory_order_relaxed);
+            variants = true;
+        }
+    }
+    if (resident && !variants) {
+        init_variants(cache, n);
+    }
+    init_headers(cache, n);
+    if (table_insert(n, &old) != 0) {
+        log_error(ev->log, "Error moving %s: no memory", e->path);
+        goto term;
+    }
+    log_debug(ev->log, "Cache moved %s %s", e->path, resident ? "into memory" : "out of memory");
+    synchronize();
+    cache_release(old);
+    n = NULL;
+    moved = true;
+term:
+    cache_release(n);
+    if (fd >= 0) {
+        close(fd);
+    }
+    debug_return moved;
+}
+
+/**
+ * @brief Moves the CLOCK hand until need more bytes fit in the budget, or
+ * it has gone round the table the given number of times. Each resident 
+ * file passed has its hit count halved, and one whose count was already 
+ * zero is moved out to a descriptor, so a file hit often survives several
+ * revolutions. Counts are at most EVICT_HITS_MAX, so any file is reached
+ * within EVICT_REVOLUTIONS. Called with the write mutex held.
+ */
+static bool evict_room(cache_evict_s *ev, size_t need, size_t revolutions, size_t *resident) {
+    size_t budget = cache_config.memory_budget;
+    for (size_t steps = 0; *resident + need > budget && steps < revolutions * cache->capacity; steps++) {
+        size_t index = ev->hand++ & cache->mask;
+        cache_element_s *e = cache->slots[index].element;
+        if (e == NULL || cache->slots[index].hash != e->hash || e->data == NULL || !evict_eligible(cache, e)) {
+            continue;
+        }
+        if (e->hits > 0) {
+            e->hits /= 2;
+            continue;
+        }
+        size_t len = e->len;
+        if (evict_move(ev, e, false)) {
+            *resident -= len;
+        }
+    }
+    return *resident + need <= budget;
+}
+
+static void *evict_run(void *arg) {
+    debug_enter();
+    cache_evict_s *ev = arg;
+    struct pollfd fds = { .fd = ev->event_fd, .events = POLLIN };
+    for (;;) {
+        int n = poll(&fds, 1, EVICT_INTERVAL_MS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error(ev->log, "Cache evictor poll failed: %s", strerror(errno));
+            break;
+        }
+        if (n > 0) {
+            break;
+        }
+        pthread_mutex_lock(&cache_write_mutex);
+        if (cache != NULL) {
+            evict_sweep(ev);
+        }
+        pthread_mutex_unlock(&cache_write_mutex);
+    }
+    debug_return NULL;
+}
+
+/**
+ * @brief One pass of the evictor. Files on descriptors hit at least 
+ * EVICT_PROMOTE_HITS times since the last pass move into memory, with the 
+ * CLOCK hand making room for them, then the hand runs until the budget
+ * holds again. Replacing an element leaves the slots in place, so the 
+ * table can be walked while elements are swapped. Called with the write 
+ * mutex held.
+ */
+static void evict_sweep(cache_evict_s *ev) {
+    debug_enter();
+    evict_fold();
+    size_t resident = 0;
+    for (size_t i = 0; i < cache->capacity; i++) {
+        cache_element_s *e = cache->slots[i].element;
+        if (e != NULL && cache->slots[i].hash == e->hash && e->data != NULL && e->image == NULL) {
+            resident += e->len;
+        }
+    }
+    for (size_t i = 0; i < cache->capacity; i++) {
+        cache_element_s *e = cache->slots[i].element;
+        if (e == NULL || cache->slots[i].hash != e->hash || e->data != NULL || e->fd < 0) {
+            continue;
+        }
+        if (e->hits < EVICT_PROMOTE_HITS || e->len > cache_config.memory_budget || !evict_eligible(cache, e) ||
+            !evict_room(ev, e->len, 2, &resident) || !evict_move(ev, e, true)) {
+            e->hits = 0;
+            continue;
+        }
+        resident += cache->slots[i].element->len;
+    }
+    evict_room(ev, 0, EVICT_REVOLUTIONS, &resident);
+    cache->resident = resident;
+    debug_return;
+}
+
+/**
+ * @brief Drops the cache's reference to each of its elements. Elements still 
+ * referenced by in-flight responses are freed when those are released.
+ */
+static void free_cache(cache_s *cache) {
+    debug_enter();
+    if (cache == NULL) {
+        debug_return;
+    }
+    if (cache->slots == NULL) {
+        goto term;
+    }
+    for (size_t i = 0; i < cache->capacity; i++) {
+        cache_release(cache->slots[i].element);
+    }
+term:
+    free_table(cache);
+    debug_return;
+}
+
+static void free_element(cache_element_s *e) {
+    for (int i = 0; i < CACHE_ENCODING_COUNT; i++) {
+        cache_release(e->variants[i]);
+    }
+    if (e->image != NULL) {
+        image_release(e->image);
+        return;
+    }
+    for (int i = 0; i < CACHE_ENCODING_COUNT; i++) {
+        free(e->headers[i]);
+        free(e->hpack[i]);
+    }
+    if (e->path != NULL) {
+        free(e->path);
+    }
+    free(e->alias);
+    if (e->data != NULL) {
+        free(e->data);
+    }
+    if (e->fd >= 0) {
+        close(e->fd);
+    }
+    free(e);
+}
+
+/**
+ * @brief Frees a table, its slots and the readers' hit counters, but not 
+ * the elements.
+ */
+static void free_table(cache_s *cache) {
+    for (size_t r = 0; r < READERS_MAX; r++) {
+        free(atomic_load_explicit(&cache->hits[r], memory_order_relaxed));
+    }
+    free(cache->slots);
+    free(cache);
+}
+
+/**
+ * @brief FNV-1a over the key, finished with the MurmurHash3 64-bit mixer so
+ * that keys differing only in their last bytes (paths sharing a long 
+ * prefix) still spread across the low bits used for the table index.
+ */
+static inline size_t hash(const char *key) {
+    debug_enter();
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; key[i] != '\0'; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    debug_return (size_t)hash;
+}
+
+/**
+ * @brief Returns a pointer to len bytes at offset in an image, or NULL if
+ * they run past its end. With string set, len is ignored and the bytes must
+ * instead hold a NUL terminated string.
+ */
+static const char *image_pointer(cache_image_s *image, uint64_t offset, uint64_t len, bool string) {
+    const char *map = image->map;
+    if (offset < sizeof(image_header_s) || offset > image->size) {
+        return NULL;
+    }
+    if (string) {
+        return memchr(map + offset, '\0', image->size - offset) != NULL ? map + offset : NULL;
+    }
+    return len <= image->size - offset ? map + offset : NULL;
+}
+
+/**
+ * @brief Drops an element's reference to its image, unmapping the image 
+ * with the last one.
+ */
+static void image_release(cache_image_s *image) {
+    if (atomic_fetch_sub_explicit(&image->refs, 1, memory_order_acq_rel) == 1) {
+        munmap(image->map, image->size);
+        free(image);
+    }
+}
+
+/**
+ * @brief Appends len bytes to an image, from data or, if data is NULL, read
+ * from fd, after padding to IMAGE_ALIGN. offset, if not NULL, gets where
+ * they start.
+ */
+static int image_write_blob(FILE *fs, const char *data, int fd, size_t len, uint64_t *offset) {
+    static const char zeros[IMAGE_ALIGN];
+    off_t pos = ftello(fs);
+    if (pos < 0) {
+        return 1;
+    }
+    size_t pad = (IMAGE_ALIGN - pos % IMAGE_ALIGN) % IMAGE_ALIGN;
+    if (pad > 0 && fwrite(zeros, 1, pad, fs) != pad) {
+        return 1;
+    }
+    if (offset != NULL) {
+        *offset = pos + pad;
+    }
+    if (data != NULL) {
+        return len > 0 && fwrite(data, 1, len, fs) != len;
+    }
+    char buffer[65536];
+    for (size_t done = 0; done < len;) {
+        ssize_t n = pread(fd, buffer, len - done < sizeof(buffer) ? len - done : sizeof(buffer), done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return 1;
+        }
+        if (fwrite(buffer, 1, n, fs) != (size_t)n) {
+            return 1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Loads the file named by e->path. Files below the sendfile threshold
+ * are read into memory while they fit in the memory budget, the others
+ * are kept open for sendfile().
+ */
+static int init_element(cache_s *cache, cache_element_s *e) {
+    debug_enter();
+    int rc = 1;
+    e->len = 0;
+    e->data = NULL;
+    e->mime = NULL;
+    e->compress = false;
+    int fd = open(e->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error(cache->log, "Error opening file %s: %s", e->path, strerror(errno));
+        goto term;
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0) {
+        log_error(cache->log, "Error reading file status %s: %s", e->path, strerror(errno));
+        goto term;
+    }
+    e->len = statbuf.st_size;
+    e->mtime = statbuf.st_mtime;
+    snprintf(e->etag[CACHE_ENCODING_IDENTITY], CACHE_ETAG_SIZE, "\"%lx-%llx-%lx\"",
+        (unsigned long)statbuf.st_ino,
+        (unsigned long long)statbuf.st_mtim.tv_sec * 1000000000ULL + statbuf.st_mtim.tv_nsec,
+        (unsigned long)statbuf.st_size);
+    struct tm tm;
+    gmtime_r(&e->mtime, &tm);
+    strftime(e->last_modified, CACHE_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if ((cache_config.sendfile_threshold > 0 && e->len >= cache_config.sendfile_threshold) ||
+        (cache_config.memory_budget > 0 && cache->resident + e->len > cache_config.memory_budget)) {
+        debug("keeping %s open for sendfile, %d bytes\n", e->path, e->len);
+        e->fd = fd;
+        fd = -1;
+    } else {
+        if (read_data(cache, e, fd, e->path) != 0) {
+            goto term;
+        }
+        cache->resident += e->len;
+    }
+    const mime_entry_s *type = determine_mime(e);
+    e->mime = type != NULL ? type->mime : "application/octet-stream";
+    e->compress = type != NULL && type->compress;
+    rc = 0;
+term:
+    if (e->data != NULL && rc != 0) {
+        free((char *)e->data);
+        e->data = NULL;
+        e->len = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (rc != 0) {
+        e->mime = NULL;
+        e->compress = false;
+    }
+    debug_return rc;
+}
+
+/**
+ * @brief Builds the entity headers for an element and each of its variants.
+ * Run after init_variants(), since the element sends Vary if it has any. 
+ * A header that can't be built is left NULL and the response falls back to
+ * formatting one; so is an HPACK block, which HTTP/2 then encodes per 
+ * response.
+ */
+static void init_headers(cache_s *cache, cache_element_s *e) {
+    debug_enter();
+    bool vary = false;
+    const char *cache_control = cache_control_for(e);
+    const char *configured = cache_config.headers != NULL ? cache_config.headers : "";
+    char additional[strlen(configured) + (cache_control != NULL ? strlen(cache_control) : 0) + CACHE_ETAG_SIZE + CACHE_DATE_SIZE + 96];
+    size_t etag_len = strlen(e->etag[CACHE_ENCODING_IDENTITY]);
+    for (int encoding = CACHE_ENCODING_GZIP; encoding < CACHE_ENCODING_COUNT; encoding++) {
+        cache_element_s *v = e->variants[encoding];
+        if (v != NULL) {
+            vary = true;
+            // The same ETag with the coding appended, so each representation
+            // has its own strong validator.
+            snprintf(e->etag[encoding], CACHE_ETAG_SIZE, "%.*s-%s\"", (int)etag_len - 1, e->etag[CACHE_ENCODING_IDENTITY], cache_encoding_str[encoding]);
+            snprintf(additional, sizeof(additional), "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s%s%s%s", e->etag[encoding], e->last_modified,
+                cache_control != NULL ? "Cache-Control: " : "", cache_control != NULL ? cache_control : "", cache_control != NULL ? "\r\n" : "", configured);
+            e->headers[encoding] = response_entity_header(e->mime, v->len, cache_encoding_str[encoding], true, additional, &e->headers_len[encoding]);
+        }
+    }
+    snprintf(additional, sizeof(additional), "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s%s%s%s", e->etag[CACHE_ENCODING_IDENTITY], e->last_modified,
+        cache_control != NULL ? "Cache-Control: " : "", cache_control != NULL ? cache_control : "", cache_control != NULL ? "\r\n" : "", configured);
+    e->headers[CACHE_ENCODING_IDENTITY] = response_entity_header(e->mime, e->len, NULL, vary, additional, &e->headers_len[CACHE_ENCODING_IDENTITY]);
+    if (e->headers[CACHE_ENCODING_IDENTITY] == NULL) {
+        log_error(cache->log, "Error building headers for %s: no memory", e->path);
+    }
+    for (int encoding = 0; encoding < CACHE_ENCODING_COUNT; encoding++) {
+        if (e->headers[encoding] != NULL) {
+            e->hpack[encoding] = hpack_encode_header(e->headers[encoding], e->headers_len[encoding], &e->hpack_len[encoding]);
+        }
+    }
+    debug_return;
+}
+
+/**
+ * @brief Attaches compressed variants to a compressible element, preferring
+ * precompressed sibling files (path.gz, path.br) over building them.
+ */
+static void init_variants(cache_s *cache, cache_element_s *e) {
+    debug_enter();
+    if (!e->compress) {
+        debug_return;
+    }
+    size_t path_len = strlen(e->path);
+    char sibling[path_len + 4];
+    for (int encoding = CACHE_ENCODING_GZIP; encoding < CACHE_ENCODING_COUNT; encoding++) {
+        snprintf(sibling, sizeof(sibling), "%s%s", e->path, encoding_suffix[encoding]);
+        cache_element_s *v = lookup(cache, sibling, hash(sibling));
+        if (v != NULL) {
+            debug("using %s as %s variant of %s\n", sibling, cache_encoding_str[encoding], e->path);
+            atomic_fetch_add_explicit(&v->refs, 1, memory_order_relaxed);
+            e->variants[encoding] = v;
+        } else if (cache_config.compress && e->data != NULL && e->len >= COMPRESS_MIN_SIZE) {
+            e->variants[encoding] = compress_element(cache, e, encoding);
+        }
+    }
+    debug_return;
+}
+
+static int load_dir(cache_s *cache, cache_element_s **list, const char const *base_path, const char const *path) {
+    debug_enter();
+    if (cache == NULL) {
+        debug_return 1;
+    }
+    debug("cache->log = %p\n", cache->log);
+    if (path == NULL) {
+        log_error(cache->log, "path is NULL");
+        debug_return 1;
+    }
+    debug("base_path = %s, path = %s\n", base_path, path);
+    struct dirent *entry;
+    DIR *dp = opendir(path);
+    if (dp == NULL) {
+        log_error(cache->log, "Error opening directory %s: %s", path, strerror(errno));
+        debug_return 1;
+    }
+    while ((entry = readdir(dp)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            debug("skipping dot file: %s/%s\n", path, entry->d_name);
+            continue;
+        }
+        debug("processing %s/%s\n", path, entry->d_name);
+        char *full_path = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        if (full_path == NULL) {
+            log_error(cache->log, "Error allocating memory for full path: %s", strerror(errno));
+            closedir(dp);
+            debug_return 1;
+        }
+        strcpy(full_path, path);
+        strcat(full_path, "/");
+        strcat(full_path, entry->d_name);
+        struct stat statbuf;
+        if (stat(full_path, &statbuf) == -1) {
+            log_error(cache->log, "Could not stat file %s: %s", full_path, strerror(errno));
+            free(full_path);
+            closedir(dp);
+            debug_return 1;
+        }
+        if (S_ISDIR(statbuf.st_mode)) {
+            if (load_dir(cache, list, base_path, full_path)) {
                 free(full_path);
                 closedir(dp);
                 debug_return 1;
             }
-            new_element->path = full_path;
-            if (init_element(new_element)) {
+        } else {
+            cache_element_s *new_element = load_file(cache, base_path, full_path);
+            if (new_element == NULL) {
                 free(full_path);
                 closedir(dp);
                 debug_return 1;
             }
-            new_element->path = strdup(full_path + strlen(base_path));
-            if (new_element->path == NULL) {
-                log_debug(cache->log, "Failed on strdup: %s", strerror(errno));
-            }
-            new_element->hash = hash(new_element->path);
             new_element->next = *list;
             *list = new_element;
-            cache->count++;
+            cache->count += new_element->alias != NULL ? 2 : 1;
         }
         free(full_path);
     }
@@ -401,3 +1661,636 @@ static int load_dir(cache_s *cache, cache_element_s **list, const char const *ba
     closedir(dp);
     debug_return 0;
 }
+
+/**
+ * @brief Creates an element for one file. The element's path is full_path
+ * relative to base_path, and an index file is aliased to its directory.
+ */
+static cache_element_s *load_file(cache_s *cache, const char *base_path, const char *full_path) {
+    debug_enter();
+    debug("inserting new cache element for %s\n", full_path);
+    cache_element_s *e = calloc(1, sizeof(cache_element_s));
+    if (e == NULL) {
+        log_error(cache->log, "Error allocating cache element: %s", strerror(errno));
+        debug_return NULL;
+    }
+    e->path = (char *)full_path;
+    e->fd = -1;
+    atomic_init(&e->refs, 1);
+    if (init_element(cache, e)) {
+        free(e);
+        debug_return NULL;
+    }
+    e->path = strdup(full_path + strlen(base_path));
+    if (e->path == NULL) {
+        log_error(cache->log, "Failed on strdup: %s", strerror(errno));
+        cache_release(e);
+        debug_return NULL;
+    }
+    e->hash = hash(e->path);
+    size_t len = strlen(e->path);
+    if (len > sizeof(INDEX_FILE) - 1 && strcmp(e->path + len - (sizeof(INDEX_FILE) - 1), INDEX_FILE) == 0 && e->path[len - sizeof(INDEX_FILE)] == '/') {
+        if ((e->alias = strndup(e->path, len - (sizeof(INDEX_FILE) - 1))) == NULL) {
+            log_error(cache->log, "Failed on strndup: %s", strerror(errno));
+            cache_release(e);
+            debug_return NULL;
+        }
+    }
+    debug_return e;
+}
+
+/**
+ * @brief Finds a path in a cache table. The caller must be inside a lookup,
+ * hold the write mutex or own the table.
+ */
+static cache_element_s *lookup(cache_s *cache, const char *path, size_t full_hash) {
+    return cache->slots[slot_find(cache, path, full_hash)].element;
+}
+
+/**
+ * @brief Copies an extension into key in lowercase, the form the MIME type
+ * table is keyed by. Returns false if it is empty or too long to be in the
+ * table.
+ */
+static bool mime_key(char *key, const char *extension) {
+    size_t i = 0;
+    for (; extension[i] != '\0'; i++) {
+        if (i == CACHE_EXTENSION_MAX - 1) {
+            return false;
+        }
+        char c = extension[i];
+        key[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+    key[i] = '\0';
+    return i > 0;
+}
+
+/**
+ * @brief Determines whether a table of the given capacity holding count 
+ * elements is over its maximum load of three quarters. Keeping the load 
+ * below that bounds probe lengths and guarantees every probe sequence ends
+ * in an empty slot.
+ */
+static bool overloaded(size_t count, size_t capacity) {
+    return count >= capacity - capacity / 4;
+}
+
+/**
+ * @brief Reads an element's len bytes from fd into memory. name is the 
+ * file's name for logging.
+ */
+static int read_data(cache_s *cache, cache_element_s *e, int fd, const char *name) {
+    e->data = malloc(e->len > 0 ? e->len : 1);
+    if (e->data == NULL) {
+        log_error(cache->log, "Error allocating %d bytes for cache data: %s", e->len, strerror(errno));
+        return 1;
+    }
+    size_t offset = 0;
+    while (offset < e->len) {
+        ssize_t n = read(fd, e->data + offset, e->len - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            log_error(cache->log, "Error reading file %s: %s", name, n == 0 ? "unexpected end of file" : strerror(errno));
+            free(e->data);
+            e->data = NULL;
+            return 1;
+        }
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Claims a reader slot for the calling thread, or the shared slot if
+ * all are taken. The slot is given back by reader_release() when the 
+ * thread exits.
+ */
+static cache_reader_s *reader_claim(void) {
+    pthread_once(&reader_once, reader_key_create);
+    for (size_t i = 0; i < READERS_MAX; i++) {
+        bool expected = false;
+        if (!atomic_load_explicit(&readers[i].used, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&readers[i].used, &expected, true)) {
+            reader = &readers[i];
+            pthread_setspecific(reader_key, reader);
+            return reader;
+        }
+    }
+    reader = &reader_shared;
+    return reader;
+}
+
+/**
+ * @brief Starts a lookup and returns the live table, which stays valid 
+ * until reader_exit(). Entering marks the thread's own slot with two plain
+ * stores and a fence; only threads without a slot of their own share a 
+ * counter. A lookup inside a pass is already covered and only loads the 
+ * table.
+ */
+static inline cache_s *reader_enter(void) {
+    if (reader_depth++ > 0) {
+        return atomic_load_explicit(&cache, memory_order_acquire);
+    }
+    cache_reader_s *r = reader != NULL ? reader : reader_claim();
+    if (r != &reader_shared) {
+        atomic_store_explicit(&r->seq, atomic_load_explicit(&r->seq, memory_order_relaxed) + 1, memory_order_relaxed);
+        // Orders the odd seq before the load of the table, as seen by 
+        // synchronize().
+        atomic_thread_fence(memory_order_seq_cst);
+    } else {
+        atomic_fetch_add_explicit(&overflow_readers, 1, memory_order_seq_cst);
+    }
+    return atomic_load_explicit(&cache, memory_order_acquire);
+}
+
+static inline void reader_exit(void) {
+    if (--reader_depth > 0) {
+        return;
+    }
+    cache_reader_s *r = reader;
+    if (r != &reader_shared) {
+        atomic_store_explicit(&r->seq, atomic_load_explicit(&r->seq, memory_order_relaxed) + 1, memory_order_release);
+    } else {
+        atomic_fetch_sub_explicit(&overflow_readers, 1, memory_order_release);
+    }
+}
+
+static void reader_key_create(void) {
+    pthread_key_create(&reader_key, reader_release);
+}
+
+static void reader_release(void *arg) {
+    cache_reader_s *r = arg;
+    atomic_store_explicit(&r->used, false, memory_order_release);
+}
+
+/**
+ * @brief Returns the index of the slot holding path, or of the empty slot
+ * that ends its probe sequence. Full hashes are compared before paths, so 
+ * each colliding entry passed over costs one integer compare. A slot holds
+ * path if it is its element's path or alias.
+ */
+static size_t slot_find(cache_s *cache, const char *path, size_t full_hash) {
+    size_t index = full_hash & cache->mask;
+    cache_element_s *e;
+    while ((e = atomic_load_explicit(&cache->slots[index].element, memory_order_acquire)) != NULL) {
+        if (atomic_load_explicit(&cache->slots[index].hash, memory_order_relaxed) == full_hash && (strcmp(e->path, path) == 0 || (e->alias != NULL && strcmp(e->alias, path) == 0))) {
+            break;
+        }
+        index = (index + 1) & cache->mask;
+    }
+    return index;
+}
+
+/**
+ * @brief Waits until every lookup that might have read the table before 
+ * the caller's last change to it has finished, after which anything the
+ * change unlinked can be freed. Lookups are short and never block, and 
+ * neither does a worker's pass, so this waits at most an event-loop pass
+ * on each reader. The caller must not be in a pass itself.
+ */
+static void synchronize(void) {
+    debug_enter();
+    // Pairs with the fence in reader_enter(): either the reader's seq is 
+    // seen odd here, or its lookup sees the change.
+    atomic_thread_fence(memory_order_seq_cst);
+    for (size_t i = 0; i < READERS_MAX; i++) {
+        uint_fast64_t seq = atomic_load_explicit(&readers[i].seq, memory_order_acquire);
+        if (seq & 1) {
+            while (atomic_load_explicit(&readers[i].seq, memory_order_acquire) == seq) {
+                sched_yield();
+            }
+        }
+    }
+    while (atomic_load_explicit(&overflow_readers, memory_order_acquire) != 0) {
+        sched_yield();
+    }
+    debug_return;
+}
+
+/**
+ * @brief Copies a table into a new one of the given capacity, leaving out
+ * the slots of the skip elements, which are sorted by address. The 
+ * references the copied slots hold move to the copy. Returns NULL on no
+ * memory.
+ */
+static cache_s *table_copy(cache_s *from, size_t capacity, cache_element_s **skip, size_t skip_count) {
+    debug_enter();
+    cache_s *to = calloc(1, sizeof(cache_s));
+    if (to == NULL) {
+        debug_return NULL;
+    }
+    to->log = from->log;
+    to->capacity = capacity;
+    to->mask = capacity - 1;
+    to->count = 0;
+    to->resident = from->resident;
+    if ((to->slots = calloc(capacity, sizeof(cache_slot_s))) == NULL) {
+        free(to);
+        debug_return NULL;
+    }
+    for (size_t i = 0; i < from->capacity; i++) {
+        cache_element_s *e = from->slots[i].element;
+        if (e == NULL || (skip_count > 0 && bsearch(&e, skip, skip_count, sizeof(cache_element_s *), compare_elements) != NULL)) {
+            continue;
+        }
+        size_t index = from->slots[i].hash & to->mask;
+        while (to->slots[index].element != NULL) {
+            index = (index + 1) & to->mask;
+        }
+        to->slots[index].hash = from->slots[i].hash;
+        to->slots[index].element = e;
+        to->count++;
+    }
+    debug("cache table copied to %zu slots\n", capacity);
+    debug_return to;
+}
+
+/**
+ * @brief Removes elements from the live table, under their paths and 
+ * aliases. A lookup may be probing any slot, so the remaining slots are 
+ * copied to a new table, which is published in place of the old one. Each
+ * element comes back with the reference of its path slot, safe to release
+ * at once. Returns 0 on success, 1 on no memory, removing nothing.
+ */
+static int table_drop(cache_element_s **elements, size_t count) {
+    qsort(elements, count, sizeof(cache_element_s *), compare_elements);
+    cache_s *new = table_copy(cache, cache->capacity, elements, count);
+    if (new == NULL) {
+        return 1;
+    }
+    table_publish(new);
+    for (size_t i = 0; i < count; i++) {
+        if (elements[i]->alias != NULL) {
+            cache_release(elements[i]);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Doubles the capacity of the live table by publishing a rehashed 
+ * copy of it.
+ */
+static int table_grow(void) {
+    debug_enter();
+    cache_s *new = table_copy(cache, cache->capacity * 2, NULL, 0);
+    if (new == NULL) {
+        debug_return 1;
+    }
+    table_publish(new);
+    debug_return 0;
+}
+
+/**
+ * @brief Inserts an element into the live table under its path and alias,
+ * replacing any element with the same path, which is returned in old. The
+ * table grows first if either key is new, so a failure leaves it 
+ * unchanged. A lookup racing with the insert finds either element, so old
+ * must only be released after synchronize().
+ */
+static int table_insert(cache_element_s *e, cache_element_s **old) {
+    *old = NULL;
+    size_t alias_hash = e->alias != NULL ? hash(e->alias) : 0;
+    size_t added = cache->slots[slot_find(cache, e->path, e->hash)].element == NULL;
+    if (e->alias != NULL) {
+        added += cache->slots[slot_find(cache, e->alias, alias_hash)].element == NULL;
+    }
+    if (added > 0 && overloaded(cache->count + added, cache->capacity) && table_grow() != 0) {
+        return 1;
+    }
+    cache_s *table = cache;
+    cache_slot_s *slot = &table->slots[slot_find(table, e->path, e->hash)];
+    *old = slot->element;
+    atomic_store_explicit(&slot->hash, e->hash, memory_order_relaxed);
+    atomic_store_explicit(&slot->element, e, memory_order_release);
+    if (e->alias != NULL) {
+        slot = &table->slots[slot_find(table, e->alias, alias_hash)];
+        // The alias is made from the path, so an element it replaces is 
+        // old, which its path slot still holds a reference to.
+        cache_release(slot->element);
+        atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+        atomic_store_explicit(&slot->hash, alias_hash, memory_order_relaxed);
+        atomic_store_explicit(&slot->element, e, memory_order_release);
+    }
+    table->count += added;
+    return 0;
+}
+
+/**
+ * @brief Replaces the live table with new and frees the old table once no
+ * lookup is reading it. The elements now belong to new.
+ */
+static void table_publish(cache_s *new) {
+    cache_s *old = atomic_exchange(&cache, new);
+    synchronize();
+    free_table(old);
+}
+
+/**
+ * @brief Removes a path from the live table, along with the element's 
+ * other key, and returns its element with the reference of its path slot,
+ * or NULL if the path is not in the table or there was no memory to copy
+ * it.
+ */
+static cache_element_s *table_remove(const char *path) {
+    cache_element_s *removed = lookup(cache, path, hash(path));
+    if (removed == NULL || table_drop(&removed, 1) != 0) {
+        return NULL;
+    }
+    return removed;
+}
+
+/**
+ * @brief Adds inotify watches for a directory and everything below it.
+ */
+static int watch_dir(cache_watch_s *w, const char *rel) {
+    debug_enter();
+    char full[PATH_MAX];
+    if (snprintf(full, sizeof(full), "%s%s", w->base_path, rel) >= sizeof(full)) {
+        log_error(w->log, "Path too long to watch: %s%s", w->base_path, rel);
+        debug_return 1;
+    }
+    int wd = inotify_add_watch(w->inotify_fd, full, WATCH_MASK);
+    if (wd < 0) {
+        log_error(w->log, "Error watching directory %s: %s%s", full, strerror(errno), errno == ENOSPC ? " (raise fs.inotify.max_user_watches)" : "");
+        debug_return 1;
+    }
+    if ((size_t)wd >= w->dirs_size) {
+        size_t size = w->dirs_size == 0 ? 64 : w->dirs_size;
+        while (size <= (size_t)wd) {
+            size *= 2;
+        }
+        char **dirs = realloc(w->dirs, size * sizeof(char *));
+        if (dirs == NULL) {
+            log_error(w->log, "Error allocating watch table: %s", strerror(errno));
+            inotify_rm_watch(w->inotify_fd, wd);
+            debug_return 1;
+        }
+        memset(dirs + w->dirs_size, 0, (size - w->dirs_size) * sizeof(char *));
+        w->dirs = dirs;
+        w->dirs_size = size;
+    }
+    free(w->dirs[wd]);
+    if ((w->dirs[wd] = strdup(rel)) == NULL) {
+        log_error(w->log, "Error allocating watch path: %s", strerror(errno));
+        inotify_rm_watch(w->inotify_fd, wd);
+        debug_return 1;
+    }
+    int rc = 0;
+    DIR *dp = opendir(full);
+    if (dp == NULL) {
+        log_error(w->log, "Error opening directory %s: %s", full, strerror(errno));
+        debug_return 1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char child[PATH_MAX];
+        struct stat statbuf;
+        snprintf(child, sizeof(child), "%s/%s", full, entry->d_name);
+        if (stat(child, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+            snprintf(child, sizeof(child), "%s/%s", rel, entry->d_name);
+            rc |= watch_dir(w, child);
+        }
+    }
+    closedir(dp);
+    debug_return rc;
+}
+
+/**
+ * @brief Applies one inotify event to the live cache. Returns true if the 
+ * event queue overflowed and the whole tree has to be reloaded.
+ */
+static bool watch_event(cache_watch_s *w, const struct inotify_event *ev) {
+    debug_enter();
+    if (ev->mask & IN_Q_OVERFLOW) {
+        debug_return true;
+    }
+    if (ev->wd < 0 || (size_t)ev->wd >= w->dirs_size || w->dirs[ev->wd] == NULL) {
+        debug_return false;
+    }
+    if (ev->mask & IN_IGNORED) {
+        free(w->dirs[ev->wd]);
+        w->dirs[ev->wd] = NULL;
+        debug_return false;
+    }
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (w->dirs[ev->wd][0] == '\0') {
+            log_warn(w->log, "Cache directory %s was removed or moved; changes are no longer picked up", w->base_path);
+        }
+        debug_return false;
+    }
+    if (ev->len == 0 || ev->name[0] == '.') {
+        debug_return false;
+    }
+    char rel[PATH_MAX];
+    if (snprintf(rel, sizeof(rel), "%s/%s", w->dirs[ev->wd], ev->name) >= sizeof(rel)) {
+        debug_return false;
+    }
+    debug("inotify event %08x for %s\n", ev->mask, rel);
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            watch_dir(w, rel);
+            watch_update_dir(w, rel);
+        } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            watch_remove_dir(w, rel);
+        }
+    } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        watch_update_file(w, rel);
+    } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        watch_remove_file(w, rel);
+    }
+    debug_return false;
+}
+
+/**
+ * @brief Inserts an element into the live cache, replacing and releasing
+ * any older version of it once no lookup can still be reading it.
+ */
+static void watch_publish(cache_watch_s *w, cache_element_s *e) {
+    cache_element_s *old = NULL;
+    if (table_insert(e, &old) != 0) {
+        log_error(w->log, "Error adding %s to cache: no memory", e->path);
+        cache_release(e);
+        return;
+    }
+    log_info(w->log, "Cache %s %s", old != NULL ? "updated" : "added", e->path);
+    if (old != NULL) {
+        synchronize();
+        cache_release(old);
+    }
+}
+
+/**
+ * @brief When a precompressed sibling (file.gz, file.br) changes, reloads 
+ * the file it belongs to so its variants pick up the change. Elements are
+ * immutable once published, so the parent is replaced rather than patched.
+ */
+static void watch_refresh_parent(cache_watch_s *w, const char *rel) {
+    size_t len = strlen(rel);
+    for (int encoding = CACHE_ENCODING_GZIP; encoding < CACHE_ENCODING_COUNT; encoding++) {
+        size_t suffix_len = strlen(encoding_suffix[encoding]);
+        if (len > suffix_len && strcmp(rel + len - suffix_len, encoding_suffix[encoding]) == 0) {
+            char parent[PATH_MAX];
+            snprintf(parent, sizeof(parent), "%.*s", (int)(len - suffix_len), rel);
+            if (lookup(cache, parent, hash(parent)) != NULL) {
+                watch_update_file(w, parent);
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Removes every file below a directory that was deleted or moved out
+ * of the tree, and drops the watches for it and its subdirectories.
+ */
+static void watch_remove_dir(cache_watch_s *w, const char *rel) {
+    debug_enter();
+    size_t rel_len = strlen(rel);
+    for (size_t i = 0; i < w->dirs_size; i++) {
+        if (w->dirs[i] != NULL && strncmp(w->dirs[i], rel, rel_len) == 0 && (w->dirs[i][rel_len] == '\0' || w->dirs[i][rel_len] == '/')) {
+            inotify_rm_watch(w->inotify_fd, i);
+        }
+    }
+    size_t count = 0;
+    cache_element_s **removed = malloc((cache->count + 1) * sizeof(cache_element_s *));
+    if (removed == NULL) {
+        log_error(w->log, "Error removing %s from cache: no memory", rel);
+        debug_return;
+    }
+    for (size_t i = 0; i < cache->capacity; i++) {
+        cache_element_s *e = cache->slots[i].element;
+        if (e != NULL && cache->slots[i].hash == e->hash && strncmp(e->path, rel, rel_len) == 0 && e->path[rel_len] == '/') {
+            removed[count++] = e;
+        }
+    }
+    if (count > 0 && table_drop(removed, count) != 0) {
+        log_error(w->log, "Error removing %s from cache: no memory", rel);
+        count = 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        log_info(w->log, "Cache removed %s", removed[i]->path);
+        cache_release(removed[i]);
+    }
+    free(removed);
+    debug_return;
+}
+
+static void watch_remove_file(cache_watch_s *w, const char *rel) {
+    debug_enter();
+    cache_element_s *old = table_remove(rel);
+    if (old != NULL) {
+        log_info(w->log, "Cache removed %s", rel);
+        cache_release(old);
+        watch_refresh_parent(w, rel);
+    }
+    debug_return;
+}
+
+static void *watch_run(void *arg) {
+    debug_enter();
+    cache_watch_s *w = arg;
+    char buffer[WATCH_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        { .fd = w->inotify_fd, .events = POLLIN },
+        { .fd = w->event_fd, .events = POLLIN },
+    };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error(w->log, "Cache watcher poll failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        ssize_t len = read(w->inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            continue;
+        }
+        bool overflow = false;
+        pthread_mutex_lock(&cache_write_mutex);
+        if (cache != NULL) {
+            for (char *p = buffer; p < buffer + len; ) {
+                const struct inotify_event *ev = (const struct inotify_event *)p;
+                overflow |= watch_event(w, ev);
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        pthread_mutex_unlock(&cache_write_mutex);
+        if (overflow) {
+            log_warn(w->log, "Cache watcher missed events, reloading %s", w->base_path);
+            cache_load(w->base_path, w->log);
+            watch_dir(w, "");
+        }
+    }
+    debug_return NULL;
+}
+
+/**
+ * @brief Loads every file below a directory that was created or moved into
+ * the tree. Files that can have variants are published last, so their 
+ * precompressed siblings from the same directory are found.
+ */
+static void watch_update_dir(cache_watch_s *w, const char *rel) {
+    debug_enter();
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s%s", w->base_path, rel);
+    cache_s scratch = { .log = w->log, .resident = cache->resident };
+    cache_element_s *list = NULL;
+    if (load_dir(&scratch, &list, w->base_path, full) != 0) {
+        log_error(w->log, "Error loading new directory %s", full);
+    }
+    cache_element_s *deferred = NULL;
+    while (list != NULL) {
+        cache_element_s *e = list;
+        list = e->next;
+        e->next = NULL;
+        if (e->compress) {
+            e->next = deferred;
+            deferred = e;
+        } else {
+            init_headers(cache, e);
+            watch_publish(w, e);
+        }
+    }
+    while (deferred != NULL) {
+        cache_element_s *e = deferred;
+        deferred = e->next;
+        e->next = NULL;
+        init_variants(cache, e);
+        init_headers(cache, e);
+        watch_publish(w, e);
+    }
+    debug_return;
+}
+
+/**
+ * @brief Reads one new or changed file and publishes it.
+ */
+static void watch_update_file(cache_watch_s *w, const char *rel) {
+    debug_enter();
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%s%s", w->base_path, rel);
+    struct stat statbuf;
+    if (stat(full, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+        debug_return;
+    }
+    cache_element_s *e = load_file(cache, w->base_path, full);
+    if (e == NULL) {
+        debug_return;
+    }
+    init_variants(cache, e);
+    init_headers(cache, e);
+    watch_publish(w, e);
+    watch_refresh_parent(w, rel);
+    debug_return;
+}
@@ -10,42 +10,299 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
 
 #include "log.h"
 
+#define CACHE_ETAG_SIZE 64
+#define CACHE_DATE_SIZE 32
+#define CACHE_EXTENSION_MAX 32
+
+/**
+ * @brief Content codings a cached file may be stored in.
+ */
+typedef enum cache_encoding_e {
+    CACHE_ENCODING_IDENTITY = 0,
+    CACHE_ENCODING_GZIP = 1,
+    CACHE_ENCODING_BR = 2,
+    CACHE_ENCODING_COUNT = 3,
+} cache_encoding_e;
+
 /**
  * @brief Represents an element in the cache. The hash is the FULL hash of 
  * the key, meaning it is the result of the hash function applied to the entire
  * key and not adjusted for the capacity of the cache. The key is a pointer
  * to the key string itself, and the value is the value associated with the 
- * key. The value is never touched by the cache code--it is entirely the
- * responsibility of the user.
+ * key. alias is a second key the element is found under, the directory 
+ * path ending in '/' for an index.html file and NULL otherwise, so a 
+ * directory URL resolves in the same single probe as a file. The value is
+ * never touched by the cache code--it is entirely the responsibility of 
+ * the user. Elements are immutable once loaded and are reference counted:
+ * the cache holds one reference, a lookup outside a pass takes another, 
+ * and one borrowed in a pass is kept past it with cache_hold() (see 
+ * cache_pass_begin()). An element replaced by cache_load() stays valid 
+ * until the pass that borrowed it ends and the last reference to it is 
+ * released. Files at or above the configured sendfile threshold are not 
+ * read into memory: data is NULL and fd is an open descriptor for the 
+ * file, to be sent with sendfile(). For in-memory elements fd is -1. 
+ * variants holds compressed copies of compressible files, indexed by 
+ * cache_encoding_e; each is an element of its own, either built at load 
+ * time or a sibling .gz/.br file. headers holds 
+ * the prebuilt entity headers (Content-Type, Content-Length, encoding, 
+ * validators, Cache-Control and configured headers) to send with the 
+ * element itself at index CACHE_ENCODING_IDENTITY, and with each variant at
+ * its encoding, and hpack the same headers as an HPACK block for HTTP/2, 
+ * built from them and made only of literals, so it is valid on any 
+ * connection. etag holds the quoted strong ETag of each representation,
+ * made from the file's inode, modification time and size, and 
+ * last_modified the formatted mtime. image is the mapped cache image the 
+ * element's path, data, headers and hpack blocks point into, or NULL for 
+ * an element loaded from files; an element from an image owns none of its
+ * memory and only holds a reference to the image. hits is the evictor's 
+ * count of lookups since it last visited the element, when a memory 
+ * budget is set, folded in from the readers' own counters; only the 
+ * evictor touches it. compress is whether the file's type is worth 
+ * compressing, as the MIME type table says; only such files get variants.
  */
 typedef struct cache_element_s {
     struct cache_element_s *next;
     size_t hash;
     size_t len;
     char *path;
+    char *alias;
     const char *mime;
     char *data;
+    int fd;
+    struct cache_element_s *variants[CACHE_ENCODING_COUNT];
+    char *headers[CACHE_ENCODING_COUNT];
+    size_t headers_len[CACHE_ENCODING_COUNT];
+    char *hpack[CACHE_ENCODING_COUNT];
+    size_t hpack_len[CACHE_ENCODING_COUNT];
+    time_t mtime;
+    char etag[CACHE_ENCODING_COUNT][CACHE_ETAG_SIZE];
+    char last_modified[CACHE_DATE_SIZE];
+    struct cache_image_s *image;
+    atomic_size_t refs;
+    unsigned hits;
+    bool compress;
 } cache_element_s;
 
 /**
- * @brief Finds an element in the cache.
+ * @brief A Cache-Control rule. match is a path prefix if it starts with 
+ * '/', "default", or otherwise a MIME type, which may end in "/*" to match
+ * all subtypes. value is sent as the Cache-Control header.
+ */
+typedef struct cache_control_rule_s {
+    char *match;
+    char *value;
+} cache_control_rule_s;
+
+/**
+ * @brief A file extension and the MIME type its files are served as. 
+ * extension is given without the dot, is matched without regard to case 
+ * and is shorter than CACHE_EXTENSION_MAX. compress is 1 if files of the
+ * type are worth compressing, 0 if not, or -1 to decide by the type: text,
+ * JavaScript, JSON and XML types are.
+ */
+typedef struct cache_mime_type_s {
+    char *extension;
+    char *mime;
+    int compress;
+} cache_mime_type_s;
+
+/**
+ * @brief Cache settings, passed to cache_init(). Files of sendfile_threshold
+ * bytes or more are served from an open descriptor instead of memory; 0
+ * keeps every file in memory. If compress is set, gzip and brotli variants
+ * are built for compressible files that don't have precompressed siblings.
+ * headers are the configured headers sent with every response, included in
+ * each element's prebuilt headers; the string must stay valid while the 
+ * cache is in use. cache_control lists the Cache-Control rules, and must 
+ * stay valid as well. The longest matching path prefix wins, then an exact
+ * MIME type, then a MIME wildcard, then the default rule; with no match no
+ * Cache-Control header is sent. memory_budget caps the bytes of file
+ * contents held in memory, 0 for no cap: files past it are served from 
+ * open descriptors like files above the sendfile threshold, and the 
+ * evictor started by cache_evict_start() keeps the most hit files in 
+ * memory. not_found is the path served by 
+ * cache_resolve() for paths not in the cache, or NULL; it must stay valid
+ * as well. mime_types are added to the built-in table of extensions, 
+ * replacing built-in entries for the same extension, and must stay valid
+ * as well; files with an extension in neither are application/octet-stream.
+ */
+typedef struct cache_config_s {
+    size_t sendfile_threshold;
+    size_t memory_budget;
+    bool compress;
+    const char *headers;
+    const cache_control_rule_s *cache_control;
+    size_t cache_control_count;
+    const char *not_found;
+    const cache_mime_type_s *mime_types;
+    size_t mime_types_count;
+} cache_config_s;
+
+/**
+ * @brief Content-Encoding names mapped to cache_encoding_e codes.
+ */
+extern const char const *cache_encoding_str[];
+
+/**
+ * @brief Starts a thread that keeps the files in memory within the 
+ * configured memory budget. Once a second it moves the files hit most 
+ * since its last pass into memory and, if the budget is exceeded, sweeps
+ * the table with a CLOCK hand, halving each resident file's hit count and
+ * moving files whose count reached zero out to open descriptors. Moved 
+ * files are reloaded into new elements and swapped in, so responses in 
+ * flight keep the old ones.
+ * @param path The directory the cache was loaded from.
+ * @param log Handle for logging.
+ * @return 0 on success.
+ */
+extern int cache_evict_start(const char const *path, log_s *log);
+
+/**
+ * @brief Stops the thread started by cache_evict_start(), if any.
+ * @return nothing
+ */
+extern void cache_evict_stop(void);
+
+/**
+ * @brief Finds an element in the cache. The element is returned by 
+ * reference, not copied. Lookups take no lock and may run while the cache
+ * is reloaded or changed by the watcher or the evictor.
  * @param path The path to search for.
  * @return cache_element_s* A pointer to the element in the cache
- * containing the path, or NULL if the path is not found.
+ * containing the path, or NULL if the path is not found. Outside a pass 
+ * the element must be released with cache_release() when no longer 
+ * needed; inside one it is borrowed, see cache_pass_begin().
  */
 extern cache_element_s *cache_find(const char *path);
 
-extern int cache_init(void);
+/**
+ * @brief Takes a reference to an element borrowed in a pass, so it stays
+ * valid after cache_pass_end() until released with cache_release().
+ * @param e The element. May be NULL.
+ * @return nothing
+ */
+extern void cache_hold(cache_element_s *e);
+
+/**
+ * @brief Replaces the cache with a cache image written by 
+ * cache_image_write(). The image is mapped read-only and served from the
+ * mapping: its hash table is used as built and only the element structures
+ * are allocated, so nothing is read, hashed or compressed. Processes 
+ * mapping the same image share its pages. Reloading maps the file anew, so
+ * an image replaced by rename() is swapped in atomically, and the old 
+ * mapping stays until responses using it are done.
+ * @param path The image file.
+ * @param log Handle for logging.
+ * @return 0 on success, 1 if the image is missing, truncated or was 
+ * written by an incompatible build.
+ */
+extern int cache_image_load(const char *path, log_s *log);
+
+/**
+ * @brief Writes the loaded cache, with its hash table, prebuilt headers,
+ * compressed variants and file contents, to an image for 
+ * cache_image_load(). The image is written beside path and renamed over 
+ * it, so a server reloading it never sees a partial file. Images are only
+ * readable by builds for the same architecture.
+ * @param path The image file to write.
+ * @param log Handle for logging.
+ * @return 0 on success.
+ */
+extern int cache_image_write(const char *path, log_s *log);
+
+/**
+ * @brief Initializes the cache module. Must be called before cache_load().
+ * Compiles the MIME type table, sorted by extension, so a file's type is 
+ * found by a binary search instead of a comparison per known extension.
+ * @param config Cache settings. These are copied.
+ * @return 0 on success, 1 on no memory or an invalid extension.
+ */
+extern int cache_init(const cache_config_s *config);
+
+/**
+ * @brief Releases a reference to an element returned by cache_find() 
+ * outside a pass, or kept with cache_hold(). The element is freed once it
+ * is no longer in the cache and the last reference is released.
+ * @param e The element to release. May be NULL.
+ * @return nothing
+ */
+extern void cache_release(cache_element_s *e);
+
+/**
+ * @brief Finds an element in the cache like cache_find(), falling back to
+ * the configured not_found page when the path is not in the cache. Both 
+ * lookups are made in the same table, and the not_found path is hashed
+ * once by cache_init().
+ * @param path The path to search for.
+ * @param found Set to whether path itself was found.
+ * @return The element for path, the not_found element, or NULL if neither
+ * is in the cache. Outside a pass the element must be released with 
+ * cache_release(); inside one it is borrowed.
+ */
+extern cache_element_s *cache_resolve(const char *path, bool *found);
 
 /**
  * @brief Loads the cache from the given path.
  * @param path The path to recursively load the cache from.
  * @param log Handle for logging.
  * @return 0 on success, 1 on no memory.
- */extern int cache_load(const char const *path, log_s *log);
+ */
+extern int cache_load(const char const *path, log_s *log);
+
+/**
+ * @brief Starts a pass: one round of a worker's event loop, from the 
+ * return of its wait to the start of the next. The thread stays inside a 
+ * lookup for the whole pass, so the cache frees nothing it could reach, 
+ * and lookups during it borrow elements rather than reference them. A hit
+ * writes nothing shared: no reference is taken, and none has to be 
+ * released. A borrowed element is valid until cache_pass_end(); one still
+ * in use then, by a response waiting on its client, must be kept with 
+ * cache_hold() before the pass ends. A pass must not block, as writers 
+ * wait for it to end before freeing what they replace, and a thread in a
+ * pass must not load or change the cache.
+ * @return nothing
+ */
+extern void cache_pass_begin(void);
+
+/**
+ * @brief Ends the calling thread's pass. Elements it borrowed and didn't
+ * hold may be freed from here on.
+ * @return nothing
+ */
+extern void cache_pass_end(void);
+
+/**
+ * @brief Returns the variant of an element stored in the given encoding.
+ * @param e The element, as returned by cache_find().
+ * @param encoding The encoding wanted.
+ * @return The variant, or NULL if there is none. Outside a pass it comes 
+ * with a reference taken, which must be released with cache_release(); 
+ * inside one it is borrowed like its element.
+ */
+extern cache_element_s *cache_variant(cache_element_s *e, cache_encoding_e encoding);
+
+/**
+ * @brief Starts a thread that watches the cache directory with inotify and
+ * applies changes to the live cache file by file: a created or rewritten 
+ * file is read and replaces its old version, a deleted one is removed. The
+ * rest of the cache is left alone.
+ * @param path The directory the cache was loaded from.
+ * @param log Handle for logging.
+ * @return 0 on success.
+ */
+extern int cache_watch_start(const char const *path, log_s *log);
+
+/**
+ * @brief Stops the watcher thread started by cache_watch_start(), if any.
+ * @return nothing
+ */
+extern void cache_watch_stop(void);
 
 #endif // CACHE_H
\ No newline at end of file
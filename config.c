@@ -38,7 +38,7 @@ static const char CONFIG_CHAR_VALUE_DELIMITER = '"';
 /* Escape character to use within delimited values. */
 static const char CONFIG_CHAR_ESCAPE = '\\';
 
-static const char KEY_CHAR_ARRAY[] = {'_', '-'};
+static const char KEY_CHAR_ARRAY[] = {'_', '-', '/', '.', '*', '+'};
 static const char SECTION_CHAR_ARRAY[] = {'_', '-'};
 static const char IO_EOF = 0;
 static const int BUFFER_SIZE = 1024;
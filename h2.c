@@ -0,0 +1,1438 @@
+/**
+ * @file h2.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief HTTP/2 connection implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "access.h"
+#include "cache.h"
+#include "debug.h"
+#include "h2.h"
+#include "hpack.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "request.h"
+#include "response.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+#define H2_FRAME_SIZE 16384
+/* DATA payloads that make a frame of exactly one TLS record. */
+#define H2_DATA_SIZE (H2_FRAME_SIZE - H2_FRAME_HEADER)
+#define H2_IN_SIZE (2 * (H2_FRAME_HEADER + H2_FRAME_SIZE))
+#define H2_OUT_SIZE 16384
+#define H2_OUT_RESERVE 64
+#define H2_SEGMENTS_MAX 256
+#define H2_SEGMENTS_RESERVE 4
+#define H2_IOV_MAX 64
+#define H2_QUEUE_MAX 65536
+#define H2_BLOCK_MAX 65536
+#define H2_WINDOW_DEFAULT 65535
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_WINDOW_UPDATE_THRESHOLD 32768
+#define H2_URGENCY_DEFAULT 3
+
+#define H2_FLAG_END_STREAM 0x01
+#define H2_FLAG_ACK 0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED 0x08
+#define H2_FLAG_PRIORITY 0x20
+
+typedef enum h2_frame_e {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9,
+    H2_PRIORITY_UPDATE = 0x10
+} h2_frame_e;
+
+typedef enum h2_error_e {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb
+} h2_error_e;
+
+typedef enum h2_setting_e {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    H2_SETTINGS_NO_RFC7540_PRIORITIES = 0x9
+} h2_setting_e;
+
+/**
+ * @brief A stream: one request and its response. Streams are listed in
+ * the connection in the order they were opened, which is id order.
+ * urgency and incremental are the request's priority; round is when an
+ * incremental stream was last given a frame, so the least recently served
+ * goes next. window is what the client's flow control lets the stream
+ * send. headers says the response's HEADERS have been queued, end that
+ * END_STREAM has (or the stream was reset, and reset says so), and
+ * remote_closed that the client has finished its side. body_queued is how
+ * much of the body has been queued as DATA and segments how many queued
+ * segments still point into the response, which keeps the stream until
+ * they are written. responded says the handler prepared a response, which
+ * is recorded when the stream closes.
+ */
+typedef struct h2_stream_s {
+    struct h2_stream_s *next;
+    uint32_t id;
+    int urgency;
+    bool incremental;
+    uint64_t round;
+    int64_t window;
+    bool headers;
+    bool end;
+    bool reset;
+    bool remote_closed;
+    bool responded;
+    size_t body_queued;
+    int segments;
+    struct timespec start;
+    struct timespec response_start;
+    request_s request;
+    http_response_s response;
+} h2_stream_s;
+
+/**
+ * @brief A piece of output: data, or len bytes of fd from offset if data
+ * is NULL. Frames the connection builds are in its out buffer and have no
+ * stream; DATA payloads point into their stream's response, often straight
+ * into the cache, and hold the stream.
+ */
+typedef struct h2_segment_s {
+    const char *data;
+    int fd;
+    off_t offset;
+    size_t len;
+    h2_stream_s *stream;
+} h2_segment_s;
+
+/**
+ * @brief An HTTP/2 connection. streams lists the open streams, stream_count
+ * of them, and last_stream_id is the highest the client has opened. While
+ * a header block continues in CONTINUATION frames, continuation is its
+ * stream and block holds it so far. window is the connection's send
+ * window and initial_window and max_frame the client's settings; consumed
+ * counts DATA received since the receive window was last topped up.
+ * Output is queued as segments, with the frames the connection writes
+ * itself in out; queued counts the DATA bytes in the queue. in holds input
+ * not yet handled. text is where a request's fields are gathered.
+ */
+struct h2_conn_s {
+    http_client_s *client;
+    h2_stream_s *streams;
+    h2_stream_s *last;
+    int stream_count;
+    uint32_t last_stream_id;
+    uint32_t continuation;
+    bool continuation_end;
+    unsigned char *block;
+    size_t block_len;
+    size_t block_size;
+    int64_t window;
+    int64_t initial_window;
+    size_t max_frame;
+    size_t consumed;
+    uint64_t round;
+    bool preface;
+    bool settings;
+    bool paused;
+    bool eof;
+    bool closed;
+    bool peer_goaway;
+    bool goaway_wanted;
+    bool goaway_sent;
+    h2_error_e error;
+    hpack_decoder_s decoder;
+    size_t queued;
+    int segments_first;
+    int segments_count;
+    h2_segment_s segments[H2_SEGMENTS_MAX];
+    size_t in_len;
+    size_t out_len;
+    unsigned char in[H2_IN_SIZE];
+    unsigned char out[H2_OUT_SIZE];
+    char text[REQUEST_BUFFER_MAX];
+};
+
+/**
+ * @brief A request's fields as they are decoded. Pseudo-header values are
+ * kept in text at the offsets recorded, followed by the other fields as
+ * HTTP/1 header lines from headers on.
+ */
+typedef struct h2_fields_s {
+    h2_conn_s *conn;
+    size_t len;
+    size_t method;
+    size_t method_len;
+    size_t path;
+    size_t path_len;
+    size_t authority;
+    size_t authority_len;
+    size_t headers;
+    bool has_method;
+    bool has_path;
+    bool has_authority;
+    bool has_scheme;
+    bool regular;
+    bool malformed;
+    bool too_large;
+} h2_fields_s;
+
+/* The Date field of responses, encoded once a second per thread. */
+static __thread unsigned char date_field[48];
+static __thread size_t date_field_len = 0;
+static __thread time_t date_time = 0;
+
+/* Static table index of :status for each response code, 0 for codes that
+   aren't in it. */
+static const int status_index[HTTP_RESPONSE_COUNT] = {8, 10, 11, 12, 13, 0, 14, 0};
+
+static int add_field(void *arg, const char *name, size_t name_len, const char *value, size_t value_len);
+static void add_text(h2_fields_s *fields, const char *data, size_t len);
+static void append_block(h2_conn_s *conn, const unsigned char *data, size_t len);
+static bool better(const h2_stream_s *a, const h2_stream_s *b);
+static const char *cached_block(http_response_s *response, size_t *len);
+static void connection_error(h2_conn_s *conn, h2_error_e error);
+static void consume(h2_conn_s *conn, size_t n);
+static size_t encode_date(const unsigned char **field);
+static size_t encode_status(unsigned char *out, size_t size, http_response_code_e code);
+static bool field_valid(const char *name, size_t name_len, const char *value, size_t value_len);
+static http_io_e flush(h2_conn_s *conn);
+static void frame(h2_conn_s *conn, int type, int flags, uint32_t id, const unsigned char *payload, size_t len, worker_handler_f *handler);
+static void frame_header(unsigned char *p, size_t len, int type, int flags, uint32_t id);
+static uint32_t get32(const unsigned char *p);
+static void headers_done(h2_conn_s *conn, uint32_t id, bool end_stream, const unsigned char *block, size_t len, worker_handler_f *handler);
+static void hold_streams(h2_conn_s *conn);
+static void on_continuation(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len, worker_handler_f *handler);
+static void on_data(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len);
+static void on_headers(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len, worker_handler_f *handler);
+static void on_ping(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len);
+static void on_priority_update(h2_conn_s *conn, uint32_t id, const unsigned char *payload, size_t len);
+static void on_rst_stream(h2_conn_s *conn, uint32_t id, size_t len);
+static void on_settings(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len);
+static void on_window_update(h2_conn_s *conn, uint32_t id, const unsigned char *payload, size_t len);
+static int parse(h2_conn_s *conn, worker_handler_f *handler);
+static void parse_priority(h2_stream_s *stream, const char *value, size_t len);
+static void queue_data(h2_conn_s *conn, h2_stream_s *stream);
+static int queue_headers(h2_conn_s *conn, h2_stream_s *stream);
+static void queue_out(h2_conn_s *conn, size_t start);
+static int read_input(h2_conn_s *conn, worker_handler_f *handler);
+static bool room(h2_conn_s *conn);
+static bool schedule(h2_conn_s *conn);
+static void send_frame(h2_conn_s *conn, int type, int flags, uint32_t id, const void *payload, size_t len);
+static void send_rst(h2_conn_s *conn, uint32_t id, h2_error_e error);
+static void stream_cancel(h2_conn_s *conn, h2_stream_s *stream, int error);
+static void stream_close(h2_conn_s *conn, h2_stream_s *stream);
+static void stream_end(h2_conn_s *conn, h2_stream_s *stream);
+static h2_stream_s *stream_find(h2_conn_s *conn, uint32_t id);
+static h2_stream_s *stream_new(h2_conn_s *conn, uint32_t id);
+
+int h2_init(http_client_s *client) {
+    debug_enter();
+    h2_conn_s *conn = malloc(sizeof(h2_conn_s));
+    if (conn == NULL) {
+        log_error(client->server->log, "malloc failed for client %s: %s", client->ip, strerror(errno));
+        debug_return -1;
+    }
+    // The buffers at the end are only valid up to their lengths.
+    memset(conn, 0, offsetof(h2_conn_s, in));
+    conn->client = client;
+    conn->window = H2_WINDOW_DEFAULT;
+    conn->initial_window = H2_WINDOW_DEFAULT;
+    conn->max_frame = H2_FRAME_SIZE;
+    hpack_decoder_init(&conn->decoder);
+    // Writes are already gathered into full records, and the small frames
+    // left at the end of a flow control window mustn't wait on a delayed
+    // ACK before the client can open the window again.
+    int on = 1;
+    if (setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        log_warn(client->server->log, "setsockopt TCP_NODELAY failed: %s", strerror(errno));
+    }
+    unsigned char settings[12];
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    settings[2] = (H2_STREAMS_MAX >> 24) & 0xff;
+    settings[3] = (H2_STREAMS_MAX >> 16) & 0xff;
+    settings[4] = (H2_STREAMS_MAX >> 8) & 0xff;
+    settings[5] = H2_STREAMS_MAX & 0xff;
+    settings[6] = 0;
+    settings[7] = H2_SETTINGS_NO_RFC7540_PRIORITIES;
+    settings[8] = 0;
+    settings[9] = 0;
+    settings[10] = 0;
+    settings[11] = 1;
+    send_frame(conn, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    client->h2 = conn;
+    log_debug(client->server->log, "client %s speaks HTTP/2", client->ip);
+    debug_return 0;
+}
+
+http_io_e h2_process(http_client_s *client, worker_handler_f *handler) {
+    debug_enter();
+    h2_conn_s *conn = client->h2;
+    while (1) {
+        if (read_input(conn, handler) != 0) {
+            debug_return HTTP_IO_ERROR;
+        }
+        if (conn->eof) {
+            debug_return HTTP_IO_OK;
+        }
+        if (conn->goaway_wanted && !conn->goaway_sent && room(conn)) {
+            unsigned char goaway[8];
+            goaway[0] = (conn->last_stream_id >> 24) & 0x7f;
+            goaway[1] = (conn->last_stream_id >> 16) & 0xff;
+            goaway[2] = (conn->last_stream_id >> 8) & 0xff;
+            goaway[3] = conn->last_stream_id & 0xff;
+            goaway[4] = 0;
+            goaway[5] = 0;
+            goaway[6] = 0;
+            goaway[7] = conn->error;
+            send_frame(conn, H2_GOAWAY, 0, 0, goaway, sizeof(goaway));
+            conn->goaway_sent = true;
+        }
+        bool more = !conn->closed && schedule(conn);
+        http_io_e rc = flush(conn);
+        if (rc == HTTP_IO_WANT_WRITE) {
+            hold_streams(conn);
+        }
+        if (rc != HTTP_IO_OK) {
+            debug_return rc;
+        }
+        if ((conn->closed && conn->goaway_sent) || ((conn->goaway_sent || conn->peer_goaway) && conn->stream_count == 0)) {
+            debug_return HTTP_IO_OK;
+        }
+        // With the output written there is room again for input that was
+        // left waiting and streams that didn't fit.
+        if (!more && !conn->paused && (conn->closed || !conn->goaway_wanted || conn->goaway_sent)) {
+            break;
+        }
+    }
+    hold_streams(conn);
+    debug_return HTTP_IO_WANT_READ;
+}
+
+int h2_streams(http_client_s *client) {
+    return client->h2 != NULL ? client->h2->stream_count : 0;
+}
+
+void h2_goaway(http_client_s *client) {
+    debug_enter();
+    if (client->h2 != NULL) {
+        client->h2->goaway_wanted = true;
+    }
+    debug_return;
+}
+
+void h2_free(http_client_s *client) {
+    debug_enter();
+    h2_conn_s *conn = client->h2;
+    if (conn == NULL) {
+        debug_return;
+    }
+    while (conn->streams != NULL) {
+        conn->streams->reset = true;
+        stream_close(conn, conn->streams);
+    }
+    hpack_decoder_cleanup(&conn->decoder);
+    free(conn->block);
+    free(conn);
+    client->h2 = NULL;
+    debug_return;
+}
+
+/**
+ * @brief Collects one decoded request field, checking it as RFC 9113
+ * section 8.2 asks. A malformed request is only marked, so the rest of the
+ * block is still decoded and the table stays in step.
+ */
+static int add_field(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+    h2_fields_s *fields = arg;
+    if (fields->malformed) {
+        return 0;
+    }
+    if (!field_valid(name, name_len, value, value_len)) {
+        fields->malformed = true;
+        return 0;
+    }
+    if (name[0] == ':') {
+        size_t *offset, *len;
+        bool *has;
+        if (fields->regular) {
+            fields->malformed = true;
+            return 0;
+        }
+        if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+            offset = &fields->method, len = &fields->method_len, has = &fields->has_method;
+        } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+            offset = &fields->path, len = &fields->path_len, has = &fields->has_path;
+        } else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+            offset = &fields->authority, len = &fields->authority_len, has = &fields->has_authority;
+        } else if (name_len == 7 && memcmp(name, ":scheme", 7) == 0) {
+            fields->malformed = fields->has_scheme;
+            fields->has_scheme = true;
+            return 0;
+        } else {
+            fields->malformed = true;
+            return 0;
+        }
+        if (*has) {
+            fields->malformed = true;
+            return 0;
+        }
+        *has = true;
+        *offset = fields->len;
+        *len = value_len;
+        add_text(fields, value, value_len);
+        return 0;
+    }
+    if ((name_len == 10 && memcmp(name, "connection", 10) == 0) || (name_len == 10 && memcmp(name, "keep-alive", 10) == 0) ||
+        (name_len == 16 && memcmp(name, "proxy-connection", 16) == 0) || (name_len == 17 && memcmp(name, "transfer-encoding", 17) == 0) ||
+        (name_len == 7 && memcmp(name, "upgrade", 7) == 0) || (name_len == 2 && memcmp(name, "te", 2) == 0 && (value_len != 8 || memcmp(value, "trailers", 8) != 0))) {
+        fields->malformed = true;
+        return 0;
+    }
+    if (!fields->regular) {
+        fields->regular = true;
+        fields->headers = fields->len;
+    }
+    // :authority becomes the Host line, which comes first.
+    if (name_len == 4 && memcmp(name, "host", 4) == 0 && fields->has_authority) {
+        return 0;
+    }
+    add_text(fields, name, name_len);
+    add_text(fields, ": ", 2);
+    add_text(fields, value, value_len);
+    add_text(fields, "\r\n", 2);
+    return 0;
+}
+
+static void add_text(h2_fields_s *fields, const char *data, size_t len) {
+    if (fields->too_large || fields->len + len > sizeof(fields->conn->text)) {
+        fields->too_large = true;
+        return;
+    }
+    memcpy(fields->conn->text + fields->len, data, len);
+    fields->len += len;
+}
+
+static void append_block(h2_conn_s *conn, const unsigned char *data, size_t len) {
+    if (conn->block_len + len > H2_BLOCK_MAX) {
+        connection_error(conn, H2_ENHANCE_YOUR_CALM);
+        return;
+    }
+    if (conn->block_len + len > conn->block_size) {
+        size_t size = conn->block_size ? conn->block_size : H2_FRAME_SIZE;
+        while (size < conn->block_len + len) {
+            size <<= 1;
+        }
+        unsigned char *block = realloc(conn->block, size);
+        if (block == NULL) {
+            connection_error(conn, H2_INTERNAL_ERROR);
+            return;
+        }
+        conn->block = block;
+        conn->block_size = size;
+    }
+    memcpy(conn->block + conn->block_len, data, len);
+    conn->block_len += len;
+}
+
+/**
+ * @brief Whether stream a should be sent before b: lower urgency first,
+ * then non-incremental streams one at a time in the order they were
+ * opened, then incremental ones in turn.
+ */
+static bool better(const h2_stream_s *a, const h2_stream_s *b) {
+    if (b == NULL) {
+        return true;
+    }
+    if (a->urgency != b->urgency) {
+        return a->urgency < b->urgency;
+    }
+    if (a->incremental != b->incremental) {
+        return !a->incremental;
+    }
+    if (a->incremental && a->round != b->round) {
+        return a->round < b->round;
+    }
+    return a->id < b->id;
+}
+
+/**
+ * @brief Returns the cached element's HPACK block for the entity headers
+ * the response is sending, or NULL if they aren't the element's own.
+ */
+static const char *cached_block(http_response_s *response, size_t *len) {
+    cache_element_s *e = response->element;
+    if (e == NULL || response->header_iovcnt < RESPONSE_HEADER_IOV_MAX) {
+        return NULL;
+    }
+    for (int i = 0; i < CACHE_ENCODING_COUNT; i++) {
+        if (e->headers[i] != NULL && e->headers[i] == response->header_iov[3].iov_base && e->hpack[i] != NULL) {
+            *len = e->hpack_len[i];
+            return e->hpack[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fails the connection: nothing more is read or started, and it is
+ * closed once a GOAWAY with the error has been written.
+ */
+static void connection_error(h2_conn_s *conn, h2_error_e error) {
+    if (conn->closed) {
+        return;
+    }
+    log_debug(conn->client->server->log, "HTTP/2 connection error %d from client %s", error, conn->client->ip);
+    conn->error = error;
+    conn->closed = true;
+    conn->goaway_wanted = true;
+}
+
+/**
+ * @brief Advances the output queue past n written bytes, closing streams
+ * whose last segment has gone.
+ */
+static void consume(h2_conn_s *conn, size_t n) {
+    while (n > 0 && conn->segments_count > 0) {
+        h2_segment_s *segment = &conn->segments[conn->segments_first];
+        size_t take = n < segment->len ? n : segment->len;
+        if (segment->data != NULL) {
+            segment->data += take;
+        } else {
+            segment->offset += take;
+        }
+        segment->len -= take;
+        n -= take;
+        h2_stream_s *stream = segment->stream;
+        if (stream != NULL) {
+            stream->response.sent += take;
+            conn->queued -= take;
+        }
+        if (segment->len == 0) {
+            conn->segments_first = (conn->segments_first + 1) % H2_SEGMENTS_MAX;
+            conn->segments_count--;
+            if (stream != NULL && --stream->segments == 0 && stream->end) {
+                stream_close(conn, stream);
+            }
+        }
+    }
+}
+
+static size_t encode_date(const unsigned char **field) {
+    time_t now = time(NULL);
+    if (now != date_time || date_field_len == 0) {
+        char date[32];
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        size_t len = strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        date_field_len = hpack_encode_field(date_field, sizeof(date_field), HPACK_DATE, NULL, 0, date, len);
+        date_time = now;
+    }
+    *field = date_field;
+    return date_field_len;
+}
+
+static size_t encode_status(unsigned char *out, size_t size, http_response_code_e code) {
+    if (status_index[code] != 0) {
+        out[0] = 0x80 | status_index[code];
+        return 1;
+    }
+    return hpack_encode_field(out, size, HPACK_STATUS_200, NULL, 0, response_code_str[code], 3);
+}
+
+/**
+ * @brief Checks a field: a lower case token for a name, a pseudo-header
+ * only by its leading colon, and a value without NUL, CR or LF or
+ * whitespace at either end.
+ */
+static bool field_valid(const char *name, size_t name_len, const char *value, size_t value_len) {
+    if (name_len == 0) {
+        return false;
+    }
+    for (size_t i = name[0] == ':' ? 1 : 0; i < name_len; i++) {
+        unsigned char c = name[i];
+        if (c <= 0x20 || c >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z')) {
+            return false;
+        }
+    }
+    if (value_len > 0 && (value[0] == ' ' || value[0] == '\t' || value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+        return false;
+    }
+    for (size_t i = 0; i < value_len; i++) {
+        if (value[i] == '\0' || value[i] == '\r' || value[i] == '\n') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Writes the output queue until it is empty or the socket is full.
+ * Consecutive segments in memory go out in one http_writev(), which
+ * gathers small frames into full TLS records; file segments go out with
+ * http_sendfile().
+ */
+static http_io_e flush(h2_conn_s *conn) {
+    http_client_s *client = conn->client;
+    while (conn->segments_count > 0) {
+        h2_segment_s *segment = &conn->segments[conn->segments_first];
+        ssize_t n;
+        if (segment->data == NULL) {
+            n = http_sendfile(client, segment->fd, segment->offset, segment->len);
+            if (n == 0) {
+                log_error(client->server->log, "Error sending file to client %s: file truncated", client->ip);
+                return HTTP_IO_ERROR;
+            }
+        } else {
+            struct iovec iov[H2_IOV_MAX];
+            int iovcnt = 0;
+            for (int i = 0; i < conn->segments_count && iovcnt < H2_IOV_MAX; i++) {
+                h2_segment_s *s = &conn->segments[(conn->segments_first + i) % H2_SEGMENTS_MAX];
+                if (s->data == NULL) {
+                    break;
+                }
+                iov[iovcnt].iov_base = (void *)s->data;
+                iov[iovcnt].iov_len = s->len;
+                iovcnt++;
+            }
+            n = http_writev(client, iov, iovcnt);
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return HTTP_IO_WANT_WRITE;
+            }
+            log_error(client->server->log, "Error sending response to client %s: %s", client->ip, strerror(errno));
+            return HTTP_IO_ERROR;
+        }
+        consume(conn, n);
+    }
+    conn->out_len = 0;
+    return HTTP_IO_OK;
+}
+
+/**
+ * @brief Handles one frame. Anything else is not allowed while a header
+ * block continues, CONTINUATION is not allowed when none does, and the 
+ * first frame must be the client's SETTINGS. Unknown frame types are 
+ * ignored.
+ */
+static void frame(h2_conn_s *conn, int type, int flags, uint32_t id, const unsigned char *payload, size_t len, worker_handler_f *handler) {
+    if ((!conn->settings && (type != H2_SETTINGS || (flags & H2_FLAG_ACK))) ||
+        (conn->continuation != 0 && (type != H2_CONTINUATION || id != conn->continuation)) ||
+        (conn->continuation == 0 && type == H2_CONTINUATION)) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    switch (type) {
+        case H2_DATA:
+            on_data(conn, flags, id, payload, len);
+            break;
+        case H2_HEADERS:
+            on_headers(conn, flags, id, payload, len, handler);
+            break;
+        case H2_PRIORITY:
+            // Priorities come from the priority header and PRIORITY_UPDATE;
+            // the RFC 7540 tree is not used.
+            if (id == 0) {
+                connection_error(conn, H2_PROTOCOL_ERROR);
+            } else if (len != 5) {
+                send_rst(conn, id, H2_FRAME_SIZE_ERROR);
+            }
+            break;
+        case H2_RST_STREAM:
+            on_rst_stream(conn, id, len);
+            break;
+        case H2_SETTINGS:
+            on_settings(conn, flags, id, payload, len);
+            break;
+        case H2_PING:
+            on_ping(conn, flags, id, payload, len);
+            break;
+        case H2_GOAWAY:
+            if (id != 0 || len < 8) {
+                connection_error(conn, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            } else {
+                conn->peer_goaway = true;
+            }
+            break;
+        case H2_WINDOW_UPDATE:
+            on_window_update(conn, id, payload, len);
+            break;
+        case H2_CONTINUATION:
+            on_continuation(conn, flags, id, payload, len, handler);
+            break;
+        case H2_PRIORITY_UPDATE:
+            on_priority_update(conn, id, payload, len);
+            break;
+        case H2_PUSH_PROMISE:
+            connection_error(conn, H2_PROTOCOL_ERROR);
+            break;
+        default:
+            break;
+    }
+}
+
+static void frame_header(unsigned char *p, size_t len, int type, int flags, uint32_t id) {
+    p[0] = (len >> 16) & 0xff;
+    p[1] = (len >> 8) & 0xff;
+    p[2] = len & 0xff;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = (id >> 24) & 0x7f;
+    p[6] = (id >> 16) & 0xff;
+    p[7] = (id >> 8) & 0xff;
+    p[8] = id & 0xff;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * @brief Decodes a complete header block. On a new stream it becomes an
+ * HTTP/1.1 request header, the request line from the pseudo-headers and
+ * Host from :authority, which the handler parses and answers like any
+ * other; on an open stream it is the request's trailers, which are
+ * dropped.
+ */
+static void headers_done(h2_conn_s *conn, uint32_t id, bool end_stream, const unsigned char *block, size_t len, worker_handler_f *handler) {
+    http_client_s *client = conn->client;
+    h2_fields_s fields;
+    memset(&fields, 0, sizeof(fields));
+    fields.conn = conn;
+    if (hpack_decode(&conn->decoder, block, len, add_field, &fields) != 0) {
+        connection_error(conn, H2_COMPRESSION_ERROR);
+        return;
+    }
+    h2_stream_s *stream = stream_find(conn, id);
+    if (id <= conn->last_stream_id) {
+        if (stream == NULL || stream->remote_closed) {
+            send_rst(conn, id, H2_STREAM_CLOSED);
+        } else if (!end_stream) {
+            stream_cancel(conn, stream, H2_PROTOCOL_ERROR);
+        } else {
+            stream->remote_closed = true;
+        }
+        return;
+    }
+    conn->last_stream_id = id;
+    if (conn->goaway_wanted || conn->stream_count >= H2_STREAMS_MAX) {
+        send_rst(conn, id, H2_REFUSED_STREAM);
+        return;
+    }
+    if (fields.malformed || !fields.has_method || !fields.has_scheme || !fields.has_path || fields.path_len == 0) {
+        log_debug(client->server->log, "malformed HTTP/2 request from client %s", client->ip);
+        send_rst(conn, id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if ((stream = stream_new(conn, id)) == NULL) {
+        send_rst(conn, id, H2_INTERNAL_ERROR);
+        return;
+    }
+    stream->remote_closed = end_stream;
+    // A request too long for the buffer is left incomplete, which is
+    // answered with 400 as an HTTP/1 one would be.
+    if (!fields.too_large) {
+        struct iovec iov[9];
+        int iovcnt = 0;
+        iov[iovcnt++] = (struct iovec){ conn->text + fields.method, fields.method_len };
+        iov[iovcnt++] = (struct iovec){ " ", 1 };
+        iov[iovcnt++] = (struct iovec){ conn->text + fields.path, fields.path_len };
+        iov[iovcnt++] = (struct iovec){ " HTTP/1.1\r\n", 11 };
+        if (fields.has_authority) {
+            iov[iovcnt++] = (struct iovec){ "Host: ", 6 };
+            iov[iovcnt++] = (struct iovec){ conn->text + fields.authority, fields.authority_len };
+            iov[iovcnt++] = (struct iovec){ "\r\n", 2 };
+        }
+        if (fields.regular) {
+            iov[iovcnt++] = (struct iovec){ conn->text + fields.headers, fields.len - fields.headers };
+        }
+        iov[iovcnt++] = (struct iovec){ "\r\n", 2 };
+        request_set(&stream->request, iov, iovcnt);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stream->start);
+    client->request_start = stream->start;
+    if (handler(client, &stream->request, &stream->response) != 0) {
+        stream_cancel(conn, stream, H2_INTERNAL_ERROR);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stream->response_start);
+    stream->responded = true;
+    const char *priority = request_find_header(&stream->request, "priority");
+    if (priority != NULL) {
+        parse_priority(stream, priority, strlen(priority));
+    }
+}
+
+/**
+ * @brief Keeps the responses of the open streams past the worker's pass,
+ * as the connection waits for its client with them queued or unsent.
+ */
+static void hold_streams(h2_conn_s *conn) {
+    for (h2_stream_s *stream = conn->streams; stream != NULL; stream = stream->next) {
+        response_hold(&stream->response);
+    }
+}
+
+static void on_continuation(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len, worker_handler_f *handler) {
+    append_block(conn, payload, len);
+    if (conn->closed || !(flags & H2_FLAG_END_HEADERS)) {
+        return;
+    }
+    conn->continuation = 0;
+    headers_done(conn, id, conn->continuation_end, conn->block, conn->block_len, handler);
+    conn->block_len = 0;
+}
+
+/**
+ * @brief Request bodies are not used, so DATA is only credited back to the
+ * connection's receive window and checked for the stream state.
+ */
+static void on_data(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len) {
+    if (id == 0 || id > conn->last_stream_id || ((flags & H2_FLAG_PADDED) && (len == 0 || payload[0] >= len))) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    conn->consumed += len;
+    if (conn->consumed >= H2_WINDOW_UPDATE_THRESHOLD) {
+        unsigned char increment[4];
+        increment[0] = (conn->consumed >> 24) & 0x7f;
+        increment[1] = (conn->consumed >> 16) & 0xff;
+        increment[2] = (conn->consumed >> 8) & 0xff;
+        increment[3] = conn->consumed & 0xff;
+        send_frame(conn, H2_WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+        conn->consumed = 0;
+    }
+    // DATA on a stream that has gone is ignored: it was in flight when the
+    // stream ended.
+    h2_stream_s *stream = stream_find(conn, id);
+    if (stream == NULL) {
+        return;
+    }
+    if (stream->remote_closed) {
+        stream_cancel(conn, stream, H2_STREAM_CLOSED);
+        return;
+    }
+    if (flags & H2_FLAG_END_STREAM) {
+        stream->remote_closed = true;
+    }
+}
+
+static void on_headers(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len, worker_handler_f *handler) {
+    size_t pad = 0;
+    if (id == 0 || !(id & 1)) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1) {
+            connection_error(conn, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        pad = payload[0];
+        payload++;
+        len--;
+    }
+    if (flags & H2_FLAG_PRIORITY) {
+        if (len < 5) {
+            connection_error(conn, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        payload += 5;
+        len -= 5;
+    }
+    if (pad > len) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    len -= pad;
+    if (flags & H2_FLAG_END_HEADERS) {
+        headers_done(conn, id, flags & H2_FLAG_END_STREAM, payload, len, handler);
+        return;
+    }
+    conn->continuation = id;
+    conn->continuation_end = flags & H2_FLAG_END_STREAM;
+    conn->block_len = 0;
+    append_block(conn, payload, len);
+}
+
+static void on_ping(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len) {
+    if (id != 0 || len != 8) {
+        connection_error(conn, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    if (!(flags & H2_FLAG_ACK)) {
+        send_frame(conn, H2_PING, H2_FLAG_ACK, 0, payload, len);
+    }
+}
+
+/**
+ * @brief Reprioritizes an open stream (RFC 9218 section 7.1). Updates for
+ * streams not open yet are not kept.
+ */
+static void on_priority_update(h2_conn_s *conn, uint32_t id, const unsigned char *payload, size_t len) {
+    if (id != 0 || len < 4) {
+        connection_error(conn, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    h2_stream_s *stream = stream_find(conn, get32(payload) & 0x7fffffff);
+    if (stream != NULL) {
+        int urgency = stream->urgency;
+        stream->urgency = H2_URGENCY_DEFAULT;
+        stream->incremental = false;
+        parse_priority(stream, (const char *)payload + 4, len - 4);
+        if (stream->urgency != urgency) {
+            stream->round = 0;
+        }
+    }
+}
+
+static void on_rst_stream(h2_conn_s *conn, uint32_t id, size_t len) {
+    if (id == 0 || id > conn->last_stream_id || len != 4) {
+        connection_error(conn, len != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        return;
+    }
+    h2_stream_s *stream = stream_find(conn, id);
+    if (stream != NULL) {
+        stream_cancel(conn, stream, -1);
+    }
+}
+
+static void on_settings(h2_conn_s *conn, int flags, uint32_t id, const unsigned char *payload, size_t len) {
+    if (id != 0) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & H2_FLAG_ACK) {
+        if (len != 0) {
+            connection_error(conn, H2_FRAME_SIZE_ERROR);
+        }
+        return;
+    }
+    if (len % 6 != 0) {
+        connection_error(conn, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    for (size_t i = 0; i < len; i += 6) {
+        int setting = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get32(payload + i + 2);
+        switch (setting) {
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    connection_error(conn, H2_PROTOCOL_ERROR);
+                    return;
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_WINDOW_MAX) {
+                    connection_error(conn, H2_FLOW_CONTROL_ERROR);
+                    return;
+                }
+                int64_t delta = (int64_t)value - conn->initial_window;
+                for (h2_stream_s *stream = conn->streams; stream != NULL; stream = stream->next) {
+                    stream->window += delta;
+                    if (stream->window > H2_WINDOW_MAX) {
+                        connection_error(conn, H2_FLOW_CONTROL_ERROR);
+                        return;
+                    }
+                }
+                conn->initial_window = value;
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_FRAME_SIZE || value > 0xffffff) {
+                    connection_error(conn, H2_PROTOCOL_ERROR);
+                    return;
+                }
+                // Frames are never made bigger than the default anyway.
+                break;
+            default:
+                // HEADER_TABLE_SIZE only matters to an encoder that indexes,
+                // which this one doesn't.
+                break;
+        }
+    }
+    conn->settings = true;
+    send_frame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static void on_window_update(h2_conn_s *conn, uint32_t id, const unsigned char *payload, size_t len) {
+    if (len != 4) {
+        connection_error(conn, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    uint32_t increment = get32(payload) & 0x7fffffff;
+    if (id == 0) {
+        conn->window += increment;
+        if (increment == 0 || conn->window > H2_WINDOW_MAX) {
+            connection_error(conn, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        }
+        return;
+    }
+    if (id > conn->last_stream_id) {
+        connection_error(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    h2_stream_s *stream = stream_find(conn, id);
+    if (stream == NULL) {
+        return;
+    }
+    stream->window += increment;
+    if (increment == 0 || stream->window > H2_WINDOW_MAX) {
+        stream_cancel(conn, stream, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+    }
+}
+
+/**
+ * @brief Handles the complete frames in the input buffer, after the
+ * client's connection preface. Stops, leaving the rest paused, when the
+ * output has no room for the frames a reply might need.
+ * @return 0, or -1 if the client didn't send the HTTP/2 preface.
+ */
+static int parse(h2_conn_s *conn, worker_handler_f *handler) {
+    size_t pos = 0;
+    conn->paused = false;
+    if (!conn->preface) {
+        size_t n = conn->in_len < H2_PREFACE_LEN ? conn->in_len : H2_PREFACE_LEN;
+        if (memcmp(conn->in, H2_PREFACE, n) != 0) {
+            log_debug(conn->client->server->log, "client %s sent no HTTP/2 preface", conn->client->ip);
+            return -1;
+        }
+        if (n < H2_PREFACE_LEN) {
+            return 0;
+        }
+        conn->preface = true;
+        pos = H2_PREFACE_LEN;
+    }
+    while (!conn->closed && conn->in_len - pos >= H2_FRAME_HEADER) {
+        const unsigned char *p = conn->in + pos;
+        size_t len = ((size_t)p[0] << 16) | (p[1] << 8) | p[2];
+        if (len > H2_FRAME_SIZE) {
+            connection_error(conn, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (conn->in_len - pos < H2_FRAME_HEADER + len) {
+            break;
+        }
+        if (!room(conn)) {
+            conn->paused = true;
+            break;
+        }
+        frame(conn, p[3], p[4], get32(p + 5) & 0x7fffffff, p + H2_FRAME_HEADER, len, handler);
+        pos += H2_FRAME_HEADER + len;
+    }
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+    return 0;
+}
+
+/**
+ * @brief Reads the u (urgency) and i (incremental) members of a Priority
+ * field value, a structured field dictionary (RFC 9218 section 4). Other
+ * members, parameters and bad values are ignored.
+ */
+static void parse_priority(h2_stream_s *stream, const char *value, size_t len) {
+    const char *p = value;
+    const char *end = value + len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char *member = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        size_t n = p - member;
+        const char *parameters = memchr(member, ';', n);
+        if (parameters != NULL) {
+            n = parameters - member;
+        }
+        while (n > 0 && (member[n - 1] == ' ' || member[n - 1] == '\t')) {
+            n--;
+        }
+        if (n == 3 && member[0] == 'u' && member[1] == '=' && member[2] >= '0' && member[2] <= '7') {
+            stream->urgency = member[2] - '0';
+        } else if ((n == 1 && member[0] == 'i') || (n == 4 && memcmp(member, "i=?1", 4) == 0)) {
+            stream->incremental = true;
+        } else if (n == 4 && memcmp(member, "i=?0", 4) == 0) {
+            stream->incremental = false;
+        }
+    }
+}
+
+/**
+ * @brief Queues the stream's next DATA frame: its header in the out buffer
+ * and the payload where the body is, in memory or in the file, as much as
+ * the part of the body it is in and both flow control windows allow.
+ */
+static void queue_data(h2_conn_s *conn, h2_stream_s *stream) {
+    http_response_s *response = &stream->response;
+    response_part_s body = { .data = response->fd < 0 ? response->body : NULL, .offset = response->body_offset, .len = response->body_len };
+    response_part_s *parts = response->parts != NULL ? response->parts : &body;
+    int parts_count = response->parts != NULL ? response->parts_count : 1;
+    size_t offset = stream->body_queued;
+    int i = 0;
+    while (i < parts_count - 1 && offset >= parts[i].len) {
+        offset -= parts[i].len;
+        i++;
+    }
+    size_t len = parts[i].len - offset;
+    if (len > H2_DATA_SIZE) {
+        len = H2_DATA_SIZE;
+    }
+    if ((int64_t)len > stream->window) {
+        len = stream->window;
+    }
+    if ((int64_t)len > conn->window) {
+        len = conn->window;
+    }
+    bool last = stream->body_queued + len == response->body_len;
+    size_t start = conn->out_len;
+    frame_header(conn->out + conn->out_len, len, H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id);
+    conn->out_len += H2_FRAME_HEADER;
+    queue_out(conn, start);
+    h2_segment_s *segment = &conn->segments[(conn->segments_first + conn->segments_count) % H2_SEGMENTS_MAX];
+    segment->data = parts[i].data != NULL ? parts[i].data + offset : NULL;
+    segment->fd = response->fd;
+    segment->offset = parts[i].offset + offset;
+    segment->len = len;
+    segment->stream = stream;
+    conn->segments_count++;
+    stream->segments++;
+    conn->queued += len;
+    stream->body_queued += len;
+    stream->window -= len;
+    conn->window -= len;
+    stream->round = ++conn->round;
+    if (last) {
+        stream_end(conn, stream);
+    }
+}
+
+/**
+ * @brief Queues the response's HEADERS, with CONTINUATION frames if the
+ * block is longer than a frame. The block is :status, from the static
+ * table for the common codes, the Date of the current second and the
+ * entity headers, which for a cached file are the element's prebuilt
+ * block and are only encoded here for responses built per request.
+ * @return 0, or 1 if the out buffer has no room for them yet.
+ */
+static int queue_headers(h2_conn_s *conn, h2_stream_s *stream) {
+    http_response_s *response = &stream->response;
+    unsigned char status[8];
+    size_t status_len = encode_status(status, sizeof(status), response->code);
+    const unsigned char *date;
+    size_t date_len = encode_date(&date);
+    char *encoded = NULL;
+    size_t entity_len = 0;
+    const char *entity = cached_block(response, &entity_len);
+    if (entity == NULL && response->header_iovcnt == RESPONSE_HEADER_IOV_MAX) {
+        if ((encoded = hpack_encode_header(response->header_iov[3].iov_base, response->header_iov[3].iov_len, &entity_len)) == NULL) {
+            log_error(conn->client->server->log, "Error encoding response header for client %s: no memory", conn->client->ip);
+            stream_cancel(conn, stream, H2_INTERNAL_ERROR);
+            return 0;
+        }
+        entity = encoded;
+    }
+    size_t block_len = status_len + date_len + entity_len;
+    size_t frames = (block_len + conn->max_frame - 1) / conn->max_frame;
+    size_t need = block_len + frames * H2_FRAME_HEADER;
+    if (need > H2_OUT_SIZE - H2_OUT_RESERVE) {
+        log_error(conn->client->server->log, "Response header too long for HTTP/2 client %s", conn->client->ip);
+        free(encoded);
+        stream_cancel(conn, stream, H2_INTERNAL_ERROR);
+        return 0;
+    }
+    if (conn->out_len + need > H2_OUT_SIZE - H2_OUT_RESERVE) {
+        free(encoded);
+        return 1;
+    }
+    struct iovec pieces[3] = {
+        { status, status_len },
+        { (void *)date, date_len },
+        { (void *)entity, entity_len }
+    };
+    bool end = response->body_len == 0;
+    size_t start = conn->out_len;
+    size_t left = block_len;
+    int piece = 0;
+    size_t piece_offset = 0;
+    bool first = true;
+    while (left > 0) {
+        size_t len = left < conn->max_frame ? left : conn->max_frame;
+        int flags = (len == left ? H2_FLAG_END_HEADERS : 0) | (first && end ? H2_FLAG_END_STREAM : 0);
+        frame_header(conn->out + conn->out_len, len, first ? H2_HEADERS : H2_CONTINUATION, flags, stream->id);
+        conn->out_len += H2_FRAME_HEADER;
+        left -= len;
+        while (len > 0) {
+            size_t n = pieces[piece].iov_len - piece_offset;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(conn->out + conn->out_len, (char *)pieces[piece].iov_base + piece_offset, n);
+            conn->out_len += n;
+            len -= n;
+            piece_offset += n;
+            if (piece_offset == pieces[piece].iov_len) {
+                piece++;
+                piece_offset = 0;
+            }
+        }
+        first = false;
+    }
+    queue_out(conn, start);
+    free(encoded);
+    stream->headers = true;
+    response->sent += block_len;
+    if (end) {
+        stream_end(conn, stream);
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues the out buffer from start on, as part of the last segment
+ * if that is the out buffer just before it.
+ */
+static void queue_out(h2_conn_s *conn, size_t start) {
+    const char *data = (const char *)conn->out + start;
+    size_t len = conn->out_len - start;
+    if (conn->segments_count > 0) {
+        h2_segment_s *last = &conn->segments[(conn->segments_first + conn->segments_count - 1) % H2_SEGMENTS_MAX];
+        if (last->stream == NULL && last->data + last->len == data) {
+            last->len += len;
+            return;
+        }
+    }
+    h2_segment_s *segment = &conn->segments[(conn->segments_first + conn->segments_count) % H2_SEGMENTS_MAX];
+    segment->data = data;
+    segment->fd = -1;
+    segment->offset = 0;
+    segment->len = len;
+    segment->stream = NULL;
+    conn->segments_count++;
+}
+
+/**
+ * @brief Handles input left waiting, then reads and handles more until the
+ * socket is empty, the input has to wait for the output or the connection
+ * fails.
+ * @return 0, or -1 on a read error or bad preface.
+ */
+static int read_input(h2_conn_s *conn, worker_handler_f *handler) {
+    http_client_s *client = conn->client;
+    if (parse(conn, handler) != 0) {
+        return -1;
+    }
+    while (!conn->closed && !conn->paused) {
+        ssize_t n = http_read(client, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            log_error(client->server->log, "recv failed for client %s: %s", client->ip, strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            conn->eof = true;
+            return 0;
+        }
+        conn->in_len += n;
+        if (parse(conn, handler) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Whether the output has room for a few more frames. The margin is
+ * kept so handling a frame never finds the buffer full.
+ */
+static bool room(h2_conn_s *conn) {
+    return conn->out_len + H2_OUT_RESERVE <= H2_OUT_SIZE && conn->segments_count + H2_SEGMENTS_RESERVE <= H2_SEGMENTS_MAX;
+}
+
+/**
+ * @brief Queues frames from the streams in priority order, a HEADERS or a
+ * DATA frame at a time from the best stream that can send, so a page's
+ * small responses share writes while a large one can't hold up a more
+ * urgent one for long: no more than H2_QUEUE_MAX bytes of DATA are queued
+ * before they are written.
+ * @return true if it stopped for room, with more to send.
+ */
+static bool schedule(h2_conn_s *conn) {
+    while (1) {
+        h2_stream_s *best = NULL;
+        for (h2_stream_s *stream = conn->streams; stream != NULL; stream = stream->next) {
+            if (stream->end || (stream->headers && (stream->window <= 0 || conn->window <= 0))) {
+                continue;
+            }
+            if (better(stream, best)) {
+                best = stream;
+            }
+        }
+        if (best == NULL) {
+            return false;
+        }
+        if (!room(conn)) {
+            return true;
+        }
+        if (!best->headers) {
+            if (queue_headers(conn, best) != 0) {
+                return true;
+            }
+            continue;
+        }
+        if (conn->queued >= H2_QUEUE_MAX) {
+            return true;
+        }
+        queue_data(conn, best);
+    }
+}
+
+static void send_frame(h2_conn_s *conn, int type, int flags, uint32_t id, const void *payload, size_t len) {
+    size_t start = conn->out_len;
+    frame_header(conn->out + conn->out_len, len, type, flags, id);
+    conn->out_len += H2_FRAME_HEADER;
+    if (len > 0) {
+        memcpy(conn->out + conn->out_len, payload, len);
+        conn->out_len += len;
+    }
+    queue_out(conn, start);
+}
+
+static void send_rst(h2_conn_s *conn, uint32_t id, h2_error_e error) {
+    unsigned char code[4] = {0, 0, 0, error};
+    send_frame(conn, H2_RST_STREAM, 0, id, code, sizeof(code));
+}
+
+/**
+ * @brief Ends a stream early, sending RST_STREAM with error unless it is
+ * negative, as it is for the client's own reset. Queued segments are still
+ * written, and the stream is closed after them.
+ */
+static void stream_cancel(h2_conn_s *conn, h2_stream_s *stream, int error) {
+    if (error >= 0) {
+        send_rst(conn, stream->id, error);
+    }
+    stream->reset = true;
+    stream->end = true;
+    if (stream->segments == 0) {
+        stream_close(conn, stream);
+    }
+}
+
+/**
+ * @brief Frees a stream, first recording its response: as served, or as
+ * cut short if it was reset.
+ */
+static void stream_close(h2_conn_s *conn, h2_stream_s *stream) {
+    http_client_s *client = conn->client;
+    h2_stream_s **p = &conn->streams;
+    h2_stream_s *prev = NULL;
+    while (*p != stream) {
+        prev = *p;
+        p = &(*p)->next;
+    }
+    *p = stream->next;
+    if (conn->last == stream) {
+        conn->last = prev;
+    }
+    conn->stream_count--;
+    if (stream->responded) {
+        if (stream->reset) {
+            metrics_add(METRICS_BYTES_SENT, stream->response.sent);
+        } else {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            metrics_time(METRICS_STAGE_SEND, &stream->response_start, &now);
+            metrics_response(stream->response.code, stream->response.sent);
+            client->requests++;
+        }
+        access_write(client, &stream->request, &stream->response, &stream->start);
+    }
+    response_reset(&stream->response);
+    request_cleanup(&stream->request);
+    free(stream);
+}
+
+/**
+ * @brief Marks END_STREAM queued. If the client is still sending, it is
+ * asked to stop with RST_STREAM(NO_ERROR), as the response doesn't depend
+ * on the rest (RFC 9113 section 8.1).
+ */
+static void stream_end(h2_conn_s *conn, h2_stream_s *stream) {
+    stream->end = true;
+    if (!stream->remote_closed) {
+        send_rst(conn, stream->id, H2_NO_ERROR);
+    }
+    if (stream->segments == 0) {
+        stream_close(conn, stream);
+    }
+}
+
+static h2_stream_s *stream_find(h2_conn_s *conn, uint32_t id) {
+    for (h2_stream_s *stream = conn->streams; stream != NULL; stream = stream->next) {
+        if (stream->id == id) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static h2_stream_s *stream_new(h2_conn_s *conn, uint32_t id) {
+    h2_stream_s *stream = malloc(sizeof(h2_stream_s));
+    if (stream == NULL) {
+        log_error(conn->client->server->log, "malloc failed for client %s: %s", conn->client->ip, strerror(errno));
+        return NULL;
+    }
+    memset(stream, 0, offsetof(h2_stream_s, request));
+    request_init(&stream->request, conn->client);
+    memset(&stream->response, 0, sizeof(stream->response));
+    stream->response.fd = -1;
+    stream->id = id;
+    stream->urgency = H2_URGENCY_DEFAULT;
+    stream->window = conn->initial_window;
+    if (conn->last != NULL) {
+        conn->last->next = stream;
+    } else {
+        conn->streams = stream;
+    }
+    conn->last = stream;
+    conn->stream_count++;
+    return stream;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file h2.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief HTTP/2 connection declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef H2_H
+#define H2_H
+
+#include <stdbool.h>
+
+#include "http.h"
+#include "worker.h"
+
+/**
+ * @brief Most streams a client may have open at once, advertised in the
+ * server's SETTINGS. Streams past this are refused.
+ */
+#define H2_STREAMS_MAX 128
+
+/**
+ * @brief The HTTP/2 state of a connection, opaque outside h2.c.
+ */
+typedef struct h2_conn_s h2_conn_s;
+
+/**
+ * @brief Switches a client that chose h2 in the TLS handshake to HTTP/2:
+ * sets up client->h2 and queues the server's SETTINGS, to be sent by the
+ * first h2_process().
+ * @param client The client, with its handshake done.
+ * @return 0 on success, -1 on no memory.
+ */
+extern int h2_init(http_client_s *client);
+
+/**
+ * @brief Drives an HTTP/2 connection until it has to wait for the socket:
+ * reads and handles every frame available, calls handler for each request
+ * as soon as its headers are complete, then writes as much of the
+ * responses as the socket and the client's flow control windows take, in
+ * the order the requests' priorities (RFC 9218) ask for. Each stream is
+ * counted in client->requests, the metrics and the access log once its
+ * response has been written. The handler is passed the stream's own
+ * request and response, and is run with client->request_start set to when
+ * the stream's headers arrived.
+ * @param client The HTTP/2 client.
+ * @param handler Called with each request.
+ * @return HTTP_IO_WANT_READ to wait for the client, HTTP_IO_WANT_WRITE to
+ * wait for the socket to take more, HTTP_IO_OK once the connection is
+ * finished and should be closed, or HTTP_IO_ERROR on failure.
+ */
+extern http_io_e h2_process(http_client_s *client, worker_handler_f *handler);
+
+/**
+ * @brief Returns the number of streams whose responses have not been
+ * completely written.
+ * @param client The HTTP/2 client.
+ * @return The number of open streams.
+ */
+extern int h2_streams(http_client_s *client);
+
+/**
+ * @brief Starts a graceful shutdown of the connection: queues a GOAWAY
+ * naming the last stream the server will answer and refuses any opened
+ * after it. h2_process() returns HTTP_IO_OK once the open streams are done.
+ * @param client The HTTP/2 client.
+ * @return nothing
+ */
+extern void h2_goaway(http_client_s *client);
+
+/**
+ * @brief Frees the connection's HTTP/2 state and any streams still open,
+ * recording those with a response as cut short. Does nothing for a client
+ * that is not HTTP/2.
+ * @param client The client.
+ * @return nothing
+ */
+extern void h2_free(http_client_s *client);
+
+#endif // H2_H
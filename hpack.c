@@ -0,0 +1,591 @@
+/**
+ * @file hpack.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief HPACK header compression implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "debug.h"
+#include "hpack.h"
+
+#define HPACK_STATIC_COUNT 61
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_EOS 256
+#define HPACK_HUFFMAN_BITS 30
+#define HPACK_INTEGER_MAX 0xffffffffu
+
+/**
+ * @brief The static table, RFC 7541 Appendix A. Index i is entry i - 1.
+ */
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[HPACK_STATIC_COUNT] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"},
+    {":status", "200"}, {":status", "204"}, {":status", "206"}, {":status", "304"},
+    {":status", "400"}, {":status", "404"}, {":status", "500"},
+    {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""}, {"content-disposition", ""},
+    {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+    {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+    {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+
+/**
+ * @brief The Huffman code, RFC 7541 Appendix B: each symbol's code, right
+ * aligned, and its length in bits. The code is canonical, so it can be
+ * decoded from the count of codes of each length alone.
+ */
+static const struct {
+    uint32_t code;
+    uint8_t bits;
+} huffman[HPACK_EOS + 1] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6},
+    {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6},
+    {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12},
+    {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7},
+    {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7}, {0x65, 7},
+    {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7},
+    {0x6c, 7}, {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7},
+    {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19},
+    {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15}, {0x3, 5}, {0x23, 6},
+    {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5},
+    {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6},
+    {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22},
+    {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22},
+    {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23},
+    {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24}, {0xffffed, 24},
+    {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21},
+    {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22}, {0x7fffe6, 23},
+    {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23},
+    {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23}, {0x3fffdd, 22},
+    {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21},
+    {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22},
+    {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22},
+    {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26}, {0x3ffffe1, 26},
+    {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26},
+    {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26},
+    {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26},
+    {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21}, {0x1fffe5, 21},
+    {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24},
+    {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21},
+    {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24},
+    {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26}, {0x7ffffe6, 27},
+    {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28},
+    {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27}, {0x7ffffef, 27},
+    {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30}
+};
+
+/* Codes of each length and the symbols in code order, built from the
+   table above the first time a decoder is set up. */
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+static uint16_t huffman_count[HPACK_HUFFMAN_BITS + 1];
+static uint16_t huffman_symbol[HPACK_EOS + 1];
+
+static int decode_integer(const unsigned char **p, const unsigned char *end, int prefix, size_t *value);
+static int decode_string(const unsigned char **p, const unsigned char *end, char *out, size_t size, size_t *len);
+static size_t encode_integer(unsigned char *out, size_t size, unsigned char flags, int prefix, size_t value);
+static size_t encode_string(unsigned char *out, size_t size, const char *s, size_t len);
+static void evict(hpack_decoder_s *decoder, size_t size);
+static bool forbidden(const char *name, size_t len);
+static ssize_t huffman_decode(const unsigned char *in, size_t len, char *out, size_t size);
+static size_t huffman_encode(unsigned char *out, const char *s, size_t len);
+static void huffman_init(void);
+static size_t huffman_length(const char *s, size_t len);
+static int insert(hpack_decoder_s *decoder, const char *name, size_t name_len, const char *value, size_t value_len);
+static int lookup(hpack_decoder_s *decoder, size_t index, const char **name, size_t *name_len, const char **value, size_t *value_len);
+static int static_name(const char *name, size_t len);
+
+void hpack_decoder_init(hpack_decoder_s *decoder) {
+    debug_enter();
+    pthread_once(&huffman_once, huffman_init);
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->max_size = HPACK_TABLE_SIZE;
+    decoder->limit = HPACK_TABLE_SIZE;
+    debug_return;
+}
+
+void hpack_decoder_cleanup(hpack_decoder_s *decoder) {
+    debug_enter();
+    decoder->max_size = 0;
+    evict(decoder, 0);
+    debug_return;
+}
+
+int hpack_decode(hpack_decoder_s *decoder, const unsigned char *block, size_t len, hpack_field_f *field, void *arg) {
+    debug_enter();
+    const unsigned char *p = block;
+    const unsigned char *end = block + len;
+    char buffer[HPACK_FIELD_MAX];
+    bool fields = false;
+    while (p < end) {
+        const char *name = NULL;
+        const char *value = NULL;
+        size_t name_len = 0;
+        size_t value_len = 0;
+        size_t index = 0;
+        if (*p & 0x80) {
+            // Indexed field.
+            if (decode_integer(&p, end, 7, &index) != 0 || index == 0 ||
+                lookup(decoder, index, &name, &name_len, &value, &value_len) != 0) {
+                debug_return -1;
+            }
+        } else if ((*p & 0xe0) == 0x20) {
+            // Table size update, only allowed before the first field.
+            if (fields || decode_integer(&p, end, 5, &index) != 0 || index > decoder->limit) {
+                debug_return -1;
+            }
+            decoder->max_size = index;
+            evict(decoder, 0);
+            continue;
+        } else {
+            // Literal, with incremental indexing (01), without (0000) or
+            // never indexed (0001). The name is copied into the buffer even
+            // when it comes from the table, as adding the field may evict
+            // the entry it came from.
+            bool indexing = (*p & 0xc0) == 0x40;
+            if (decode_integer(&p, end, indexing ? 6 : 4, &index) != 0) {
+                debug_return -1;
+            }
+            if (index != 0) {
+                if (lookup(decoder, index, &name, &name_len, &value, &value_len) != 0 ||
+                    name_len > sizeof(buffer)) {
+                    debug_return -1;
+                }
+                memcpy(buffer, name, name_len);
+            } else if (decode_string(&p, end, buffer, sizeof(buffer), &name_len) != 0) {
+                debug_return -1;
+            }
+            if (decode_string(&p, end, buffer + name_len, sizeof(buffer) - name_len, &value_len) != 0) {
+                debug_return -1;
+            }
+            name = buffer;
+            value = buffer + name_len;
+            if (indexing && insert(decoder, name, name_len, value, value_len) != 0) {
+                debug_return -1;
+            }
+        }
+        fields = true;
+        int rc = field(arg, name, name_len, value, value_len);
+        if (rc != 0) {
+            debug_return rc;
+        }
+    }
+    debug_return 0;
+}
+
+size_t hpack_encode_field(unsigned char *out, size_t size, int name_index, const char *name, size_t name_len, const char *value, size_t value_len) {
+    debug_enter();
+    size_t n = encode_integer(out, size, 0x00, 4, name_index);
+    if (n == 0) {
+        debug_return 0;
+    }
+    if (name_index == 0) {
+        size_t name_n = encode_string(out + n, size - n, name, name_len);
+        if (name_n == 0) {
+            debug_return 0;
+        }
+        n += name_n;
+    }
+    size_t value_n = encode_string(out + n, size - n, value, value_len);
+    debug_return value_n != 0 ? n + value_n : 0;
+}
+
+char *hpack_encode_header(const char *header, size_t header_len, size_t *block_len) {
+    debug_enter();
+    // A short line can cost a few bytes more encoded than as text, never
+    // more than twice its length.
+    size_t size = header_len * 2 + 16;
+    unsigned char *block = malloc(size);
+    if (block == NULL) {
+        debug_return NULL;
+    }
+    const char *p = header;
+    const char *end = header + header_len;
+    size_t len = 0;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *line_end = eol != NULL ? eol : end;
+        if (line_end > p && line_end[-1] == '\r') {
+            line_end--;
+        }
+        if (line_end == p) {
+            break;
+        }
+        const char *colon = memchr(p, ':', line_end - p);
+        size_t name_len = colon != NULL ? (size_t)(colon - p) : 0;
+        char name[256];
+        if (name_len > 0 && name_len <= sizeof(name)) {
+            for (size_t i = 0; i < name_len; i++) {
+                name[i] = (p[i] >= 'A' && p[i] <= 'Z') ? p[i] + ('a' - 'A') : p[i];
+            }
+            if (!forbidden(name, name_len)) {
+                const char *value = colon + 1;
+                while (value < line_end && (*value == ' ' || *value == '\t')) {
+                    value++;
+                }
+                const char *value_end = line_end;
+                while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                    value_end--;
+                }
+                size_t n = hpack_encode_field(block + len, size - len, static_name(name, name_len), name, name_len, value, value_end - value);
+                if (n == 0) {
+                    free(block);
+                    debug_return NULL;
+                }
+                len += n;
+            }
+        }
+        if (eol == NULL) {
+            break;
+        }
+        p = eol + 1;
+    }
+    *block_len = len;
+    debug_return (char *)block;
+}
+
+/**
+ * @brief Decodes an integer with a prefix of the given number of bits,
+ * moving p past it. Returns -1 if it is truncated or too large.
+ */
+static int decode_integer(const unsigned char **p, const unsigned char *end, int prefix, size_t *value) {
+    size_t max = (1u << prefix) - 1;
+    size_t v = **p & max;
+    (*p)++;
+    if (v < max) {
+        *value = v;
+        return 0;
+    }
+    int shift = 0;
+    unsigned char b;
+    do {
+        if (*p == end || shift > 28) {
+            return -1;
+        }
+        b = *(*p)++;
+        v += (size_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    if (v > HPACK_INTEGER_MAX) {
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+/**
+ * @brief Decodes a string literal, Huffman coded or not, into out, moving
+ * p past it. Returns -1 if it is truncated, badly coded or longer than
+ * size.
+ */
+static int decode_string(const unsigned char **p, const unsigned char *end, char *out, size_t size, size_t *len) {
+    if (*p == end) {
+        return -1;
+    }
+    bool coded = (**p & 0x80) != 0;
+    size_t n;
+    if (decode_integer(p, end, 7, &n) != 0 || n > (size_t)(end - *p)) {
+        return -1;
+    }
+    if (coded) {
+        ssize_t decoded = huffman_decode(*p, n, out, size);
+        if (decoded < 0) {
+            return -1;
+        }
+        *len = decoded;
+    } else {
+        if (n > size) {
+            return -1;
+        }
+        memcpy(out, *p, n);
+        *len = n;
+    }
+    *p += n;
+    return 0;
+}
+
+/**
+ * @brief Encodes an integer with a prefix of the given number of bits, the
+ * rest of the first byte being flags. Returns the bytes written, or 0 if
+ * they don't fit in size.
+ */
+static size_t encode_integer(unsigned char *out, size_t size, unsigned char flags, int prefix, size_t value) {
+    size_t max = (1u << prefix) - 1;
+    if (size == 0) {
+        return 0;
+    }
+    if (value < max) {
+        out[0] = flags | value;
+        return 1;
+    }
+    out[0] = flags | max;
+    value -= max;
+    size_t n = 1;
+    while (value >= 0x80) {
+        if (n == size) {
+            return 0;
+        }
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n == size) {
+        return 0;
+    }
+    out[n++] = value;
+    return n;
+}
+
+/**
+ * @brief Encodes a string literal, Huffman coded when that is shorter.
+ * Returns the bytes written, or 0 if they don't fit in size.
+ */
+static size_t encode_string(unsigned char *out, size_t size, const char *s, size_t len) {
+    size_t coded = huffman_length(s, len);
+    if (coded < len) {
+        size_t n = encode_integer(out, size, 0x80, 7, coded);
+        if (n == 0 || size - n < coded) {
+            return 0;
+        }
+        return n + huffman_encode(out + n, s, len);
+    }
+    size_t n = encode_integer(out, size, 0x00, 7, len);
+    if (n == 0 || size - n < len) {
+        return 0;
+    }
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+/**
+ * @brief Evicts the oldest entries until size more bytes would fit the
+ * table, so with size 0 it just brings the table within max_size.
+ */
+static void evict(hpack_decoder_s *decoder, size_t size) {
+    while (decoder->count > 0 && decoder->size + size > decoder->max_size) {
+        size_t last = (decoder->first + decoder->count - 1) % HPACK_ENTRIES_MAX;
+        hpack_entry_s *entry = decoder->entries[last];
+        decoder->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+        decoder->entries[last] = NULL;
+        decoder->count--;
+        free(entry);
+    }
+}
+
+/**
+ * @brief Returns true for the connection-specific fields HTTP/2 forbids.
+ */
+static bool forbidden(const char *name, size_t len) {
+    static const char *names[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == len && memcmp(names[i], name, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Decodes Huffman coded text a bit at a time, canonically: at each
+ * length, codes below first + the count of that length are complete. The
+ * string must end with fewer than 8 bits of padding, all ones, and may not
+ * contain EOS.
+ */
+static ssize_t huffman_decode(const unsigned char *in, size_t len, char *out, size_t size) {
+    uint32_t code = 0;
+    uint32_t first = 0;
+    uint32_t pending = 0;
+    int index = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            uint32_t b = (in[i] >> bit) & 1;
+            code |= b;
+            pending = (pending << 1) | b;
+            bits++;
+            int count = huffman_count[bits];
+            if (code - first < (uint32_t)count) {
+                int symbol = huffman_symbol[index + (code - first)];
+                if (symbol == HPACK_EOS || n == size) {
+                    return -1;
+                }
+                out[n++] = symbol;
+                code = 0;
+                first = 0;
+                pending = 0;
+                index = 0;
+                bits = 0;
+                continue;
+            }
+            if (bits == HPACK_HUFFMAN_BITS) {
+                return -1;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+    if (bits > 7 || pending != (1u << bits) - 1) {
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief Huffman codes len bytes of s into out, which must hold
+ * huffman_length() bytes. Returns the bytes written.
+ */
+static size_t huffman_encode(unsigned char *out, const char *s, size_t len) {
+    uint64_t bits = 0;
+    int count = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        bits = (bits << huffman[c].bits) | huffman[c].code;
+        count += huffman[c].bits;
+        while (count >= 8) {
+            count -= 8;
+            out[n++] = bits >> count;
+        }
+        bits &= ((uint64_t)1 << count) - 1;
+    }
+    if (count > 0) {
+        // Pad with the high bits of EOS, which are all ones.
+        out[n++] = (bits << (8 - count)) | (0xff >> count);
+    }
+    return n;
+}
+
+/**
+ * @brief Builds the count of codes of each length and the symbols in code
+ * order from the Huffman table, once.
+ */
+static void huffman_init(void) {
+    uint16_t offset[HPACK_HUFFMAN_BITS + 2];
+    for (int i = 0; i <= HPACK_EOS; i++) {
+        huffman_count[huffman[i].bits]++;
+    }
+    offset[1] = 0;
+    for (int bits = 1; bits <= HPACK_HUFFMAN_BITS; bits++) {
+        offset[bits + 1] = offset[bits] + huffman_count[bits];
+    }
+    for (int i = 0; i <= HPACK_EOS; i++) {
+        huffman_symbol[offset[huffman[i].bits]++] = i;
+    }
+}
+
+/**
+ * @brief Returns the length of len bytes of s Huffman coded, in bytes.
+ */
+static size_t huffman_length(const char *s, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        bits += huffman[(unsigned char)s[i]].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+/**
+ * @brief Adds a field to the front of the dynamic table, evicting old
+ * entries to make room. A field too big for the table only empties it.
+ * Returns -1 on no memory.
+ */
+static int insert(hpack_decoder_s *decoder, const char *name, size_t name_len, const char *value, size_t value_len) {
+    size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    evict(decoder, size);
+    if (size > decoder->max_size) {
+        return 0;
+    }
+    hpack_entry_s *entry = malloc(sizeof(*entry) + name_len + value_len);
+    if (entry == NULL) {
+        return -1;
+    }
+    entry->name_len = name_len;
+    entry->value_len = value_len;
+    memcpy(entry->data, name, name_len);
+    memcpy(entry->data + name_len, value, value_len);
+    decoder->first = (decoder->first + HPACK_ENTRIES_MAX - 1) % HPACK_ENTRIES_MAX;
+    decoder->entries[decoder->first] = entry;
+    decoder->count++;
+    decoder->size += size;
+    return 0;
+}
+
+/**
+ * @brief Looks up a field by index: the static table, then the dynamic
+ * table from its newest entry.
+ */
+static int lookup(hpack_decoder_s *decoder, size_t index, const char **name, size_t *name_len, const char **value, size_t *value_len) {
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= decoder->count) {
+        return -1;
+    }
+    hpack_entry_s *entry = decoder->entries[(decoder->first + index) % HPACK_ENTRIES_MAX];
+    *name = entry->data;
+    *name_len = entry->name_len;
+    *value = entry->data + entry->name_len;
+    *value_len = entry->value_len;
+    return 0;
+}
+
+/**
+ * @brief Returns the first static table index with the name, or 0.
+ */
+static int static_name(const char *name, size_t len) {
+    for (int i = 0; i < HPACK_STATIC_COUNT; i++) {
+        if (strlen(static_table[i].name) == len && memcmp(static_table[i].name, name, len) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * @file hpack.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief HPACK header compression declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Size of the dynamic table a decoder starts with and the most a
+ * peer may set it to: the HTTP/2 default SETTINGS_HEADER_TABLE_SIZE, which
+ * the server never changes. Each entry costs its name and value plus 32,
+ * so it holds at most HPACK_ENTRIES_MAX entries.
+ */
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_ENTRIES_MAX (HPACK_TABLE_SIZE / 32)
+
+/**
+ * @brief Largest decoded header field, name and value together. A field
+ * this long wouldn't fit a request header anyway.
+ */
+#define HPACK_FIELD_MAX 8192
+
+/**
+ * @brief Static table indexes of the fields the server encodes by name.
+ */
+#define HPACK_STATUS_200 8
+#define HPACK_DATE 33
+
+/**
+ * @brief A dynamic table entry, the name followed by the value in data.
+ */
+typedef struct hpack_entry_s {
+    size_t name_len;
+    size_t value_len;
+    char data[];
+} hpack_entry_s;
+
+/**
+ * @brief The decoding side of one connection's compression context: the
+ * dynamic table as a ring of entries, newest at first, with count entries
+ * taking size bytes of max_size. limit is the largest max_size the peer
+ * may choose.
+ */
+typedef struct hpack_decoder_s {
+    hpack_entry_s *entries[HPACK_ENTRIES_MAX];
+    size_t first;
+    size_t count;
+    size_t size;
+    size_t max_size;
+    size_t limit;
+} hpack_decoder_s;
+
+/**
+ * @brief Called by hpack_decode() for each header field in a block, in
+ * order. name and value are not NUL terminated and are only valid during
+ * the call.
+ * @return 0 to carry on, anything else to stop decoding and return it.
+ */
+typedef int (hpack_field_f)(void *arg, const char *name, size_t name_len, const char *value, size_t value_len);
+
+/**
+ * @brief Prepares an empty decoder with a table of HPACK_TABLE_SIZE bytes.
+ * @param decoder The decoder.
+ * @return nothing
+ */
+extern void hpack_decoder_init(hpack_decoder_s *decoder);
+
+/**
+ * @brief Frees the decoder's dynamic table entries.
+ * @param decoder The decoder.
+ * @return nothing
+ */
+extern void hpack_decoder_cleanup(hpack_decoder_s *decoder);
+
+/**
+ * @brief Decodes a complete header block, adding to the dynamic table as
+ * the block says. Every block on a connection must be decoded, in order,
+ * even if its fields are not wanted, or the table goes out of step.
+ * @param decoder The connection's decoder.
+ * @param block The header block.
+ * @param len Length of the block.
+ * @param field Called for each field.
+ * @param arg Passed to field.
+ * @return 0 on success, -1 if the block is malformed or has a field longer
+ * than HPACK_FIELD_MAX (a COMPRESSION_ERROR for the connection), or what
+ * field returned to stop decoding.
+ */
+extern int hpack_decode(hpack_decoder_s *decoder, const unsigned char *block, size_t len, hpack_field_f *field, void *arg);
+
+/**
+ * @brief Encodes one field as a literal that is not added to the table,
+ * so the result may be sent on any connection: by static table index if
+ * name_index is not 0, otherwise with the name, which must be lower case.
+ * Huffman coding is used for strings it makes shorter.
+ * @param out Buffer to encode into.
+ * @param size Size of out.
+ * @param name_index Static table index to take the name from, or 0.
+ * @param name Name, if name_index is 0.
+ * @param name_len Length of name.
+ * @param value Value.
+ * @param value_len Length of value.
+ * @return Bytes written, or 0 if out is too small.
+ */
+extern size_t hpack_encode_field(unsigned char *out, size_t size, int name_index, const char *name, size_t name_len, const char *value, size_t value_len);
+
+/**
+ * @brief Encodes HTTP/1 header lines, "Name: value" each ending in CRLF
+ * up to an optional blank line, as a header block of literals that are
+ * not added to the table, with lower case names found in the static table
+ * where they can be. Fields HTTP/2 forbids, such as Connection, are left
+ * out. The block depends on no connection state, so it can be built once,
+ * for instance with the cached entity headers, and sent on every
+ * connection.
+ * @param header The header lines.
+ * @param header_len Length of header.
+ * @param block_len Contains the length of the block.
+ * @return The block, allocated, or NULL on no memory.
+ */
+extern char *hpack_encode_header(const char *header, size_t header_len, size_t *block_len);
+
+#endif // HPACK_H
@@ -7,68 +7,69 @@
  * @copyright Copyright (c) 2024
  */
 
+#define _GNU_SOURCE
+
 #define MAX_RECV_CHARACTERS 8192
 #define URL_VAR_NAME_MAX 128
 #define URL_VAR_VALUE_MAX 1024
 #define PATH_SIZE_MAX 1024
 #define BUFFER_SIZE 512
+#define SENDFILE_CHUNK_SIZE 16384
+#define SSL_COALESCE_SIZE 16384
 
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 
-#include "cache.h"
 #include "debug.h"
 #include "http.h"
 #include "log.h"
 
 volatile sig_atomic_t reload = 0;
 
-http_client_s *http_accept(http_server_s *server) {
+static void client_init(http_server_s *server, http_client_s *client);
+
+int http_accept(http_server_s *server, http_client_s *client) {
     debug_enter();
-    http_client_s *client = malloc(sizeof(http_client_s));
-    if (client == NULL) {
-        log_error(server->log, "malloc failed: %s", strerror(errno));
-        debug_return NULL;
-    }
+    memset(client, 0, sizeof(http_client_s));
     client->addr_len = sizeof(client->addr);
-    client->fd = accept(server->fd, (struct sockaddr *)&client->addr, &client->addr_len);
-    if (reload == 1) {
-        if (cache_load(server->html_path, server->log) != 0) {
-            debug_return NULL;
-        }
-        reload = 0;
-    }
+    client->fd = accept4(server->fd, (struct sockaddr *)&client->addr, &client->addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (client->fd < 0) {
-        log_error(server->log, "accept failed: %s", strerror(errno));
-        free(client);
-        debug_return NULL;
-    }
-    if (server->ssl_ctx != NULL) {
-        debug("server->ssl_ctx = %p\n", server->ssl_ctx);
-        client->ssl = SSL_new(server->ssl_ctx);
-        SSL_set_fd(client->ssl, client->fd);
-        ERR_clear_error();
-        if (SSL_accept(client->ssl) <= 0) {
-            log_error(server->log, "ssl accept failed: %s", ERR_reason_error_string(ERR_get_error()));
-            SSL_free(client->ssl);
-            close(client->fd);
-            free(client);
-            debug_return(NULL);
+        int err = errno;
+        if (err != EAGAIN && err != EWOULDBLOCK && err != EINTR) {
+            log_error(server->log, "accept failed: %s", strerror(err));
         }
-    } else {
-        client->ssl = NULL;
+        errno = err;
+        debug_return -1;
     }
-    client->server = server;
-    client->ip = inet_ntoa(client->addr.sin_addr);
-    debug_return client;
+    client_init(server, client);
+    debug_return 0;
+}
+
+int http_accept_fd(http_server_s *server, http_client_s *client, int fd) {
+    debug_enter();
+    memset(client, 0, sizeof(http_client_s));
+    client->addr_len = sizeof(client->addr);
+    if (getpeername(fd, (struct sockaddr *)&client->addr, &client->addr_len) < 0) {
+        // The client is already gone.
+        int err = errno;
+        close(fd);
+        errno = err;
+        debug_return -1;
+    }
+    client->fd = fd;
+    client_init(server, client);
+    debug_return 0;
 }
 
 void http_client_close(http_client_s *client) {
@@ -78,14 +79,18 @@ void http_client_close(http_client_s *client) {
         debug_return;
     }
     if (client->ssl != NULL) {
-        int ret = SSL_shutdown(client->ssl);
-        if (ret == 0) {
-            ret = SSL_shutdown(client->ssl); // Second call to complete shutdown
-        }
-        if (ret < 0) {
-            int err = SSL_get_error(client->ssl, ret);
-            log_error(client->server->log, "SSL_shutdown failed: %s (error code: %d)", 
-                      ERR_reason_error_string(ERR_get_error()), err);
+        // The socket is non-blocking, so only send our close_notify rather
+        // than waiting for the peer's.
+        if (client->state != HTTP_CLIENT_HANDSHAKE) {
+            ERR_clear_error();
+            int ret = SSL_shutdown(client->ssl);
+            if (ret < 0) {
+                int err = SSL_get_error(client->ssl, ret);
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_SYSCALL) {
+                    log_error(client->server->log, "SSL_shutdown failed: %s (error code: %d)", 
+                              ERR_reason_error_string(ERR_get_error()), err);
+                }
+            }
         }
         SSL_free(client->ssl); // Always free SSL, even on shutdown failure
         client->ssl = NULL;
@@ -95,98 +100,312 @@ void http_client_close(http_client_s *client) {
         close(client->fd);
         client->fd = -1; // Prevent double close
     }
-    debug("freeing client\n");
-    free(client);
     debug_return;
 }
 
 void http_close(http_server_s *server) {
     debug_enter();
-    if (server == NULL) {
-        debug_return;
-    }
-    if (server->fd >= 0) {
-        close(server->fd);
+    while (server != NULL) {
+        http_server_s *next = server->next;
+        if (server->fd >= 0) {
+            close(server->fd);
+        }
+        free(server);
+        server = next;
     }
-    free(server);
     debug_return;
 }
 
-http_server_s *http_init(log_s *log, SSL_CTX *ssl_ctx, const char const *html_path, char *server_ip, int port) {
+http_server_s *http_init(log_s *log, SSL_CTX *ssl_ctx, const char const *html_path, const http_listen_s *listener, int shard, int fd) {
     debug_enter();
-    http_server_s *http = malloc(sizeof(http_server_s));
+    http_server_s *http = calloc(1, sizeof(http_server_s));
     if (http == NULL) {
-        log_error(log, "malloc failed: %s", strerror(errno));
+        log_error(log, "calloc failed: %s", strerror(errno));
         debug_return NULL;
     }
     http->html_path = html_path;
     http->ssl_ctx = ssl_ctx;
-    http->fd = socket(AF_INET, SOCK_STREAM, 0);
+    http->log = log;
+    http->port = listener->port;
+    http->shard = shard;
+    http->admin = listener->admin;
+    http->fd = -1;
+    socklen_t addr_len;
+    if (strcmp(listener->ip, "any") == 0) {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&http->addr;
+        addr->sin_family = AF_INET;
+        addr->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr->sin_port = htons(listener->port);
+        addr_len = sizeof(struct sockaddr_in);
+    } else if (strchr(listener->ip, ':') != NULL) {
+        struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&http->addr;
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(listener->port);
+        addr_len = sizeof(struct sockaddr_in6);
+        if (inet_pton(AF_INET6, listener->ip, &addr->sin6_addr) != 1) {
+            log_error(log, "invalid IPv6 address %s", listener->ip);
+            goto error;
+        }
+    } else {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&http->addr;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(listener->port);
+        addr_len = sizeof(struct sockaddr_in);
+        if (inet_pton(AF_INET, listener->ip, &addr->sin_addr) != 1) {
+            log_error(log, "invalid IPv4 address %s", listener->ip);
+            goto error;
+        }
+    }
+    if (fd >= 0) {
+        // An inherited socket is already bound and listening; it only has
+        // to be the one the configuration asks for.
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        struct sockaddr_storage bound;
+        socklen_t bound_len = sizeof(bound);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening ||
+            getsockname(fd, (struct sockaddr *)&bound, &bound_len) < 0 || bound.ss_family != http->addr.ss_family ||
+            ((struct sockaddr_in *)&bound)->sin_port != ((struct sockaddr_in *)&http->addr)->sin_port) {
+            log_error(log, "inherited descriptor %d is not listening on %s port %d", fd, listener->ip, listener->port);
+            goto error;
+        }
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+            log_warn(log, "fcntl FD_CLOEXEC failed: %s", strerror(errno));
+        }
+        http->fd = fd;
+        debug_return http;
+    }
+    http->fd = socket(http->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (http->fd < 0) {
         log_error(log, "socket failed: %s", strerror(errno));
-        free(http);
-        debug_return NULL;
+        goto error;
     }
-    http->addr.sin_family = AF_INET;
-    if (strncmp(server_ip, "any", sizeof("any")) == 0) {
-        http->addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    } else {
-        if (inet_pton(AF_INET, server_ip, &http->addr.sin_addr) < 0) {
-            log_error(log, "inet_pton failed: %s", strerror(errno));
-            close(http->fd);
-            free(http);
-            debug_return NULL;
-        }
+    int on = 1;
+    if (setsockopt(http->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+        log_warn(log, "setsockopt SO_REUSEADDR failed: %s", strerror(errno));
     }
-    http->addr.sin_port = htons(port);
-    if (bind(http->fd, (struct sockaddr *)&http->addr, sizeof(http->addr)) < 0) {
-        log_error(log, "bind failed: %s", strerror(errno));
-        close(http->fd);
-        free(http);
-        debug_return NULL;
+    if (http->addr.ss_family == AF_INET6 && setsockopt(http->fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) < 0) {
+        log_warn(log, "setsockopt IPV6_V6ONLY failed: %s", strerror(errno));
+    }
+    if (listener->reuseport && setsockopt(http->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        log_error(log, "setsockopt SO_REUSEPORT failed: %s", strerror(errno));
+        goto error;
+    }
+    if (listener->defer_accept > 0 && setsockopt(http->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &listener->defer_accept, sizeof(listener->defer_accept)) < 0) {
+        log_warn(log, "setsockopt TCP_DEFER_ACCEPT failed: %s", strerror(errno));
+    }
+    if (listener->fastopen > 0 && setsockopt(http->fd, IPPROTO_TCP, TCP_FASTOPEN, &listener->fastopen, sizeof(listener->fastopen)) < 0) {
+        log_warn(log, "setsockopt TCP_FASTOPEN failed: %s", strerror(errno));
+    }
+    if (bind(http->fd, (struct sockaddr *)&http->addr, addr_len) < 0) {
+        log_error(log, "bind to %s port %d failed: %s", listener->ip, listener->port, strerror(errno));
+        goto error;
     }
-    if (listen(http->fd, 10) < 0) {
+    if (listen(http->fd, listener->backlog > 0 ? listener->backlog : SOMAXCONN) < 0) {
         log_error(log, "listen failed: %s", strerror(errno));
-        close(http->fd);
-        free(http);
-        debug_return NULL;
+        goto error;
     }
-    http->log = log;
     debug_return http;
+error:
+    if (http->fd >= 0) {
+        close(http->fd);
+    }
+    free(http);
+    debug_return NULL;
 }
 
-size_t http_read(http_client_s *client, void *buffer, size_t len) {
-    size_t size = 0;
-    if (client->server->ssl_ctx == NULL) {
+http_io_e http_handshake(http_client_s *client) {
+    debug_enter();
+    SSL_CTX *ssl_ctx = client->server->ssl_ctx;
+    if (ssl_ctx == NULL) {
+        debug_return HTTP_IO_OK;
+    }
+    if (client->ssl == NULL) {
+        debug("ssl_ctx = %p\n", ssl_ctx);
+        ERR_clear_error();
+        client->ssl = SSL_new(ssl_ctx);
+        if (client->ssl == NULL || SSL_set_fd(client->ssl, client->fd) != 1) {
+            log_error(client->server->log, "ssl setup failed: %s", ERR_reason_error_string(ERR_get_error()));
+            if (client->ssl != NULL) {
+                SSL_free(client->ssl);
+                client->ssl = NULL;
+            }
+            debug_return HTTP_IO_ERROR;
+        }
+        SSL_set_accept_state(client->ssl);
+    }
+    ERR_clear_error();
+    int ret = SSL_do_handshake(client->ssl);
+    if (ret == 1) {
+        debug_return HTTP_IO_OK;
+    }
+    switch (SSL_get_error(client->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            debug_return HTTP_IO_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            debug_return HTTP_IO_WANT_WRITE;
+        default:
+            log_error(client->server->log, "ssl accept failed for client %s: %s", client->ip, ERR_reason_error_string(ERR_get_error()));
+            debug_return HTTP_IO_ERROR;
+    }
+}
+
+bool http_is_h2(http_client_s *client) {
+    const unsigned char *protocol = NULL;
+    unsigned int len = 0;
+    if (client->ssl == NULL) {
+        return false;
+    }
+    SSL_get0_alpn_selected(client->ssl, &protocol, &len);
+    return len == 2 && memcmp(protocol, "h2", 2) == 0;
+}
+
+ssize_t http_read(http_client_s *client, void *buffer, size_t len) {
+    ssize_t size = 0;
+    if (client->ssl == NULL) {
         debug("non-ssl reading %d bytes\n", len);
         size = recv(client->fd, buffer, len, 0);
         debug("non-ssl read %d of %d bytes\n", size, len);
     } else {
         debug("ssl reading %d bytes\n", len);
-        size = SSL_read(client->ssl, buffer, len);
-        if (size < 0) {
-            int err = SSL_get_error(client->ssl, size);
-            debug("SSL_shutdown failed: %s\n", ERR_reason_error_string(ERR_get_error()));
+        size_t read = 0;
+        ERR_clear_error();
+        int ret = SSL_read_ex(client->ssl, buffer, len, &read);
+        if (ret == 1) {
+            size = read;
+        } else {
+            switch (SSL_get_error(client->ssl, ret)) {
+                case SSL_ERROR_WANT_READ:
+                case SSL_ERROR_WANT_WRITE:
+                    errno = EAGAIN;
+                    size = -1;
+                    break;
+                case SSL_ERROR_ZERO_RETURN:
+                    size = 0;
+                    break;
+                default:
+                    debug("SSL_read failed: %s\n", ERR_reason_error_string(ERR_get_error()));
+                    errno = EIO;
+                    size = -1;
+                    break;
+            }
         }
         debug("ssl read %d of %d bytes\n", size, len);
     }
     return size;
 }
 
-size_t http_write(http_client_s *client, const void const *buffer, size_t len) {
-    size_t size = 0;
-    if (client->server->ssl_ctx == NULL) {
+ssize_t http_write(http_client_s *client, const void const *buffer, size_t len) {
+    ssize_t size = 0;
+    if (client->ssl == NULL) {
         debug("non-ssl write\n");
-        size = send(client->fd, buffer, len, 0);
+        size = send(client->fd, buffer, len, MSG_NOSIGNAL);
         debug("non-ssl wrote %d of %d bytes\n", size, len);
     } else {
         debug("ssl writing %d bytes\n", len);
-        if (SSL_write_ex(client->ssl, buffer, len, &size) == 1) {
+        size_t written = 0;
+        ERR_clear_error();
+        int ret = SSL_write_ex(client->ssl, buffer, len, &written);
+        if (ret == 1) {
+            size = written;
             debug("ssl wrote %d of %d bytes\n", size, len);
         } else {
-            debug("ssl write failed\n");
-            size = 0;
+            switch (SSL_get_error(client->ssl, ret)) {
+                case SSL_ERROR_WANT_READ:
+                case SSL_ERROR_WANT_WRITE:
+                    errno = EAGAIN;
+                    break;
+                default:
+                    debug("ssl write failed\n");
+                    errno = EIO;
+                    break;
+            }
+            size = -1;
         }
     }
     return size;
 }
+
+ssize_t http_writev(http_client_s *client, const struct iovec *iov, int iovcnt) {
+    if (client->ssl == NULL) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t size = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        debug("non-ssl wrote %d bytes from %d buffers\n", size, iovcnt);
+        return size;
+    }
+    if (iovcnt > 1 && iov[0].iov_len < SSL_COALESCE_SIZE) {
+        /* Gather small leading buffers, typically the header pieces and the
+           start of the body, into one TLS record instead of one each. */
+        char buffer[SSL_COALESCE_SIZE];
+        size_t len = 0;
+        for (int i = 0; i < iovcnt && len < sizeof(buffer); i++) {
+            size_t n = iov[i].iov_len < sizeof(buffer) - len ? iov[i].iov_len : sizeof(buffer) - len;
+            memcpy(buffer + len, iov[i].iov_base, n);
+            len += n;
+        }
+        return http_write(client, buffer, len);
+    }
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t size = http_write(client, iov[i].iov_base, iov[i].iov_len);
+        if (size < 0) {
+            return total > 0 ? total : -1;
+        }
+        total += size;
+        if ((size_t)size < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+ssize_t http_sendfile(http_client_s *client, int fd, off_t offset, size_t len) {
+    if (client->ssl == NULL) {
+        ssize_t size = sendfile(client->fd, fd, &offset, len);
+        debug("non-ssl sendfile wrote %d bytes\n", size);
+        return size;
+    }
+    if (BIO_get_ktls_send(SSL_get_wbio(client->ssl))) {
+        ssize_t size = SSL_sendfile(client->ssl, fd, offset, len, 0);
+        if (size < 0) {
+            int err = SSL_get_error(client->ssl, size);
+            errno = (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) ? EAGAIN : EIO;
+        }
+        debug("ktls sendfile wrote %d bytes\n", size);
+        return size;
+    }
+    char buffer[SENDFILE_CHUNK_SIZE];
+    if (len > sizeof(buffer)) {
+        len = sizeof(buffer);
+    }
+    ssize_t size = pread(fd, buffer, len, offset);
+    if (size <= 0) {
+        if (size == 0) {
+            errno = EIO;
+        }
+        return -1;
+    }
+    /* SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER lets a retried write pass a 
+       different buffer holding the same bytes. */
+    return http_write(client, buffer, size);
+}
+
+/**
+ * @brief Sets up a client whose socket and address have just been filled
+ * in by an accept.
+ */
+static void client_init(http_server_s *server, http_client_s *client) {
+    // The SSL state is created by the first http_handshake(), so a 
+    // connection turned away on accept costs no TLS work.
+    client->ssl = NULL;
+    client->state = server->ssl_ctx != NULL ? HTTP_CLIENT_HANDSHAKE : HTTP_CLIENT_READ;
+    client->server = server;
+    if (client->addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&client->addr)->sin6_addr, client->ip, sizeof(client->ip));
+    } else {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&client->addr)->sin_addr, client->ip, sizeof(client->ip));
+    }
+}
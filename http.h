@@ -10,89 +10,250 @@
 #ifndef http_H
 #define http_H
 
+#include <arpa/inet.h>
 #include <netinet/in.h>
 #include <openssl/ssl.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #include "log.h"
+#include "response.h"
+#include "trace.h"
 
 /**
- * @brief Represents a variable, either a query parameter, which is passed as 
- * part of the URI, or a header.
+ * @brief Listener settings, passed to http_init(). ip is "any" for every 
+ * IPv4 address, or an IPv4 or IPv6 literal ("::" for every IPv6 address).
+ * IPv6 listeners only accept IPv6, so the same port can be bound for both.
+ * backlog is the listen() backlog. defer_accept, if not 0, holds off 
+ * accepting a connection until the client has sent data or that many 
+ * seconds have passed (TCP_DEFER_ACCEPT). fastopen, if not 0, accepts data
+ * in the SYN from clients that know the server, queueing up to that many 
+ * such connections (TCP_FASTOPEN). reuseport gives each worker a socket of
+ * its own bound with SO_REUSEPORT, so the kernel spreads connections across
+ * them instead of all workers sharing one queue. admin marks a listener
+ * for internal endpoints such as metrics.
  */
-typedef struct http_variable_s {
-    char *var;
-    char *val;
-    struct http_variable_s *next;
-} http_variable_s;
+typedef struct http_listen_s {
+    char *ip;
+    int port;
+    bool ssl;
+    int backlog;
+    int defer_accept;
+    int fastopen;
+    bool reuseport;
+    bool admin;
+} http_listen_s;
 
 /**
- * @brief Represents the HTTP server. The socket is tracked for accepting 
- * connections, the log handle for logging output and the address structure.
+ * @brief Represents one listening socket of the HTTP server. The socket is
+ * tracked for accepting connections, the log handle for logging output and
+ * the address structure. ssl_ctx is NULL for plaintext listeners. shard is
+ * the worker a SO_REUSEPORT socket belongs to, -1 for a socket every worker
+ * accepts from. admin is copied from the listener settings. Listeners are
+ * linked through next.
  */
 typedef struct http_server_s {
     const char const *html_path;
     log_s *log;
     int fd;
     SSL_CTX *ssl_ctx;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
+    int port;
+    int shard;
+    bool admin;
+    struct http_server_s *next;
 } http_server_s;
 
+/**
+ * @brief Connection states. A client moves through these as the event loop
+ * drives it: the TLS handshake (skipped for plaintext), reading a complete
+ * request, writing the response and finally closing. A client that chose
+ * HTTP/2 in the handshake stays in HTTP_CLIENT_H2, where its streams are
+ * read and written together, until it closes.
+ */
+typedef enum http_client_state_e {
+    HTTP_CLIENT_HANDSHAKE,
+    HTTP_CLIENT_READ,
+    HTTP_CLIENT_WRITE,
+    HTTP_CLIENT_H2,
+    HTTP_CLIENT_CLOSE
+} http_client_state_e;
+
+/**
+ * @brief Results of non-blocking I/O stages such as http_handshake().
+ * HTTP_IO_WANT_READ and HTTP_IO_WANT_WRITE mean the stage must be retried 
+ * once the socket becomes readable or writable.
+ */
+typedef enum http_io_e {
+    HTTP_IO_ERROR = -1,
+    HTTP_IO_OK = 0,
+    HTTP_IO_WANT_READ = 1,
+    HTTP_IO_WANT_WRITE = 2
+} http_io_e;
+
 /**
  * @brief Represents an HTTP client connection. A pointer to the server is 
  * kept, along with the IP the client is coming from, the socket used 
- * to communicate with it and the sockaddr_in info.
+ * to communicate with it and the sockaddr_in info. The state, the request
+ * being read and the response being sent are kept here so the event loop can
+ * resume the connection wherever it left off. requests counts the requests
+ * served on the connection and keep_alive says whether it stays open after
+ * the current response. request_start is when the current request was 
+ * received, for the access log, and response_start when its response was
+ * ready to send. trace times the current request's stages when it is 
+ * sampled. h2 is the HTTP/2 connection state of an HTTP_CLIENT_H2
+ * client, whose streams have requests and responses of their own. prev and
+ * next link the client into the list of connections owned by its worker.
  */
 typedef struct http_client_s {
     http_server_s *server;
-    char *ip;
+    char ip[INET6_ADDRSTRLEN];
     int fd;
     SSL *ssl;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addr_len;
+    http_client_state_e state;
+    uint32_t events;
+    struct request_s *request;
+    http_response_s response;
+    unsigned int requests;
+    bool keep_alive;
+    struct timespec request_start;
+    struct timespec response_start;
+    trace_s trace;
+    struct h2_conn_s *h2;
+    struct http_client_s *prev;
+    struct http_client_s *next;
 } http_client_s;
 
 extern volatile sig_atomic_t reload;
 
 /**
- * @brief Accept a client connection.
+ * @brief Accept a client connection. The listening socket is non-blocking,
+ * so this returns -1 with errno set to EAGAIN when there are no more 
+ * pending connections. The accepted socket is also non-blocking. For SSL
+ * servers neither the SSL state nor the handshake is set up here; both are
+ * left to http_handshake(), so the connection can be checked first.
  * @param server The HTTP server.
- * @return A pointer to an http_client_s structure representing the client
- * connection. This must be freed with http_client_close(). Returns NULL on 
- * error.
+ * @param client Storage for the client connection, owned by the caller so
+ * it can be recycled. It is cleared before use. Once accepted, the 
+ * connection must be closed with http_client_close().
+ * @return 0 on success, -1 on error.
+ */
+extern int http_accept(http_server_s *server, http_client_s *client);
+
+/**
+ * @brief Sets up a client for a connection accepted by other means, such
+ * as an io_uring accept, as http_accept() would have. The socket must be
+ * non-blocking.
+ * @param server The HTTP server the connection was accepted on.
+ * @param client Storage for the client connection, cleared before use.
+ * @param fd The accepted socket, which is closed on error.
+ * @return 0 on success, -1 on error.
  */
-extern http_client_s *http_accept(http_server_s *server);
+extern int http_accept_fd(http_server_s *server, http_client_s *client, int fd);
 
 /**
- * @brief Closes a client connection and cleans up allocated resources.
+ * @brief Closes a client connection and frees its SSL state. The 
+ * http_client_s storage itself belongs to the caller.
  * @param client The client connection to close.
  * @return nothing
  */
 extern void http_client_close(http_client_s *client);
 
 /**
- * @brief Closes the HTTP server connection.
- * @param server The HTTP server to close.
+ * @brief Closes a listening socket and every listener linked after it.
+ * @param server The first listener to close.
  * @return nothing
  */
 extern void http_close(http_server_s *server);
 
 /**
- * @brief Initializes the HTTP server. The server is setup to listen on the
- * given IP address and port and will use the passed log.
+ * @brief Opens a listening socket as given by listener, using the passed 
+ * log. Call once per worker with shard set for a reuseport listener. A 
+ * listening socket inherited from the process that executed this one may
+ * be passed in fd to be used instead, after checking it is listening on 
+ * the listener's port; queued connections are then not lost.
  * @param log The log handle to write to.
  * @param ssl_ctx SSL context, NULL if not using SSL.
  * @param html_path Path to HTML.
- * @param server_ip IP for the server to listen on.
- * @param port Port for the server to listen on.
- * @return Pointer to the http_server_s representing the HTTP connection, or
- * NULL on error. 
+ * @param listener Address, port and socket options.
+ * @param shard Worker the socket is for if listener->reuseport is set, 
+ * otherwise -1.
+ * @param fd Inherited listening socket to use, or -1 to open one.
+ * @return Pointer to the http_server_s representing the listener, or NULL
+ * on error. 
+ */
+extern http_server_s *http_init(log_s *log, SSL_CTX *ssl_ctx, const char const *html_path, const http_listen_s *listener, int shard, int fd);
+
+/**
+ * @brief Advances the SSL handshake on a client connection, creating its 
+ * SSL state on the first call. For plaintext connections this returns 
+ * HTTP_IO_OK immediately.
+ * @param client The client connection.
+ * @return HTTP_IO_OK when the handshake is complete, HTTP_IO_WANT_READ or
+ * HTTP_IO_WANT_WRITE when it must be retried, HTTP_IO_ERROR on failure.
  */
-extern http_server_s *http_init(log_s *log, SSL_CTX *ssl_ctx, const char const *html_path, char *server_ip, int port);
+extern http_io_e http_handshake(http_client_s *client);
 
-extern size_t http_read(http_client_s *client, void *buffer, size_t len);
-extern size_t http_write(http_client_s *client, const void const *buffer, size_t len);
+/**
+ * @brief Checks whether the client chose HTTP/2 by ALPN during the TLS
+ * handshake.
+ * @param client The client connection, after http_handshake() succeeded.
+ * @return true if "h2" was selected.
+ */
+extern bool http_is_h2(http_client_s *client);
+
+/**
+ * @brief Reads from a client connection.
+ * @param client The client connection.
+ * @param buffer Buffer to read into.
+ * @param len Size of the buffer.
+ * @return Number of bytes read, 0 if the peer closed the connection, or -1 on
+ * error. errno is EAGAIN if the read would block.
+ */
+extern ssize_t http_read(http_client_s *client, void *buffer, size_t len);
+
+/**
+ * @brief Writes to a client connection.
+ * @param client The client connection.
+ * @param buffer Data to write.
+ * @param len Number of bytes to write.
+ * @return Number of bytes written or -1 on error. errno is EAGAIN if the 
+ * write would block.
+ */
+extern ssize_t http_write(http_client_s *client, const void const *buffer, size_t len);
+
+/**
+ * @brief Writes a vector of buffers to a client connection. Plaintext 
+ * connections use a single writev(); SSL connections gather up to 16 KiB of
+ * the buffers into one record, or write each large buffer in turn, stopping
+ * at the first one that doesn't complete.
+ * @param client The client connection.
+ * @param iov Buffers to write.
+ * @param iovcnt Number of buffers.
+ * @return Number of bytes written or -1 on error. errno is EAGAIN if nothing
+ * could be written without blocking.
+ */
+extern ssize_t http_writev(http_client_s *client, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Writes part of a file to a client connection without copying it 
+ * through user space where possible: sendfile() on plaintext connections,
+ * SSL_sendfile() when kernel TLS is active, and a bounded pread() and 
+ * SSL_write() otherwise.
+ * @param client The client connection.
+ * @param fd File to read from.
+ * @param offset Offset in the file to start at.
+ * @param len Number of bytes to write.
+ * @return Number of bytes written or -1 on error. errno is EAGAIN if the
+ * write would block.
+ */
+extern ssize_t http_sendfile(http_client_s *client, int fd, off_t offset, size_t len);
 
 #endif // http_H
\ No newline at end of file
@@ -0,0 +1,293 @@
+/**
+ * @file limit.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief per-client limits module implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "limit.h"
+
+#define LIMIT_CACHE_LINE 64
+#define LIMIT_KEY_SIZE 16
+#define LIMIT_SHARDS_BITS 6
+#define LIMIT_SHARDS (1 << LIMIT_SHARDS_BITS)
+#define LIMIT_BUCKETS_MIN 16
+
+/**
+ * @brief A tracked address: the connections it has open and its token
+ * bucket, which holds tokens as of stamp, in CLOCK_MONOTONIC nanoseconds.
+ * IPv4 addresses are keyed as IPv4-mapped IPv6 addresses, so a client is
+ * the same whichever kind of listener it comes in on. Clients are chained
+ * in their shard's buckets.
+ */
+struct limit_client_s {
+    struct limit_client_s *next;
+    uint8_t key[LIMIT_KEY_SIZE];
+    int shard;
+    int connections;
+    double tokens;
+    uint64_t stamp;
+};
+
+/**
+ * @brief One shard of the client table, on its own cache lines so workers
+ * locking different shards don't share a line.
+ */
+typedef struct limit_shard_s {
+    pthread_mutex_t mutex;
+    limit_client_s **buckets;
+    size_t mask;
+    size_t count;
+} __attribute__((aligned(LIMIT_CACHE_LINE))) limit_shard_s;
+
+static limit_config_s limit_config;
+static limit_shard_s *shards = NULL;
+static size_t shard_clients = 0;
+static double burst = 0;
+
+/* The address hash is keyed with a random seed, so a client choosing its
+   addresses can't aim them all at one chain. */
+static uint64_t seed[2];
+
+static uint64_t hash_key(const uint8_t *key);
+static bool idle(limit_client_s *client, uint64_t now);
+static void make_key(const struct sockaddr_storage *addr, uint8_t *key);
+static uint64_t monotonic_ns(void);
+static void refill(limit_client_s *client, uint64_t now);
+
+int limit_init(const limit_config_s *config) {
+    debug_enter();
+    limit_config = *config;
+    if (config->connections <= 0 && config->rate <= 0) {
+        debug_return 0;
+    }
+    if (getrandom(seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+        seed[0] = monotonic_ns() ^ ((uint64_t)getpid() << 32);
+        seed[1] = (uintptr_t)&seed ^ time(NULL);
+    }
+    burst = config->burst;
+    if (burst <= 0) {
+        int64_t whole = (int64_t)config->rate;
+        burst = whole < config->rate ? whole + 1 : whole;
+    }
+    if (burst < 1) {
+        burst = 1;
+    }
+    int clients = config->clients > 0 ? config->clients : LIMIT_CLIENTS_DEFAULT;
+    shard_clients = (clients + LIMIT_SHARDS - 1) / LIMIT_SHARDS;
+    size_t buckets = LIMIT_BUCKETS_MIN;
+    while (buckets < shard_clients) {
+        buckets *= 2;
+    }
+    shards = aligned_alloc(LIMIT_CACHE_LINE, LIMIT_SHARDS * sizeof(limit_shard_s));
+    if (shards == NULL) {
+        debug_return 1;
+    }
+    memset(shards, 0, LIMIT_SHARDS * sizeof(limit_shard_s));
+    for (int i = 0; i < LIMIT_SHARDS; i++) {
+        limit_shard_s *shard = &shards[i];
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->mask = buckets - 1;
+        shard->count = 0;
+        shard->buckets = calloc(buckets, sizeof(limit_client_s *));
+        if (shard->buckets == NULL) {
+            limit_cleanup();
+            debug_return 1;
+        }
+    }
+    debug_return 0;
+}
+
+limit_result_e limit_acquire(const struct sockaddr_storage *addr, limit_client_s **client) {
+    *client = NULL;
+    if (shards == NULL) {
+        return LIMIT_OK;
+    }
+    uint8_t key[LIMIT_KEY_SIZE];
+    make_key(addr, key);
+    uint64_t h = hash_key(key);
+    limit_shard_s *shard = &shards[h >> (64 - LIMIT_SHARDS_BITS)];
+    uint64_t now = monotonic_ns();
+    limit_result_e result = LIMIT_OK;
+    pthread_mutex_lock(&shard->mutex);
+    limit_client_s **bucket = &shard->buckets[h & shard->mask];
+    limit_client_s *c = *bucket;
+    while (c != NULL && memcmp(c->key, key, LIMIT_KEY_SIZE) != 0) {
+        c = c->next;
+    }
+    if (c == NULL) {
+        // A full table lets new addresses through untracked rather than
+        // turning away clients that have done nothing wrong.
+        if (shard->count >= shard_clients || (c = malloc(sizeof(limit_client_s))) == NULL) {
+            goto term;
+        }
+        memcpy(c->key, key, LIMIT_KEY_SIZE);
+        c->shard = shard - shards;
+        c->connections = 0;
+        c->tokens = burst;
+        c->stamp = now;
+        c->next = *bucket;
+        *bucket = c;
+        shard->count++;
+    } else {
+        refill(c, now);
+    }
+    if (limit_config.connections > 0 && c->connections >= limit_config.connections) {
+        result = LIMIT_CONNECTIONS;
+    } else if (limit_config.rate > 0 && c->tokens < 1) {
+        result = LIMIT_RATE;
+    } else {
+        c->connections++;
+        if (limit_config.rate > 0) {
+            c->tokens -= 1;
+        }
+        *client = c;
+    }
+term:
+    pthread_mutex_unlock(&shard->mutex);
+    return result;
+}
+
+void limit_release(limit_client_s *client) {
+    if (client == NULL) {
+        return;
+    }
+    limit_shard_s *shard = &shards[client->shard];
+    pthread_mutex_lock(&shard->mutex);
+    client->connections--;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void limit_sweep(int part, int parts) {
+    if (shards == NULL || parts <= 0) {
+        return;
+    }
+    uint64_t now = monotonic_ns();
+    for (int i = part; i < LIMIT_SHARDS; i += parts) {
+        limit_shard_s *shard = &shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (size_t b = 0; shard->count > 0 && b <= shard->mask; b++) {
+            limit_client_s **link = &shard->buckets[b];
+            while (*link != NULL) {
+                limit_client_s *c = *link;
+                if (idle(c, now)) {
+                    *link = c->next;
+                    free(c);
+                    shard->count--;
+                } else {
+                    link = &c->next;
+                }
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+void limit_cleanup(void) {
+    debug_enter();
+    if (shards == NULL) {
+        debug_return;
+    }
+    for (int i = 0; i < LIMIT_SHARDS; i++) {
+        limit_shard_s *shard = &shards[i];
+        if (shard->buckets == NULL) {
+            // limit_init() stopped here.
+            break;
+        }
+        for (size_t b = 0; b <= shard->mask; b++) {
+            limit_client_s *c = shard->buckets[b];
+            while (c != NULL) {
+                limit_client_s *next = c->next;
+                free(c);
+                c = next;
+            }
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(shards);
+    shards = NULL;
+    debug_return;
+}
+
+/**
+ * @brief Hashes a key with the seed. The top bits pick the shard and the
+ * low bits the bucket.
+ */
+static uint64_t hash_key(const uint8_t *key) {
+    uint64_t a, b;
+    memcpy(&a, key, sizeof(a));
+    memcpy(&b, key + sizeof(a), sizeof(b));
+    uint64_t h = (a ^ seed[0]) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 32) ^ b ^ seed[1]) * 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 31;
+    h *= 0x94d049bb133111ebULL;
+    return h ^ (h >> 29);
+}
+
+/**
+ * @brief Whether a client can be forgotten without loosening its limits:
+ * it has nothing open and a full bucket, as a new client would.
+ */
+static bool idle(limit_client_s *client, uint64_t now) {
+    if (client->connections > 0) {
+        return false;
+    }
+    return limit_config.rate <= 0 || client->tokens + (double)(now - client->stamp) * limit_config.rate / 1e9 >= burst;
+}
+
+/**
+ * @brief Builds the key for a peer address: IPv4 as an IPv4-mapped IPv6
+ * address, IPv6 cut to the configured prefix.
+ */
+static void make_key(const struct sockaddr_storage *addr, uint8_t *key) {
+    memset(key, 0, LIMIT_KEY_SIZE);
+    if (addr->ss_family == AF_INET) {
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    } else if (addr->ss_family == AF_INET6) {
+        const struct in6_addr *in6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        memcpy(key, in6, LIMIT_KEY_SIZE);
+        if (IN6_IS_ADDR_V4MAPPED(in6)) {
+            return;
+        }
+        int bits = limit_config.ipv6_prefix > 0 && limit_config.ipv6_prefix < 128 ? limit_config.ipv6_prefix : 128;
+        for (int i = bits / 8; i < LIMIT_KEY_SIZE; i++) {
+            key[i] &= i == bits / 8 ? (uint8_t)(0xff << (8 - bits % 8)) : 0;
+        }
+    }
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Adds the tokens earned since the bucket was last filled, up to the
+ * burst.
+ */
+static void refill(limit_client_s *client, uint64_t now) {
+    if (limit_config.rate > 0) {
+        client->tokens += (double)(now - client->stamp) * limit_config.rate / 1e9;
+        if (client->tokens > burst) {
+            client->tokens = burst;
+        }
+    }
+    client->stamp = now;
+}
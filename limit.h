@@ -0,0 +1,94 @@
+/**
+ * @file limit.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief per-client limits module declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef LIMIT_H
+#define LIMIT_H
+
+#include <sys/socket.h>
+
+#define LIMIT_CLIENTS_DEFAULT 65536
+#define LIMIT_IPV6_PREFIX_DEFAULT 64
+
+/**
+ * @brief Per-client limit settings. connections is the most connections one
+ * client may have open at once. rate is the number of new connections a
+ * client may open per second, with up to burst opened at once after it has
+ * been quiet; burst 0 is rate rounded up. Either limit is off at 0. clients
+ * is the most addresses tracked at once; connections from further addresses
+ * are let through untracked until idle ones are swept. IPv6 clients are
+ * told apart by their first ipv6_prefix bits, since a single host is
+ * usually given a whole /64.
+ */
+typedef struct limit_config_s {
+    int connections;
+    double rate;
+    int burst;
+    int clients;
+    int ipv6_prefix;
+} limit_config_s;
+
+/**
+ * @brief Results of limit_acquire().
+ */
+typedef enum limit_result_e {
+    LIMIT_OK,
+    LIMIT_CONNECTIONS,
+    LIMIT_RATE
+} limit_result_e;
+
+/**
+ * @brief A tracked client address, opaque outside limit.c.
+ */
+typedef struct limit_client_s limit_client_s;
+
+/**
+ * @brief Sets up the client table. Limits are off until this is called
+ * with at least one limit set.
+ * @param config Limit settings. These are copied.
+ * @return 0 on success, 1 on no memory.
+ */
+extern int limit_init(const limit_config_s *config);
+
+/**
+ * @brief Checks a newly accepted connection against the limits of the
+ * address it came from, and counts it if it is let through. The address
+ * is hashed into one of several shards, each with its own lock, so workers
+ * accepting from different clients rarely wait on each other.
+ * @param addr The peer address from accept().
+ * @param client Set to the tracked client, to pass to limit_release() when
+ * the connection closes, or to NULL if the connection isn't tracked.
+ * @return LIMIT_OK if the connection may proceed, LIMIT_CONNECTIONS if the
+ * client has too many open, or LIMIT_RATE if it is opening them too fast.
+ */
+extern limit_result_e limit_acquire(const struct sockaddr_storage *addr, limit_client_s **client);
+
+/**
+ * @brief Counts a connection let through by limit_acquire() as closed.
+ * @param client The client from limit_acquire(). May be NULL.
+ * @return nothing
+ */
+extern void limit_release(limit_client_s *client);
+
+/**
+ * @brief Frees clients with no open connections whose token buckets have
+ * refilled, in the shards numbered part modulo parts, so each worker can
+ * sweep its own share on its tick.
+ * @param part Which share of the shards to sweep.
+ * @param parts Number of shares.
+ * @return nothing
+ */
+extern void limit_sweep(int part, int parts);
+
+/**
+ * @brief Frees the client table. No connection may still hold a client.
+ * @return nothing
+ */
+extern void limit_cleanup(void);
+
+#endif // LIMIT_H
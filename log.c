@@ -1,29 +1,48 @@
 /**
  * @file log.c
  * @author Warren Mann (warren@nonvol.io)
- * @brief Logger implementation.
+ * @brief Logger implementation. Messages are formatted by the calling thread
+ * into preallocated records of a bounded lock-free ring (multiple producers,
+ * one consumer). The writer thread drains the ring in batches and writes
+ * each batch with a single writev(). When the ring is full, messages are
+ * dropped and counted rather than blocking the caller.
  * @version 0.1.0
  * @date 2024-11-27
  * @copyright Copyright (c) 2024
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "debug.h"
 #include "log.h"
 
-// This is sum of the formatted string for the date and time, the app name, the
-// process id, the thread id, the source name, the line number, and the level.
+// Maximum size of a formatted message, not counting the prefix with the date
+// and time, app name, process id, thread id, source name, line number and
+// level that the writer adds.
 #define LOG_BUFFER_SIZE 1024
+// Size of the formatted prefix of one line.
+#define LOG_PREFIX_SIZE 256
+// Maximum number of records written by one writev().
+#define LOG_BATCH_SIZE 64
+// Seconds the writer sleeps when idle before checking the ring regardless.
+#define LOG_IDLE_TIMEOUT 1
 
 static const char const *LEVELS[] = {
 	"ERROR",
@@ -33,27 +52,43 @@ static const char const *LEVELS[] = {
 	"TRACE"
 };
 
-typedef struct output_s {
+/**
+ * @brief One slot of the ring. sequence tells producers and the consumer who
+ * owns the slot: it equals the enqueue position when the slot is free for
+ * that position, and position + 1 once the record has been published.
+ */
+typedef struct log_record_s {
+    atomic_size_t sequence;
     time_t raw_time;
-    const char const *source;
+    const char *source;
     int line;
-    const char const *level;
-    char buffer[LOG_BUFFER_SIZE];
+    log_levels_e level;
+    bool raw;
     pid_t tid;
-    struct output_s *next;
-} output_s;
+    size_t len;
+    char buffer[LOG_BUFFER_SIZE];
+} log_record_s;
 
 typedef struct log_queue_s {
     pthread_t log_thread;
-    output_s *head;
-    output_s *tail;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    bool stop;
+    log_record_s *records;
+    size_t mask;
+    atomic_size_t enqueue_pos;
+    size_t dequeue_pos;
+    atomic_ulong dropped;
+    atomic_int sleeping;
+    atomic_bool stop;
+    _Atomic(char *) reopen_path;
 } log_queue_s;
 
-static void enqueue(log_queue_s *queue, output_s *output);
-static output_s *dequeue(log_queue_s *queue);
+static __thread pid_t cached_tid = 0;
+
+static log_record_s *claim(log_queue_s *queue, size_t *pos);
+static size_t drain(log_s *log, log_queue_s *queue);
+static void publish(log_queue_s *queue, log_record_s *record, size_t pos, int len);
+static void reopen(log_s *log, log_queue_s *queue);
+static void wake_writer(log_queue_s *queue);
+static void write_all(int fd, struct iovec *iov, int iovcnt);
 void *writer(void *arg);
 
 void log_cleanup(log_s *log) {
@@ -61,11 +96,12 @@ void log_cleanup(log_s *log) {
     if (log != NULL) {
         if (log->queue != NULL) {
             log_queue_s *queue = log->queue;
-            pthread_mutex_lock(&queue->mutex);
-            queue->stop = true;
-            pthread_cond_broadcast(&queue->cond);
-            pthread_mutex_unlock(&queue->mutex);
+            atomic_store(&queue->stop, true);
+            atomic_store(&queue->sleeping, 0);
+            syscall(SYS_futex, &queue->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
             pthread_join(queue->log_thread, NULL);
+            free(atomic_load(&queue->reopen_path));
+            free(queue->records);
             free(queue);
         }
         if (log->fs != stderr && log->fs != stdout && log->fs > 0) {
@@ -89,99 +125,172 @@ log_s *log_init(log_levels_e level, const char *app_name, FILE *fs) {
     if (log == NULL) {
         debug_return NULL;
     }
-    queue = malloc(sizeof(log_queue_s));
+    queue = calloc(1, sizeof(log_queue_s));
     if (queue == NULL) {
         free(log);
         debug_return NULL;
     }
+    queue->records = calloc(LOG_QUEUE_LENGTH, sizeof(log_record_s));
+    if (queue->records == NULL) {
+        free(queue);
+        free(log);
+        debug_return NULL;
+    }
+    for (size_t i = 0; i < LOG_QUEUE_LENGTH; i++) {
+        atomic_init(&queue->records[i].sequence, i);
+    }
+    queue->mask = LOG_QUEUE_LENGTH - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    queue->dequeue_pos = 0;
+    atomic_init(&queue->dropped, 0);
+    atomic_init(&queue->sleeping, 0);
+    atomic_init(&queue->stop, false);
+    atomic_init(&queue->reopen_path, NULL);
 	memset(log, 0, sizeof(log_s) + len + 1);
     log->queue = queue;
-    queue->head = queue->tail = NULL;
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->cond, NULL);
-    queue->stop = false;
 	log->log_level = level;
 	log->pid = getpid();
 	log->app_name_len = len;
     log->app_name = (char *)log + sizeof(log_s);
     log->fs = fs;
 	memcpy((char *)log->app_name, (char *)app_name, len);
-    pthread_create(&queue->log_thread, NULL, writer, log);
+    if (pthread_create(&queue->log_thread, NULL, writer, log) != 0) {
+        free(queue->records);
+        free(queue);
+        free(log);
+        debug_return NULL;
+    }
 	debug_return log;
 }
 
 void log_write(log_s *log, log_levels_e level, const char *source_name, const int line_number, const char *format, ...) {
     debug_enter();
     va_list ap;
-	time_t raw_time;
-	struct tm tm;
-	struct tm *tm_ptr = &tm;
-    size_t len;
     if (log == NULL) {
         debug_return;
     }
-    output_s *output = malloc(sizeof(output_s));
-    if (output == NULL) {
-        perror("malloc failed");
+    size_t pos;
+    log_record_s *record = claim(log->queue, &pos);
+    if (record == NULL) {
         debug_return;
     }
-    // NOTE: This is a Linux specific call. It will not work on other platforms.
-    output->tid = syscall(__NR_gettid);
-    output->source = source_name;
-    output->line = line_number;
-    output->level = LEVELS[level];
-	time(&output->raw_time);
+    if (cached_tid == 0) {
+        // NOTE: This is a Linux specific call. It will not work on other platforms.
+        cached_tid = syscall(__NR_gettid);
+    }
+    record->raw = false;
+    record->tid = cached_tid;
+    record->source = source_name;
+    record->line = line_number;
+    record->level = level;
+	record->raw_time = time(NULL);
     va_start(ap, format);
-	len = vsnprintf(output->buffer, LOG_BUFFER_SIZE, format, ap);
-    output->buffer[len++] = '\n';
-    output->buffer[len] = '\0';
+	int len = vsnprintf(record->buffer, LOG_BUFFER_SIZE - 1, format, ap);
 	va_end(ap);
-    enqueue(log->queue, output);
+    publish(log->queue, record, pos, len);
     debug_return;
 }
 
-static void enqueue(log_queue_s *queue, output_s *output) {
-    output->next = NULL;
-    pthread_mutex_lock(&queue->mutex);
-    if (queue->tail != NULL) {
-        queue->tail->next = output;
-    } else {
-        queue->head = output;
+void log_write_raw(log_s *log, const char *format, ...) {
+    debug_enter();
+    va_list ap;
+    if (log == NULL) {
+        debug_return;
     }
-    queue->tail = output;
-    pthread_cond_signal(&queue->cond);
-    pthread_mutex_unlock(&queue->mutex);
+    size_t pos;
+    log_record_s *record = claim(log->queue, &pos);
+    if (record == NULL) {
+        debug_return;
+    }
+    record->raw = true;
+    va_start(ap, format);
+	int len = vsnprintf(record->buffer, LOG_BUFFER_SIZE - 1, format, ap);
+	va_end(ap);
+    publish(log->queue, record, pos, len);
+    debug_return;
 }
 
-static output_s *dequeue(log_queue_s *queue) {
-    pthread_mutex_lock(&queue->mutex);
-    while (queue->head == NULL && queue->stop == false) {
-        pthread_cond_wait(&queue->cond, &queue->mutex);
+int log_reopen(log_s *log, const char *path) {
+    debug_enter();
+    if (log == NULL || path == NULL) {
+        debug_return 1;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        debug_return 1;
     }
-    output_s *output = queue->head;
-    if (output != NULL) {
-        queue->head = output->next;
-        if (queue->head == NULL) {
-            queue->tail = NULL;
+    free(atomic_exchange(&log->queue->reopen_path, copy));
+    atomic_store(&log->queue->sleeping, 0);
+    syscall(SYS_futex, &log->queue->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    debug_return 0;
+}
+
+/**
+ * @brief Claims the next free record of the ring for the caller to fill in,
+ * or counts a dropped message and returns NULL if the ring is full.
+ */
+static log_record_s *claim(log_queue_s *queue, size_t *pos_ptr) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        log_record_s *record = &queue->records[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *pos_ptr = pos;
+                return record;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
         }
-    } else {
-        queue->head = queue->tail = NULL;
     }
-    pthread_mutex_unlock(&queue->mutex);
-    return output;
 }
 
-void *writer(void *arg) {
-    log_s *log = (log_s *)arg;
-    log_queue_s *queue = log->queue;
-    while (1) {
-        output_s *output = dequeue(queue);
-        if (output == NULL) {
+/**
+ * @brief Writes out up to LOG_BATCH_SIZE published records with one
+ * writev() and hands their slots back to the producers. Returns the number
+ * of records written.
+ */
+static size_t drain(log_s *log, log_queue_s *queue) {
+    static __thread time_t prefix_time = -1;
+    static __thread struct tm tm;
+    char prefix[LOG_BATCH_SIZE + 1][LOG_PREFIX_SIZE];
+    struct iovec iov[(LOG_BATCH_SIZE + 1) * 2];
+    int iovcnt = 0;
+    size_t count = 0;
+    unsigned long dropped = atomic_exchange_explicit(&queue->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        time_t now = time(NULL);
+        struct tm dtm;
+        gmtime_r(&now, &dtm);
+        int len = snprintf(prefix[LOG_BATCH_SIZE], LOG_PREFIX_SIZE, "%04i-%02i-%02i %02i:%02i:%02i  %s  % 6i  % 6i  %s  % 6i  %-5s  %lu log messages dropped, log queue full\n",
+            dtm.tm_year + 1900, dtm.tm_mon + 1, dtm.tm_mday, dtm.tm_hour, dtm.tm_min, dtm.tm_sec,
+            log->app_name, log->pid, log->pid, __FILE__, __LINE__, LEVELS[LOG_WARN], dropped);
+        iov[iovcnt].iov_base = prefix[LOG_BATCH_SIZE];
+        iov[iovcnt].iov_len = len < LOG_PREFIX_SIZE ? len : LOG_PREFIX_SIZE - 1;
+        iovcnt++;
+    }
+    size_t pos = queue->dequeue_pos;
+    while (count < LOG_BATCH_SIZE) {
+        log_record_s *record = &queue->records[(pos + count) & queue->mask];
+        if (atomic_load_explicit(&record->sequence, memory_order_acquire) != pos + count + 1) {
             break;
         }
-        struct tm tm;
-        gmtime_r(&output->raw_time, &tm);
-        fprintf(log->fs, "%04i-%02i-%02i %02i:%02i:%02i  %s  % 6i  % 6i  %s  % 6i  %-5s  ",
+        if (record->raw) {
+            iov[iovcnt].iov_base = record->buffer;
+            iov[iovcnt].iov_len = record->len;
+            iovcnt++;
+            count++;
+            continue;
+        }
+        if (record->raw_time != prefix_time) {
+            gmtime_r(&record->raw_time, &tm);
+            prefix_time = record->raw_time;
+        }
+        int len = snprintf(prefix[count], LOG_PREFIX_SIZE, "%04i-%02i-%02i %02i:%02i:%02i  %s  % 6i  % 6i  %s  % 6i  %-5s  ",
             tm.tm_year + 1900,
             tm.tm_mon + 1,
             tm.tm_mday,
@@ -190,13 +299,124 @@ void *writer(void *arg) {
             tm.tm_sec,
             log->app_name,
             log->pid,
-            output->tid,
-            output->source,
-            output->line,
-            output->level);
-        fputs(output->buffer, log->fs);
-        fflush(log->fs);
-        free(output);
+            record->tid,
+            record->source,
+            record->line,
+            LEVELS[record->level]);
+        iov[iovcnt].iov_base = prefix[count];
+        iov[iovcnt].iov_len = len < LOG_PREFIX_SIZE ? len : LOG_PREFIX_SIZE - 1;
+        iovcnt++;
+        iov[iovcnt].iov_base = record->buffer;
+        iov[iovcnt].iov_len = record->len;
+        iovcnt++;
+        count++;
+    }
+    if (iovcnt > 0) {
+        write_all(fileno(log->fs), iov, iovcnt);
+    }
+    for (size_t i = 0; i < count; i++) {
+        log_record_s *record = &queue->records[(pos + i) & queue->mask];
+        atomic_store_explicit(&record->sequence, pos + i + LOG_QUEUE_LENGTH, memory_order_release);
+    }
+    queue->dequeue_pos = pos + count;
+    return count;
+}
+
+/**
+ * @brief Terminates a filled record with a newline and hands it to the 
+ * writer.
+ */
+static void publish(log_queue_s *queue, log_record_s *record, size_t pos, int len) {
+    if (len < 0) {
+        len = 0;
+    } else if (len > LOG_BUFFER_SIZE - 2) {
+        len = LOG_BUFFER_SIZE - 2;
+    }
+    record->buffer[len++] = '\n';
+    record->len = len;
+    atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+    wake_writer(queue);
+}
+
+/**
+ * @brief Switches the log to the file requested by log_reopen(), if any. 
+ * Runs on the writer thread, between batches, so no lock is needed.
+ */
+static void reopen(log_s *log, log_queue_s *queue) {
+    char *path = atomic_exchange(&queue->reopen_path, NULL);
+    if (path == NULL) {
+        return;
+    }
+    FILE *fs = fopen(path, "a");
+    if (fs == NULL) {
+        fprintf(stderr, "unable to reopen log file %s: %s\n", path, strerror(errno));
+    } else {
+        if (log->fs != stderr && log->fs != stdout && log->fs != NULL) {
+            fclose(log->fs);
+        }
+        log->fs = fs;
+    }
+    free(path);
+}
+
+/**
+ * @brief Wakes the writer if it is waiting for records. Costs one atomic
+ * load when the writer is busy.
+ */
+static void wake_writer(log_queue_s *queue) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->sleeping, memory_order_relaxed) && atomic_exchange(&queue->sleeping, 0)) {
+        syscall(SYS_futex, &queue->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/**
+ * @brief writev() that retries on short writes and EINTR.
+ */
+static void write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+void *writer(void *arg) {
+    log_s *log = (log_s *)arg;
+    log_queue_s *queue = log->queue;
+    fflush(log->fs);
+    while (1) {
+        reopen(log, queue);
+        if (drain(log, queue) > 0) {
+            continue;
+        }
+        if (atomic_load(&queue->stop)) {
+            break;
+        }
+        atomic_store(&queue->sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        log_record_s *next = &queue->records[queue->dequeue_pos & queue->mask];
+        if (atomic_load_explicit(&next->sequence, memory_order_acquire) != queue->dequeue_pos + 1 &&
+            atomic_load_explicit(&queue->dropped, memory_order_relaxed) == 0 &&
+            atomic_load(&queue->reopen_path) == NULL &&
+            !atomic_load(&queue->stop)) {
+            struct timespec timeout = { .tv_sec = LOG_IDLE_TIMEOUT, .tv_nsec = 0 };
+            syscall(SYS_futex, &queue->sleeping, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0);
+        }
+        atomic_store(&queue->sleeping, 0);
     }
     return NULL;
 }
@@ -3,8 +3,10 @@
  * @author Warren Mann (warren@nonvol.io)
  * @brief To use the log module, include this file and define a global 
  * log_s. Initialize the log_s variable appropriately, then use the 
- * macros to log messages. See main.c for an example. The default maximum
- * message size is 2048 bytes.
+ * macros to log messages. See main.c for an example. The maximum message
+ * size is 1024 bytes; longer messages are truncated. Logging never blocks:
+ * if the writer falls behind by LOG_QUEUE_LENGTH messages, further messages
+ * are dropped and the number dropped is logged once the writer catches up.
  * @version 0.1.0
  * @date 2024-11-27
  * @copyright Copyright (c) 2024
@@ -16,8 +18,12 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+/**
+ * @brief Number of preallocated message records in the log queue. Must be a
+ * power of two.
+ */
 #ifndef LOG_QUEUE_LENGTH
-#define LOG_QUEUE_LENGTH 5
+#define LOG_QUEUE_LENGTH 4096
 #endif
 
 /**
@@ -155,4 +161,23 @@ extern void log_write(log_s *log,
     const char *format, 
     ...);
 
+/**
+ * @brief Write a line to the log exactly as formatted, without the date, 
+ * process, source and level prefix and regardless of the log level. For 
+ * logs with a record format of their own, such as the access log.
+ * @param log A pointer to a log_s initialized by log_init().
+ * @param format printf style format string.
+ * @param ... Arguments to be formatted by the format string.
+ */
+extern void log_write_raw(log_s *log, const char *format, ...);
+/**
+ * @brief Reopen the log file, for log rotation. The writer thread switches 
+ * to the new file between batches, so messages already queued go to
+ * whichever file is open when they are written.
+ * @param log A pointer to a log_s initialized by log_init().
+ * @param path Path of the file to append to.
+ * @return 0 if the request was queued.
+ */
+extern int log_reopen(log_s *log, const char *path);
+
 #endif // _LOG_H
@@ -7,9 +7,13 @@
  * @copyright Copyright (c) 2024
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <pthread.h>
@@ -18,17 +22,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "access.h"
 #include "cache.h"
 #include "config.h"
 #include "debug.h"
 #include "http.h"
+#include "limit.h"
 #include "log.h"
+#include "metrics.h"
 #include "option.h"
+#include "process.h"
 #include "request.h"
 #include "response.h"
+#include "tls.h"
+#include "trace.h"
+#include "worker.h"
 
 #define log_file_def stdout
 
@@ -45,12 +59,23 @@ static const char response_501_path_def[] = "/error/501.html";
 static const char cfg_filename[] = "nvhttpd.conf";
 static const char cfg_filename_primary[] = "/etc/nvhttpd/nvhttpd.conf";
 static const char pid_filename_def[] = "/var/run/nvhttpd.pid";
+static const char pid_oldbin_suffix[] = ".oldbin";
+static const char image_built_suffix[] = ".img";
+static const char listeners_env[] = "NVHTTPD_LISTENERS";
 static const char html_path_def[] = "html";
 static const int server_port_def = 80;
 static const int server_ssl_port_def = 443;
 static const char server_ip_def[] = "any";
 static const char server_string_def[] = "nvhttpd";
-const int max_threads = 100;
+static const int workers_def = 0;
+static const int processes_def = 0;
+static const int max_connections_def = 10000;
+static const int request_timeout_def = 10;
+static const int send_timeout_def = 30;
+static const int keepalive_timeout_def = 5;
+static const int keepalive_requests_def = 100;
+static const long sendfile_threshold_def = 1048576;
+static const long trace_sample_def = 1000;
 
 static const char const *strong_ciphers = 
     "ECDHE-ECDSA-AES256-GCM-SHA384:"
@@ -61,7 +86,20 @@ static const char const *strong_ciphers =
     "ECDHE-RSA-AES128-GCM-SHA256";
 
 volatile sig_atomic_t terminate = 0;
+volatile sig_atomic_t reopen = 0;
+volatile sig_atomic_t quit = 0;
+volatile sig_atomic_t upgrade = 0;
+
+extern char **environ;
 
+static option_s option_b = {
+    .name = "b",
+    .description = "Build a cache image of html_path into the given file and exit",
+    .arg_type = option_arg_required,
+    .value = NULL,
+    .validate = NULL,
+    .present = false
+};
 static option_s option_c = {
     .name = "c", 
     .description = "Specify /full/path/and/filename of config file", 
@@ -87,6 +125,7 @@ static option_s option_v = {
     .present = false
 };
 static option_s *options[] = {
+    &option_b,
     &option_c,
     &option_h,
     &option_v,
@@ -109,29 +148,98 @@ static char **response_headers_array = NULL;
 static size_t response_headers_count = 0;
 static size_t response_headers_size = 0;
 static size_t response_headers_total = 0;
+static cache_control_rule_s *cache_control_rules = NULL;
+static size_t cache_control_count = 0;
+static size_t cache_control_size = 0;
+static cache_mime_type_s *mime_types = NULL;
+static size_t mime_types_count = 0;
+static size_t mime_types_size = 0;
+static http_listen_s *listeners = NULL;
+static size_t listeners_count = 0;
+static size_t listeners_size = 0;
+static char *metrics_path = NULL;
+static bool metrics_everywhere = true;
+static char *trace_path = NULL;
+static long trace_sample = -1;
 static char *server_string = NULL;
 static FILE *log_file = NULL;
+static char *log_filename = NULL;
+static char *access_filename = NULL;
 static SSL_CTX *ssl_ctx = NULL;
 static char *ssl_cert_filename = NULL;
 static char *ssl_key_filename = NULL;
+static char *ssl_ecdsa_cert_filename = NULL;
+static char *ssl_ecdsa_key_filename = NULL;
+static long ssl_session_cache_size = TLS_SESSION_CACHE_SIZE_DEFAULT;
+static long ssl_session_timeout = TLS_SESSION_TIMEOUT_DEFAULT;
+static bool ssl_tickets = true;
+static long ssl_ticket_rotation = TLS_TICKET_ROTATION_DEFAULT;
+static bool ssl_ktls = true;
+static bool ssl_http2 = true;
 static bool ssl_enabled = false;
+static int workers = -1;
+static int processes = -1;
+static process_pin_e process_pin = PROCESS_PIN_NONE;
+static bool server_uring = false;
+static int process_slot = -1;
+static int max_connections = 0;
+static int request_timeout = -1;
+static int send_timeout = -1;
+static int keepalive_timeout = -1;
+static int keepalive_requests = -1;
+static long sendfile_threshold = -1;
+static long memory_budget = 0;
+static int limit_connections = 0;
+static double limit_rate = 0;
+static int limit_burst = 0;
+static int limit_clients = LIMIT_CLIENTS_DEFAULT;
+static int limit_ipv6_prefix = LIMIT_IPV6_PREFIX_DEFAULT;
+static bool compress = true;
+static bool cache_watch = true;
+static char *cache_image = NULL;
+static bool cache_image_built = false;
+static http_server_s *servers = NULL;
+static bool listeners_inherited = false;
+static char *exec_path = NULL;
+static char **exec_argv = NULL;
+static char *pid_oldbin = NULL;
+static pid_t upgrade_pid = 0;
+static sigset_t signal_mask;
 
+static int block_signals(void);
+static int build_image(const char *path);
+static void check_upgrade(void);
 static config_error_t config_handler(char *section, char *key, char *value);
 static int configure(int ac, char **av);
-static void *handle_client_request(void *arg);
+static bool etag_matches(const char *list, const char *etag);
+static int handle_client_request(http_client_s *client, request_s *request, http_response_s *response);
 static int handle_connections(http_server_s *server);
+static int handle_processes(void);
+static void hand_over(void);
+static int init_cache(void);
+static void init_fd_limit(void);
 static int init_signal_handlers(void);
 static int init_ssl(void);
+static int load_cache(void);
+static bool not_modified(request_s *request, cache_element_s *e, cache_encoding_e selected);
+static http_server_s *open_listeners(void);
+static int parse_listener(const char *value, http_listen_s *listener);
+static bool range_applies(request_s *request, cache_element_s *e, cache_encoding_e selected);
+static int run_worker_process(int slot, int log_fd);
+static cache_encoding_e select_encoding(request_s *request, cache_element_s *e);
+static int serve_report(http_client_s *client, request_s *request, http_response_s *response, const char *name, char *(*format)(size_t *len), const char *mime);
+static void sig_handler_child(int sig);
 static void sig_handler_ctlc(int sig);
 static void sig_handler_pipe(int sig);
+static void sig_handler_quit(int sig);
+static void sig_handler_reopen(int sig);
 static void sig_handler_reload(int sig);
-static pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int active_threads = 0;
+static void sig_handler_upgrade(int sig);
+static void start_upgrade(void);
 
 int main(int argc, char *argv[]) {
     debug_enter();
     int pid_file = -1;
-    http_server_s *server = NULL;
     int rc = 1;
     if (option_parse_args(options, argc, argv) != 0) {
         option_h.present = true;
@@ -150,6 +258,17 @@ int main(int argc, char *argv[]) {
     if (configure(argc, argv) != 0) {
         goto shutdown;
     }
+    if (option_b.present) {
+        // No pid file is written, so none may be removed at shutdown.
+        free(pid_filename);
+        pid_filename = NULL;
+        rc = build_image(option_b.value);
+        goto shutdown;
+    }
+    // Kept to execute the binary again on SIGUSR2, from where it is now, 
+    // so a new build installed over it is what runs.
+    exec_path = realpath("/proc/self/exe", NULL);
+    exec_argv = argv;
     pid_file = open(pid_filename, (O_CREAT | O_WRONLY | O_TRUNC), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (pid_file == -1) {
         fprintf(stderr, "unable to open pid file %s: %s\n", pid_filename, strerror(errno));
@@ -162,21 +281,56 @@ int main(int argc, char *argv[]) {
     }
     close(pid_file);
     pid_file = -1;
+    if (block_signals() != 0) {
+        goto shutdown;
+    }
     log = log_init(log_level, server_string, log_file);
     if (log == NULL) {
         fprintf(stderr, "log initialization failed\n");
         goto shutdown;
     }
     log_info(log, "starting up server");
-    if (cache_init() != 0) {
-        log_error(log, "cache initialization failed");
+    // Worker processes open the access log themselves, as the writer 
+    // thread of one opened here wouldn't be running in them.
+    if (processes == 0 && access_filename != NULL && access_init(access_filename, server_string) != 0) {
+        log_error(log, "unable to open access log %s: %s", access_filename, strerror(errno));
         goto shutdown;
     }
-    if (cache_load(html_path, log) != 0) {
+    if (processes > 0 && cache_image == NULL) {
+        // Worker processes share the cache by mapping one image of it, 
+        // which the master builds from html_path.
+        size_t len = strlen(pid_filename) + sizeof(image_built_suffix);
+        if ((cache_image = malloc(len)) == NULL) {
+            log_error(log, "malloc failed: %s", strerror(errno));
+            goto shutdown;
+        }
+        snprintf(cache_image, len, "%s%s", pid_filename, image_built_suffix);
+        cache_image_built = true;
+    }
+    if (init_cache() != 0) {
+        goto shutdown;
+    }
+    if (load_cache() != 0) {
         log_error(log, "cache load failed");
         goto shutdown;
     }
-    if (ssl_enabled) {
+    if (cache_image_built) {
+        log_info(log, "sharing %s with the worker processes as cache image %s, not watching it, reload with SIGUSR1", html_path, cache_image);
+    } else if (cache_image != NULL) {
+        log_info(log, "serving cache image %s, not watching %s", cache_image, html_path);
+    } else {
+        if (cache_watch && cache_watch_start(html_path, log) != 0) {
+            log_warn(log, "not watching %s for changes, reload with SIGUSR1", html_path);
+        }
+        if (memory_budget > 0 && cache_evict_start(html_path, log) != 0) {
+            log_warn(log, "not tracking hits, files past the memory budget stay out of memory");
+        }
+    }
+    bool ssl_needed = false;
+    for (size_t i = 0; i < listeners_count; i++) {
+        ssl_needed |= listeners[i].ssl;
+    }
+    if (ssl_needed) {
         if (init_ssl() != 0) {
             goto shutdown;
         }
@@ -187,14 +341,39 @@ int main(int argc, char *argv[]) {
     if (init_signal_handlers() != 0) {
         goto shutdown;
     }
-    server = http_init(log, ssl_ctx, html_path, server_ip, server_port);
-    log_info(log, "server listening on port %d", server_port);
-    if (server == NULL) {
+    init_fd_limit();
+    if (metrics_init((processes > 0 ? processes : 1) * worker_pool_size(workers)) != 0) {
+        log_error(log, "metrics initialization failed");
+        goto shutdown;
+    }
+    // Requests are only sampled when there is somewhere to read them.
+    if (trace_init((processes > 0 ? processes : 1) * worker_pool_size(workers), trace_path != NULL ? (unsigned)trace_sample : 0) != 0) {
+        log_error(log, "trace initialization failed");
+        goto shutdown;
+    }
+    limit_config_s limit_config = {
+        .connections = limit_connections,
+        .rate = limit_rate,
+        .burst = limit_burst,
+        .clients = limit_clients,
+        .ipv6_prefix = limit_ipv6_prefix,
+    };
+    if (limit_init(&limit_config) != 0) {
+        log_error(log, "limits initialization failed");
+        goto shutdown;
+    }
+    if (limit_connections > 0 || limit_rate > 0) {
+        log_info(log, "limiting each client to %d connections, %g new per second", limit_connections, limit_rate);
+    }
+    servers = open_listeners();
+    if (servers == NULL) {
         goto shutdown;
     }
-    rc = handle_connections(server);
+    rc = processes > 0 ? handle_processes() : handle_connections(servers);
 shutdown:
     debug("shutting down server with result code %d\n", rc);
+    cache_watch_stop();
+    cache_evict_stop();
     if (log != NULL) {
         log_info(log, "shutting down server with result code %d", rc);
     }
@@ -209,6 +388,16 @@ shutdown:
         }
         free(response_headers_array);
     }
+    for (size_t i = 0; i < cache_control_count; i++) {
+        free(cache_control_rules[i].match);
+        free(cache_control_rules[i].value);
+    }
+    free(cache_control_rules);
+    for (size_t i = 0; i < mime_types_count; i++) {
+        free(mime_types[i].extension);
+        free(mime_types[i].mime);
+    }
+    free(mime_types);
     if (response_501_path != NULL) {
         free(response_501_path);
     }
@@ -227,25 +416,119 @@ shutdown:
     if (server_ip != NULL) {
         free(server_ip);
     }
-    if (server != NULL) {
-        http_close(server);
+    http_close(servers);
+    for (size_t i = 0; i < listeners_count; i++) {
+        free(listeners[i].ip);
     }
+    free(listeners);
+    metrics_cleanup();
+    trace_cleanup();
+    limit_cleanup();
+    free(metrics_path);
+    free(trace_path);
     if (config_file != NULL) {
         free(config_file);
     }
+    tls_cleanup(ssl_ctx);
+    free(ssl_cert_filename);
+    free(ssl_key_filename);
+    free(ssl_ecdsa_cert_filename);
+    free(ssl_ecdsa_key_filename);
+    access_cleanup();
+    if (access_filename != NULL) {
+        free(access_filename);
+    }
+    if (log_filename != NULL) {
+        free(log_filename);
+    }
     if (log != NULL) {
         log_cleanup(log);
     }
     if (pid_file >= 0) {
         close(pid_file);
     }
+    // Once another server has taken over, the pid file and the cache image
+    // are its own.
+    if (cache_image_built && upgrade_pid == 0) {
+        unlink(cache_image);
+    }
+    free(cache_image);
     if (pid_filename != NULL) {
-        unlink(pid_filename);
+        unlink(upgrade_pid > 0 ? pid_oldbin : pid_filename);
         free(pid_filename);
     }
+    free(pid_oldbin);
+    free(exec_path);
     debug_return rc;
 }
 
+/**
+ * @brief Blocks the signals we handle in every thread but the main one. 
+ * Threads inherit the mask, so this must run before any are created. The 
+ * main thread waits for them with sigsuspend() in handle_connections(), or
+ * ppoll() in handle_processes().
+ */
+static int block_signals(void) {
+    debug_enter();
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGCHLD);
+    if (pthread_sigmask(SIG_BLOCK, &set, &signal_mask) != 0) {
+        fprintf(stderr, "unable to block signals: %s\n", strerror(errno));
+        debug_return 1;
+    }
+    debug_return 0;
+}
+
+/**
+ * @brief Loads html_path as the server would and writes it to a cache image
+ * at path, for [cache] image. Logs go to stderr.
+ */
+static int build_image(const char *path) {
+    debug_enter();
+    int rc = 1;
+    if ((log = log_init(log_level, server_string, stderr)) == NULL) {
+        fprintf(stderr, "log initialization failed\n");
+        debug_return 1;
+    }
+    if (init_cache() != 0) {
+        goto term;
+    }
+    if (cache_load(html_path, log) != 0) {
+        log_error(log, "cache load of %s failed", html_path);
+        goto term;
+    }
+    if (cache_image_write(path, log) != 0) {
+        goto term;
+    }
+    rc = 0;
+term:
+    debug_return rc;
+}
+
+/**
+ * @brief Reaps the server started by start_upgrade() if it exited without 
+ * taking over, and puts the pid file back so this one carries on.
+ */
+static void check_upgrade(void) {
+    debug_enter();
+    int status;
+    if (upgrade_pid <= 0 || quit || waitpid(upgrade_pid, &status, WNOHANG) != upgrade_pid) {
+        debug_return;
+    }
+    log_error(log, "upgrade failed, pid %d exited with status %d, carrying on", upgrade_pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    if (rename(pid_oldbin, pid_filename) != 0) {
+        log_warn(log, "unable to rename %s to %s: %s", pid_oldbin, pid_filename, strerror(errno));
+    }
+    upgrade_pid = 0;
+    debug_return;
+}
+
 static config_error_t config_handler(char *section, char *key, char *value) {
     config_error_t rc = CONFIG_ERROR_NONE;
     if (strcasecmp(section, "server") == 0) {
@@ -297,6 +580,77 @@ static config_error_t config_handler(char *section, char *key, char *value) {
                 rc = CONFIG_ERROR_NO_MEMORY;
                 goto term;
             }
+        } else if (strcasecmp(key, "workers") == 0) {
+            workers = atoi(value);
+        } else if (strcasecmp(key, "processes") == 0) {
+            char *end;
+            long n = strcasecmp(value, "auto") == 0 ? sysconf(_SC_NPROCESSORS_ONLN) : strtol(value, &end, 10);
+            if (strcasecmp(value, "auto") != 0 && (*value == '\0' || *end != '\0')) {
+                n = -1;
+            }
+            if (n < 0 || n > 4096) {
+                fprintf(stderr, "invalid value for server.processes: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+            processes = n;
+        } else if (strcasecmp(key, "pin") == 0) {
+            if (strcasecmp(value, "none") == 0) {
+                process_pin = PROCESS_PIN_NONE;
+            } else if (strcasecmp(value, "cpu") == 0) {
+                process_pin = PROCESS_PIN_CPU;
+            } else if (strcasecmp(value, "node") == 0) {
+                process_pin = PROCESS_PIN_NODE;
+            } else {
+                fprintf(stderr, "invalid value for server.pin: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "io") == 0) {
+            if (strcasecmp(value, "epoll") == 0) {
+                server_uring = false;
+            } else if (strcasecmp(value, "io_uring") == 0) {
+                server_uring = true;
+            } else {
+                fprintf(stderr, "invalid value for server.io: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "max_connections") == 0) {
+            max_connections = atoi(value);
+            if (max_connections <= 0) {
+                fprintf(stderr, "invalid value for server.max_connections: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "request_timeout") == 0) {
+            request_timeout = atoi(value);
+            if (request_timeout <= 0) {
+                fprintf(stderr, "invalid value for server.request_timeout: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "send_timeout") == 0) {
+            send_timeout = atoi(value);
+            if (send_timeout <= 0) {
+                fprintf(stderr, "invalid value for server.send_timeout: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "keepalive_timeout") == 0) {
+            keepalive_timeout = atoi(value);
+            if (keepalive_timeout <= 0) {
+                fprintf(stderr, "invalid value for server.keepalive_timeout: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "keepalive_requests") == 0) {
+            keepalive_requests = atoi(value);
+            if (keepalive_requests < 0) {
+                fprintf(stderr, "invalid value for server.keepalive_requests: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
         } else if (strcasecmp(key, "name") == 0) {
             server_string = strdup(value);
             if (server_string == NULL) {
@@ -306,6 +660,10 @@ static config_error_t config_handler(char *section, char *key, char *value) {
             }
         }
     } else if (strcasecmp(section, "response-headers") == 0) {
+        if (strcasecmp(key, "Connection") == 0) {
+            fprintf(stderr, "ignoring Connection response header, it is set per connection\n");
+            goto term;
+        }
         if (response_headers_array == NULL) {
             response_headers_size = 10;
             response_headers_array = malloc(response_headers_size * sizeof(char *));
@@ -334,6 +692,170 @@ static config_error_t config_handler(char *section, char *key, char *value) {
         }
         response_headers_total += snprintf(s, len, "%s: %s\r\n", key, value);
         response_headers_array[response_headers_count++] = s;
+    } else if (strcasecmp(section, "listeners") == 0) {
+        if (listeners_count == listeners_size) {
+            size_t size = listeners_size == 0 ? 4 : listeners_size << 1;
+            http_listen_s *tmp = realloc(listeners, size * sizeof(http_listen_s));
+            if (tmp == NULL) {
+                fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+                rc = CONFIG_ERROR_NO_MEMORY;
+                goto term;
+            }
+            listeners = tmp;
+            listeners_size = size;
+        }
+        if (parse_listener(value, &listeners[listeners_count]) != 0) {
+            fprintf(stderr, "invalid listener %s: %s\n", key, value);
+            rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+            goto term;
+        }
+        listeners_count++;
+    } else if (strcasecmp(section, "metrics") == 0) {
+        if (strcasecmp(key, "path") == 0) {
+            if (value[0] != '/') {
+                fprintf(stderr, "invalid value for metrics.path: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+            free(metrics_path);
+            metrics_path = strdup(value);
+            if (metrics_path == NULL) {
+                fprintf(stderr, "strdup failed: %s\n", strerror(errno));
+                rc = CONFIG_ERROR_NO_MEMORY;
+                goto term;
+            }
+        } else {
+            fprintf(stderr, "unrecognized metrics option: %s\n", key);
+            rc = CONFIG_ERROR_UNRECOGNIZED_SECTION;
+        }
+    } else if (strcasecmp(section, "trace") == 0) {
+        if (strcasecmp(key, "path") == 0) {
+            if (value[0] != '/') {
+                fprintf(stderr, "invalid value for trace.path: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+            free(trace_path);
+            trace_path = strdup(value);
+            if (trace_path == NULL) {
+                fprintf(stderr, "strdup failed: %s\n", strerror(errno));
+                rc = CONFIG_ERROR_NO_MEMORY;
+                goto term;
+            }
+        } else if (strcasecmp(key, "sample") == 0) {
+            char *end;
+            trace_sample = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || trace_sample < 0 || trace_sample > UINT_MAX) {
+                fprintf(stderr, "invalid value for trace.sample: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else {
+            fprintf(stderr, "unrecognized trace option: %s\n", key);
+            rc = CONFIG_ERROR_UNRECOGNIZED_SECTION;
+        }
+    } else if (strcasecmp(section, "limits") == 0) {
+        char *end;
+        if (strcasecmp(key, "rate") == 0) {
+            limit_rate = strtod(value, &end);
+            if (*value == '\0' || *end != '\0' || limit_rate < 0) {
+                fprintf(stderr, "invalid value for limits.rate: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "connections") == 0 || strcasecmp(key, "burst") == 0 || strcasecmp(key, "clients") == 0 || strcasecmp(key, "ipv6_prefix") == 0) {
+            bool prefix = strcasecmp(key, "ipv6_prefix") == 0;
+            long min = prefix || strcasecmp(key, "clients") == 0 ? 1 : 0;
+            long n = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || n < min || n > (prefix ? 128 : INT_MAX)) {
+                fprintf(stderr, "invalid value for limits.%s: %s\n", key, value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+            if (strcasecmp(key, "connections") == 0) {
+                limit_connections = n;
+            } else if (strcasecmp(key, "burst") == 0) {
+                limit_burst = n;
+            } else if (strcasecmp(key, "clients") == 0) {
+                limit_clients = n;
+            } else {
+                limit_ipv6_prefix = n;
+            }
+        } else {
+            fprintf(stderr, "unrecognized limits option: %s\n", key);
+            rc = CONFIG_ERROR_UNRECOGNIZED_SECTION;
+        }
+    } else if (strcasecmp(section, "cache-control") == 0) {
+        if (cache_control_count == cache_control_size) {
+            size_t size = cache_control_size == 0 ? 8 : cache_control_size << 1;
+            cache_control_rule_s *tmp = realloc(cache_control_rules, size * sizeof(cache_control_rule_s));
+            if (tmp == NULL) {
+                fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+                rc = CONFIG_ERROR_NO_MEMORY;
+                goto term;
+            }
+            cache_control_rules = tmp;
+            cache_control_size = size;
+        }
+        cache_control_rule_s *rule = &cache_control_rules[cache_control_count];
+        rule->match = strdup(key);
+        rule->value = strdup(value);
+        if (rule->match == NULL || rule->value == NULL) {
+            fprintf(stderr, "strdup failed: %s\n", strerror(errno));
+            free(rule->match);
+            free(rule->value);
+            rc = CONFIG_ERROR_NO_MEMORY;
+            goto term;
+        }
+        cache_control_count++;
+    } else if (strcasecmp(section, "mime-types") == 0) {
+        size_t key_len = strlen(key);
+        if (key_len == 0 || key_len >= CACHE_EXTENSION_MAX || strpbrk(key, "./") != NULL) {
+            fprintf(stderr, "invalid extension for mime-types: %s\n", key);
+            rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+            goto term;
+        }
+        int type_compress = -1;
+        size_t len = strlen(value);
+        const char *word = strrchr(value, ' ');
+        if (word != NULL && strcasecmp(word + 1, "compress") == 0) {
+            type_compress = 1;
+            len = word - value;
+        } else if (word != NULL && strcasecmp(word + 1, "nocompress") == 0) {
+            type_compress = 0;
+            len = word - value;
+        }
+        while (len > 0 && value[len - 1] == ' ') {
+            len--;
+        }
+        if (len == 0) {
+            fprintf(stderr, "invalid value for mime-types.%s: %s\n", key, value);
+            rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+            goto term;
+        }
+        if (mime_types_count == mime_types_size) {
+            size_t size = mime_types_size == 0 ? 8 : mime_types_size << 1;
+            cache_mime_type_s *tmp = realloc(mime_types, size * sizeof(cache_mime_type_s));
+            if (tmp == NULL) {
+                fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+                rc = CONFIG_ERROR_NO_MEMORY;
+                goto term;
+            }
+            mime_types = tmp;
+            mime_types_size = size;
+        }
+        cache_mime_type_s *type = &mime_types[mime_types_count];
+        type->extension = strdup(key);
+        type->mime = strndup(value, len);
+        type->compress = type_compress;
+        if (type->extension == NULL || type->mime == NULL) {
+            fprintf(stderr, "strdup failed: %s\n", strerror(errno));
+            free(type->extension);
+            free(type->mime);
+            rc = CONFIG_ERROR_NO_MEMORY;
+            goto term;
+        }
+        mime_types_count++;
     } else if (strcasecmp(section, "logging") == 0) {
         if (strcasecmp(key, "level") == 0) {
             if (strcasecmp(value, "error") == 0) {
@@ -365,6 +887,19 @@ static config_error_t config_handler(char *section, char *key, char *value) {
                     rc = CONFIG_ERROR_UNEXPECTED_VALUE;
                     goto term;
                 }
+                log_filename = strdup(value);
+                if (log_filename == NULL) {
+                    fprintf(stderr, "strdup failed: %s\n", strerror(errno));
+                    rc = CONFIG_ERROR_NO_MEMORY;
+                    goto term;
+                }
+            }
+        } else if (strcasecmp(key, "access_file") == 0) {
+            access_filename = strdup(value);
+            if (access_filename == NULL) {
+                fprintf(stderr, "strdup failed: %s\n", strerror(errno));
+                rc = CONFIG_ERROR_NO_MEMORY;
+                goto term;
             }
         } else if (strcasecmp(key, "pid") == 0) {
             pid_filename = strdup(value);
@@ -374,11 +909,90 @@ static config_error_t config_handler(char *section, char *key, char *value) {
                 goto term;
             }
         }
+    } else if (strcasecmp(section, "cache") == 0) {
+        if (strcasecmp(key, "sendfile_threshold") == 0) {
+            char *end;
+            sendfile_threshold = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || sendfile_threshold < 0) {
+                fprintf(stderr, "invalid value for cache.sendfile_threshold: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "memory") == 0) {
+            char *end;
+            memory_budget = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || memory_budget < 0) {
+                fprintf(stderr, "invalid value for cache.memory: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "watch") == 0) {
+            if (strcasecmp(value, "true") == 0 || strcasecmp(value, "1") == 0 || strcasecmp(value, "yes") == 0) {
+                cache_watch = true;
+            } else if (strcasecmp(value, "false") == 0 || strcasecmp(value, "0") == 0 || strcasecmp(value, "no") == 0) {
+                cache_watch = false;
+            } else {
+                fprintf(stderr, "invalid value for cache.watch: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else if (strcasecmp(key, "image") == 0) {
+            free(cache_image);
+            cache_image = strdup(value);
+            if (cache_image == NULL) {
+                fprintf(stderr, "strdup failed: %s\n", strerror(errno));
+                rc = CONFIG_ERROR_NO_MEMORY;
+                goto term;
+            }
+        } else if (strcasecmp(key, "compress") == 0) {
+            if (strcasecmp(value, "true") == 0 || strcasecmp(value, "1") == 0 || strcasecmp(value, "yes") == 0) {
+                compress = true;
+            } else if (strcasecmp(value, "false") == 0 || strcasecmp(value, "0") == 0 || strcasecmp(value, "no") == 0) {
+                compress = false;
+            } else {
+                fprintf(stderr, "invalid value for cache.compress: %s\n", value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+        } else {
+            fprintf(stderr, "unrecognized cache option: %s\n", key);
+            rc = CONFIG_ERROR_UNRECOGNIZED_SECTION;
+        }
     } else if (strcasecmp(section, "ssl") == 0) {
         if (strcasecmp(key, "certificate") == 0) {
             ssl_cert_filename = strdup(value);
         } else if (strcasecmp(key, "key") == 0) {
             ssl_key_filename = strdup(value);
+        } else if (strcasecmp(key, "ecdsa_certificate") == 0) {
+            ssl_ecdsa_cert_filename = strdup(value);
+        } else if (strcasecmp(key, "ecdsa_key") == 0) {
+            ssl_ecdsa_key_filename = strdup(value);
+        } else if (strcasecmp(key, "session_cache") == 0 || strcasecmp(key, "session_timeout") == 0 || strcasecmp(key, "ticket_rotation") == 0) {
+            char *end;
+            long n = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || n < 0) {
+                fprintf(stderr, "invalid value for ssl.%s: %s\n", key, value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
+            if (strcasecmp(key, "session_cache") == 0) {
+                ssl_session_cache_size = n;
+            } else if (strcasecmp(key, "session_timeout") == 0) {
+                ssl_session_timeout = n;
+            } else {
+                ssl_ticket_rotation = n;
+            }
+        } else if (strcasecmp(key, "tickets") == 0 || strcasecmp(key, "ktls") == 0 || strcasecmp(key, "http2") == 0) {
+            bool *flag = strcasecmp(key, "tickets") == 0 ? &ssl_tickets : strcasecmp(key, "ktls") == 0 ? &ssl_ktls : &ssl_http2;
+            if (strcasecmp(value, "true") == 0 || strcasecmp(value, "1") == 0 || strcasecmp(value, "yes") == 0) {
+                *flag = true;
+            } else if (strcasecmp(value, "false") == 0 || strcasecmp(value, "0") == 0 || strcasecmp(value, "no") == 0) {
+                *flag = false;
+            } else {
+                fprintf(stderr, "invalid value for ssl.%s: %s\n", key, value);
+                rc = CONFIG_ERROR_UNEXPECTED_VALUE;
+                goto term;
+            }
         } else if (strcasecmp(key, "enabled") == 0) {
             if (strcasecmp(value, "true") == 0 || strcasecmp(value, "1") == 0 || strcasecmp(value, "yes") == 0) {
                 ssl_enabled = true;
@@ -505,13 +1119,62 @@ static int configure(int ac, char **av) {
             goto finish;
         }
     }
+    if (processes < 0) {
+        processes = processes_def;
+    }
+    // Worker processes are the unit spread across the CPUs, so each runs
+    // a single worker unless told otherwise.
+    if (workers < 0 || (processes > 0 && workers == 0)) {
+        workers = processes > 0 ? 1 : workers_def;
+    }
+    if (max_connections == 0) {
+        max_connections = max_connections_def;
+    }
+    if (request_timeout < 0) {
+        request_timeout = request_timeout_def;
+    }
+    if (send_timeout < 0) {
+        send_timeout = send_timeout_def;
+    }
+    if (keepalive_timeout < 0) {
+        keepalive_timeout = keepalive_timeout_def;
+    }
+    if (keepalive_requests < 0) {
+        keepalive_requests = keepalive_requests_def;
+    }
+    if (sendfile_threshold < 0) {
+        sendfile_threshold = sendfile_threshold_def;
+    }
+    if (trace_sample < 0) {
+        trace_sample = trace_sample_def;
+    }
     if (server_port == 0) {
-        if (ssl_ctx != NULL) {
+        if (ssl_enabled) {
             server_port = server_ssl_port_def;
         } else {
             server_port = server_port_def;
         }
     }
+    // Without a [listeners] section the server listens where [server] and
+    // [SSL] say, as it always has.
+    if (listeners_count == 0) {
+        listeners = calloc(1, sizeof(http_listen_s));
+        if (listeners == NULL || (listeners[0].ip = strdup(server_ip)) == NULL) {
+            fprintf(stderr, "malloc failed: %s", strerror(errno));
+            goto finish;
+        }
+        listeners[0].port = server_port;
+        listeners[0].ssl = ssl_enabled;
+        listeners_count = 1;
+        listeners_size = 1;
+    }
+    // Once any listener is marked admin, metrics and traces are only 
+    // served there.
+    for (size_t i = 0; i < listeners_count; i++) {
+        if (listeners[i].admin) {
+            metrics_everywhere = false;
+        }
+    }
     if (response_headers_array != NULL && response_headers_count > 0) {
         response_headers = malloc(response_headers_total + 1);
         if (response_headers == NULL) {
@@ -538,31 +1201,70 @@ finish:
     debug_return rc;
 }
 
-static void *handle_client_request(void *arg) {
+/**
+ * @brief Checks an If-None-Match list against an entity tag, ignoring weak
+ * prefixes. "*" matches any tag.
+ */
+static bool etag_matches(const char *list, const char *etag) {
     debug_enter();
-    char *header = NULL;
-    if (arg == NULL) {
-        debug_return NULL;
+    size_t etag_len = strlen(etag);
+    const char *p = list;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (*p == '*') {
+            debug_return true;
+        }
+        if (p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        if (*p != '"') {
+            break;
+        }
+        const char *close = strchr(p + 1, '"');
+        if (close == NULL) {
+            break;
+        }
+        size_t len = close + 1 - p;
+        if (len == etag_len && memcmp(p, etag, len) == 0) {
+            debug_return true;
+        }
+        p = close + 1;
     }
-    http_client_s *client = (http_client_s *)arg;
-    cache_element_s cache_element;
-    cache_element_s *e;
+    debug_return false;
+}
+
+static int handle_client_request(http_client_s *client, request_s *request, http_response_s *response) {
+    debug_enter();
+    int rc = 1;
+    cache_element_s *e = NULL;
     const char const *path = NULL;
+    const char *mime = "text/plain";
     request_parse_error_e parse_error;
     http_response_code_e code;
     log_s *log = client->server->log;
-    log_info(log, "handling new client connection from %s", client->ip);
-    request_s *request = request_get(client);
-    http_variable_s *var = request->headers;
-    if (request == NULL) {
-        parse_error = REQUEST_PARSE_INTERNAL;
-    } else {
-        parse_error = request_parse(request);
-    }
+    log_info(log, "handling new client request from %s", client->ip);
+    parse_error = request_parse(request);
+    struct timespec parsed;
+    clock_gettime(CLOCK_MONOTONIC, &parsed);
+    metrics_time(METRICS_STAGE_PARSE, &client->request_start, &parsed);
+    trace_point(&client->trace, TRACE_PARSE);
     if (parse_error == REQUEST_PARSE_OK) {
+        if (metrics_path != NULL && (metrics_everywhere || client->server->admin) && strcmp(request->uri, metrics_path) == 0) {
+            rc = serve_report(client, request, response, "metrics", metrics_format, "text/plain; version=0.0.4");
+            goto terminate;
+        }
+        if (trace_path != NULL && (metrics_everywhere || client->server->admin) && strcmp(request->uri, trace_path) == 0) {
+            rc = serve_report(client, request, response, "trace", trace_format, "text/plain; charset=UTF-8");
+            goto terminate;
+        }
         code = HTTP_RESPONSE_200;
         path = request->uri;
     } else {
+        if (parse_error != REQUEST_PARSE_IO_ERROR) {
+            metrics_add(METRICS_PARSE_ERRORS, 1);
+        }
         switch (parse_error) {
             case REQUEST_PARSE_BAD:
                 log_info(log, "returning 400");
@@ -583,110 +1285,291 @@ static void *handle_client_request(void *arg) {
                 break;
         }
     }
-    if (path != NULL) {
-        if ((e = cache_find(path)) == NULL) {
-            log_error(client->server->log, "cache find failed");
-            if (code == HTTP_RESPONSE_200) {
-                code = HTTP_RESPONSE_404;
-                path = response_404_path;
-                e = cache_find(path);
-            }
-        }
-    }
-    if (e == NULL) {
-        e = malloc(sizeof(cache_element_s));
-        e->data = (char *)response_code_str[code];
-        e->hash = 0;
-        e->len = strlen(cache_element.data);
-        e->mime = "text/plain";
-        e->next = NULL;
-    }
-    size_t header_len = 0;
-    size_t out_len = 0;
-    size_t data_len = (request->method == REQUEST_METHOD_GET) ? e->len : 0;
-    header = http_response_header(code, data_len, e->mime, response_headers, &header_len);
-    out_len = header_len + data_len;
-    char *output = malloc(out_len);
-    if (output == NULL) {
-        log_error(log, "Error allocating %d bytes: %s", out_len, strerror(errno));
-        goto terminate;
-    }
-    memcpy(output, header, header_len);
-    if (data_len > 0) {
-        memcpy(output + header_len, e->data, data_len);
-    }
-    free(e);
-    debug("sending http response: %*s\n", out_len, output);
-    size_t offset = 0;
-    while (out_len > 0) {
-        debug("out_len = %d, offset = %d\n", out_len, offset);
-        size_t sent = http_write(client, output + offset, out_len);
-        debug("sent = %d\n", sent);
-        if (sent < 1) {
-            log_error(log, "Error sending header to client %s: %s", client->ip, strerror(errno));
+    if (code == HTTP_RESPONSE_200) {
+        // A path not in the cache resolves to the 404 page in the same 
+        // lookup.
+        bool found;
+        e = cache_resolve(path, &found);
+        if (!found) {
+            log_info(log, "returning 404 for %s", path);
+            code = HTTP_RESPONSE_404;
+        }
+    } else if (path != NULL && (e = cache_find(path)) == NULL) {
+        log_error(log, "cache find failed for %s", path);
+    }
+    if (parse_error == REQUEST_PARSE_OK) {
+        metrics_add(code == HTTP_RESPONSE_200 ? METRICS_CACHE_HITS : METRICS_CACHE_MISSES, 1);
+    }
+    response->request = request;
+    response->code = code;
+    response->element = e;
+    response->fd = -1;
+    const char *entity_header = NULL;
+    size_t entity_header_len = 0;
+    if (e != NULL) {
+        cache_encoding_e selected = CACHE_ENCODING_IDENTITY;
+        cache_element_s *body = e;
+        if (parse_error == REQUEST_PARSE_OK) {
+            selected = select_encoding(request, e);
+            if ((response->variant = cache_variant(e, selected)) != NULL) {
+                debug("sending %s variant of %s\n", cache_encoding_str[selected], e->path);
+                body = response->variant;
+            } else {
+                selected = CACHE_ENCODING_IDENTITY;
+            }
+        }
+        response->body = body->data;
+        response->body_len = body->len;
+        response->fd = body->fd;
+        entity_header = e->headers[selected];
+        entity_header_len = e->headers_len[selected];
+        mime = e->mime;
+        if (code == HTTP_RESPONSE_200 && not_modified(request, e, selected)) {
+            // The entity headers are the ones a 200 would carry, which is
+            // what a 304 should send; only the body is left out.
+            code = HTTP_RESPONSE_304;
+            response->code = code;
+            response->body_len = 0;
+            response->fd = -1;
+        } else if (code == HTTP_RESPONSE_200 && request->method == REQUEST_METHOD_GET && range_applies(request, e, selected)) {
+            request_range_s ranges[REQUEST_RANGES_MAX];
+            int count = request_ranges(request, response->body_len, ranges);
+            if (count > 0) {
+                if (response_set_ranges(response, entity_header, entity_header_len, mime, ranges, count, &entity_header_len) != 0) {
+                    log_error(log, "Error building range response: %s", strerror(errno));
+                    goto terminate;
+                }
+                code = HTTP_RESPONSE_206;
+                response->code = code;
+                entity_header = response->header;
+            } else if (count < 0) {
+                char additional[(response_headers != NULL ? strlen(response_headers) : 0) + 64];
+                snprintf(additional, sizeof(additional), "Content-Range: bytes */%zu\r\n%s", response->body_len, response_headers != NULL ? response_headers : "");
+                code = HTTP_RESPONSE_416;
+                response->code = code;
+                response->body = response_code_str[code];
+                response->body_len = strlen(response->body);
+                response->fd = -1;
+                mime = "text/plain";
+                response->header = response_entity_header(mime, response->body_len, NULL, false, additional, &entity_header_len);
+                if (response->header == NULL) {
+                    log_error(log, "Error building response header: %s", strerror(errno));
+                    goto terminate;
+                }
+                entity_header = response->header;
+            }
+        }
+    } else {
+        response->body = response_code_str[code];
+        response->body_len = strlen(response->body);
+    }
+    if (entity_header == NULL) {
+        response->header = response_entity_header(mime, response->body_len, NULL, false, response_headers, &entity_header_len);
+        if (response->header == NULL) {
+            log_error(log, "Error building response header: %s", strerror(errno));
             goto terminate;
         }
-        out_len -= sent;
-        offset += sent;
+        entity_header = response->header;
     }
-    terminate:
-    if (header != NULL) {
-        free(header);
+    if (request->method == REQUEST_METHOD_HEAD) {
+        response->body_len = 0;
     }
-    request_free(request);
-    http_client_close(client);
-    pthread_mutex_lock(&thread_mutex);
-    active_threads--;
-    pthread_mutex_unlock(&thread_mutex);
-    log_debug(log, "Thread terminated, active threads: %d", active_threads);
-    debug_return NULL;
+    client->keep_alive = parse_error == REQUEST_PARSE_OK && client->requests + 1 < keepalive_requests && request_keep_alive(request);
+    response_set_header(response, code, entity_header, entity_header_len, client->keep_alive);
+    struct timespec found;
+    clock_gettime(CLOCK_MONOTONIC, &found);
+    metrics_time(METRICS_STAGE_LOOKUP, &parsed, &found);
+    trace_point(&client->trace, TRACE_LOOKUP);
+    rc = 0;
+terminate:
+    debug_return rc;
 }
 
+/**
+ * @brief Starts the worker pool and then waits for signals: SIGUSR1 reloads
+ * the cache, SIGHUP reopens the log files after rotation, SIGINT shuts the
+ * server down, SIGQUIT shuts it down once the open connections are done 
+ * and SIGUSR2 starts a new server to take over. Also runs each worker 
+ * process, which leaves the log and upgrades to the master.
+ */
 static int handle_connections(http_server_s *server) {
     debug_enter();
     int rc = 1;
+    bool draining = false;
+    worker_config_s config = {
+        .workers = workers,
+        .metrics_base = process_slot >= 0 ? process_slot * worker_pool_size(workers) : 0,
+        .max_connections = max_connections,
+        .request_timeout = request_timeout,
+        .send_timeout = send_timeout,
+        .keepalive_timeout = keepalive_timeout,
+        .uring = server_uring,
+    };
+    worker_pool_s *pool = worker_pool_start(server, &config, handle_client_request);
+    if (pool == NULL) {
+        log_error(server->log, "unable to start workers");
+        debug_return rc;
+    }
+    if (process_slot < 0) {
+        hand_over();
+    }
     while (!terminate) {
-        http_client_s *client = http_accept(server);
-        if (client != NULL) {
-            pthread_attr_t attr;
-            if (pthread_attr_init(&attr) != 0) {
-                log_error(server->log, "pthread_attr_init failed: %s", strerror(errno));
-                http_client_close(client);
-                continue;
-            }
-            if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0) {
-                log_error(server->log, "pthread_attr_setdetachstate failed: %s", strerror(errno));
-                pthread_attr_destroy(&attr);
-                http_client_close(client);
-                continue;
-            }
-            pthread_t thread_id;
-            pthread_mutex_lock(&thread_mutex); // Add a mutex to protect active_threads
-            if (active_threads >= max_threads) {
-                log_warn(server->log, "Max threads (%d) reached, rejecting connection from %s", max_threads, client->ip);
-                http_client_close(client);
-                pthread_mutex_unlock(&thread_mutex);
-                continue;
-            }
-            active_threads++;
-            pthread_mutex_unlock(&thread_mutex);
-            if (pthread_create(&thread_id, &attr, handle_client_request, (void *)client) != 0) {
-                log_error(server->log, "pthread_create failed: %s", strerror(errno));
-                pthread_mutex_lock(&thread_mutex);
-                active_threads--;
-                pthread_mutex_unlock(&thread_mutex);
-                http_client_close(client);
-            } else {
-                log_debug(server->log, "Thread created for client %s, active threads: %d", client->ip, active_threads);
+        if (!draining) {
+            sigsuspend(&signal_mask);
+        } else if (worker_pool_drained(pool)) {
+            break;
+        } else {
+            struct timespec ts = {.tv_sec = 0, .tv_nsec = 100000000};
+            ppoll(NULL, 0, &ts, &signal_mask);
+        }
+        if (reload) {
+            reload = 0;
+            if (load_cache() != 0) {
+                log_error(server->log, "cache reload failed");
+            }
+        }
+        if (reopen) {
+            reopen = 0;
+            if (log_filename != NULL && process_slot < 0) {
+                log_reopen(server->log, log_filename);
+            }
+            access_reopen();
+            log_info(server->log, "log files reopened");
+        }
+        if (quit && !draining) {
+            draining = true;
+            log_info(server->log, "finishing open connections");
+            worker_pool_drain(pool);
+        }
+        if (upgrade) {
+            upgrade = 0;
+            if (process_slot < 0) {
+                start_upgrade();
             }
-            pthread_attr_destroy(&attr);
         }
+        check_upgrade();
     }
+    worker_pool_stop(pool);
     rc = 0;
-shutdown:
     debug_return rc;
 }
 
+/**
+ * @brief Starts the worker processes and then waits for signals as 
+ * handle_connections() does, passing reloads and log reopens on to the 
+ * workers, while copying their log lines and replacing any that exit.
+ */
+static int handle_processes(void) {
+    debug_enter();
+    bool draining = false;
+    process_config_s config = {
+        .processes = processes,
+        .threads = worker_pool_size(workers),
+        .pin = process_pin,
+    };
+    process_pool_s *pool = process_pool_start(&config, run_worker_process, log);
+    if (pool == NULL) {
+        log_error(log, "unable to start worker processes");
+        debug_return 1;
+    }
+    hand_over();
+    while (!terminate) {
+        process_pool_wait(pool, &signal_mask);
+        if (reload) {
+            reload = 0;
+            if (load_cache() != 0) {
+                log_error(log, "cache reload failed");
+            } else {
+                process_pool_signal(pool, SIGUSR1);
+            }
+        }
+        if (reopen) {
+            reopen = 0;
+            if (log_filename != NULL) {
+                log_reopen(log, log_filename);
+            }
+            process_pool_signal(pool, SIGHUP);
+            log_info(log, "log files reopened");
+        }
+        if (quit && !draining) {
+            draining = true;
+            log_info(log, "finishing open connections");
+            process_pool_drain(pool);
+        }
+        if (draining && process_pool_running(pool) == 0) {
+            break;
+        }
+        if (upgrade) {
+            upgrade = 0;
+            start_upgrade();
+        }
+        check_upgrade();
+    }
+    process_pool_stop(pool);
+    debug_return 0;
+}
+
+/**
+ * @brief Once a server started by SIGUSR2 is serving on the listeners it 
+ * inherited, tells the one that started it to finish up and exit.
+ */
+static void hand_over(void) {
+    debug_enter();
+    if (listeners_inherited) {
+        log_info(log, "taking over from pid %d", getppid());
+        kill(getppid(), SIGQUIT);
+    }
+    debug_return;
+}
+
+/**
+ * @brief Initializes the cache module with the configured settings.
+ */
+static int init_cache(void) {
+    debug_enter();
+    cache_config_s cache_config = {
+        .sendfile_threshold = (size_t)sendfile_threshold,
+        .memory_budget = (size_t)memory_budget,
+        .compress = compress,
+        .headers = response_headers,
+        .cache_control = cache_control_rules,
+        .cache_control_count = cache_control_count,
+        .not_found = response_404_path,
+        .mime_types = mime_types,
+        .mime_types_count = mime_types_count
+    };
+    if (cache_init(&cache_config) != 0) {
+        log_error(log, "cache initialization failed");
+        debug_return 1;
+    }
+    debug_return 0;
+}
+
+/**
+ * @brief Each connection holds a descriptor, so raise the soft limit on open
+ * files to the hard limit.
+ */
+static void init_fd_limit(void) {
+    debug_enter();
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        log_warn(log, "getrlimit failed: %s", strerror(errno));
+        debug_return;
+    }
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            log_warn(log, "setrlimit failed: %s", strerror(errno));
+            debug_return;
+        }
+    }
+    log_debug(log, "open file limit is %ld", (long)rl.rlim_cur);
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (rlim_t)max_connections + 64) {
+        log_warn(log, "open file limit %ld is below max_connections %d", (long)rl.rlim_cur, max_connections);
+    }
+    debug_return;
+}
+
 static int init_signal_handlers(void) {
     debug_enter();
     struct sigaction sa;
@@ -711,6 +1594,34 @@ static int init_signal_handlers(void) {
         log_error(log, "reload signal initialization failed: %s", strerror(errno));
         debug_return 1;
     }
+    sa.sa_handler = sig_handler_reopen;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGHUP, &sa, NULL) == -1) {
+        log_error(log, "reopen signal initialization failed: %s", strerror(errno));
+        debug_return 1;
+    }
+    sa.sa_handler = sig_handler_quit;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGQUIT, &sa, NULL) == -1) {
+        log_error(log, "quit signal initialization failed: %s", strerror(errno));
+        debug_return 1;
+    }
+    sa.sa_handler = sig_handler_upgrade;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+        log_error(log, "upgrade signal initialization failed: %s", strerror(errno));
+        debug_return 1;
+    }
+    sa.sa_handler = sig_handler_child;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        log_error(log, "child signal initialization failed: %s", strerror(errno));
+        debug_return 1;
+    }
     debug_return 0;
 }
 
@@ -718,46 +1629,325 @@ static int init_ssl(void) {
     debug_enter();
     debug("ssl enabled\n");
     log_info(log, "ssl enabled");
-    if (ssl_cert_filename == NULL) {
-        log_error(log, "ssl certificate filename not specified");
-        debug_return 1;
-    }
-    if (ssl_key_filename == NULL) {
-        log_error(log, "ssl key filename not specified");
-        debug_return 1;
-    }
     SSL_library_init();
     SSL_load_error_strings();
     OpenSSL_add_all_algorithms();
-    ERR_clear_error();
-    if (!(ssl_ctx = SSL_CTX_new(TLS_server_method()))) {
-        log_error(log, "failed to initialize ssl context: %s", ERR_reason_error_string(ERR_get_error()));
+    tls_config_s config = {
+        .certificate = ssl_cert_filename,
+        .key = ssl_key_filename,
+        .ecdsa_certificate = ssl_ecdsa_cert_filename,
+        .ecdsa_key = ssl_ecdsa_key_filename,
+        .ciphers = strong_ciphers,
+        .session_cache_size = ssl_session_cache_size,
+        .session_timeout = ssl_session_timeout,
+        .tickets = ssl_tickets,
+        .ticket_rotation = ssl_ticket_rotation,
+        .ktls = ssl_ktls,
+        .http2 = ssl_http2,
+    };
+    if ((ssl_ctx = tls_init(&config, log)) == NULL) {
         debug_return 1;
     }
-    SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
-    ERR_clear_error();
-    if (!SSL_CTX_set_cipher_list(ssl_ctx, strong_ciphers)) {
-        log_error(log, "failed to set strong cipher list: %s", ERR_reason_error_string(ERR_get_error()));
-        debug_return 1;
+    debug_return 0;
+}
+
+/**
+ * @brief Loads the cache from the configured image, or from html_path if 
+ * there is none. Used at startup and on reload. When the image is built 
+ * for the worker processes, the master builds it from html_path first; a
+ * worker only maps it.
+ */
+static int load_cache(void) {
+    debug_enter();
+    if (cache_image_built && process_slot < 0) {
+        if (cache_load(html_path, log) != 0 || cache_image_write(cache_image, log) != 0) {
+            debug_return 1;
+        }
+    }
+    if (cache_image != NULL) {
+        debug_return cache_image_load(cache_image, log);
+    }
+    debug_return cache_load(html_path, log);
+}
+
+/**
+ * @brief Checks whether the client's conditional request headers show its 
+ * copy of the representation is current. If-None-Match is evaluated with 
+ * the weak comparison RFC 9110 requires for GET and HEAD; If-Modified-Since
+ * is only consulted when If-None-Match is absent.
+ */
+static bool not_modified(request_s *request, cache_element_s *e, cache_encoding_e selected) {
+    debug_enter();
+    if (request->method != REQUEST_METHOD_GET && request->method != REQUEST_METHOD_HEAD) {
+        debug_return false;
+    }
+    const char *value = request_header(request, REQUEST_HEADER_IF_NONE_MATCH);
+    if (value != NULL) {
+        debug_return etag_matches(value, e->etag[selected]);
+    }
+    value = request_header(request, REQUEST_HEADER_IF_MODIFIED_SINCE);
+    if (value == NULL) {
+        debug_return false;
+    }
+    // Clients usually echo Last-Modified back verbatim.
+    if (strcmp(value, e->last_modified) == 0) {
+        debug_return true;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        debug_return false;
+    }
+    time_t since = timegm(&tm);
+    debug_return since != (time_t)-1 && since <= time(NULL) && e->mtime <= since;
+}
+
+/**
+ * @brief Opens every configured listener, one socket per worker for 
+ * SO_REUSEPORT listeners, and returns them as a list in configuration 
+ * order, or NULL on error. A server started by SIGUSR2 is given the 
+ * sockets of the one it replaces, in the same order, in NVHTTPD_LISTENERS
+ * and uses those instead, so no connection is refused while both run.
+ */
+static http_server_s *open_listeners(void) {
+    debug_enter();
+    http_server_s *head = NULL;
+    http_server_s **tail = &head;
+    int shards = (processes > 0 ? processes : 1) * worker_pool_size(workers);
+    const char *inherited = getenv(listeners_env);
+    const char *next = inherited;
+    for (size_t i = 0; i < listeners_count; i++) {
+        http_listen_s *listener = &listeners[i];
+        for (int shard = 0; shard < (listener->reuseport ? shards : 1); shard++) {
+            int fd = -1;
+            if (inherited != NULL) {
+                char *end;
+                long n = strtol(next, &end, 10);
+                if (end == next || n < 0 || n > INT_MAX || (*end != ',' && *end != '\0')) {
+                    log_error(log, "inherited listeners %s don't match the configured ones", inherited);
+                    http_close(head);
+                    debug_return NULL;
+                }
+                fd = (int)n;
+                next = *end == ',' ? end + 1 : end;
+            }
+            http_server_s *server = http_init(log, listener->ssl ? ssl_ctx : NULL, html_path, listener, listener->reuseport ? shard : -1, fd);
+            if (server == NULL) {
+                http_close(head);
+                debug_return NULL;
+            }
+            *tail = server;
+            tail = &server->next;
+        }
+        log_info(log, "server listening on %s port %d%s%s%s", listener->ip, listener->port, listener->ssl ? " with ssl" : "", listener->reuseport ? ", one socket per worker" : "", inherited != NULL ? ", inherited" : "");
+    }
+    if (inherited != NULL) {
+        if (*next != '\0') {
+            log_error(log, "inherited listeners %s don't match the configured ones", inherited);
+            http_close(head);
+            debug_return NULL;
+        }
+        listeners_inherited = true;
+        unsetenv(listeners_env);
+    }
+    debug_return head;
+}
+
+/**
+ * @brief Parses a listener: an address and port, "any:80", "[::]:443" or
+ * just "80" for every IPv4 address, followed by any of the options ssl, 
+ * reuseport, admin, backlog=N, defer_accept=N and fastopen=N, separated by
+ * spaces. Returns 0 on success.
+ */
+static int parse_listener(const char *value, http_listen_s *listener) {
+    debug_enter();
+    memset(listener, 0, sizeof(http_listen_s));
+    size_t len = strcspn(value, " \t");
+    char address[len + 1];
+    memcpy(address, value, len);
+    address[len] = '\0';
+    const char *ip = server_ip_def;
+    char *port = address;
+    if (address[0] == '[') {
+        char *close = strchr(address, ']');
+        if (close == NULL || close[1] != ':') {
+            debug_return 1;
+        }
+        *close = '\0';
+        ip = address + 1;
+        port = close + 2;
+    } else if ((port = strrchr(address, ':')) != NULL) {
+        *port++ = '\0';
+        ip = address;
+    } else {
+        port = address;
     }
-    ERR_clear_error();
-    if (SSL_CTX_use_certificate_file(ssl_ctx, ssl_cert_filename, SSL_FILETYPE_PEM) <= 0) {
-        log_error(log, "failed to load ssl cert %s: %s", ssl_cert_filename, ERR_reason_error_string(ERR_get_error()));
+    char *end;
+    long n = strtol(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || n <= 0 || n > 65535) {
         debug_return 1;
     }
-    ERR_clear_error();
-    if (SSL_CTX_use_PrivateKey_file(ssl_ctx, ssl_key_filename, SSL_FILETYPE_PEM) <= 0) {
-        log_error(log, "failed to load ssl key %s: %s", ssl_key_filename, ERR_reason_error_string(ERR_get_error()));
+    listener->port = n;
+    for (const char *cp = value + len; *cp != '\0'; ) {
+        cp += strspn(cp, " \t");
+        size_t option_len = strcspn(cp, " \t");
+        if (option_len == 0) {
+            break;
+        }
+        const char *eq = memchr(cp, '=', option_len);
+        size_t name_len = eq != NULL ? (size_t)(eq - cp) : option_len;
+        int *number = NULL;
+        if (name_len == 3 && strncasecmp(cp, "ssl", 3) == 0 && eq == NULL) {
+            listener->ssl = true;
+        } else if (name_len == 9 && strncasecmp(cp, "reuseport", 9) == 0 && eq == NULL) {
+            listener->reuseport = true;
+        } else if (name_len == 5 && strncasecmp(cp, "admin", 5) == 0 && eq == NULL) {
+            listener->admin = true;
+        } else if (name_len == 7 && strncasecmp(cp, "backlog", 7) == 0) {
+            number = &listener->backlog;
+        } else if (name_len == 12 && strncasecmp(cp, "defer_accept", 12) == 0) {
+            number = &listener->defer_accept;
+        } else if (name_len == 8 && strncasecmp(cp, "fastopen", 8) == 0) {
+            number = &listener->fastopen;
+        } else {
+            debug_return 1;
+        }
+        if (number != NULL) {
+            if (eq == NULL) {
+                debug_return 1;
+            }
+            n = strtol(eq + 1, &end, 10);
+            if (end != cp + option_len || end == eq + 1 || n < 0 || n > 65535) {
+                debug_return 1;
+            }
+            *number = n;
+        }
+        cp += option_len;
+    }
+    listener->ip = strdup(strcasecmp(ip, "any") == 0 ? server_ip_def : ip);
+    debug_return listener->ip != NULL ? 0 : 1;
+}
+
+/**
+ * @brief Checks If-Range: a Range header is only honored if the client's 
+ * partial copy is of the current representation. Entity tags are compared
+ * strongly, and a date must be the Last-Modified date exactly.
+ */
+static bool range_applies(request_s *request, cache_element_s *e, cache_encoding_e selected) {
+    debug_enter();
+    const char *value = request_header(request, REQUEST_HEADER_IF_RANGE);
+    if (value == NULL) {
+        debug_return true;
+    }
+    if (value[0] == '"') {
+        debug_return strcmp(value, e->etag[selected]) == 0;
+    }
+    debug_return strcmp(value, e->last_modified) == 0;
+}
+
+/**
+ * @brief Runs worker process slot: gives it a log of its own that writes 
+ * to the master over log_fd and an access log, keeps the listeners and 
+ * SO_REUSEPORT sockets that are its own, numbered from 0, and serves 
+ * them. The cache is the image the master mapped, remapped on SIGUSR1.
+ */
+static int run_worker_process(int slot, int log_fd) {
+    debug_enter();
+    int rc = 1;
+    int threads = worker_pool_size(workers);
+    process_slot = slot;
+    FILE *fs = fdopen(log_fd, "w");
+    if (fs == NULL || (log = log_init(log_level, server_string, fs)) == NULL) {
+        debug_return rc;
+    }
+    if (access_filename != NULL && access_init(access_filename, server_string) != 0) {
+        log_error(log, "unable to open access log %s: %s", access_filename, strerror(errno));
+        goto term;
+    }
+    http_server_s **link = &servers;
+    while (*link != NULL) {
+        http_server_s *server = *link;
+        if (server->shard >= 0 && server->shard / threads != slot) {
+            *link = server->next;
+            server->next = NULL;
+            http_close(server);
+            continue;
+        }
+        if (server->shard >= 0) {
+            server->shard -= slot * threads;
+        }
+        server->log = log;
+        link = &server->next;
+    }
+    rc = handle_connections(servers);
+term:
+    access_cleanup();
+    log_cleanup(log);
+    debug_return rc;
+}
+
+/**
+ * @brief Picks the encoded variant of e the client rates highest in 
+ * Accept-Encoding, brotli winning ties.
+ */
+static cache_encoding_e select_encoding(request_s *request, cache_element_s *e) {
+    debug_enter();
+    cache_encoding_e selected = CACHE_ENCODING_IDENTITY;
+    int selected_quality = 0;
+    for (int encoding = CACHE_ENCODING_COUNT - 1; encoding > CACHE_ENCODING_IDENTITY; encoding--) {
+        if (e->variants[encoding] == NULL) {
+            continue;
+        }
+        int quality = request_token_quality(request, REQUEST_HEADER_ACCEPT_ENCODING, cache_encoding_str[encoding]);
+        if (quality > selected_quality) {
+            selected = encoding;
+            selected_quality = quality;
+        }
+    }
+    debug_return selected;
+}
+
+/**
+ * @brief Answers a request for the metrics or trace path with the text 
+ * made by format: the current metrics in Prometheus text format, or the 
+ * breakdown of sampled requests. name says which, for logging.
+ */
+static int serve_report(http_client_s *client, request_s *request, http_response_s *response, const char *name, char *(*format)(size_t *len), const char *mime) {
+    debug_enter();
+    size_t len;
+    response->request = request;
+    response->code = HTTP_RESPONSE_200;
+    response->fd = -1;
+    response->buffer = format(&len);
+    if (response->buffer == NULL) {
+        log_error(client->server->log, "Error formatting %s: %s", name, strerror(errno));
         debug_return 1;
     }
-    ERR_clear_error();
-    if (!SSL_CTX_check_private_key(ssl_ctx)) {
-        log_error(log, "private key %s does not match the certificate %s", ssl_key_filename, ssl_cert_filename);
+    response->body = response->buffer;
+    response->body_len = len;
+    size_t entity_header_len;
+    response->header = response_entity_header(mime, len, NULL, false, response_headers, &entity_header_len);
+    if (response->header == NULL) {
+        log_error(client->server->log, "Error building response header: %s", strerror(errno));
         debug_return 1;
     }
+    if (request->method == REQUEST_METHOD_HEAD) {
+        response->body_len = 0;
+    }
+    client->keep_alive = client->requests + 1 < keepalive_requests && request_keep_alive(request);
+    response_set_header(response, HTTP_RESPONSE_200, response->header, entity_header_len, client->keep_alive);
     debug_return 0;
 }
 
+/**
+ * @brief SIGCHLD only wakes the main thread, so exited worker processes 
+ * and upgrades are reaped without waiting for the timeout.
+ */
+static void sig_handler_child(int sig) {
+    (void)sig;
+}
+
 /**
  * @brief gracefully handle ctrl-c shutdown.
  */
@@ -774,6 +1964,15 @@ static void sig_handler_pipe(int sig) {
     (void)sig;
 }
 
+/**
+ * @brief SIGQUIT stops accepting connections and shuts the server down once
+ * the open ones are done.
+ */
+static void sig_handler_quit(int sig) {
+    (void)sig;
+    quit = 1;
+}
+
 /**
  * @brief SIGUSER1 initiates a cache reload.
  */
@@ -781,3 +1980,89 @@ static void sig_handler_reload(int sig) {
     (void)sig;
     reload = 1;
 }
+
+/**
+ * @brief SIGHUP reopens the log files, for log rotation.
+ */
+static void sig_handler_reopen(int sig) {
+    (void)sig;
+    reopen = 1;
+}
+
+/**
+ * @brief SIGUSR2 starts a new server from the binary to take over.
+ */
+static void sig_handler_upgrade(int sig) {
+    (void)sig;
+    upgrade = 1;
+}
+
+/**
+ * @brief Executes the binary again with the listening sockets passed on in
+ * NVHTTPD_LISTENERS and the pid file moved aside to pid.oldbin. Once the 
+ * new server is serving it sends SIGQUIT, and this one finishes its open 
+ * connections and exits; if it exits first, check_upgrade() rolls back.
+ */
+static void start_upgrade(void) {
+    debug_enter();
+    char **env = NULL;
+    char *value = NULL;
+    if (upgrade_pid > 0) {
+        log_warn(log, "upgrade to pid %d already in progress", upgrade_pid);
+        debug_return;
+    }
+    if (exec_path == NULL) {
+        log_error(log, "unable to upgrade, the path of the running binary is unknown");
+        debug_return;
+    }
+    size_t count = 0;
+    for (http_server_s *server = servers; server != NULL; server = server->next) {
+        count++;
+    }
+    size_t envc = 0;
+    while (environ[envc] != NULL) {
+        envc++;
+    }
+    size_t len = strlen(pid_filename) + sizeof(pid_oldbin_suffix);
+    if ((pid_oldbin == NULL && (pid_oldbin = malloc(len)) == NULL) || (value = malloc(sizeof(listeners_env) + count * 12)) == NULL || (env = malloc((envc + 2) * sizeof(char *))) == NULL) {
+        log_error(log, "malloc failed: %s", strerror(errno));
+        goto term;
+    }
+    snprintf(pid_oldbin, len, "%s%s", pid_filename, pid_oldbin_suffix);
+    int pos = sprintf(value, "%s=", listeners_env);
+    for (http_server_s *server = servers; server != NULL; server = server->next) {
+        pos += sprintf(value + pos, "%s%d", server == servers ? "" : ",", server->fd);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < envc; i++) {
+        if (strncmp(environ[i], value, sizeof(listeners_env)) != 0) {
+            env[n++] = environ[i];
+        }
+    }
+    env[n++] = value;
+    env[n] = NULL;
+    if (rename(pid_filename, pid_oldbin) != 0) {
+        log_error(log, "unable to rename %s to %s: %s", pid_filename, pid_oldbin, strerror(errno));
+        goto term;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (http_server_s *server = servers; server != NULL; server = server->next) {
+            fcntl(server->fd, F_SETFD, 0);
+        }
+        sigprocmask(SIG_SETMASK, &signal_mask, NULL);
+        execve(exec_path, exec_argv, env);
+        _exit(127);
+    }
+    if (pid < 0) {
+        log_error(log, "fork failed: %s", strerror(errno));
+        rename(pid_oldbin, pid_filename);
+        goto term;
+    }
+    upgrade_pid = pid;
+    log_info(log, "upgrading to %s, pid %d, pid file moved to %s", exec_path, pid, pid_oldbin);
+term:
+    free(env);
+    free(value);
+    debug_return;
+}
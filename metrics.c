@@ -0,0 +1,184 @@
+/**
+ * @file metrics.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief metrics module implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "debug.h"
+#include "metrics.h"
+#include "response.h"
+
+static const char *counter_name[] = {
+    [METRICS_BYTES_SENT] = "sent_bytes_total",
+    [METRICS_CACHE_HITS] = "cache_hits_total",
+    [METRICS_CACHE_MISSES] = "cache_misses_total",
+    [METRICS_PARSE_ERRORS] = "parse_errors_total",
+    [METRICS_TLS_HANDSHAKE_FAILURES] = "tls_handshake_failures_total",
+    [METRICS_CONNECTIONS_ACCEPTED] = "connections_accepted_total",
+    [METRICS_CONNECTIONS_REJECTED] = "connections_rejected_total",
+    [METRICS_CONNECTIONS_LIMITED] = "connections_limited_total",
+    [METRICS_CONNECTIONS_RATE_LIMITED] = "connections_rate_limited_total",
+    [METRICS_CONNECTIONS_CLOSED] = "connections_closed_total",
+    [METRICS_CONNECTIONS_TIMED_OUT] = "connections_timed_out_total",
+};
+
+static const char *counter_help[] = {
+    [METRICS_BYTES_SENT] = "Bytes of response headers and bodies sent.",
+    [METRICS_CACHE_HITS] = "Requests for resources found in the cache.",
+    [METRICS_CACHE_MISSES] = "Requests for resources not in the cache.",
+    [METRICS_PARSE_ERRORS] = "Requests that could not be parsed.",
+    [METRICS_TLS_HANDSHAKE_FAILURES] = "TLS handshakes that failed.",
+    [METRICS_CONNECTIONS_ACCEPTED] = "Connections accepted.",
+    [METRICS_CONNECTIONS_REJECTED] = "Connections closed on accept because the connection limit was reached.",
+    [METRICS_CONNECTIONS_LIMITED] = "Connections closed on accept because their client had as many open as it may.",
+    [METRICS_CONNECTIONS_RATE_LIMITED] = "Connections closed on accept because their client was opening them faster than its rate.",
+    [METRICS_CONNECTIONS_CLOSED] = "Accepted connections closed.",
+    [METRICS_CONNECTIONS_TIMED_OUT] = "Connections closed because a request or response took longer than its timeout.",
+};
+
+static const char *stage_name[] = {
+    [METRICS_STAGE_PARSE] = "parse",
+    [METRICS_STAGE_LOOKUP] = "lookup",
+    [METRICS_STAGE_SEND] = "send",
+};
+
+static metrics_slot_s fallback;
+static metrics_slot_s *slots = NULL;
+static int slots_count = 0;
+static __thread metrics_slot_s *current = &fallback;
+
+static void add(atomic_uint_fast64_t *value, uint64_t n);
+static void sum_slot(metrics_slot_s *total, metrics_slot_s *slot);
+
+int metrics_init(int count) {
+    debug_enter();
+    // Anonymous mappings are page aligned and zeroed.
+    void *map = mmap(NULL, count * sizeof(metrics_slot_s), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        debug_return 1;
+    }
+    slots = map;
+    slots_count = count;
+    debug_return 0;
+}
+
+void metrics_attach(int slot) {
+    if (slot >= 0 && slot < slots_count) {
+        current = &slots[slot];
+    }
+}
+
+void metrics_add(metrics_counter_e counter, uint64_t n) {
+    add(&current->counters[counter], n);
+}
+
+void metrics_response(http_response_code_e code, size_t bytes) {
+    add(&current->responses[code], 1);
+    add(&current->counters[METRICS_BYTES_SENT], bytes);
+}
+
+void metrics_time(metrics_stage_e stage, const struct timespec *start, const struct timespec *end) {
+    int64_t ns = (int64_t)(end->tv_sec - start->tv_sec) * 1000000000 + (end->tv_nsec - start->tv_nsec);
+    if (ns < 0) {
+        ns = 0;
+    }
+    uint64_t us = ((uint64_t)ns + 999) / 1000;
+    // The bucket is the power of two at or above the duration in
+    // microseconds.
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > METRICS_BUCKETS) {
+        bucket = METRICS_BUCKETS;
+    }
+    metrics_histogram_s *histogram = &current->stages[stage];
+    add(&histogram->buckets[bucket], 1);
+    add(&histogram->sum_ns, ns);
+    add(&histogram->count, 1);
+}
+
+char *metrics_format(size_t *len) {
+    debug_enter();
+    metrics_slot_s total;
+    memset(&total, 0, sizeof(total));
+    sum_slot(&total, &fallback);
+    for (int i = 0; i < slots_count; i++) {
+        sum_slot(&total, &slots[i]);
+    }
+    char *text = NULL;
+    FILE *fs = open_memstream(&text, len);
+    if (fs == NULL) {
+        debug_return NULL;
+    }
+    fprintf(fs, "# HELP nvhttpd_responses_total Responses sent, by status code.\n# TYPE nvhttpd_responses_total counter\n");
+    for (int code = 0; code < HTTP_RESPONSE_COUNT; code++) {
+        fprintf(fs, "nvhttpd_responses_total{code=\"%.3s\"} %lu\n", response_code_str[code], (unsigned long)total.responses[code]);
+    }
+    for (int i = 0; i < METRICS_COUNTER_COUNT; i++) {
+        fprintf(fs, "# HELP nvhttpd_%s %s\n# TYPE nvhttpd_%s counter\nnvhttpd_%s %lu\n", counter_name[i], counter_help[i], counter_name[i], counter_name[i], (unsigned long)total.counters[i]);
+    }
+    uint64_t open = total.counters[METRICS_CONNECTIONS_ACCEPTED] - total.counters[METRICS_CONNECTIONS_REJECTED] - total.counters[METRICS_CONNECTIONS_LIMITED] - total.counters[METRICS_CONNECTIONS_RATE_LIMITED] - total.counters[METRICS_CONNECTIONS_CLOSED];
+    fprintf(fs, "# HELP nvhttpd_connections Open connections.\n# TYPE nvhttpd_connections gauge\nnvhttpd_connections %lu\n", (unsigned long)open);
+    fprintf(fs, "# HELP nvhttpd_stage_duration_seconds Time spent parsing requests, looking them up in the cache and sending responses.\n# TYPE nvhttpd_stage_duration_seconds histogram\n");
+    for (int stage = 0; stage < METRICS_STAGE_COUNT; stage++) {
+        metrics_histogram_s *histogram = &total.stages[stage];
+        uint64_t cumulative = 0;
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+            cumulative += histogram->buckets[i];
+            fprintf(fs, "nvhttpd_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n", stage_name[stage], (double)(1UL << i) / 1e6, (unsigned long)cumulative);
+        }
+        // The count is taken from the buckets rather than the count field,
+        // which a worker may have moved on since its buckets were read.
+        cumulative += histogram->buckets[METRICS_BUCKETS];
+        fprintf(fs, "nvhttpd_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", stage_name[stage], (unsigned long)cumulative);
+        fprintf(fs, "nvhttpd_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stage_name[stage], (double)histogram->sum_ns / 1e9);
+        fprintf(fs, "nvhttpd_stage_duration_seconds_count{stage=\"%s\"} %lu\n", stage_name[stage], (unsigned long)cumulative);
+    }
+    if (fclose(fs) != 0) {
+        free(text);
+        debug_return NULL;
+    }
+    debug_return text;
+}
+
+void metrics_cleanup(void) {
+    debug_enter();
+    if (slots != NULL) {
+        munmap(slots, slots_count * sizeof(metrics_slot_s));
+    }
+    slots = NULL;
+    slots_count = 0;
+    debug_return;
+}
+
+/**
+ * @brief Adds to a value only the calling thread writes.
+ */
+static void add(atomic_uint_fast64_t *value, uint64_t n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * @brief Adds the values in slot to total, which is not shared.
+ */
+static void sum_slot(metrics_slot_s *total, metrics_slot_s *slot) {
+    for (int i = 0; i < METRICS_COUNTER_COUNT; i++) {
+        total->counters[i] += atomic_load_explicit(&slot->counters[i], memory_order_relaxed);
+    }
+    for (int i = 0; i < HTTP_RESPONSE_COUNT; i++) {
+        total->responses[i] += atomic_load_explicit(&slot->responses[i], memory_order_relaxed);
+    }
+    for (int stage = 0; stage < METRICS_STAGE_COUNT; stage++) {
+        for (int i = 0; i <= METRICS_BUCKETS; i++) {
+            total->stages[stage].buckets[i] += atomic_load_explicit(&slot->stages[stage].buckets[i], memory_order_relaxed);
+        }
+        total->stages[stage].sum_ns += atomic_load_explicit(&slot->stages[stage].sum_ns, memory_order_relaxed);
+        total->stages[stage].count += atomic_load_explicit(&slot->stages[stage].count, memory_order_relaxed);
+    }
+}
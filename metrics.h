@@ -0,0 +1,139 @@
+/**
+ * @file metrics.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief metrics module declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "response.h"
+
+/**
+ * @brief Number of finite histogram buckets. Bucket i counts durations up
+ * to 2^i microseconds, so the last finite bucket ends a little over 8
+ * seconds; anything longer only counts towards +Inf.
+ */
+#define METRICS_BUCKETS 24
+
+#define METRICS_CACHE_LINE 64
+
+/**
+ * @brief Counters kept per worker.
+ */
+typedef enum metrics_counter_e {
+    METRICS_BYTES_SENT,
+    METRICS_CACHE_HITS,
+    METRICS_CACHE_MISSES,
+    METRICS_PARSE_ERRORS,
+    METRICS_TLS_HANDSHAKE_FAILURES,
+    METRICS_CONNECTIONS_ACCEPTED,
+    METRICS_CONNECTIONS_REJECTED,
+    METRICS_CONNECTIONS_LIMITED,
+    METRICS_CONNECTIONS_RATE_LIMITED,
+    METRICS_CONNECTIONS_CLOSED,
+    METRICS_CONNECTIONS_TIMED_OUT,
+    METRICS_COUNTER_COUNT
+} metrics_counter_e;
+
+/**
+ * @brief Request stages timed with histograms: parsing the request, finding
+ * the resource in the cache, and sending the response.
+ */
+typedef enum metrics_stage_e {
+    METRICS_STAGE_PARSE,
+    METRICS_STAGE_LOOKUP,
+    METRICS_STAGE_SEND,
+    METRICS_STAGE_COUNT
+} metrics_stage_e;
+
+/**
+ * @brief A latency histogram with power of two buckets, plus the sum and
+ * count of the recorded durations. buckets[METRICS_BUCKETS] counts the
+ * durations past the last finite bucket.
+ */
+typedef struct metrics_histogram_s {
+    atomic_uint_fast64_t buckets[METRICS_BUCKETS + 1];
+    atomic_uint_fast64_t sum_ns;
+    atomic_uint_fast64_t count;
+} metrics_histogram_s;
+
+/**
+ * @brief One thread's metrics. Each slot is written only by the thread it
+ * is attached to, so updates are plain relaxed loads and stores rather than
+ * locked read-modify-writes, and slots are cache line aligned so workers
+ * never write the same line. The formatter sums the slots as it reads them.
+ */
+typedef struct metrics_slot_s {
+    atomic_uint_fast64_t counters[METRICS_COUNTER_COUNT];
+    atomic_uint_fast64_t responses[HTTP_RESPONSE_COUNT];
+    metrics_histogram_s stages[METRICS_STAGE_COUNT];
+} __attribute__((aligned(METRICS_CACHE_LINE))) metrics_slot_s;
+
+/**
+ * @brief Allocates a slot for each worker. Until a thread attaches to a
+ * slot its updates go to a shared fallback slot, so the functions below are
+ * always safe to call. The slots are in a shared mapping, so worker 
+ * processes forked afterwards count into slots of their own that any of 
+ * them can format, and the metrics cover the whole server.
+ * @param count Number of slots, one per worker across all processes.
+ * @return 0 on success.
+ */
+extern int metrics_init(int count);
+
+/**
+ * @brief Attaches the calling thread to a slot.
+ * @param slot Slot number, below the count given to metrics_init().
+ * @return nothing
+ */
+extern void metrics_attach(int slot);
+
+/**
+ * @brief Adds to one of the calling thread's counters.
+ * @param counter The counter.
+ * @param n Amount to add.
+ * @return nothing
+ */
+extern void metrics_add(metrics_counter_e counter, uint64_t n);
+
+/**
+ * @brief Counts a response sent with the given code.
+ * @param code Response code.
+ * @param bytes Bytes of header and body sent.
+ * @return nothing
+ */
+extern void metrics_response(http_response_code_e code, size_t bytes);
+
+/**
+ * @brief Records the duration of a stage.
+ * @param stage The stage.
+ * @param start When the stage started, from CLOCK_MONOTONIC.
+ * @param end When it ended.
+ * @return nothing
+ */
+extern void metrics_time(metrics_stage_e stage, const struct timespec *start, const struct timespec *end);
+
+/**
+ * @brief Formats the sum of all slots in the Prometheus text exposition
+ * format.
+ * @param len Contains the length of the returned text.
+ * @return The text, allocated, which the caller frees, or NULL on no
+ * memory.
+ */
+extern char *metrics_format(size_t *len);
+
+/**
+ * @brief Unmaps the slots. No thread may be updating metrics.
+ * @return nothing
+ */
+extern void metrics_cleanup(void);
+
+#endif // METRICS_H
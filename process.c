@@ -0,0 +1,464 @@
+/**
+ * @file process.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief worker process supervisor implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "log.h"
+#include "process.h"
+
+#define PROCESS_LOG_LINE_MAX 4096
+#define PROCESS_WAIT_MS 1000
+#define PROCESS_STOP_POLL_MS 100
+#define PROCESS_REPLACE_DELAY 1
+#define PROCESS_NODE_PATH "/sys/devices/system/node"
+
+/**
+ * @brief One worker slot: the process in it, 0 if none, and the read end
+ * of its log pipe, -1 once closed. log_line holds the start of a line not
+ * yet complete. started is when the process was forked, in seconds of the
+ * monotonic clock. replace says a new process is due in the slot at
+ * replace_at.
+ */
+typedef struct process_s {
+    pid_t pid;
+    int log_fd;
+    time_t started;
+    bool replace;
+    time_t replace_at;
+    size_t log_len;
+    char log_line[PROCESS_LOG_LINE_MAX];
+} process_s;
+
+/**
+ * @brief The pool. master is the pid workers check their parent against.
+ * cpus are the CPUs the master may run on, which pinned workers are given
+ * from. draining stops exited workers being replaced. running counts the
+ * slots with a process.
+ */
+struct process_pool_s {
+    process_config_s config;
+    process_main_f *run;
+    log_s *log;
+    pid_t master;
+    cpu_set_t cpus;
+    bool draining;
+    int running;
+    process_s processes[];
+};
+
+static bool affinity(process_pool_s *pool, int slot, cpu_set_t *set);
+static void copy_log(process_pool_s *pool, process_s *p);
+static void format_cpus(const cpu_set_t *set, char *buffer, size_t size);
+static time_t monotonic_now(void);
+static int parse_list(const char *text, cpu_set_t *set);
+static void poll_logs(process_pool_s *pool, int timeout_ms, const sigset_t *mask);
+static int read_list(const char *path, cpu_set_t *set);
+static void reap(process_pool_s *pool);
+static int spawn(process_pool_s *pool, int slot);
+
+process_pool_s *process_pool_start(const process_config_s *config, process_main_f *run, log_s *log) {
+    debug_enter();
+    process_pool_s *pool = calloc(1, sizeof(process_pool_s) + config->processes * sizeof(process_s));
+    if (pool == NULL) {
+        log_error(log, "calloc failed: %s", strerror(errno));
+        debug_return NULL;
+    }
+    pool->config = *config;
+    pool->run = run;
+    pool->log = log;
+    pool->master = getpid();
+    if (sched_getaffinity(0, sizeof(pool->cpus), &pool->cpus) != 0) {
+        CPU_ZERO(&pool->cpus);
+    }
+    for (int i = 0; i < config->processes; i++) {
+        pool->processes[i].log_fd = -1;
+    }
+    for (int i = 0; i < config->processes; i++) {
+        if (spawn(pool, i) != 0) {
+            process_pool_stop(pool);
+            debug_return NULL;
+        }
+    }
+    log_info(log, "started %d worker processes of %d workers each", config->processes, config->threads);
+    debug_return pool;
+}
+
+void process_pool_wait(process_pool_s *pool, const sigset_t *mask) {
+    debug_enter();
+    poll_logs(pool, PROCESS_WAIT_MS, mask);
+    reap(pool);
+    time_t now = monotonic_now();
+    for (int i = 0; i < pool->config.processes; i++) {
+        process_s *p = &pool->processes[i];
+        if (p->replace && !pool->draining && now >= p->replace_at && spawn(pool, i) != 0) {
+            // Tried again after the same delay.
+            p->replace = true;
+            p->replace_at = now + PROCESS_REPLACE_DELAY;
+        }
+    }
+    debug_return;
+}
+
+void process_pool_signal(process_pool_s *pool, int sig) {
+    debug_enter();
+    for (int i = 0; i < pool->config.processes; i++) {
+        if (pool->processes[i].pid > 0 && kill(pool->processes[i].pid, sig) != 0 && errno != ESRCH) {
+            log_error(pool->log, "unable to signal worker process %d: %s", i, strerror(errno));
+        }
+    }
+    debug_return;
+}
+
+void process_pool_drain(process_pool_s *pool) {
+    debug_enter();
+    pool->draining = true;
+    process_pool_signal(pool, SIGQUIT);
+    debug_return;
+}
+
+int process_pool_running(process_pool_s *pool) {
+    return pool->running;
+}
+
+void process_pool_stop(process_pool_s *pool) {
+    debug_enter();
+    if (pool == NULL) {
+        debug_return;
+    }
+    pool->draining = true;
+    process_pool_signal(pool, SIGINT);
+    time_t deadline = monotonic_now() + PROCESS_STOP_TIMEOUT;
+    bool killed = false;
+    while (pool->running > 0) {
+        if (!killed && monotonic_now() >= deadline) {
+            log_warn(pool->log, "worker processes still running after %d seconds, killing them", PROCESS_STOP_TIMEOUT);
+            process_pool_signal(pool, SIGKILL);
+            killed = true;
+        }
+        poll_logs(pool, PROCESS_STOP_POLL_MS, NULL);
+        reap(pool);
+    }
+    for (int i = 0; i < pool->config.processes; i++) {
+        if (pool->processes[i].log_fd >= 0) {
+            close(pool->processes[i].log_fd);
+        }
+    }
+    free(pool);
+    debug_return;
+}
+
+/**
+ * @brief Works out the CPUs to pin a worker to. Returns false if it isn't
+ * to be pinned or no CPUs could be found for it.
+ */
+static bool affinity(process_pool_s *pool, int slot, cpu_set_t *set) {
+    CPU_ZERO(set);
+    int count = CPU_COUNT(&pool->cpus);
+    if (count == 0) {
+        return false;
+    }
+    if (pool->config.pin == PROCESS_PIN_CPU) {
+        int cpus[count];
+        int n = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE && n < count; cpu++) {
+            if (CPU_ISSET(cpu, &pool->cpus)) {
+                cpus[n++] = cpu;
+            }
+        }
+        int threads = pool->config.threads > 0 ? pool->config.threads : 1;
+        for (int i = 0; i < threads && i < n; i++) {
+            CPU_SET(cpus[(slot * threads + i) % n], set);
+        }
+        return true;
+    }
+    if (pool->config.pin == PROCESS_PIN_NODE) {
+        cpu_set_t nodes;
+        if (read_list(PROCESS_NODE_PATH "/online", &nodes) != 0 || CPU_COUNT(&nodes) == 0) {
+            return false;
+        }
+        int index = slot % CPU_COUNT(&nodes);
+        int node = 0;
+        for (; node < CPU_SETSIZE; node++) {
+            if (CPU_ISSET(node, &nodes) && index-- == 0) {
+                break;
+            }
+        }
+        char path[sizeof(PROCESS_NODE_PATH) + 32];
+        snprintf(path, sizeof(path), PROCESS_NODE_PATH "/node%d/cpulist", node);
+        if (read_list(path, set) != 0) {
+            return false;
+        }
+        CPU_AND(set, set, &pool->cpus);
+        return CPU_COUNT(set) > 0;
+    }
+    return false;
+}
+
+/**
+ * @brief Reads what a worker has written to its log pipe and copies each
+ * complete line into the master's log, which cuts lines to what one of 
+ * its records holds. A line too long for the buffer is copied in pieces.
+ * Closes the pipe at end of file, once the worker and
+ * every thread of it are gone.
+ */
+static void copy_log(process_pool_s *pool, process_s *p) {
+    while (p->log_fd >= 0) {
+        ssize_t n = read(p->log_fd, p->log_line + p->log_len, PROCESS_LOG_LINE_MAX - p->log_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            if (p->log_len > 0) {
+                log_write_raw(pool->log, "%.*s", (int)p->log_len, p->log_line);
+                p->log_len = 0;
+            }
+            close(p->log_fd);
+            p->log_fd = -1;
+            return;
+        }
+        p->log_len += n;
+        char *start = p->log_line;
+        char *end = p->log_line + p->log_len;
+        char *newline;
+        while ((newline = memchr(start, '\n', end - start)) != NULL) {
+            log_write_raw(pool->log, "%.*s", (int)(newline - start), start);
+            start = newline + 1;
+        }
+        if (start == p->log_line && p->log_len == PROCESS_LOG_LINE_MAX) {
+            log_write_raw(pool->log, "%.*s", (int)p->log_len, p->log_line);
+            start = end;
+        }
+        p->log_len = end - start;
+        memmove(p->log_line, start, p->log_len);
+    }
+}
+
+/**
+ * @brief Formats a CPU set as a list of ranges, "0-3,8".
+ */
+static void format_cpus(const cpu_set_t *set, char *buffer, size_t size) {
+    size_t len = 0;
+    buffer[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            last++;
+        }
+        int n = last == cpu ? snprintf(buffer + len, size - len, "%s%d", len > 0 ? "," : "", cpu) : snprintf(buffer + len, size - len, "%s%d-%d", len > 0 ? "," : "", cpu, last);
+        len += n > 0 ? (size_t)n : 0;
+        cpu = last;
+    }
+}
+
+static time_t monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * @brief Parses a list of numbers and ranges such as "0-3,8-11", as sysfs
+ * writes CPU and node lists, into a set. Returns 0 on success.
+ */
+static int parse_list(const char *text, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *cp = text;
+    while (*cp != '\0' && *cp != '\n') {
+        char *end;
+        long first = strtol(cp, &end, 10);
+        long last = first;
+        if (end == cp) {
+            return 1;
+        }
+        if (*end == '-') {
+            cp = end + 1;
+            last = strtol(cp, &end, 10);
+            if (end == cp) {
+                return 1;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return 1;
+        }
+        for (long i = first; i <= last; i++) {
+            CPU_SET(i, set);
+        }
+        cp = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+/**
+ * @brief Waits for any worker log pipe to become readable and copies what
+ * it can from each. mask is passed to ppoll(); NULL leaves the mask alone.
+ */
+static void poll_logs(process_pool_s *pool, int timeout_ms, const sigset_t *mask) {
+    struct pollfd fds[pool->config.processes];
+    process_s *owners[pool->config.processes];
+    nfds_t count = 0;
+    for (int i = 0; i < pool->config.processes; i++) {
+        if (pool->processes[i].log_fd >= 0) {
+            fds[count].fd = pool->processes[i].log_fd;
+            fds[count].events = POLLIN;
+            fds[count].revents = 0;
+            owners[count++] = &pool->processes[i];
+        }
+    }
+    struct timespec timeout = { .tv_sec = timeout_ms / 1000, .tv_nsec = (long)(timeout_ms % 1000) * 1000000 };
+    int n = ppoll(fds, count, &timeout, mask);
+    if (n < 0) {
+        if (errno != EINTR) {
+            log_error(pool->log, "ppoll failed: %s", strerror(errno));
+        }
+        return;
+    }
+    for (nfds_t i = 0; i < count && n > 0; i++) {
+        if (fds[i].revents != 0) {
+            copy_log(pool, owners[i]);
+            n--;
+        }
+    }
+}
+
+/**
+ * @brief Opens a sysfs list file and parses it into a set. Returns 0 on
+ * success.
+ */
+static int read_list(const char *path, cpu_set_t *set) {
+    FILE *fs = fopen(path, "r");
+    if (fs == NULL) {
+        return 1;
+    }
+    char line[4096];
+    int rc = fgets(line, sizeof(line), fs) != NULL ? parse_list(line, set) : 1;
+    fclose(fs);
+    return rc;
+}
+
+/**
+ * @brief Collects the workers that have exited, copying the last of their
+ * logs, and marks their slots for a new worker unless the pool is
+ * draining. Each worker is waited for by its pid, so other children of the
+ * master are left to whoever started them.
+ */
+static void reap(process_pool_s *pool) {
+    time_t now = monotonic_now();
+    for (int i = 0; i < pool->config.processes; i++) {
+        process_s *p = &pool->processes[i];
+        int status;
+        if (p->pid <= 0 || waitpid(p->pid, &status, WNOHANG) != p->pid) {
+            continue;
+        }
+        if (p->log_fd >= 0) {
+            // The pipe may still hold the worker's last lines.
+            copy_log(pool, p);
+            if (p->log_fd >= 0) {
+                close(p->log_fd);
+                p->log_fd = -1;
+            }
+            p->log_len = 0;
+        }
+        if (WIFSIGNALED(status)) {
+            log_error(pool->log, "worker process %d (pid %d) killed by signal %d", i, p->pid, WTERMSIG(status));
+        } else if (WEXITSTATUS(status) != 0) {
+            log_error(pool->log, "worker process %d (pid %d) exited with status %d", i, p->pid, WEXITSTATUS(status));
+        } else {
+            log_info(pool->log, "worker process %d (pid %d) exited", i, p->pid);
+        }
+        p->pid = 0;
+        pool->running--;
+        if (!pool->draining) {
+            // A worker that dies as soon as it starts is likely to keep
+            // doing so, so it isn't replaced in a tight loop.
+            p->replace = true;
+            p->replace_at = now - p->started < PROCESS_REPLACE_DELAY ? now + PROCESS_REPLACE_DELAY : now;
+        }
+    }
+}
+
+/**
+ * @brief Forks a worker into a slot, with a new log pipe.
+ */
+static int spawn(process_pool_s *pool, int slot) {
+    debug_enter();
+    process_s *p = &pool->processes[slot];
+    cpu_set_t set;
+    bool pinned = affinity(pool, slot, &set);
+    if (!pinned && pool->config.pin != PROCESS_PIN_NONE) {
+        log_warn(pool->log, "unable to find CPUs to pin worker process %d to, leaving it unpinned", slot);
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        log_error(pool->log, "pipe2 failed: %s", strerror(errno));
+        debug_return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_error(pool->log, "fork failed: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        debug_return 1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        for (int i = 0; i < pool->config.processes; i++) {
+            if (pool->processes[i].log_fd >= 0) {
+                close(pool->processes[i].log_fd);
+            }
+        }
+        // A worker outliving its master finishes its connections and
+        // exits; checking the parent catches a master that went first.
+        prctl(PR_SET_PDEATHSIG, SIGQUIT);
+        if (getppid() != pool->master) {
+            _exit(1);
+        }
+        if (pinned) {
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+        _exit(pool->run(slot, fds[1]));
+    }
+    close(fds[1]);
+    int flags = fcntl(fds[0], F_GETFL);
+    if (flags < 0 || fcntl(fds[0], F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_warn(pool->log, "unable to make the log pipe of worker process %d non-blocking: %s", slot, strerror(errno));
+    }
+    p->pid = pid;
+    p->log_fd = fds[0];
+    p->log_len = 0;
+    p->started = monotonic_now();
+    p->replace = false;
+    pool->running++;
+    if (pinned) {
+        char cpus[256];
+        format_cpus(&set, cpus, sizeof(cpus));
+        log_info(pool->log, "started worker process %d, pid %d, on CPUs %s", slot, pid, cpus);
+    } else {
+        log_info(pool->log, "started worker process %d, pid %d", slot, pid);
+    }
+    debug_return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * @file process.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief worker process supervisor declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <signal.h>
+#include <stdbool.h>
+
+#include "log.h"
+
+#define PROCESS_STOP_TIMEOUT 10
+
+/**
+ * @brief Where worker processes are pinned: nowhere, to CPUs of their own,
+ * or to the CPUs of one NUMA node each.
+ */
+typedef enum process_pin_e {
+    PROCESS_PIN_NONE,
+    PROCESS_PIN_CPU,
+    PROCESS_PIN_NODE
+} process_pin_e;
+
+/**
+ * @brief Worker process settings. processes is the number of worker
+ * processes and threads the number of worker threads each runs. With pin
+ * PROCESS_PIN_CPU, process i is pinned to threads CPUs of its own, taken in
+ * turn from the CPUs the master may run on; with PROCESS_PIN_NODE it is
+ * pinned to the CPUs of node i modulo the number of nodes, so its memory
+ * is allocated on that node too.
+ */
+typedef struct process_config_s {
+    int processes;
+    int threads;
+    process_pin_e pin;
+} process_config_s;
+
+/**
+ * @brief Runs a worker process. Called in the child after fork(), pinned
+ * and with the descriptors of the other workers' logs closed. Everything
+ * set up before process_pool_start() is inherited, but none of the
+ * master's threads are.
+ * @param slot Which worker this is, from 0 to processes - 1. A worker
+ * started in place of one that exited gets its slot.
+ * @param log_fd Write end of a pipe whose lines the master copies into its
+ * log.
+ * @return The process exit status.
+ */
+typedef int (process_main_f)(int slot, int log_fd);
+
+/**
+ * @brief A running set of worker processes, opaque outside process.c.
+ */
+typedef struct process_pool_s process_pool_s;
+
+/**
+ * @brief Forks the worker processes.
+ * @param config Worker process settings. These are copied.
+ * @param run Run in each worker process.
+ * @param log The master's log, which worker log lines are copied to.
+ * @return The pool, or NULL if any worker could not be started.
+ */
+extern process_pool_s *process_pool_start(const process_config_s *config, process_main_f *run, log_s *log);
+
+/**
+ * @brief Waits up to a second for worker log lines, copying those that
+ * arrive into the master's log, with the signals in mask unblocked as
+ * ppoll() does. Then reaps workers that exited and, unless the pool is
+ * draining or stopping, starts new ones in their slots, waiting a second
+ * before replacing a worker that exited within a second of starting.
+ * @param pool The pool.
+ * @param mask Signal mask to wait with, so handled signals end the wait.
+ * @return nothing
+ */
+extern void process_pool_wait(process_pool_s *pool, const sigset_t *mask);
+
+/**
+ * @brief Sends a signal to every running worker.
+ * @param pool The pool.
+ * @param sig The signal.
+ * @return nothing
+ */
+extern void process_pool_signal(process_pool_s *pool, int sig);
+
+/**
+ * @brief Tells every worker to finish its open connections and exit, with
+ * SIGQUIT, and stops replacing workers that exit.
+ * @param pool The pool.
+ * @return nothing
+ */
+extern void process_pool_drain(process_pool_s *pool);
+
+/**
+ * @brief Returns the number of workers that have not been reaped.
+ * @param pool The pool.
+ * @return The number of running workers.
+ */
+extern int process_pool_running(process_pool_s *pool);
+
+/**
+ * @brief Stops the workers still running with SIGINT, killing any that
+ * haven't exited after PROCESS_STOP_TIMEOUT seconds, copies the last of
+ * their logs and frees the pool.
+ * @param pool The pool. May be NULL.
+ * @return nothing
+ */
+extern void process_pool_stop(process_pool_s *pool);
+
+#endif // PROCESS_H
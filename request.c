@@ -7,9 +7,13 @@
  * @copyright Copyright (c) 2024
  */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -18,19 +22,20 @@
 #include "log.h"
 #include "request.h"
 
-#define MAX_RECV_CHARACTERS 8192
-#define URL_VAR_NAME_MAX 128
-#define URL_VAR_VALUE_MAX 1024
-#define URI_SIZE_MAX 1024
-#define BUFFER_SIZE 512
-
-static const int IO_OK = 0;
-static const int IO_EOF = -1;
-static const int IO_ERROR = -2;
+static const char const *header_names[] = {
+    [REQUEST_HEADER_ACCEPT_ENCODING] = "Accept-Encoding",
+    [REQUEST_HEADER_CONNECTION] = "Connection",
+    [REQUEST_HEADER_CONTENT_LENGTH] = "Content-Length",
+    [REQUEST_HEADER_HOST] = "Host",
+    [REQUEST_HEADER_IF_MODIFIED_SINCE] = "If-Modified-Since",
+    [REQUEST_HEADER_IF_NONE_MATCH] = "If-None-Match",
+    [REQUEST_HEADER_IF_RANGE] = "If-Range",
+    [REQUEST_HEADER_RANGE] = "Range",
+    [REQUEST_HEADER_TRANSFER_ENCODING] = "Transfer-Encoding",
+};
 static const int http_version_major_default = 0;
 static const int http_version_minor_default = 9;
-static const char const *error_str_io = "I/O error";
-static const char const *method_str[] = {
+const char const *request_method_str[] = {
     [REQUEST_METHOD_CONNECT] = "CONNECT",
     [REQUEST_METHOD_DELETE] = "DELETE",
     [REQUEST_METHOD_GET] = "GET",
@@ -41,87 +46,323 @@ static const char const *method_str[] = {
     [REQUEST_METHOD_TRACE] = "TRACE",
 };
 
-static int add_header(request_s *request, char *var, char *val);
-static request_parse_error_e add_variable(request_s *request, char *var, char *val);
-static int io_next(request_s *request);
-static int io_peek(request_s *request);
-static int get_headers(request_s *request);
-static request_parse_error_e get_http_ver(request_s *request);
-static request_parse_error_e get_method(request_s *request);
-static int get_query(request_s *request);
-static request_parse_error_e get_uri(request_s *request);
-static request_parse_error_e get_uri_fragment(request_s *request);
-static int parse_request(request_s *request);
-static request_parse_error_e parse_val(request_s *request, char **val);
-static request_parse_error_e parse_var(request_s *request, int separator, char **var);
-static int skip_ws(request_s *request);
+static int grow_buffer(request_s *request, size_t size);
+static bool header_complete(request_s *request);
+static bool header_has_token(const char *value, const char *token);
+static size_t header_hash(const char *name, size_t len);
+static request_header_e header_known(const char *name, size_t len);
+static void header_index(request_s *request, unsigned int index);
+static int hex_value(int ch);
+static bool is_ws(int ch);
+static request_parse_error_e parse_headers(request_s *request, size_t offset, size_t end);
+static request_parse_error_e parse_method(request_s *request, const char *method, size_t len);
+static const char *parse_position(const char *cp, size_t *position);
+static request_parse_error_e parse_query(request_s *request, size_t offset, size_t end);
+static int parse_quality(const char *cp, const char *end);
+static request_parse_error_e parse_uri(request_s *request, size_t offset, size_t end);
+static request_parse_error_e parse_version(request_s *request, const char *version, size_t len);
 
-void request_free(request_s *request) {
+void request_cleanup(request_s *request) {
     debug_enter();
     if (request == NULL) {
         debug_return;
     }
-    if (request->buffer) {
+    if (request->buffer != NULL && request->buffer != request->inline_buffer) {
         free(request->buffer);
     }
-    if (request->uri) {
-        free(request->uri);
+    request->buffer = NULL;
+    debug_return;
+}
+
+const char *request_find_header(request_s *request, const char *name) {
+    size_t len = strlen(name);
+    request_header_e known = header_known(name, len);
+    if (known != REQUEST_HEADER_COUNT) {
+        return request_header(request, known);
     }
-    if (request->uri_fragment) {
-        free(request->uri_fragment);
+    size_t mask = REQUEST_HEADERS_TABLE_SIZE - 1;
+    for (size_t slot = header_hash(name, len) & mask; request->headers_table[slot] != 0; slot = (slot + 1) & mask) {
+        request_variable_s *header = &request->headers[request->headers_table[slot] - 1];
+        if (header->name.len == len && strncasecmp(request->buffer + header->name.offset, name, len) == 0) {
+            return request->buffer + header->value.offset;
+        }
+    }
+    return NULL;
+}
+
+const char *request_header(request_s *request, request_header_e header) {
+    unsigned char index = request->known[header];
+    if (index == 0) {
+        return NULL;
+    }
+    return request->buffer + request->headers[index - 1].value.offset;
+}
+
+void request_init(request_s *request, http_client_s *client) {
+    debug_enter();
+    // Only the fields before the large arrays need clearing; the arrays are
+    // valid only up to their counts.
+    memset(request, 0, offsetof(request_s, url_variables));
+    request->url_variables_count = 0;
+    request->headers_count = 0;
+    request->method = 0;
+    request->type = 0;
+    request->buffer = request->inline_buffer;
+    request->buffer_size = REQUEST_BUFFER_SIZE;
+    request->client = client;
+    debug_return;
+}
+
+bool request_keep_alive(request_s *request) {
+    debug_enter();
+    if (request->type != REQUEST_TYPE_FULL || request->http_version_major < 1) {
+        debug_return false;
+    }
+    const char *length = request_header(request, REQUEST_HEADER_CONTENT_LENGTH);
+    if ((length != NULL && strtol(length, NULL, 10) != 0) || request_header(request, REQUEST_HEADER_TRANSFER_ENCODING) != NULL) {
+        debug_return false;
+    }
+    const char *connection = request_header(request, REQUEST_HEADER_CONNECTION);
+    if (request->http_version_major == 1 && request->http_version_minor == 0) {
+        debug_return connection != NULL && header_has_token(connection, "keep-alive");
+    }
+    debug_return connection == NULL || !header_has_token(connection, "close");
+}
+
+int request_ranges(request_s *request, size_t length, request_range_s *ranges) {
+    debug_enter();
+    const char *cp = request_header(request, REQUEST_HEADER_RANGE);
+    if (cp == NULL || strncasecmp(cp, "bytes=", 6) != 0) {
+        debug_return 0;
     }
-    if (request->url_variables) {
-        http_variable_s *var = request->url_variables;
-        while (var) {
-            http_variable_s *next = var->next;
-            if (var->var) {
-                free(var->var);
+    cp += 6;
+    int count = 0;
+    while (*cp) {
+        while (is_ws(*cp) || *cp == ',') {
+            cp++;
+        }
+        if (*cp == '\0') {
+            break;
+        }
+        size_t first = 0;
+        size_t last = length > 0 ? length - 1 : 0;
+        bool satisfiable = length > 0;
+        if (*cp == '-') {
+            size_t suffix;
+            if ((cp = parse_position(cp + 1, &suffix)) == NULL) {
+                debug_return 0;
+            }
+            if (suffix == 0) {
+                satisfiable = false;
+            } else if (suffix < length) {
+                first = length - suffix;
+            }
+        } else {
+            if ((cp = parse_position(cp, &first)) == NULL || *cp++ != '-') {
+                debug_return 0;
+            }
+            if (*cp >= '0' && *cp <= '9') {
+                size_t end;
+                if ((cp = parse_position(cp, &end)) == NULL || end < first) {
+                    debug_return 0;
+                }
+                if (end < last) {
+                    last = end;
+                }
             }
-            if (var->val) {
-                free(var->val);
+            if (first >= length) {
+                satisfiable = false;
             }
-            free(var);
-            var = next;
         }
-    }
-    if (request->headers) {
-        http_variable_s *var = request->headers;
-        while (var) {
-            http_variable_s *next = var->next;
-            if (var->var) {
-                free(var->var);
+        while (is_ws(*cp)) {
+            cp++;
+        }
+        if (*cp != ',' && *cp != '\0') {
+            debug_return 0;
+        }
+        if (!satisfiable) {
+            continue;
+        }
+        // Insert in order of offset, merging with any range this one 
+        // overlaps or touches, so a flood of small ranges can't multiply 
+        // the response.
+        int i = 0;
+        while (i < count && ranges[i].offset + ranges[i].len < first) {
+            i++;
+        }
+        int j = i;
+        while (j < count && ranges[j].offset <= last + 1) {
+            if (ranges[j].offset < first) {
+                first = ranges[j].offset;
             }
-            if (var->val) {
-                free(var->val);
+            if (ranges[j].offset + ranges[j].len - 1 > last) {
+                last = ranges[j].offset + ranges[j].len - 1;
             }
-            free(var);
-            var = next;
+            j++;
         }
+        if (i == j && count == REQUEST_RANGES_MAX) {
+            debug_return 0;
+        }
+        memmove(&ranges[i + 1], &ranges[j], (count - j) * sizeof(request_range_s));
+        count -= j - i - 1;
+        ranges[i].offset = first;
+        ranges[i].len = last - first + 1;
     }
-    free(request);
+    debug_return count > 0 ? count : -1;
+}
+
+int request_token_quality(request_s *request, request_header_e header, const char *token) {
+    debug_enter();
+    const char *value = request_header(request, header);
+    if (value == NULL) {
+        debug_return 0;
+    }
+    size_t token_len = strlen(token);
+    int quality = -1;
+    int wildcard = 0;
+    const char *cp = value;
+    while (*cp) {
+        while (*cp == ' ' || *cp == '\t' || *cp == ',') {
+            cp++;
+        }
+        const char *start = cp;
+        while (*cp && *cp != ',' && *cp != ';' && *cp != ' ' && *cp != '\t') {
+            cp++;
+        }
+        size_t len = cp - start;
+        const char *end = strchr(cp, ',');
+        if (end == NULL) {
+            end = cp + strlen(cp);
+        }
+        int q = parse_quality(cp, end);
+        if (len == token_len && strncasecmp(start, token, token_len) == 0) {
+            quality = q;
+        } else if (len == 1 && *start == '*') {
+            wildcard = q;
+        }
+        cp = end;
+    }
+    debug_return quality >= 0 ? quality : wildcard;
+}
+
+void request_reset(request_s *request) {
+    debug_enter();
+    size_t remaining = 0;
+    if (request->complete && request->buffer_index < request->buffer_len) {
+        remaining = request->buffer_len - request->buffer_index;
+    }
+    if (request->buffer != request->inline_buffer && remaining <= REQUEST_BUFFER_SIZE) {
+        memcpy(request->inline_buffer, request->buffer + request->buffer_index, remaining);
+        free(request->buffer);
+        request->buffer = request->inline_buffer;
+        request->buffer_size = REQUEST_BUFFER_SIZE;
+    } else if (remaining > 0) {
+        memmove(request->buffer, request->buffer + request->buffer_index, remaining);
+    }
+    request->uri = NULL;
+    request->uri_fragment.offset = 0;
+    request->uri_fragment.len = 0;
+    request->url_variables_count = 0;
+    memset(request->known, 0, sizeof(request->known));
+    memset(request->headers_table, 0, sizeof(request->headers_table));
+    request->headers_count = 0;
+    request->http_version_major = 0;
+    request->http_version_minor = 0;
+    request->method = 0;
+    request->type = 0;
+    request->buffer_len = remaining;
+    request->buffer_index = 0;
+    request->scan_index = 0;
+    request->complete = false;
     debug_return;
 }
 
-request_s *request_get(http_client_s *client) {
+request_read_e request_append(request_s *request, const char *data, size_t len) {
     debug_enter();
-    http_server_s *server = client->server;
-    log_debug(server->log, "getting request for client %s", client->ip);
-    request_s *request = malloc(sizeof(request_s));
-    if (request == NULL) {
-        log_error(server->log, "malloc failed: %s", strerror(errno));
-        debug_return NULL;
+    http_client_s *client = request->client;
+    if (request->buffer_len + len > REQUEST_BUFFER_MAX) {
+        log_error(client->server->log, "request header too long > %d bytes from client %s", REQUEST_BUFFER_MAX, client->ip);
+        debug_return REQUEST_READ_TOO_LARGE;
     }
-    memset(request, 0, sizeof(request_s));
-    request->buffer = malloc(BUFFER_SIZE);
-    if (request->buffer == NULL) {
-        log_error(server->log, "malloc failed: %s", strerror(errno));
-        free(request);
-        debug_return NULL;
+    size_t size = request->buffer_size;
+    while (size < request->buffer_len + len) {
+        size <<= 1;
     }
-    request->client = client;
-    request->url_variables = NULL;
-    log_debug(server->log, "request setup complete for client %s", client->ip);
-    debug_return request;
+    if (size != request->buffer_size && grow_buffer(request, size) != 0) {
+        debug_return REQUEST_READ_ERROR;
+    }
+    if (len > 0) {
+        memcpy(request->buffer + request->buffer_len, data, len);
+        request->buffer_len += len;
+    }
+    if (header_complete(request)) {
+        request->complete = true;
+        debug_return REQUEST_READ_COMPLETE;
+    }
+    if (request->buffer_len >= REQUEST_BUFFER_MAX) {
+        log_error(client->server->log, "request header too long > %d bytes from client %s", REQUEST_BUFFER_MAX, client->ip);
+        debug_return REQUEST_READ_TOO_LARGE;
+    }
+    debug_return REQUEST_READ_AGAIN;
+}
+
+request_read_e request_read(request_s *request) {
+    debug_enter();
+    http_client_s *client = request->client;
+    log_s *log = client->server->log;
+    while (!header_complete(request)) {
+        if (request->buffer_len >= request->buffer_size) {
+            if (request->buffer_size >= REQUEST_BUFFER_MAX) {
+                log_error(log, "request header too long > %d bytes from client %s", REQUEST_BUFFER_MAX, client->ip);
+                debug_return REQUEST_READ_TOO_LARGE;
+            }
+            if (grow_buffer(request, request->buffer_size << 1) != 0) {
+                debug_return REQUEST_READ_ERROR;
+            }
+        }
+        ssize_t n = http_read(client, request->buffer + request->buffer_len, request->buffer_size - request->buffer_len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                debug_return REQUEST_READ_AGAIN;
+            }
+            log_error(log, "recv failed for client %s: %s", client->ip, strerror(errno));
+            debug_return REQUEST_READ_ERROR;
+        }
+        if (n == 0) {
+            debug_return REQUEST_READ_EOF;
+        }
+        debug("request_read() received: %*s\n", n, request->buffer + request->buffer_len);
+        request->buffer_len += n;
+    }
+    request->complete = true;
+    debug_return REQUEST_READ_COMPLETE;
+}
+
+request_read_e request_set(request_s *request, const struct iovec *iov, int iovcnt) {
+    debug_enter();
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len > REQUEST_BUFFER_MAX) {
+        debug_return REQUEST_READ_TOO_LARGE;
+    }
+    if (len > request->buffer_size) {
+        char *buffer = request->buffer == request->inline_buffer ? NULL : request->buffer;
+        if ((buffer = realloc(buffer, REQUEST_BUFFER_MAX)) == NULL) {
+            debug_return REQUEST_READ_ERROR;
+        }
+        request->buffer = buffer;
+        request->buffer_size = REQUEST_BUFFER_MAX;
+    }
+    request->buffer_len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(request->buffer + request->buffer_len, iov[i].iov_base, iov[i].iov_len);
+        request->buffer_len += iov[i].iov_len;
+    }
+    request->scan_index = 0;
+    request->complete = header_complete(request);
+    debug_return request->complete ? REQUEST_READ_COMPLETE : REQUEST_READ_ERROR;
 }
 
 request_parse_error_e request_parse(request_s *request) {
@@ -129,973 +370,556 @@ request_parse_error_e request_parse(request_s *request) {
     request_parse_error_e res;
     log_s *log = request->client->server->log;
     http_client_s *client = request->client;
-    int ch;
     log_debug(log, "parsing request from client %s", client->ip);
-    res = get_method(request);
-    if (res != REQUEST_PARSE_OK) {
-        debug("get_method() != REQUEST_PARSE_OK: %d\n", res);
-        if (res == REQUEST_PARSE_BAD) {
-            debug("returning REQUEST_PARSE_NOT_IMPLEMENTED\n");
-            debug_return REQUEST_PARSE_NOT_IMPLEMENTED;
-        }
+    if (!request->complete) {
+        log_error(log, "incomplete request from client %s", client->ip);
+        debug_return REQUEST_PARSE_BAD;
+    }
+    // header_complete() left scan_index just past the end of the header,
+    // where the next pipelined request starts whether or not this one parses.
+    char *buffer = request->buffer;
+    size_t end = request->scan_index;
+    request->buffer_index = end;
+    char *nl = memchr(buffer, '\n', end);
+    if (nl == NULL) {
+        log_error(log, "invalid request from client %s: missing request line", client->ip);
+        debug_return REQUEST_PARSE_BAD;
+    }
+    size_t line_end = nl - buffer;
+    if (line_end > 0 && buffer[line_end - 1] == '\r') {
+        line_end--;
+    }
+    size_t pos = 0;
+    while (pos < line_end && !is_ws(buffer[pos])) {
+        pos++;
+    }
+    if ((res = parse_method(request, buffer, pos)) != REQUEST_PARSE_OK) {
         debug_return res;
     }
     // Only accepting GET and HEAD
     if (request->method != REQUEST_METHOD_GET && request->method != REQUEST_METHOD_HEAD) {
         debug_return REQUEST_PARSE_NOT_IMPLEMENTED;
     }
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    if (!isspace(ch)) {
+    if (pos == line_end) {
         log_error(log, "invalid request from client %s: missing whitespace after method", client->ip);
         debug_return REQUEST_PARSE_BAD;
     }
-    if ((ch = skip_ws(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
+    while (pos < line_end && is_ws(buffer[pos])) {
+        pos++;
     }
-    if (ch == '\n') {
+    if (pos == line_end) {
         log_error(log, "invalid request from client %s: expected URI", client->ip);
         debug_return REQUEST_PARSE_BAD;
     }
-    if ((ch = get_uri(request)) != REQUEST_PARSE_OK) {
-        debug_return ch;
+    size_t uri = pos;
+    while (pos < line_end && !is_ws(buffer[pos])) {
+        pos++;
     }
-    if ((ch = io_peek(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    if (ch == '?') {
-        if ((ch = get_query(request)) != REQUEST_PARSE_OK) {
-            log_error(log, "invalid request from client %s", client->ip);
-            debug_return ch;
-        }
-        if ((ch = io_peek(request)) < IO_OK) {
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
+    if ((res = parse_uri(request, uri, pos)) != REQUEST_PARSE_OK) {
+        debug_return res;
     }
-    if (ch == '#') {
-        if ((ch = io_next(request)) < IO_OK) {
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if ((ch = get_uri_fragment(request)) != REQUEST_PARSE_OK) {
-            debug_return ch;
-        }
+    while (pos < line_end && is_ws(buffer[pos])) {
+        pos++;
     }
-    request->type = REQUEST_TYPE_FULL;
-    if (isspace(ch)) {
-        if ((ch = skip_ws(request)) < IO_OK) {
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (ch == '\n') {
-            request->type = REQUEST_TYPE_SIMPLE;
-        }
-    }
-    log_debug(log, "got request type %s from client %s", request->type == REQUEST_TYPE_SIMPLE ? "simple" : "full", client->ip);
-    if (request->type == REQUEST_TYPE_SIMPLE) {
+    if (pos == line_end) {
+        request->type = REQUEST_TYPE_SIMPLE;
+        log_debug(log, "got request type simple from client %s", client->ip);
         if (request->method != REQUEST_METHOD_GET) {
             log_error(log, "invalid request from client %s, simple request must be GET", client->ip);
             debug_return REQUEST_PARSE_BAD;
         }
         request->http_version_major = http_version_major_default;
         request->http_version_minor = http_version_minor_default;
-    } else {
-        if ((ch = get_http_ver(request)) != REQUEST_PARSE_OK) {
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
+        debug_return REQUEST_PARSE_OK;
     }
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
+    request->type = REQUEST_TYPE_FULL;
+    size_t version = pos;
+    while (pos < line_end && !is_ws(buffer[pos])) {
+        pos++;
     }
-    if (ch != '\r') {
-        log_error(log, "invalid request from client %s: expected \\r", client->ip);
-        debug_return REQUEST_PARSE_BAD;
+    if ((res = parse_version(request, buffer + version, pos - version)) != REQUEST_PARSE_OK) {
+        debug_return res;
     }
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
+    while (pos < line_end && is_ws(buffer[pos])) {
+        pos++;
     }
-    if (ch != '\n') {
-        log_error(log, "invalid request from client %s: expected \\n", client->ip);
+    if (pos != line_end) {
+        log_error(log, "invalid request from client %s: unexpected data after HTTP version", client->ip);
         debug_return REQUEST_PARSE_BAD;
     }
-    if ((ch = get_headers(request)) != REQUEST_PARSE_OK) {
+    if ((res = parse_headers(request, nl - buffer + 1, end)) != REQUEST_PARSE_OK) {
         log_error(log, "invalid request from client %s: unable to parse headers", client->ip);
-        debug_return REQUEST_PARSE_BAD;
-    }
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    if (ch == '\r') {
-        if ((ch = io_next(request)) < IO_OK) {
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (ch != '\n') {
-            log_error(log, "invalid request from client %s: expected \\n", client->ip);
-            debug_return REQUEST_PARSE_BAD;
-        }
-    } else if (ch != '\n') {
-        log_error(log, "invalid request from client %s: expected \\r or \\n", client->ip);
-        debug_return REQUEST_PARSE_BAD;
+        debug_return res;
     }
     debug_return REQUEST_PARSE_OK;
 }
 
-static int add_header(request_s *request, char *var, char *val) {
-    debug_enter();
-    http_variable_s *variable = malloc(sizeof(http_variable_s));
-    if (variable == NULL) {
-        log_error(request->client->server->log, "malloc failed: %s", strerror(errno));
-        debug_return IO_ERROR;
-    }
-    variable->var = var;
-    variable->val = val;
-    variable->next = request->headers;
-    request->headers = variable;
-    debug("added header %s = %s\n", var, val);
-    debug_return IO_OK;
-}
-
-static request_parse_error_e add_variable(request_s *request, char *var, char *val) {
-    debug_enter();
-    http_variable_s *variable = malloc(sizeof(http_variable_s));
-    if (variable == NULL) {
-        log_error(request->client->server->log, "malloc failed: %s", strerror(errno));
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    variable->var = var;
-    variable->val = val;
-    variable->next = request->url_variables;
-    request->url_variables = variable;
-    debug("added query variable %s = %s\n", var, val);
-    debug_return REQUEST_PARSE_OK;
-}
-
-static int io_next(request_s *request) {
-    if (request->buffer_index >= request->buffer_len) {
-        request->buffer_len = http_read(request->client, request->buffer, BUFFER_SIZE);
-        if (request->buffer_len < 0) {
-            log_error(request->client->server->log, "recv failed for client %s: %s", request->client->ip, strerror(errno));
-            return IO_ERROR;
-        }
-        if (request->buffer_len == 0) {
-            return IO_EOF;
+/**
+ * @brief Moves the receive buffer to the heap with room for size bytes, or
+ * grows the heap buffer it already has. Returns 0 on success, -1 on no 
+ * memory.
+ */
+static int grow_buffer(request_s *request, size_t size) {
+    char *buffer;
+    if (request->buffer == request->inline_buffer) {
+        if ((buffer = malloc(size)) != NULL) {
+            memcpy(buffer, request->inline_buffer, request->buffer_len);
         }
-        request->buffer_index = 0;
-        debug("io_next() received: %*s\n", request->buffer_len, request->buffer);
+    } else {
+        buffer = realloc(request->buffer, size);
     }
-    return request->buffer[request->buffer_index++];
+    if (buffer == NULL) {
+        log_error(request->client->server->log, "realloc failed for client %s: %s", request->client->ip, strerror(errno));
+        return -1;
+    }
+    request->buffer = buffer;
+    request->buffer_size = size;
+    return 0;
 }
 
-static int io_peek(request_s *request) {
-    if (request->buffer_index >= request->buffer_len) {
-        request->buffer_len = http_read(request->client, request->buffer, BUFFER_SIZE);
-        if (request->buffer_len < 0) {
-            log_error(request->client->server->log, "recv failed for client %s: %s", request->client->ip, strerror(errno));
-            return IO_ERROR;
+/**
+ * @brief Checks whether the buffer holds a complete request header: a blank
+ * line terminating the headers, or a request line with no HTTP version (a
+ * simple request). Scanning resumes where the previous call left off.
+ */
+static bool header_complete(request_s *request) {
+    char *buffer = request->buffer;
+    size_t i = request->scan_index;
+    while (i < request->buffer_len) {
+        char *nl = memchr(buffer + i, '\n', request->buffer_len - i);
+        if (nl == NULL) {
+            break;
         }
-        if (request->buffer_len == 0) {
-            return IO_EOF;
+        size_t line_end = nl - buffer;
+        if (i == 0) {
+            // Request line: a simple request has no "HTTP/" version field.
+            if (memmem(buffer, line_end, " HTTP/", 6) == NULL) {
+                request->scan_index = line_end + 1;
+                return true;
+            }
+        } else if ((line_end >= 1 && buffer[line_end - 1] == '\n') || (line_end >= 2 && buffer[line_end - 1] == '\r' && buffer[line_end - 2] == '\n')) {
+            request->scan_index = line_end + 1;
+            return true;
         }
-        request->buffer_index = 0;
-        debug("io_peek() received: %*s\n", request->buffer_len, request->buffer);
+        i = line_end + 1;
     }
-    return request->buffer[request->buffer_index];
+    // Resume from the start of the incomplete line on the next call.
+    request->scan_index = i;
+    return false;
 }
 
-static int get_headers(request_s *request) {
-    debug_enter();
-    log_s *log = request->client->server->log;
-    http_client_s *client = request->client;
-    int ch;
-    log_debug(log, "parsing headers from client %s", client->ip);
-    while (1) {
-        if ((ch = io_peek(request)) < IO_OK) {
-            log_debug(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (ch == '\r') {
-            break;
-        }
-        char *var = NULL;
-        if ((ch = parse_var(request, ':', &var)) != REQUEST_PARSE_OK) {
-            return ch;
-        }
-        if (var == NULL) {
-            log_debug(log, "No var found from client %s", client->ip);
-            return REQUEST_PARSE_BAD;
-        }
-        if ((ch = io_next(request)) < IO_OK) {
-            log_debug(log, error_str_io);
-            free(var);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (ch != ':') {
-            log_debug(log, "expected :, got %02xh from client %s", ch, client->ip);
-            debug_return REQUEST_PARSE_BAD;
-        }
-        if ((ch = io_next(request)) < IO_OK) {
-            log_debug(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (ch != ' ') {
-            log_debug(log, "expected space, got %02xh from client %s", ch, client->ip);
-            debug_return REQUEST_PARSE_BAD;
-        }
-        char *val = NULL;
-        if ((ch = parse_val(request, &val)) != REQUEST_PARSE_OK) {
-            free(var);
-            return ch;
-        }
-        if (val == NULL) {
-            log_debug(log, "No val found from client %s", client->ip);
-            free(var);
-            return REQUEST_PARSE_BAD;
-        }
-        if (add_header(request, var, val) != REQUEST_PARSE_OK) {
-            free(var);
-            free(val);
-            return REQUEST_PARSE_ERROR;
+/**
+ * @brief Checks a comma separated header value, such as Connection, for the
+ * given token, ignoring case and surrounding whitespace.
+ */
+static bool header_has_token(const char *value, const char *token) {
+    size_t token_len = strlen(token);
+    const char *cp = value;
+    while (*cp) {
+        while (*cp == ' ' || *cp == '\t' || *cp == ',') {
+            cp++;
         }
-        if ((ch = io_next(request)) < IO_OK) {
-            log_debug(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
+        const char *start = cp;
+        while (*cp && *cp != ',') {
+            cp++;
         }
-        if (ch != '\r') {
-            log_debug(log, "expected \\r from client %s", client->ip);
-            debug_return REQUEST_PARSE_BAD;
+        const char *end = cp;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
         }
-        if ((ch = io_next(request)) < IO_OK) {
-            log_debug(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (ch != '\n') {
-            log_debug(log, "expected \\n, got %02xh from client %s", ch, client->ip);
-            debug_return REQUEST_PARSE_BAD;
+        if (end - start == token_len && strncasecmp(start, token, token_len) == 0) {
+            return true;
         }
     }
-    debug_return REQUEST_PARSE_OK;
+    return false;
 }
 
-static request_parse_error_e get_http_ver(request_s *request) {
-    debug_enter();
-    http_client_s *client = request->client;
-    log_s *log = client->server->log;
-    int ch;
-    int i;
-    char buffer[16];
-    char *minor = NULL;
-    log_debug(log, "parsing HTTP version from client %s", client->ip);
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    if (ch != 'H') {
-        log_error(log, "invalid HTTP version from client %s", client->ip);
-        debug_return REQUEST_PARSE_BAD;
-    }
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    if (ch != 'T') {
-        log_error(log, "invalid HTTP version from client %s", client->ip);
-        debug_return REQUEST_PARSE_BAD;
-    }
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    if (ch != 'T') {
-        log_error(log, "invalid HTTP version from client %s", client->ip);
-        debug_return REQUEST_PARSE_BAD;
-    }
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    if (ch != 'P') {
-        log_error(log, "invalid HTTP version from client %s", client->ip);
-        debug_return REQUEST_PARSE_BAD;
-    }
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    if (ch != '/') {
-        log_error(log, "invalid HTTP version from client %s", client->ip);
-        debug_return REQUEST_PARSE_BAD;
-    }
-    for (i = 0; i < sizeof(buffer) - 1; i++) {
-        if ((ch = io_peek(request)) < IO_OK) {
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (isspace(ch)) {
-            buffer[i] = 0;
-            break;
-        } else if (!isdigit(ch) && ch != '.') {
-            log_error(log, "invalid HTTP version from client %s", client->ip);
-            debug_return REQUEST_PARSE_BAD;
-        } else if (ch == '.') {
-            if (minor != NULL) {
-                log_error(log, "invalid HTTP version from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            ch = 0;
-            minor = &buffer[i + 1];
-        }
-        if ((ch = io_next(request)) < IO_OK) {
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        buffer[i] = ch;
+/**
+ * @brief FNV-1a hash of a header name, folded to lower case.
+ */
+static size_t header_hash(const char *name, size_t len) {
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)tolower((unsigned char)name[i]);
+        hash *= 16777619u;
     }
-    buffer[i] = 0;
-    request->http_version_major = strtol(buffer, NULL, 10);
-    request->http_version_minor = strtol(minor, NULL, 10);
-    log_debug(log, "HTTP version: %d.%d from client %s", request->http_version_major, request->http_version_minor, client->ip);
-    debug_return REQUEST_PARSE_OK;
+    return hash;
 }
 
-static request_parse_error_e get_method(request_s *request) {
-    debug_enter();
-    int ch;
-    http_client_s *client = request->client;
-    log_s *log = client->server->log;
-    log_debug(log, "parsing request method from client %s", client->ip);
-    if ((ch = io_next(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
-    }
-    switch (ch) {
-        case 'C':
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'O') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'N') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'N') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'E') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'C') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'T') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            request->method = REQUEST_METHOD_CONNECT;
+/**
+ * @brief Maps a header name to its request_header_e slot, or 
+ * REQUEST_HEADER_COUNT if it is not one the server acts on. The length and
+ * first letter pick the only possible candidate, which one comparison then
+ * confirms.
+ */
+static request_header_e header_known(const char *name, size_t len) {
+    request_header_e header;
+    switch (len) {
+        case 4:
+            header = REQUEST_HEADER_HOST;
             break;
-        case 'D':
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'E') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'L') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'E') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'T') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'E') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            request->method = REQUEST_METHOD_DELETE;
+        case 5:
+            header = REQUEST_HEADER_RANGE;
             break;
-        case 'G':
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'E') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'T') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            request->method = REQUEST_METHOD_GET;
+        case 8:
+            header = REQUEST_HEADER_IF_RANGE;
             break;
-        case 'H':
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'E') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'A') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'D') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            request->method = REQUEST_METHOD_HEAD;
+        case 10:
+            header = REQUEST_HEADER_CONNECTION;
             break;
-        case 'O':
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'P') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'T') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'I') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'O') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'N') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'S') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            request->method = REQUEST_METHOD_OPTIONS;
+        case 13:
+            header = REQUEST_HEADER_IF_NONE_MATCH;
             break;
-        case 'P':
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch == 'O') {
-                if ((ch = io_next(request)) < IO_OK) {
-                    log_error(log, error_str_io);
-                    debug_return REQUEST_PARSE_IO_ERROR;
-                }
-                if (ch != 'S') {
-                log_error(log, "invalid method from client %s", client->ip);
-                    debug_return REQUEST_PARSE_BAD;
-                }
-                if ((ch = io_next(request)) < IO_OK) {
-                    log_error(log, error_str_io);
-                    debug_return REQUEST_PARSE_IO_ERROR;
-                }
-                if (ch != 'T') {
-                log_error(log, "invalid method from client %s", client->ip);
-                    debug_return REQUEST_PARSE_BAD;
-                }
-                request->method = REQUEST_METHOD_POST;
-            } else if (ch == 'U') {
-                if ((ch = io_next(request)) < IO_OK) {
-                    log_error(log, error_str_io);
-                    debug_return REQUEST_PARSE_IO_ERROR;
-                }
-                if (ch != 'T') {
-                log_error(log, "invalid method from client %s", client->ip);
-                    debug_return REQUEST_PARSE_BAD;
-                }
-                request->method = REQUEST_METHOD_PUT;
-            }
-            debug_return REQUEST_PARSE_IO_ERROR;
-        case 'T':
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'R') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'A') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'C') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (ch != 'E') {
-                log_error(log, "invalid method from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            request->method = REQUEST_METHOD_TRACE;
+        case 14:
+            header = REQUEST_HEADER_CONTENT_LENGTH;
+            break;
+        case 15:
+            header = REQUEST_HEADER_ACCEPT_ENCODING;
+            break;
+        case 17:
+            header = (name[0] | 0x20) == 'i' ? REQUEST_HEADER_IF_MODIFIED_SINCE : REQUEST_HEADER_TRANSFER_ENCODING;
             break;
         default:
-            log_error(log, "invalid method from client %s", client->ip);
-            debug_return REQUEST_PARSE_BAD;
+            return REQUEST_HEADER_COUNT;
+    }
+    return strncasecmp(name, header_names[header], len) == 0 ? header : REQUEST_HEADER_COUNT;
+}
+
+/**
+ * @brief Indexes the header at position index - 1 of request->headers, 
+ * either in known or in headers_table. A repeated header keeps the first
+ * entry.
+ */
+static void header_index(request_s *request, unsigned int index) {
+    request_variable_s *header = &request->headers[index - 1];
+    const char *name = request->buffer + header->name.offset;
+    request_header_e known = header_known(name, header->name.len);
+    if (known != REQUEST_HEADER_COUNT) {
+        if (request->known[known] == 0) {
+            request->known[known] = index;
+        }
+        return;
     }
-    if ((ch = io_peek(request)) < IO_OK) {
-        log_error(log, error_str_io);
-        debug_return REQUEST_PARSE_IO_ERROR;
+    size_t mask = REQUEST_HEADERS_TABLE_SIZE - 1;
+    size_t slot = header_hash(name, header->name.len) & mask;
+    for (; request->headers_table[slot] != 0; slot = (slot + 1) & mask) {
+        request_variable_s *other = &request->headers[request->headers_table[slot] - 1];
+        if (other->name.len == header->name.len && strncasecmp(request->buffer + other->name.offset, name, header->name.len) == 0) {
+            return;
+        }
     }
-    if (!isspace(ch)) {
-        log_error(log, "invalid method from client %s", client->ip);
-        debug_return REQUEST_PARSE_BAD;
+    request->headers_table[slot] = index;
+}
+
+/**
+ * @brief Returns the value of a hex digit, or -1 if ch is not one.
+ */
+static int hex_value(int ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
     }
-    log_debug(log, "returning method %s (%02x) successfully for client %s", method_str[request->method], request->method, client->ip);
-    debug_return REQUEST_PARSE_OK;
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
 }
 
-static int get_query(request_s *request) {
+static bool is_ws(int ch) {
+    return ch == ' ' || ch == '\t';
+}
+
+/**
+ * @brief Records the header lines between offset and end, up to the blank
+ * line that ends the header. Each line is found with memchr(), split at the
+ * first colon and stored as name and value slices, the value trimmed of
+ * surrounding whitespace and NUL terminated in place.
+ */
+static request_parse_error_e parse_headers(request_s *request, size_t offset, size_t end) {
     debug_enter();
     http_client_s *client = request->client;
     log_s *log = client->server->log;
-    int ch;
-    log_debug(log, "parsing query from URI for client %s", client->ip);
-    if ((ch = io_next(request)) == IO_ERROR) {
-        debug_return ch;
-    }
-    if (ch != '?') {
-        debug_return IO_OK;
-    }
-    while (1) {
-        if ((ch = io_peek(request)) < IO_OK) {
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (isspace(ch) || ch == '#') {
-            break;
-        }
-        char *var = NULL;
-        if ((ch = parse_var(request, '=', &var)) != REQUEST_PARSE_OK) {
-            return ch;
+    char *buffer = request->buffer;
+    size_t pos = offset;
+    while (pos < end) {
+        char *nl = memchr(buffer + pos, '\n', end - pos);
+        if (nl == NULL) {
+            log_debug(log, "unterminated header line from client %s", client->ip);
+            debug_return REQUEST_PARSE_BAD;
         }
-        if (var == NULL) {
-            return REQUEST_PARSE_IO_ERROR;
+        size_t line_end = nl - buffer;
+        if (line_end > pos && buffer[line_end - 1] == '\r') {
+            line_end--;
         }
-        if ((ch = io_next(request)) < IO_OK) {
-            free(var);
-            debug_return REQUEST_PARSE_IO_ERROR;
+        if (line_end == pos) {
+            debug_return REQUEST_PARSE_OK;
         }
-        if (ch != '=') {
-            free(var);
+        if (is_ws(buffer[pos])) {
+            log_debug(log, "folded header line from client %s", client->ip);
             debug_return REQUEST_PARSE_BAD;
         }
-        char *val = NULL;
-        if ((ch = parse_val(request, &val)) != REQUEST_PARSE_OK) {
-            free(var);
-            return ch;
+        char *colon = memchr(buffer + pos, ':', line_end - pos);
+        if (colon == NULL || colon == buffer + pos) {
+            log_debug(log, "No var found from client %s", client->ip);
+            debug_return REQUEST_PARSE_BAD;
         }
-        if (val == NULL) {
-            free(var);
-            return REQUEST_PARSE_IO_ERROR;
+        size_t name_end = colon - buffer;
+        if (memchr(buffer + pos, ' ', name_end - pos) != NULL || memchr(buffer + pos, '\t', name_end - pos) != NULL) {
+            log_debug(log, "whitespace in header name from client %s", client->ip);
+            debug_return REQUEST_PARSE_BAD;
         }
-        request_parse_error_e res = add_variable(request, var, val);
-        if (res != REQUEST_PARSE_OK) {
-            free(var);
-            free(val);
-            return res;
+        size_t value = name_end + 1;
+        while (value < line_end && is_ws(buffer[value])) {
+            value++;
         }
-        if ((ch = io_peek(request)) < IO_OK) {
-            debug_return REQUEST_PARSE_IO_ERROR;
+        size_t value_end = line_end;
+        while (value_end > value && is_ws(buffer[value_end - 1])) {
+            value_end--;
         }
-        if (ch == '&') {
-            if ((ch = io_next(request)) < IO_OK) {
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
+        if (request->headers_count >= REQUEST_HEADERS_MAX) {
+            log_error(log, "too many headers > %d from client %s", REQUEST_HEADERS_MAX, client->ip);
+            debug_return REQUEST_PARSE_BAD;
         }
-    }
-    debug_return REQUEST_PARSE_OK;
+        request_variable_s *header = &request->headers[request->headers_count++];
+        header->name.offset = pos;
+        header->name.len = name_end - pos;
+        header->value.offset = value;
+        header->value.len = value_end - value;
+        buffer[value_end] = 0;
+        header_index(request, request->headers_count);
+        debug("added header %.*s = %s\n", (int)header->name.len, buffer + pos, buffer + value);
+        pos = nl - buffer + 1;
+    }
+    log_debug(log, "missing end of header from client %s", client->ip);
+    debug_return REQUEST_PARSE_BAD;
 }
 
-static request_parse_error_e get_uri(request_s *request) {
+/**
+ * @brief Looks up the len bytes at method in the method table. Methods are
+ * case sensitive.
+ */
+static request_parse_error_e parse_method(request_s *request, const char *method, size_t len) {
     debug_enter();
-    static const char index_html_str[] = "index.html";
     http_client_s *client = request->client;
     log_s *log = client->server->log;
-    char *uri = malloc(BUFFER_SIZE);
-    size_t uri_size = BUFFER_SIZE;
-    size_t uri_len = 0;
-    int ch;
-    log_info(log, "parsing uri from client %s", client->ip);
-    while (1) {
-        if ((ch = io_peek(request)) < IO_OK) {
-            free(uri);
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (uri_len >= uri_size) {
-            if (uri_size >= URI_SIZE_MAX) {
-                free(uri);
-                log_error(log, "path too long > %d bytes from client %s", uri_len, client->ip);
-                debug_return REQUEST_PARSE_ERROR;
-            }
-            uri_size <<= 1;
-            char *new_uri = realloc(uri, uri_size);
-            if (new_uri == NULL) {
-                free(uri);
-                log_error(log, "realloc failed in client %s: %s", client->ip, strerror(errno));
-                debug_return REQUEST_PARSE_ERROR;
-            }
-            uri = new_uri;
-        }
-        if (isspace(ch) || ch == '?' || ch == '#') {
-            break;
-        }
-        if (ch == '%') {
-            if ((ch = io_next(request)) < IO_OK) {
-                free(uri);
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                free(uri);
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (!isxdigit(ch)) {
-                free(uri);
-                log_error(log, "invalid hex digit from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            int digit = ch;
-            if ((ch = io_peek(request)) < IO_OK) {
-                free(uri);
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (!isxdigit(ch)) {
-                free(uri);
-                log_error(log, "invalid hex digit from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            ch += (digit << 4);
-        }
-        uri[uri_len++] = ch;
-        if ((ch = io_next(request)) < IO_OK) {
-            free(uri);
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-    }
-    uri[uri_len] = 0;
-    if (uri[uri_len - 1] == '/') {
-        if (uri_len + sizeof(index_html_str) > uri_size) {
-            uri_size = uri_len + sizeof(index_html_str);
-            char *new_uri = realloc(uri, uri_size);
-            if (new_uri == NULL) {
-                free(uri);
-                log_error(log, "realloc failed in client %s: %s", client->ip, strerror(errno));
-                debug_return REQUEST_PARSE_ERROR;
-            }
-            uri = new_uri;
+    for (int i = 0; i < sizeof(request_method_str) / sizeof(request_method_str[0]); i++) {
+        if (strlen(request_method_str[i]) == len && memcmp(method, request_method_str[i], len) == 0) {
+            request->method = i;
+            log_debug(log, "returning method %s (%02x) successfully for client %s", request_method_str[request->method], request->method, client->ip);
+            debug_return REQUEST_PARSE_OK;
         }
-        strcat(uri, index_html_str);
-    }
-    if ((request->uri = strdup(uri)) == NULL) {
-        free(uri);
-        log_error(log, "strdup failed in client %s: %s", client->ip, strerror(errno));
-        debug_return REQUEST_PARSE_ERROR;
     }
-    free(uri);
-    log_debug(log, "uri from client %s: %s", client->ip, request->uri);
-    debug_return REQUEST_PARSE_OK;
+    log_error(log, "invalid method from client %s", client->ip);
+    debug_return REQUEST_PARSE_NOT_IMPLEMENTED;
 }
 
-static request_parse_error_e get_uri_fragment(request_s *request) {
+/**
+ * @brief Records the query variables between offset and end, which are
+ * separated by '&'. A variable with no '=' has an empty value.
+ */
+static request_parse_error_e parse_query(request_s *request, size_t offset, size_t end) {
     debug_enter();
     http_client_s *client = request->client;
-    log_s *log = client->server->log;
-    char *fragment = malloc(BUFFER_SIZE);
-    size_t fragment_size = BUFFER_SIZE;
-    size_t fragment_len = 0;
-    int ch;
-    log_info(log, "parsing uri fragment from client %s", client->ip);
-    while (1) {
-        if ((ch = io_peek(request)) < IO_OK) {
-            free(fragment);
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
-        }
-        if (fragment_len >= fragment_size) {
-            if (fragment_size >= URI_SIZE_MAX) {
-                free(fragment);
-                log_error(log, "path too long > %d bytes from client %s", fragment_len, client->ip);
-                debug_return REQUEST_PARSE_ERROR;
-            }
-            fragment_size <<= 1;
-            char *new_fragment = realloc(fragment, fragment_size);
-            if (new_fragment == NULL) {
-                free(fragment);
-                log_error(log, "realloc failed in client %s: %s", client->ip, strerror(errno));
-                debug_return REQUEST_PARSE_ERROR;
-            }
-            fragment = new_fragment;
-        }
-        if (isspace(ch)) {
-            break;
-        }
-        if (ch == '%') {
-            if ((ch = io_next(request)) < IO_OK) {
-                free(fragment);
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if ((ch = io_next(request)) < IO_OK) {
-                free(fragment);
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (!isxdigit(ch)) {
-                free(fragment);
-                log_error(log, "invalid hex digit from client %s", client->ip);
-                debug_return REQUEST_PARSE_BAD;
-            }
-            int digit = ch;
-            if ((ch = io_peek(request)) < IO_OK) {
-                free(fragment);
-                log_error(log, error_str_io);
-                debug_return REQUEST_PARSE_IO_ERROR;
-            }
-            if (!isxdigit(ch)) {
-                free(fragment);
-                log_error(log, "invalid hex digit from client %s", client->ip);
+    char *buffer = request->buffer;
+    size_t pos = offset;
+    while (pos < end) {
+        char *amp = memchr(buffer + pos, '&', end - pos);
+        size_t var_end = amp != NULL ? (size_t)(amp - buffer) : end;
+        if (var_end > pos) {
+            if (request->url_variables_count >= REQUEST_VARIABLES_MAX) {
+                log_error(client->server->log, "too many query variables > %d from client %s", REQUEST_VARIABLES_MAX, client->ip);
                 debug_return REQUEST_PARSE_BAD;
             }
-            ch += (digit << 4);
-        }
-        fragment[fragment_len++] = ch;
-        if ((ch = io_next(request)) < IO_OK) {
-            free(fragment);
-            log_error(log, error_str_io);
-            debug_return REQUEST_PARSE_IO_ERROR;
+            char *eq = memchr(buffer + pos, '=', var_end - pos);
+            size_t name_end = eq != NULL ? (size_t)(eq - buffer) : var_end;
+            request_variable_s *variable = &request->url_variables[request->url_variables_count++];
+            variable->name.offset = pos;
+            variable->name.len = name_end - pos;
+            variable->value.offset = eq != NULL ? name_end + 1 : var_end;
+            variable->value.len = var_end - variable->value.offset;
+            debug("added query variable %.*s = %.*s\n", (int)variable->name.len, buffer + pos, (int)variable->value.len, buffer + variable->value.offset);
         }
+        pos = var_end + 1;
     }
-    fragment[fragment_len] = 0;
-    if ((request->uri_fragment = strdup(fragment)) == NULL) {
-        free(fragment);
-        log_error(log, "strdup failed from client %s: %s", client->ip, strerror(errno));
-        debug_return REQUEST_PARSE_ERROR;
-    }
-    free(fragment);
-    log_debug(log, "uri fragment from client %s: %s", client->ip, request->uri_fragment);
     debug_return REQUEST_PARSE_OK;
 }
 
-static request_parse_error_e parse_val(request_s *request, char **val) {
-    int ch;
-    http_client_s *client = request->client;
-    log_s *log = client->server->log;
-    char *ret = NULL;
-    char *res = malloc(BUFFER_SIZE);
-    size_t res_size = BUFFER_SIZE;
-    size_t res_len = 0;
-    while (1) {
-        if ((ch = io_peek(request)) < IO_OK) {
-            free(res);
-            return REQUEST_PARSE_IO_ERROR;
-        }
-        if (res_len >= res_size) {
-            if (res_size >= URL_VAR_VALUE_MAX) {
-                log_error(log, "url variable value too long > %d bytes from client %s", res_len, client->ip);
-                free(res);
-                return REQUEST_PARSE_ERROR;
-            }
-            res_size <<= 1;
-            char *new_res = realloc(res, res_size);
-            if (new_res == NULL) {
-                log_error(log, "realloc failed in client %s: %s", client->ip, strerror(errno));
-                free(res);
-                return REQUEST_PARSE_ERROR;
+/**
+ * @brief Parses the decimal byte position at cp. Positions too large to 
+ * represent are clamped, which leaves them past the end of any file. 
+ * Returns a pointer past the digits, or NULL if there are none.
+ */
+static const char *parse_position(const char *cp, size_t *position) {
+    if (*cp < '0' || *cp > '9') {
+        return NULL;
+    }
+    size_t value = 0;
+    for (; *cp >= '0' && *cp <= '9'; cp++) {
+        value = value > (SIZE_MAX - 9) / 10 ? SIZE_MAX - 1 : value * 10 + (*cp - '0');
+    }
+    *position = value;
+    return cp;
+}
+
+/**
+ * @brief Parses the q parameter from the parameters of one list element,
+ * between cp and end. Returns thousandths, 1000 if q is not given.
+ */
+static int parse_quality(const char *cp, const char *end) {
+    while (cp < end) {
+        if (*cp == ';') {
+            cp++;
+            while (cp < end && (*cp == ' ' || *cp == '\t')) {
+                cp++;
+            }
+            if (end - cp >= 2 && (*cp == 'q' || *cp == 'Q') && cp[1] == '=') {
+                cp += 2;
+                int q = 0;
+                if (cp < end && *cp == '1') {
+                    return 1000;
+                }
+                if (cp < end && *cp == '0') {
+                    cp++;
+                    if (cp < end && *cp == '.') {
+                        cp++;
+                        for (int scale = 100; scale > 0 && cp < end && isdigit((unsigned char)*cp); scale /= 10, cp++) {
+                            q += (*cp - '0') * scale;
+                        }
+                    }
+                }
+                return q;
             }
-            res = new_res;
-        }
-        if (ch == '&' || ch == '\r') {
-            break;
-        }
-        if ((ch = io_next(request)) < IO_OK) {
-            free(res);
-            return REQUEST_PARSE_IO_ERROR;
         }
-        res[res_len++] = ch;
-    }
-    res[res_len] = 0;
-    if ((ret = strdup(res)) == NULL) {
-        log_error(log, "strdup failed for client %s: %s", client->ip, strerror(errno));
-        free(res);
-        return REQUEST_PARSE_ERROR;
+        cp++;
     }
-    free(res);
-    *val = ret;
-    return REQUEST_PARSE_OK;
+    return 1000;
 }
 
-static request_parse_error_e parse_var(request_s *request, int separator, char **var) {
-    int ch;
+/**
+ * @brief Splits the URI between offset and end into path, query and
+ * fragment. The path is normalized into uri_buffer in one pass: percent 
+ * escapes are decoded, the empty segments of repeated slashes are dropped
+ * and "." and ".." segments are resolved, never climbing above the root.
+ * Decoded slashes and dots count as literal ones, so every spelling of a 
+ * path becomes the one key the cache knows it by. The query and fragment 
+ * are left in the buffer.
+ */
+static request_parse_error_e parse_uri(request_s *request, size_t offset, size_t end) {
+    debug_enter();
     http_client_s *client = request->client;
     log_s *log = client->server->log;
-    char *ret = NULL;
-    char *res = malloc(BUFFER_SIZE);
-    size_t res_size = BUFFER_SIZE;
-    size_t res_len = 0;
-    while (1) {
-        if ((ch = io_peek(request)) < IO_OK) {
-            free(res);
-            return REQUEST_PARSE_IO_ERROR;
-        }
-        if (isspace(ch) && separator == '=') {
-            free(res);
-            return REQUEST_PARSE_BAD;
+    char *buffer = request->buffer;
+    char *hash = memchr(buffer + offset, '#', end - offset);
+    size_t query_end = end;
+    if (hash != NULL) {
+        query_end = hash - buffer;
+        request->uri_fragment.offset = query_end + 1;
+        request->uri_fragment.len = end - query_end - 1;
+    }
+    char *question = memchr(buffer + offset, '?', query_end - offset);
+    size_t path_end = question != NULL ? (size_t)(question - buffer) : query_end;
+    if (path_end == offset) {
+        log_error(log, "invalid request from client %s: empty path", client->ip);
+        debug_return REQUEST_PARSE_BAD;
+    }
+    char *uri = request->uri_buffer;
+    uri[0] = '/';
+    size_t uri_len = 1;
+    size_t segment = 1;
+    // The end of the path ends the last segment like a slash would, 
+    // without adding one.
+    for (size_t i = offset; i <= path_end; i++) {
+        int ch = '/';
+        if (i < path_end) {
+            ch = (unsigned char)buffer[i];
+            if (ch == '%') {
+                int high = i + 2 < path_end ? hex_value(buffer[i + 1]) : -1;
+                int low = high >= 0 ? hex_value(buffer[i + 2]) : -1;
+                if (low < 0 || (high == 0 && low == 0)) {
+                    log_error(log, "invalid hex digit from client %s", client->ip);
+                    debug_return REQUEST_PARSE_BAD;
+                }
+                ch = (high << 4) | low;
+                i += 2;
+            }
         }
-        if (res_len >= res_size) {
-            if (res_size >= URL_VAR_NAME_MAX) {
-                log_error(log, "url variable/header name too long > %d bytes from client %s", res_len, client->ip);
-                free(res);
-                return REQUEST_PARSE_ERROR;
+        if (ch == '/') {
+            size_t len = uri_len - segment;
+            if (len == 2 && uri[segment] == '.' && uri[segment + 1] == '.') {
+                // Drops the ".." and the segment before it.
+                uri_len = segment > 1 ? segment - 1 : 1;
+                while (uri[uri_len - 1] != '/') {
+                    uri_len--;
+                }
+                segment = uri_len;
+                continue;
+            }
+            if (len == 1 && uri[segment] == '.') {
+                uri_len = segment;
+                continue;
             }
-            res_size <<= 1;
-            char *new_res = realloc(res, res_size);
-            if (new_res == NULL) {
-                log_error(log, "realloc failed for client %s: %s", client->ip, strerror(errno));
-                free(res);
-                return REQUEST_PARSE_ERROR;
+            if (len == 0 || i == path_end) {
+                continue;
             }
-            res = new_res;
         }
-        if (ch == separator) {
-            break;
+        if (uri_len >= REQUEST_URI_MAX) {
+            log_error(log, "path too long > %d bytes from client %s", REQUEST_URI_MAX, client->ip);
+            debug_return REQUEST_PARSE_BAD;
         }
-        if ((ch = io_next(request)) < IO_OK) {
-            free(res);
-            return REQUEST_PARSE_IO_ERROR;
+        uri[uri_len++] = ch;
+        if (ch == '/') {
+            segment = uri_len;
         }
-        res[res_len++] = ch;
     }
-    res[res_len] = 0;
-    if ((ret = strdup(res)) == NULL) {
-        log_error(log, "strdup failed for client %s: %s", client->ip, strerror(errno));
-        free(res);
-        return REQUEST_PARSE_ERROR;
+    uri[uri_len] = 0;
+    request->uri = uri;
+    log_debug(log, "uri from client %s: %s", client->ip, request->uri);
+    if (question != NULL) {
+        debug_return parse_query(request, path_end + 1, query_end);
     }
-    free(res);
-    *var = ret;
-    return REQUEST_PARSE_OK;
+    debug_return REQUEST_PARSE_OK;
 }
 
-static int skip_ws(request_s *request) {
+/**
+ * @brief Parses "HTTP/major.minor" from the len bytes at version. A missing
+ * minor version is taken as 0.
+ */
+static request_parse_error_e parse_version(request_s *request, const char *version, size_t len) {
     debug_enter();
-    while (1) {
-        int c = io_peek(request);
-        if (c < 0 || !isspace(c) || c == '\n') {
-            debug_return c;
+    http_client_s *client = request->client;
+    log_s *log = client->server->log;
+    size_t i = 5;
+    int major = 0;
+    int minor = 0;
+    if (len <= 5 || memcmp(version, "HTTP/", 5) != 0) {
+        log_error(log, "invalid HTTP version from client %s", client->ip);
+        debug_return REQUEST_PARSE_BAD;
+    }
+    for (; i < len && isdigit((unsigned char)version[i]) && major < 100; i++) {
+        major = major * 10 + version[i] - '0';
+    }
+    if (i == 5) {
+        log_error(log, "invalid HTTP version from client %s", client->ip);
+        debug_return REQUEST_PARSE_BAD;
+    }
+    if (i < len && version[i] == '.') {
+        size_t start = ++i;
+        for (; i < len && isdigit((unsigned char)version[i]) && minor < 100; i++) {
+            minor = minor * 10 + version[i] - '0';
+        }
+        if (i == start) {
+            log_error(log, "invalid HTTP version from client %s", client->ip);
+            debug_return REQUEST_PARSE_BAD;
         }
-        io_next(request);
     }
+    if (i != len) {
+        log_error(log, "invalid HTTP version from client %s", client->ip);
+        debug_return REQUEST_PARSE_BAD;
+    }
+    request->http_version_major = major;
+    request->http_version_minor = minor;
+    log_debug(log, "HTTP version: %d.%d from client %s", request->http_version_major, request->http_version_minor, client->ip);
+    debug_return REQUEST_PARSE_OK;
 }
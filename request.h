@@ -10,6 +10,9 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include <stdbool.h>
+#include <sys/uio.h>
+
 #include "http.h"
 
 /**
@@ -27,6 +30,11 @@ typedef enum request_method_e {
     REQUEST_METHOD_TRACE
 } request_method_e;
 
+/**
+ * @brief Table of method names mapped to request_method_e codes.
+ */
+extern const char const *request_method_str[];
+
 /**
  * @brief Error codes returned from the request module.
  */
@@ -39,6 +47,19 @@ typedef enum request_parse_error_e {
     REQUEST_PARSE_NOT_IMPLEMENTED = 501,
 } request_parse_error_e;
 
+/**
+ * @brief Results returned from request_read(). REQUEST_READ_AGAIN means the
+ * socket has no more data for now and request_read() should be called again
+ * once it is readable.
+ */
+typedef enum request_read_e {
+    REQUEST_READ_COMPLETE,
+    REQUEST_READ_AGAIN,
+    REQUEST_READ_EOF,
+    REQUEST_READ_ERROR,
+    REQUEST_READ_TOO_LARGE
+} request_read_e;
+
 /**
  * @brief HTTP request types: SIMPLE and FULL, as specified in the HTTP RFC.
  * The SIMPLE type refers to HTTP version 0.9 and FULL refers to version 1.0
@@ -55,49 +76,256 @@ typedef enum request_type_e {
  */
 typedef struct request_s http_request_s;
 
+/**
+ * @brief Largest normalized URI path accepted, in bytes.
+ */
+#define REQUEST_URI_MAX 1024
+#define REQUEST_URI_SIZE (REQUEST_URI_MAX + 1)
+
+/**
+ * @brief Size of the receive buffer kept inside request_s. A request header
+ * that doesn't fit moves to a heap buffer, which grows up to 
+ * REQUEST_BUFFER_MAX bytes.
+ */
+#define REQUEST_BUFFER_SIZE 4096
+#define REQUEST_BUFFER_MAX 8192
+
+/**
+ * @brief Most headers and query variables kept for one request. A request
+ * with more is rejected as a bad request.
+ */
+#define REQUEST_HEADERS_MAX 64
+#define REQUEST_VARIABLES_MAX 32
+
+/**
+ * @brief Size of the open addressed table indexing headers that are not in
+ * request_header_e. Twice REQUEST_HEADERS_MAX, so probes stay short.
+ */
+#define REQUEST_HEADERS_TABLE_SIZE (REQUEST_HEADERS_MAX * 2)
+
+/**
+ * @brief Most byte ranges honored in one Range header, after overlapping 
+ * ranges have been merged. A request asking for more gets the whole 
+ * representation.
+ */
+#define REQUEST_RANGES_MAX 16
+
+/**
+ * @brief Headers the server acts on. These are found during parsing, so 
+ * request_header() is a single array lookup.
+ */
+typedef enum request_header_e {
+    REQUEST_HEADER_ACCEPT_ENCODING,
+    REQUEST_HEADER_CONNECTION,
+    REQUEST_HEADER_CONTENT_LENGTH,
+    REQUEST_HEADER_HOST,
+    REQUEST_HEADER_IF_MODIFIED_SINCE,
+    REQUEST_HEADER_IF_NONE_MATCH,
+    REQUEST_HEADER_IF_RANGE,
+    REQUEST_HEADER_RANGE,
+    REQUEST_HEADER_TRANSFER_ENCODING,
+    REQUEST_HEADER_COUNT
+} request_header_e;
+
+/**
+ * @brief A piece of the receive buffer, by offset and length. Offsets rather
+ * than pointers stay valid if the buffer is moved.
+ */
+typedef struct request_slice_s {
+    unsigned int offset;
+    unsigned int len;
+} request_slice_s;
+
+/**
+ * @brief Represents a variable, either a query parameter, which is passed 
+ * as part of the URI, or a header. Header values are also NUL terminated in
+ * the buffer, so request_find_header() can return them as strings.
+ */
+typedef struct request_variable_s {
+    request_slice_s name;
+    request_slice_s value;
+} request_variable_s;
+
+/**
+ * @brief A satisfiable byte range of a representation: len bytes starting
+ * at offset.
+ */
+typedef struct request_range_s {
+    size_t offset;
+    size_t len;
+} request_range_s;
+
 /**
  * @brief Represents an HTTP request. The client, request version,
  * URI, URI fragment (the designator following a "#" in the URI),
  * I/O buffer, URI query variable names and values, headers, 
- * request method and type are tracked.
+ * request method and type are tracked. buffer_len is the number of bytes
+ * received into the buffer, buffer_size its capacity, buffer_index the end
+ * of the request being parsed and scan_index how far request_read() has 
+ * searched for the end of the request header. Nothing is copied out of the
+ * buffer but the decoded URI: the fragment, query variables and headers are
+ * slices of it. uri points to uri_buffer once the request has been parsed
+ * and is NULL before. buffer points to inline_buffer unless a request has 
+ * outgrown it, so a request_s embedded in a connection needs no allocation
+ * of its own. known and headers_table index headers, holding the position
+ * in headers plus one, or 0 for an empty slot: known by request_header_e 
+ * and headers_table by a hash of the name for any other header. When a 
+ * header is repeated the first one is indexed.
  */
 typedef struct request_s {
     http_client_s *client;
     int http_version_major;
     int http_version_minor;
-    char *uri_fragment;
+    request_slice_s uri_fragment;
     char *uri;
     char *buffer;
     size_t buffer_len;
+    size_t buffer_size;
     size_t buffer_index;
-    http_variable_s *url_variables;
-    http_variable_s *headers;
+    size_t scan_index;
+    bool complete;
+    unsigned char known[REQUEST_HEADER_COUNT];
+    unsigned char headers_table[REQUEST_HEADERS_TABLE_SIZE];
+    request_variable_s url_variables[REQUEST_VARIABLES_MAX];
+    unsigned int url_variables_count;
+    request_variable_s headers[REQUEST_HEADERS_MAX];
+    unsigned int headers_count;
     request_method_e method;
     request_type_e type;
+    char uri_buffer[REQUEST_URI_SIZE];
+    char inline_buffer[REQUEST_BUFFER_SIZE];
 } request_s;
 
 /**
- * @brief Free a request. This closes the connection and frees any memory
- * allocated for the request.
- * @param request Pointer to the request_s structure to free.
+ * @brief Adds data received by the caller, rather than read from the 
+ * connection by request_read(), to the request, and checks whether the 
+ * request header is now complete. The buffer grows as request_read() 
+ * would grow it. With no data, only what is already in the buffer, such
+ * as a pipelined request kept by request_reset(), is checked.
+ * @param request The request to add to.
+ * @param data The data received, or NULL.
+ * @param len Length of data, which must fit within REQUEST_BUFFER_MAX 
+ * with what the buffer already holds.
+ * @return REQUEST_READ_COMPLETE, REQUEST_READ_AGAIN until more data 
+ * arrives, REQUEST_READ_TOO_LARGE or REQUEST_READ_ERROR.
+ */
+extern request_read_e request_append(request_s *request, const char *data, size_t len);
+
+/**
+ * @brief Releases a request when its connection closes. Only a receive 
+ * buffer that outgrew inline_buffer is freed; the request_s storage belongs
+ * to the caller.
+ * @param request Pointer to the request_s structure to clean up.
  * @return nothing.
  */
-extern void request_free(request_s *request);
+extern void request_cleanup(request_s *request);
+
+/**
+ * @brief Looks up a request header by name. The comparison is case 
+ * insensitive. Headers in request_header_e are faster to find with 
+ * request_header().
+ * @param request The parsed request.
+ * @param name Name of the header to find.
+ * @return The header value, or NULL if the request has no such header.
+ */
+extern const char *request_find_header(request_s *request, const char *name);
+
+/**
+ * @brief Looks up one of the headers in request_header_e.
+ * @param request The parsed request.
+ * @param header The header to find.
+ * @return The header value, or NULL if the request has no such header.
+ */
+extern const char *request_header(request_s *request, request_header_e header);
+
+/**
+ * @brief Determines whether the client asked for a persistent connection:
+ * HTTP/1.1 requests are persistent unless they send "Connection: close",
+ * HTTP/1.0 requests only if they send "Connection: keep-alive". Requests 
+ * carrying a body are never kept alive, since the body is not read.
+ * @param request The parsed request.
+ * @return true if the connection should be kept open after the response.
+ */
+extern bool request_keep_alive(request_s *request);
+
+/**
+ * @brief Parses the Range header against a representation of length bytes.
+ * Ranges are clipped to the representation, sorted, and merged where they
+ * overlap or touch. A header with a unit other than bytes, a syntax error 
+ * or more than REQUEST_RANGES_MAX ranges is ignored.
+ * @param request The parsed request.
+ * @param length Length of the selected representation.
+ * @param ranges Receives up to REQUEST_RANGES_MAX ranges.
+ * @return The number of ranges, 0 if the whole representation should be 
+ * sent, or -1 if none of the ranges can be satisfied.
+ */
+extern int request_ranges(request_s *request, size_t length, request_range_s *ranges);
+
+/**
+ * @brief Looks up the quality value given to a token in a list header such
+ * as Accept-Encoding ("gzip;q=0.8, br"). A token that is not listed takes
+ * the value given to "*", if any.
+ * @param request The parsed request.
+ * @param header The header to search.
+ * @param token Token to look for. The comparison is case insensitive.
+ * @return The quality value in thousandths: 1000 for a token listed without
+ * a q parameter and 0 for a token that is not acceptable.
+ */
+extern int request_token_quality(request_s *request, request_header_e header, const char *token);
 
 /** 
- * @brief Establishes a request structure for the given client. The request
- * must be free'd by request_free() when it is no longer needed.
+ * @brief Prepares request storage, new or recycled, for the given client. 
+ * Nothing is allocated. The request must be released with 
+ * request_cleanup() when the connection closes.
+ * @param request The request storage.
  * @param client The client to establish the request for.
- * @return Returns a pointer to a new request_s structure or NULL on error.
+ * @return nothing
  */
-extern request_s *request_get(http_client_s *client);
+extern void request_init(request_s *request, http_client_s *client);
 
 /**
- * @brief Parses the incoming client request and fills in most of the fields
- * of the given request_s structure.
+ * @brief Reads from the client connection until a complete request header
+ * has been received. The buffer grows as needed, up to a fixed maximum; a
+ * header that doesn't fit returns REQUEST_READ_TOO_LARGE.
+ * @param request The request to read into.
+ * @return Returns a request_read_e code.
+ */
+extern request_read_e request_read(request_s *request);
+
+/**
+ * @brief Parses the request received by request_read() and fills in most of
+ * the fields of the given request_s structure. No I/O is performed and 
+ * nothing is allocated: the request line and each header line are found 
+ * with memchr() and recorded as slices of the receive buffer. A request 
+ * that was not completely received is rejected as a bad request.
  * @param request The request structure to parse into.
  * @return Returns a request_parse_error_e error code for the parse.
  */
 extern request_parse_error_e request_parse(request_s *request);
 
+/**
+ * @brief Resets a request so the next request on the same connection can be
+ * read into it. Parsed fields are cleared and any bytes received beyond the end
+ * of the current request (pipelined requests) are moved to the start of the
+ * buffer rather than discarded. This takes constant time apart from that 
+ * move; a heap buffer is given up once what is left fits inline_buffer.
+ * @param request The request to reset.
+ * @return nothing
+ */
+extern void request_reset(request_s *request);
+
+/**
+ * @brief Fills a freshly initialized request with a complete request
+ * header from memory instead of the connection, such as one rebuilt from
+ * an HTTP/2 HEADERS frame, ready for request_parse(). The buffer grows as
+ * request_read() would grow it.
+ * @param request The request, as left by request_init().
+ * @param iov The pieces of the header, which must end in a blank line.
+ * @param iovcnt Number of pieces.
+ * @return REQUEST_READ_COMPLETE, REQUEST_READ_TOO_LARGE if the header is
+ * longer than REQUEST_BUFFER_MAX, or REQUEST_READ_ERROR if it is not
+ * complete or the buffer could not grow.
+ */
+extern request_read_e request_set(request_s *request, const struct iovec *iov, int iovcnt);
+
 #endif // REQUEST_H
@@ -7,9 +7,14 @@
  * @copyright Copyright (c) 2024
  */
 
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <time.h>
 
+#include "cache.h"
 #include "debug.h"
 #include "http.h"
 #include "request.h"
@@ -17,21 +22,282 @@
 
 const char const *response_code_str[] = {
     "200 OK",
+    "206 Partial Content",
+    "304 Not Modified",
     "400 Bad Request",
     "404 Not Found",
+    "416 Range Not Satisfiable",
     "500 Internal Server Error",
     "501 Not Implemented",
 };
 
-char *http_response_header(http_response_code_e code, size_t content_length, const char *mime, const char *additional_headers, size_t *header_len) {
+static const char const *status_line[] = {
+    "HTTP/1.1 200 OK\r\n",
+    "HTTP/1.1 206 Partial Content\r\n",
+    "HTTP/1.1 304 Not Modified\r\n",
+    "HTTP/1.1 400 Bad Request\r\n",
+    "HTTP/1.1 404 Not Found\r\n",
+    "HTTP/1.1 416 Range Not Satisfiable\r\n",
+    "HTTP/1.1 500 Internal Server Error\r\n",
+    "HTTP/1.1 501 Not Implemented\r\n",
+};
+
+static const char connection_keep_alive[] = "Connection: keep-alive\r\n";
+static const char connection_close[] = "Connection: close\r\n";
+
+/* The formatted Date line is cached per thread and rebuilt when the second
+   changes, so workers never share or lock it. */
+static __thread time_t date_time = 0;
+static __thread char date_line[RESPONSE_DATE_SIZE];
+static __thread size_t date_line_len = 0;
+static __thread unsigned long long boundary_count = 0;
+
+static size_t format_date(char *buffer);
+static char *partial_header(const char *entity_header, size_t entity_header_len, const char *content_type, size_t content_length, const char *content_range, size_t *header_len);
+
+char *response_entity_header(const char *mime, size_t content_length, const char *encoding, bool vary, const char *additional_headers, size_t *header_len) {
+    debug_enter();
+    const char *format = "Content-Type: %s\r\nContent-Length: %zu\r\n%s%s%s%s%s\r\n";
+    const char *encoding_name = encoding != NULL ? "Content-Encoding: " : "";
+    const char *encoding_value = encoding != NULL ? encoding : "";
+    const char *encoding_end = encoding != NULL ? "\r\n" : "";
+    const char *vary_line = vary ? "Vary: Accept-Encoding\r\n" : "";
+    const char *additional = additional_headers != NULL ? additional_headers : "";
+    int len = snprintf(NULL, 0, format, mime, content_length, encoding_name, encoding_value, encoding_end, vary_line, additional);
+    if (len < 0) {
+        debug_return NULL;
+    }
+    char *header = malloc(len + 1);
+    if (header == NULL) {
+        debug_return NULL;
+    }
+    snprintf(header, len + 1, format, mime, content_length, encoding_name, encoding_value, encoding_end, vary_line, additional);
+    *header_len = len;
+    debug_return header;
+}
+
+void response_set_header(http_response_s *response, http_response_code_e code, const char *entity_header, size_t entity_header_len, bool keep_alive) {
     debug_enter();
-    time_t rawtime;
-    struct tm *timeinfo;
-    char date_str[80];
-    time(&rawtime);
-    timeinfo = gmtime(&rawtime);
-    strftime(date_str, sizeof(date_str), "%a, %d %b %Y %H:%M:%S GMT", timeinfo);
-    char header[1024];
-    *header_len = sprintf(header, "HTTP/1.1 %s\r\nDate: %s\r\nContent-Type: %s\r\nContent-Length: %ld\r\n%s\r\n", response_code_str[code], date_str, mime, content_length, additional_headers);
-    debug_return strdup(header);
+    struct iovec *iov = response->header_iov;
+    iov[0].iov_base = (void *)status_line[code];
+    iov[0].iov_len = strlen(status_line[code]);
+    iov[1].iov_base = response->date;
+    iov[1].iov_len = format_date(response->date);
+    iov[2].iov_base = (void *)(keep_alive ? connection_keep_alive : connection_close);
+    iov[2].iov_len = keep_alive ? sizeof(connection_keep_alive) - 1 : sizeof(connection_close) - 1;
+    iov[3].iov_base = (void *)entity_header;
+    iov[3].iov_len = entity_header_len;
+    response->header_iovcnt = 4;
+    response->header_len = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+    debug_return;
+}
+
+int response_set_ranges(http_response_s *response, const char *entity_header, size_t entity_header_len, const char *mime, const request_range_s *ranges, int count, size_t *header_len) {
+    debug_enter();
+    size_t length = response->body_len;
+    char content_range[80];
+    if (count == 1) {
+        snprintf(content_range, sizeof(content_range), "bytes %zu-%zu/%zu", ranges[0].offset, ranges[0].offset + ranges[0].len - 1, length);
+        response->header = partial_header(entity_header, entity_header_len, NULL, ranges[0].len, content_range, header_len);
+        if (response->header == NULL) {
+            debug_return -1;
+        }
+        if (response->fd >= 0) {
+            response->body_offset += ranges[0].offset;
+        } else {
+            response->body += ranges[0].offset;
+        }
+        response->body_len = ranges[0].len;
+        debug_return 0;
+    }
+    if (mime == NULL) {
+        mime = "application/octet-stream";
+    }
+    // The boundary only has to be absent from the parts, which a counter 
+    // mixed with the time and the response's address makes as good as 
+    // certain for any content that isn't deliberately built to collide.
+    char boundary[24];
+    snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)time(NULL) * 0x9e3779b97f4a7c15ULL ^ (unsigned long long)(uintptr_t)response ^ ++boundary_count);
+    int parts_count = count * 2 + 1;
+    size_t text_size = count * (strlen(mime) + 128) + 32;
+    response_part_s *parts = malloc(parts_count * sizeof(response_part_s) + text_size);
+    if (parts == NULL) {
+        debug_return -1;
+    }
+    char *text = (char *)(parts + parts_count);
+    size_t body_len = 0;
+    for (int i = 0; i < count; i++) {
+        int len = snprintf(text, text_size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n", boundary, mime, ranges[i].offset, ranges[i].offset + ranges[i].len - 1, length);
+        parts[i * 2] = (response_part_s){ .data = text, .len = len };
+        text += len;
+        text_size -= len;
+        if (response->fd >= 0) {
+            parts[i * 2 + 1] = (response_part_s){ .offset = response->body_offset + ranges[i].offset, .len = ranges[i].len };
+        } else {
+            parts[i * 2 + 1] = (response_part_s){ .data = response->body + ranges[i].offset, .len = ranges[i].len };
+        }
+        body_len += len + ranges[i].len;
+    }
+    int len = snprintf(text, text_size, "\r\n--%s--\r\n", boundary);
+    parts[count * 2] = (response_part_s){ .data = text, .len = len };
+    body_len += len;
+    char content_type[64];
+    snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+    response->header = partial_header(entity_header, entity_header_len, content_type, body_len, NULL, header_len);
+    if (response->header == NULL) {
+        free(parts);
+        debug_return -1;
+    }
+    response->parts = parts;
+    response->parts_count = parts_count;
+    response->body_len = body_len;
+    debug_return 0;
+}
+
+void response_hold(http_response_s *response) {
+    if (!response->held) {
+        cache_hold(response->element);
+        cache_hold(response->variant);
+        response->held = true;
+    }
+}
+
+void response_reset(http_response_s *response) {
+    debug_enter();
+    if (response->header != NULL) {
+        free(response->header);
+    }
+    free(response->parts);
+    free(response->buffer);
+    if (response->held) {
+        cache_release(response->variant);
+        cache_release(response->element);
+    }
+    memset(response, 0, sizeof(http_response_s));
+    response->fd = -1;
+    debug_return;
+}
+
+int response_iov(const http_response_s *response, struct iovec *iov, off_t *file_offset, size_t *file_len) {
+    int iovcnt = 0;
+    size_t offset = response->sent;
+    *file_len = 0;
+    for (int i = 0; i < response->header_iovcnt; i++) {
+        if (offset >= response->header_iov[i].iov_len) {
+            offset -= response->header_iov[i].iov_len;
+            continue;
+        }
+        iov[iovcnt].iov_base = (char *)response->header_iov[i].iov_base + offset;
+        iov[iovcnt].iov_len = response->header_iov[i].iov_len - offset;
+        iovcnt++;
+        offset = 0;
+    }
+    // Gather the body parts from memory that follow, up to the first 
+    // part that has to come from the file.
+    response_part_s body = { .data = response->fd < 0 ? response->body : NULL, .offset = response->body_offset, .len = response->body_len };
+    const response_part_s *parts = response->parts != NULL ? response->parts : &body;
+    int parts_count = response->parts != NULL ? response->parts_count : 1;
+    for (int i = 0; i < parts_count && iovcnt < RESPONSE_IOV_MAX; i++) {
+        if (offset >= parts[i].len) {
+            offset -= parts[i].len;
+            continue;
+        }
+        if (parts[i].data == NULL) {
+            *file_offset = parts[i].offset + offset;
+            *file_len = parts[i].len - offset;
+            break;
+        }
+        iov[iovcnt].iov_base = (void *)(parts[i].data + offset);
+        iov[iovcnt].iov_len = parts[i].len - offset;
+        iovcnt++;
+        offset = 0;
+    }
+    return iovcnt;
+}
+
+int response_send(http_client_s *client, http_response_s *response) {
+    debug_enter();
+    size_t total = response->header_len + response->body_len;
+    while (response->sent < total) {
+        struct iovec iov[RESPONSE_IOV_MAX];
+        off_t file_offset;
+        size_t file_len;
+        int iovcnt = response_iov(response, iov, &file_offset, &file_len);
+        if (iovcnt == 0 && file_len > 0) {
+            ssize_t sent = http_sendfile(client, response->fd, file_offset, file_len);
+            debug("sendfile sent = %d of %d\n", sent, total - response->sent);
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                debug_return HTTP_IO_WANT_WRITE;
+            }
+            if (sent <= 0) {
+                log_error(client->server->log, "Error sending file to client %s: %s", client->ip, sent == 0 ? "file truncated" : strerror(errno));
+                debug_return HTTP_IO_ERROR;
+            }
+            response->sent += sent;
+            continue;
+        }
+        ssize_t sent = http_writev(client, iov, iovcnt);
+        debug("sent = %d of %d\n", sent, total - response->sent);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                debug_return HTTP_IO_WANT_WRITE;
+            }
+            log_error(client->server->log, "Error sending response to client %s: %s", client->ip, strerror(errno));
+            debug_return HTTP_IO_ERROR;
+        }
+        response->sent += sent;
+    }
+    debug_return HTTP_IO_OK;
+}
+
+/**
+ * @brief Copies the Date header line for the current second into buffer,
+ * which must hold RESPONSE_DATE_SIZE bytes, and returns its length.
+ */
+static size_t format_date(char *buffer) {
+    time_t now = time(NULL);
+    if (now != date_time || date_line_len == 0) {
+        struct tm timeinfo;
+        gmtime_r(&now, &timeinfo);
+        date_line_len = strftime(date_line, sizeof(date_line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &timeinfo);
+        date_time = now;
+    }
+    memcpy(buffer, date_line, date_line_len);
+    return date_line_len;
+}
+
+/**
+ * @brief Copies entity headers with the Content-Length line replaced, 
+ * followed by a Content-Range line if content_range is not NULL, and the 
+ * Content-Type line replaced if content_type is not NULL. Returns the new
+ * headers, allocated, or NULL on no memory.
+ */
+static char *partial_header(const char *entity_header, size_t entity_header_len, const char *content_type, size_t content_length, const char *content_range, size_t *header_len) {
+    size_t size = entity_header_len + (content_type != NULL ? strlen(content_type) : 0) + (content_range != NULL ? strlen(content_range) : 0) + 64;
+    char *header = malloc(size);
+    if (header == NULL) {
+        return NULL;
+    }
+    size_t len = 0;
+    const char *line = entity_header;
+    const char *end = entity_header + entity_header_len;
+    while (line < end) {
+        const char *next = memchr(line, '\n', end - line);
+        next = next != NULL ? next + 1 : end;
+        if (content_type != NULL && strncasecmp(line, "Content-Type:", 13) == 0) {
+            len += snprintf(header + len, size - len, "Content-Type: %s\r\n", content_type);
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            len += snprintf(header + len, size - len, "Content-Length: %zu\r\n", content_length);
+            if (content_range != NULL) {
+                len += snprintf(header + len, size - len, "Content-Range: %s\r\n", content_range);
+            }
+        } else {
+            memcpy(header + len, line, next - line);
+            len += next - line;
+        }
+        line = next;
+    }
+    header[len] = '\0';
+    *header_len = len;
+    return header;
 }
@@ -10,24 +10,78 @@
 #ifndef RESPONSE_H
 #define RESPONSE_H
 
+#include <stdbool.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RESPONSE_HEADER_IOV_MAX 4
+#define RESPONSE_DATE_SIZE 40
+#define RESPONSE_IOV_MAX 16
+
+struct cache_element_s;
+struct http_client_s;
+struct request_range_s;
 
 /**
  * @brief HTTP response codes: 200, 501, etc.
  */
 typedef enum http_response_code_e {
     HTTP_RESPONSE_200 = 0,
-    HTTP_RESPONSE_400 = 1,
-    HTTP_RESPONSE_404 = 2,
-    HTTP_RESPONSE_500 = 3,
-    HTTP_RESPONSE_501 = 4,
+    HTTP_RESPONSE_206 = 1,
+    HTTP_RESPONSE_304 = 2,
+    HTTP_RESPONSE_400 = 3,
+    HTTP_RESPONSE_404 = 4,
+    HTTP_RESPONSE_416 = 5,
+    HTTP_RESPONSE_500 = 6,
+    HTTP_RESPONSE_501 = 7,
+    HTTP_RESPONSE_COUNT
 } http_response_code_e;
 
 /**
- * @brief Represents an HTTP response.
+ * @brief One piece of a multipart response body: len bytes from data, or
+ * from the response's fd at offset when data is NULL.
+ */
+typedef struct response_part_s {
+    const char *data;
+    off_t offset;
+    size_t len;
+} response_part_s;
+
+/**
+ * @brief Represents an HTTP response. The header is assembled from pieces in
+ * header_iov: the status line, the Date line (copied into date), the 
+ * Connection line and the entity headers, which come prebuilt from the cache
+ * element (or from header for fallback responses). The body points straight
+ * into the cache element, or a static string for fallback responses. The
+ * element, and variant if an encoded copy is sent, are borrowed from the 
+ * worker's cache pass rather than copied; held says references were taken
+ * by response_hold() for a response that outlives the pass. When fd is not -1 the body
+ * is sent from that file with sendfile(), starting at body_offset, instead
+ * of from memory. A multipart body is described by parts instead, which 
+ * body_len is the total of. buffer holds a body built for this response
+ * alone, which is freed with it. sent counts bytes of header and body 
+ * written so far.
  */
 typedef struct http_response_s {
     struct request_s *request;
+    http_response_code_e code;
+    char *header;
+    struct iovec header_iov[RESPONSE_HEADER_IOV_MAX];
+    int header_iovcnt;
+    size_t header_len;
+    char date[RESPONSE_DATE_SIZE];
+    const char *body;
+    size_t body_len;
+    char *buffer;
+    struct cache_element_s *element;
+    struct cache_element_s *variant;
+    bool held;
+    int fd;
+    off_t body_offset;
+    response_part_s *parts;
+    int parts_count;
+    size_t sent;
 } http_response_s;
 
 /**
@@ -36,17 +90,102 @@ typedef struct http_response_s {
 extern const char const *response_code_str[];
 
 /**
- * @brief Generates an HTTP response header appropriate for the given 
- * parameters.
- * @param code The response code for the response.
- * @param content_length Length of the content part.
+ * @brief Formats the entity part of a response header: everything that 
+ * depends only on the content and configuration, not on the request or the
+ * time. This is done once per cache element at load time.
  * @param mime Mime type of the content part.
- * @param additional_headers List of headers to send with the response.
+ * @param content_length Length of the content part.
+ * @param encoding Content-Encoding of the content part, or NULL if it is not
+ * encoded.
+ * @param vary Whether to send "Vary: Accept-Encoding", for resources that 
+ * have encoded variants.
+ * @param additional_headers List of configured headers to send with every
+ * response. May be NULL.
  * @param header_len Contains the size of the returned header.
- * @return Returns a character string containing the header to send to the 
- * client. The string is allocated dynamically and freeing it is the
- * responsibility of the caller.
+ * @return Returns a character string containing the header lines followed 
+ * by the blank line that ends the header. The string is allocated 
+ * dynamically and freeing it is the responsibility of the caller. NULL on 
+ * no memory.
+ */
+extern char *response_entity_header(const char *mime, size_t content_length, const char *encoding, bool vary, const char *additional_headers, size_t *header_len);
+
+/**
+ * @brief Assembles the header of a response from the status line, the 
+ * current Date, the Connection line and the given entity headers. The 
+ * entity headers are referenced, not copied, and must stay valid until the
+ * response has been sent.
+ * @param response The response.
+ * @param code The response code.
+ * @param entity_header Entity headers from response_entity_header().
+ * @param entity_header_len Length of entity_header.
+ * @param keep_alive Whether the connection will be kept open after this
+ * response.
+ * @return nothing
+ */
+extern void response_set_header(http_response_s *response, http_response_code_e code, const char *entity_header, size_t entity_header_len, bool keep_alive);
+
+/**
+ * @brief Narrows the body of a response to the given byte ranges and 
+ * builds the header of the 206 response from its entity headers: a single
+ * range gets a Content-Range header and the slice in place of the body, 
+ * several ranges a multipart/byteranges body whose parts reference the 
+ * body rather than copying it. The body, body_len and fd of the response 
+ * must already describe the whole representation.
+ * @param response The response.
+ * @param entity_header Entity headers of the whole representation, from 
+ * response_entity_header().
+ * @param entity_header_len Length of entity_header.
+ * @param mime Mime type of the representation.
+ * @param ranges Ranges to send, sorted and not overlapping.
+ * @param count Number of ranges, at least 1.
+ * @param header_len Contains the length of the new entity headers, which 
+ * are kept in response->header.
+ * @return 0 on success, -1 on no memory.
+ */
+extern int response_set_ranges(http_response_s *response, const char *entity_header, size_t entity_header_len, const char *mime, const struct request_range_s *ranges, int count, size_t *header_len);
+
+/**
+ * @brief Gathers the unsent part of a response, from the header pieces and
+ * the body parts in memory that follow them, up to RESPONSE_IOV_MAX pieces
+ * or the first part that has to be sent from the response's fd.
+ * @param response The response.
+ * @param iov Receives up to RESPONSE_IOV_MAX pieces.
+ * @param file_offset Contains the file offset to send from, if file_len is
+ * not 0.
+ * @param file_len Contains the length of the file part the gathering 
+ * stopped at, or 0 if it reached none.
+ * @return The number of pieces, 0 if the next bytes to send are in the 
+ * file or there are none.
+ */
+extern int response_iov(const http_response_s *response, struct iovec *iov, off_t *file_offset, size_t *file_len);
+
+/**
+ * @brief Keeps the cache elements a response borrowed in the current pass
+ * until the response is reset, for a response that has to wait for its 
+ * client. Does nothing if they are kept already.
+ * @param response The response.
+ * @return nothing
+ */
+extern void response_hold(http_response_s *response);
+
+/**
+ * @brief Releases the header and any cache elements held by a response and
+ * clears it for reuse.
+ * @param response The response to reset.
+ * @return nothing
+ */
+extern void response_reset(http_response_s *response);
+
+/**
+ * @brief Sends as much of the response as the socket accepts, using a single
+ * writev() of the header pieces and body on plaintext connections. Parts 
+ * of the body in files are sent with sendfile().
+ * @param client The client to send to.
+ * @param response The response to send.
+ * @return HTTP_IO_OK once the whole response has been sent, 
+ * HTTP_IO_WANT_WRITE if it must be resumed when the socket is writable, or
+ * HTTP_IO_ERROR.
  */
-extern char *http_response_header(http_response_code_e code, size_t content_length, const char *mime, const char *additional_headers, size_t *header_len);
+extern int response_send(struct http_client_s *client, http_response_s *response);
 
 #endif // RESPONSE_H
\ No newline at end of file
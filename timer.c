@@ -0,0 +1,129 @@
+/**
+ * @file timer.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief hierarchical timer wheel implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#include "timer.h"
+
+#define TIMER_SLOTS_MASK (TIMER_SLOTS - 1)
+#define TIMER_SPAN(level) (1ULL << (TIMER_SLOTS_BITS * (level)))
+
+static void cascade(timer_wheel_s *wheel, int level, int slot);
+static void link_timer(timer_s *head, timer_s *timer);
+static void place(timer_wheel_s *wheel, timer_s *timer);
+static void unlink_timer(timer_s *timer);
+
+void timer_wheel_init(timer_wheel_s *wheel, uint64_t now) {
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            timer_s *head = &wheel->slots[level][slot];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+}
+
+void timer_init(timer_s *timer) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+}
+
+void timer_schedule(timer_wheel_s *wheel, timer_s *timer, uint64_t expires) {
+    if (timer->next != NULL) {
+        unlink_timer(timer);
+    } else {
+        wheel->count++;
+    }
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    place(wheel, timer);
+}
+
+void timer_cancel(timer_wheel_s *wheel, timer_s *timer) {
+    if (timer->next != NULL) {
+        unlink_timer(timer);
+        wheel->count--;
+    }
+}
+
+bool timer_pending(const timer_s *timer) {
+    return timer->next != NULL;
+}
+
+void timer_advance(timer_wheel_s *wheel, uint64_t now, timer_expire_f *expire, void *arg) {
+    while (wheel->now < now) {
+        if (wheel->count == 0) {
+            // Nothing to move or fire, so the ticks between can be skipped.
+            wheel->now = now;
+            break;
+        }
+        wheel->now++;
+        // Passing the end of a level's revolution brings the next slot of
+        // the level above into reach.
+        uint64_t tick = wheel->now;
+        for (int level = 1; level < TIMER_LEVELS && (tick & TIMER_SLOTS_MASK) == 0; level++) {
+            tick >>= TIMER_SLOTS_BITS;
+            cascade(wheel, level, tick & TIMER_SLOTS_MASK);
+        }
+        timer_s *head = &wheel->slots[0][wheel->now & TIMER_SLOTS_MASK];
+        while (head->next != head) {
+            timer_s *timer = head->next;
+            unlink_timer(timer);
+            wheel->count--;
+            expire(timer, arg);
+        }
+    }
+}
+
+/**
+ * @brief Moves the timers in a slot to the levels below, now that they are
+ * due within that slot's span.
+ */
+static void cascade(timer_wheel_s *wheel, int level, int slot) {
+    timer_s *head = &wheel->slots[level][slot];
+    while (head->next != head) {
+        timer_s *timer = head->next;
+        unlink_timer(timer);
+        place(wheel, timer);
+    }
+}
+
+static void link_timer(timer_s *head, timer_s *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/**
+ * @brief Links a timer into the lowest level whose span reaches its expiry,
+ * in the slot for its expiry at that level. A timer due later than a
+ * level's span from now always lands in a slot the wheel reaches within
+ * one revolution of that level.
+ */
+static void place(timer_wheel_s *wheel, timer_s *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    if (delta >= TIMER_SPAN(TIMER_LEVELS)) {
+        delta = TIMER_SPAN(TIMER_LEVELS) - 1;
+        timer->expires = wheel->now + delta;
+    }
+    int level = 0;
+    while (delta >= TIMER_SPAN(level + 1)) {
+        level++;
+    }
+    int slot = (timer->expires >> (TIMER_SLOTS_BITS * level)) & TIMER_SLOTS_MASK;
+    link_timer(&wheel->slots[level][slot], timer);
+}
+
+static void unlink_timer(timer_s *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file timer.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief hierarchical timer wheel declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_SLOTS_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOTS_BITS)
+#define TIMER_LEVELS 4
+
+/**
+ * @brief A timer, embedded in whatever it times. It is pending while
+ * linked into a wheel slot, and next is NULL otherwise. expires is the tick
+ * it fires on.
+ */
+typedef struct timer_s {
+    struct timer_s *next;
+    struct timer_s *prev;
+    uint64_t expires;
+} timer_s;
+
+/**
+ * @brief A hierarchical timer wheel of TIMER_LEVELS levels of TIMER_SLOTS
+ * slots. Level 0 holds timers due in the next TIMER_SLOTS ticks, one slot
+ * per tick; each level above covers TIMER_SLOTS times the span of the one
+ * below, and its slots are moved down a level as the wheel reaches them.
+ * Scheduling and cancelling are a few pointer updates whatever the number
+ * of timers, and advancing touches only the timers that fire or move down.
+ * Timers due further away than the top level reaches are clamped to its
+ * end. A wheel is used by one thread and is not locked. now is the last
+ * tick advanced to and count the number of pending timers. Each slot is
+ * the head of a circular list.
+ */
+typedef struct timer_wheel_s {
+    uint64_t now;
+    size_t count;
+    timer_s slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel_s;
+
+/**
+ * @brief Called for each timer that fires. The timer is no longer pending
+ * and may be scheduled again.
+ * @param timer The timer.
+ * @param arg The argument given to timer_advance().
+ * @return nothing
+ */
+typedef void (timer_expire_f)(timer_s *timer, void *arg);
+
+/**
+ * @brief Initializes an empty wheel.
+ * @param wheel The wheel.
+ * @param now The current tick.
+ * @return nothing
+ */
+extern void timer_wheel_init(timer_wheel_s *wheel, uint64_t now);
+
+/**
+ * @brief Initializes a timer as not pending.
+ * @param timer The timer.
+ * @return nothing
+ */
+extern void timer_init(timer_s *timer);
+
+/**
+ * @brief Schedules a timer, first cancelling it if it is pending.
+ * @param wheel The wheel.
+ * @param timer The timer.
+ * @param expires Tick to fire on. A tick already passed fires on the next
+ * advance.
+ * @return nothing
+ */
+extern void timer_schedule(timer_wheel_s *wheel, timer_s *timer, uint64_t expires);
+
+/**
+ * @brief Cancels a timer. Does nothing if it is not pending.
+ * @param wheel The wheel the timer was scheduled on.
+ * @param timer The timer.
+ * @return nothing
+ */
+extern void timer_cancel(timer_wheel_s *wheel, timer_s *timer);
+
+/**
+ * @brief Whether a timer is scheduled and has not fired.
+ * @param timer The timer.
+ * @return true if the timer is pending.
+ */
+extern bool timer_pending(const timer_s *timer);
+
+/**
+ * @brief Advances the wheel tick by tick up to now, calling expire for each
+ * timer that fires on the way. expire may schedule and cancel timers,
+ * including the one it is called for.
+ * @param wheel The wheel.
+ * @param now The current tick. Ticks earlier than the wheel's are ignored.
+ * @param expire Called for each timer that fires.
+ * @param arg Passed to expire.
+ * @return nothing
+ */
+extern void timer_advance(timer_wheel_s *wheel, uint64_t now, timer_expire_f *expire, void *arg);
+
+#endif // TIMER_H
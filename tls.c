@@ -0,0 +1,316 @@
+/**
+ * @file tls.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief TLS context module implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "debug.h"
+#include "log.h"
+#include "tls.h"
+
+#define TLS_TICKET_NAME_SIZE 16
+#define TLS_TICKET_KEY_SIZE 32
+
+static const unsigned char session_id_context[] = "nvhttpd";
+
+// ALPN protocols in the order the server prefers them, length prefixed.
+static const unsigned char alpn_protocols[] = "\x02h2\x08http/1.1";
+
+/**
+ * @brief A session ticket key: the name sent with each ticket to find the
+ * key again, and the keys for AES-256-CBC and HMAC-SHA256.
+ */
+typedef struct tls_ticket_key_s {
+    unsigned char name[TLS_TICKET_NAME_SIZE];
+    unsigned char aes[TLS_TICKET_KEY_SIZE];
+    unsigned char hmac[TLS_TICKET_KEY_SIZE];
+} tls_ticket_key_s;
+
+/**
+ * @brief The session ticket keys. keys[0] issues new tickets, keys[1] is 
+ * the key it replaced, still accepted until the next rotation; previous 
+ * says keys[1] holds one, and rotated is when keys[0] was made. Handshakes
+ * on every worker use them, so they are guarded by mutex, which is only 
+ * taken once per ticket issued or presented. The state lives in a shared
+ * mapping with a process-shared, robust mutex, so worker processes forked 
+ * after tls_init() issue and accept the same tickets, and one dying while
+ * holding the lock doesn't stop the rest.
+ */
+typedef struct tls_tickets_s {
+    pthread_mutex_t mutex;
+    tls_ticket_key_s keys[2];
+    bool previous;
+    time_t rotated;
+} tls_tickets_s;
+
+static tls_tickets_s *tickets = NULL;
+static long ticket_rotation = TLS_TICKET_ROTATION_DEFAULT;
+
+static int alpn_callback(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg);
+static int load_pair(SSL_CTX *ctx, const char *certificate, const char *key, log_s *log);
+static int ticket_callback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc);
+static int ticket_key_new(tls_ticket_key_s *key);
+static bool ticket_key_use(tls_ticket_key_s *key, const unsigned char *name, int *rc);
+static int tickets_init(void);
+
+SSL_CTX *tls_init(const tls_config_s *config, log_s *log) {
+    debug_enter();
+    SSL_CTX *ctx = NULL;
+    if (config->certificate == NULL && config->ecdsa_certificate == NULL) {
+        log_error(log, "no ssl certificate specified");
+        goto error;
+    }
+    ERR_clear_error();
+    if (!(ctx = SSL_CTX_new(TLS_server_method()))) {
+        log_error(log, "failed to initialize ssl context: %s", ERR_reason_error_string(ERR_get_error()));
+        goto error;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // Renegotiation is a client-triggered full handshake mid-connection,
+    // which costs the server far more than the client. Clients often close
+    // without close_notify, HTTP/2 ones especially; every response is 
+    // framed, so that is an ordinary end of the connection.
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF;
+    if (config->ktls) {
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+    if (!config->tickets) {
+        options |= SSL_OP_NO_TICKET;
+    }
+    SSL_CTX_set_options(ctx, options);
+    // Sockets are non-blocking, so writes may complete partially and be
+    // retried from a different offset.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    ERR_clear_error();
+    if (!SSL_CTX_set_cipher_list(ctx, config->ciphers)) {
+        log_error(log, "failed to set strong cipher list: %s", ERR_reason_error_string(ERR_get_error()));
+        goto error;
+    }
+    if (!SSL_CTX_set1_groups_list(ctx, "X25519:P-256:P-384")) {
+        log_warn(log, "unable to set key exchange groups, using defaults");
+    }
+    if (config->ecdsa_certificate != NULL && load_pair(ctx, config->ecdsa_certificate, config->ecdsa_key, log) != 0) {
+        goto error;
+    }
+    if (config->certificate != NULL && load_pair(ctx, config->certificate, config->key, log) != 0) {
+        goto error;
+    }
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_timeout(ctx, config->session_timeout);
+    if (config->session_cache_size > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, config->session_cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    if (config->tickets) {
+        ticket_rotation = config->ticket_rotation;
+        if (tickets_init() != 0) {
+            log_error(log, "unable to set up session ticket keys: %s", strerror(errno));
+            goto error;
+        }
+        if (ticket_key_new(&tickets->keys[0]) != 0) {
+            log_error(log, "unable to generate session ticket key: %s", ERR_reason_error_string(ERR_get_error()));
+            goto error;
+        }
+        tickets->previous = false;
+        tickets->rotated = time(NULL);
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_callback);
+        // One ticket per TLS 1.3 handshake is enough for a browser that
+        // reuses its connections, and saves an encryption per handshake.
+        SSL_CTX_set_num_tickets(ctx, 1);
+    }
+    if (config->http2) {
+        SSL_CTX_set_alpn_select_cb(ctx, alpn_callback, NULL);
+    }
+    log_info(log, "ssl session cache %ld, tickets %s, ktls %s, http2 %s", config->session_cache_size, config->tickets ? "on" : "off", config->ktls ? "requested" : "off",
+        config->http2 ? "on" : "off");
+    debug_return ctx;
+error:
+    SSL_CTX_free(ctx);
+    debug_return NULL;
+}
+
+void tls_cleanup(SSL_CTX *ctx) {
+    debug_enter();
+    SSL_CTX_free(ctx);
+    if (tickets != NULL) {
+        OPENSSL_cleanse(tickets->keys, sizeof(tickets->keys));
+        pthread_mutex_destroy(&tickets->mutex);
+        munmap(tickets, sizeof(tls_tickets_s));
+        tickets = NULL;
+    }
+    debug_return;
+}
+
+/**
+ * @brief Picks h2 if the client offers it, otherwise http/1.1. A client
+ * offering neither gets no ALPN answer and is served HTTP/1.
+ */
+static int alpn_callback(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg) {
+    (void)ssl;
+    (void)arg;
+    unsigned char *selected;
+    if (SSL_select_next_proto(&selected, outlen, alpn_protocols, sizeof(alpn_protocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * @brief Loads a certificate chain and its private key into the context.
+ * OpenSSL keeps one pair per key type, so loading an ECDSA and an RSA pair
+ * leaves both available.
+ */
+static int load_pair(SSL_CTX *ctx, const char *certificate, const char *key, log_s *log) {
+    debug_enter();
+    if (key == NULL) {
+        log_error(log, "ssl key for certificate %s not specified", certificate);
+        debug_return 1;
+    }
+    ERR_clear_error();
+    if (SSL_CTX_use_certificate_chain_file(ctx, certificate) <= 0) {
+        log_error(log, "failed to load ssl cert %s: %s", certificate, ERR_reason_error_string(ERR_get_error()));
+        debug_return 1;
+    }
+    ERR_clear_error();
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) <= 0) {
+        log_error(log, "failed to load ssl key %s: %s", key, ERR_reason_error_string(ERR_get_error()));
+        debug_return 1;
+    }
+    ERR_clear_error();
+    if (!SSL_CTX_check_private_key(ctx)) {
+        log_error(log, "private key %s does not match the certificate %s", key, certificate);
+        debug_return 1;
+    }
+    debug_return 0;
+}
+
+/**
+ * @brief Encrypts and decrypts session tickets with the rotating keys.
+ * Returns 1 to use the ticket, 2 to use it and issue a fresh one under the
+ * current key, 0 if the key is unknown and -1 on error, as OpenSSL expects.
+ */
+static int ticket_callback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc) {
+    (void)ssl;
+    tls_ticket_key_s key;
+    int rc = 1;
+    if (enc) {
+        ticket_key_use(&key, NULL, &rc);
+        memcpy(name, key.name, TLS_TICKET_NAME_SIZE);
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 || EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1) {
+            rc = -1;
+            goto term;
+        }
+    } else {
+        if (!ticket_key_use(&key, name, &rc)) {
+            rc = 0;
+            goto term;
+        }
+        if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1) {
+            rc = -1;
+            goto term;
+        }
+    }
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, TLS_TICKET_KEY_SIZE),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+    if (EVP_MAC_CTX_set_params(mac, params) != 1) {
+        rc = -1;
+    }
+term:
+    OPENSSL_cleanse(&key, sizeof(key));
+    return rc;
+}
+
+/**
+ * @brief Fills a ticket key with random name and keys.
+ */
+static int ticket_key_new(tls_ticket_key_s *key) {
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 || RAND_priv_bytes(key->aes, sizeof(key->aes)) != 1 || RAND_priv_bytes(key->hmac, sizeof(key->hmac)) != 1) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Rotates the ticket keys if they are due, then copies the key to
+ * use into key: the current key if name is NULL, otherwise the key with
+ * that name. Sets rc to 2 when a ticket under the previous key should be
+ * renewed. Returns false if no key has that name.
+ */
+static bool ticket_key_use(tls_ticket_key_s *key, const unsigned char *name, int *rc) {
+    bool found = true;
+    time_t now = time(NULL);
+    if (pthread_mutex_lock(&tickets->mutex) == EOWNERDEAD) {
+        // A worker process died holding the lock. The keys are copied 
+        // whole under it, so at worst a rotation was lost.
+        pthread_mutex_consistent(&tickets->mutex);
+    }
+    if (ticket_rotation > 0 && now - tickets->rotated >= ticket_rotation) {
+        tls_ticket_key_s next;
+        if (ticket_key_new(&next) == 0) {
+            tickets->keys[1] = tickets->keys[0];
+            tickets->keys[0] = next;
+            tickets->previous = true;
+            OPENSSL_cleanse(&next, sizeof(next));
+        }
+        tickets->rotated = now;
+    }
+    if (name == NULL || memcmp(name, tickets->keys[0].name, TLS_TICKET_NAME_SIZE) == 0) {
+        *key = tickets->keys[0];
+    } else if (tickets->previous && memcmp(name, tickets->keys[1].name, TLS_TICKET_NAME_SIZE) == 0) {
+        *key = tickets->keys[1];
+        *rc = 2;
+    } else {
+        found = false;
+    }
+    pthread_mutex_unlock(&tickets->mutex);
+    return found;
+}
+
+/**
+ * @brief Maps the shared ticket state, if it isn't yet, and sets up its 
+ * lock.
+ */
+static int tickets_init(void) {
+    if (tickets != NULL) {
+        return 0;
+    }
+    tls_tickets_s *shared = mmap(NULL, sizeof(tls_tickets_s), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        return 1;
+    }
+    pthread_mutexattr_t attr;
+    int rc = pthread_mutexattr_init(&attr);
+    if (rc == 0) {
+        if ((rc = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) == 0 && (rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) == 0) {
+            rc = pthread_mutex_init(&shared->mutex, &attr);
+        }
+        pthread_mutexattr_destroy(&attr);
+    }
+    if (rc != 0) {
+        munmap(shared, sizeof(tls_tickets_s));
+        errno = rc;
+        return 1;
+    }
+    tickets = shared;
+    return 0;
+}
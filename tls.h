@@ -0,0 +1,68 @@
+/**
+ * @file tls.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief TLS context module declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+#include <stdbool.h>
+
+#include "log.h"
+
+#define TLS_SESSION_CACHE_SIZE_DEFAULT 20480
+#define TLS_SESSION_TIMEOUT_DEFAULT 3600
+#define TLS_TICKET_ROTATION_DEFAULT 3600
+
+/**
+ * @brief TLS settings, passed to tls_init(). certificate and key are the
+ * RSA pair, ecdsa_certificate and ecdsa_key the ECDSA pair; either or both
+ * may be given, and with both OpenSSL picks ECDSA for clients that support
+ * it, RSA for the rest. Certificate files may hold the chain.
+ * session_cache_size is the number of sessions kept for resumption by ID,
+ * 0 to disable the cache; session_timeout is how long, in seconds, a
+ * session or ticket may be resumed. When tickets is set, session tickets
+ * are issued under keys that rotate every ticket_rotation seconds, with
+ * tickets under the previous key still accepted and renewed. ktls asks
+ * OpenSSL to hand record encryption to the kernel where it can. http2 
+ * offers h2 by ALPN, ahead of http/1.1.
+ */
+typedef struct tls_config_s {
+    const char *certificate;
+    const char *key;
+    const char *ecdsa_certificate;
+    const char *ecdsa_key;
+    const char *ciphers;
+    long session_cache_size;
+    long session_timeout;
+    bool tickets;
+    long ticket_rotation;
+    bool ktls;
+    bool http2;
+} tls_config_s;
+
+/**
+ * @brief Creates the server's TLS context: TLS 1.2 and later with the given
+ * ciphers in server preference order, no renegotiation, the configured
+ * certificates, and session resumption. The session ticket keys are kept
+ * in shared memory, so worker processes forked afterwards accept each 
+ * other's tickets; the session cache is per process.
+ * @param config TLS settings.
+ * @param log Log for errors.
+ * @return The context, or NULL on error.
+ */
+extern SSL_CTX *tls_init(const tls_config_s *config, log_s *log);
+
+/**
+ * @brief Frees the context and wipes the ticket keys.
+ * @param ctx Context from tls_init(). May be NULL.
+ * @return nothing
+ */
+extern void tls_cleanup(SSL_CTX *ctx);
+
+#endif // TLS_H
@@ -0,0 +1,289 @@
+/**
+ * @file trace.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief tracing module implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
+#include "debug.h"
+#include "trace.h"
+
+#define TRACE_RECENT 20
+#define TRACE_CACHE_LINE 64
+
+/**
+ * @brief A sampled request in a ring. seq is odd while the worker is
+ * writing it, so a reader that sees it odd, or changed after copying,
+ * skips the sample rather than report a torn one.
+ */
+typedef struct trace_sample_s {
+    atomic_uint_fast64_t seq;
+    atomic_uint_fast64_t at[TRACE_POINT_COUNT];
+} trace_sample_s;
+
+/**
+ * @brief One worker's ring of samples, written only by the thread attached
+ * to it. head counts the samples ever written; the latest is at
+ * (head - 1) % TRACE_SAMPLES.
+ */
+typedef struct trace_ring_s {
+    atomic_uint_fast64_t head;
+    trace_sample_s samples[TRACE_SAMPLES];
+} __attribute__((aligned(TRACE_CACHE_LINE))) trace_ring_s;
+
+/**
+ * @brief A sample copied out of a ring for formatting.
+ */
+typedef struct trace_copy_s {
+    uint64_t at[TRACE_POINT_COUNT];
+} trace_copy_s;
+
+static const char *point_name[] = {
+    [TRACE_ACCEPT] = "accept",
+    [TRACE_HANDSHAKE] = "handshake",
+    [TRACE_READ] = "read",
+    [TRACE_PARSE] = "parse",
+    [TRACE_LOOKUP] = "lookup",
+    [TRACE_FIRST_BYTE] = "first_byte",
+    [TRACE_DONE] = "done",
+    [TRACE_CLOSE] = "close",
+};
+
+static trace_ring_s *rings = NULL;
+static int rings_count = 0;
+static unsigned sample_every = 0;
+static __thread trace_ring_s *current = NULL;
+static __thread unsigned countdown = 0;
+
+static int compare_copies(const void *a, const void *b);
+static int compare_durations(const void *a, const void *b);
+static uint64_t first_at(const trace_copy_s *copy);
+static uint64_t last_at(const trace_copy_s *copy);
+static bool stage_duration(const trace_copy_s *copy, int point, uint64_t *ns);
+
+int trace_init(int count, unsigned sample) {
+    debug_enter();
+    // Anonymous mappings are page aligned and zeroed.
+    void *map = mmap(NULL, count * sizeof(trace_ring_s), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        debug_return 1;
+    }
+    rings = map;
+    rings_count = count;
+    sample_every = sample;
+    debug_return 0;
+}
+
+void trace_attach(int slot) {
+    if (slot >= 0 && slot < rings_count) {
+        current = &rings[slot];
+    }
+}
+
+void trace_begin(trace_s *trace) {
+    trace->sampled = false;
+    if (sample_every == 0 || current == NULL) {
+        return;
+    }
+    if (countdown > 1) {
+        countdown--;
+        return;
+    }
+    countdown = sample_every;
+    memset(trace->at, 0, sizeof(trace->at));
+    trace->sampled = true;
+}
+
+void trace_point(trace_s *trace, trace_point_e point) {
+#ifdef HAVE_SDT
+    DTRACE_PROBE2(nvhttpd, point, (int)point, trace);
+#endif
+    if (__builtin_expect(trace->sampled, 0)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        trace->at[point] = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+}
+
+void trace_commit(trace_s *trace) {
+    if (!trace->sampled) {
+        return;
+    }
+    trace->sampled = false;
+    if (trace->at[TRACE_READ] == 0 || current == NULL) {
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&current->head, memory_order_relaxed);
+    trace_sample_s *sample = &current->samples[head % TRACE_SAMPLES];
+    uint64_t seq = atomic_load_explicit(&sample->seq, memory_order_relaxed);
+    atomic_store_explicit(&sample->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (int i = 0; i < TRACE_POINT_COUNT; i++) {
+        atomic_store_explicit(&sample->at[i], trace->at[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&sample->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&current->head, head + 1, memory_order_relaxed);
+}
+
+char *trace_format(size_t *len) {
+    debug_enter();
+    char *text = NULL;
+    trace_copy_s *copies = malloc((rings_count > 0 ? rings_count : 1) * TRACE_SAMPLES * sizeof(trace_copy_s));
+    uint64_t *durations = malloc((rings_count > 0 ? rings_count : 1) * TRACE_SAMPLES * sizeof(uint64_t));
+    if (copies == NULL || durations == NULL) {
+        goto term;
+    }
+    size_t count = 0;
+    for (int r = 0; r < rings_count; r++) {
+        trace_ring_s *ring = &rings[r];
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t n = head < TRACE_SAMPLES ? head : TRACE_SAMPLES;
+        for (uint64_t i = 0; i < n; i++) {
+            trace_sample_s *sample = &ring->samples[(head - 1 - i) % TRACE_SAMPLES];
+            uint64_t seq = atomic_load_explicit(&sample->seq, memory_order_acquire);
+            if (seq & 1) {
+                continue;
+            }
+            for (int p = 0; p < TRACE_POINT_COUNT; p++) {
+                copies[count].at[p] = atomic_load_explicit(&sample->at[p], memory_order_relaxed);
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&sample->seq, memory_order_relaxed) == seq) {
+                count++;
+            }
+        }
+    }
+    // Newest first, across all the rings.
+    qsort(copies, count, sizeof(trace_copy_s), compare_copies);
+    FILE *fs = open_memstream(&text, len);
+    if (fs == NULL) {
+        goto term;
+    }
+    fprintf(fs, "# %zu sampled requests, 1 in %u; microseconds from the previous point reached\n", count, sample_every);
+    fprintf(fs, "%-10s %8s %10s %10s %10s %10s\n", "stage", "count", "p50", "p90", "p99", "max");
+    for (int p = TRACE_HANDSHAKE; p <= TRACE_POINT_COUNT; p++) {
+        size_t n = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (p == TRACE_POINT_COUNT) {
+                durations[n++] = last_at(&copies[i]) - first_at(&copies[i]);
+            } else if (stage_duration(&copies[i], p, &durations[n])) {
+                n++;
+            }
+        }
+        const char *name = p == TRACE_POINT_COUNT ? "total" : point_name[p];
+        if (n == 0) {
+            fprintf(fs, "%-10s %8d %10s %10s %10s %10s\n", name, 0, "-", "-", "-", "-");
+            continue;
+        }
+        qsort(durations, n, sizeof(uint64_t), compare_durations);
+        fprintf(fs, "%-10s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, n,
+            durations[(n - 1) * 50 / 100] / 1e3, durations[(n - 1) * 90 / 100] / 1e3,
+            durations[(n - 1) * 99 / 100] / 1e3, durations[n - 1] / 1e3);
+    }
+    fprintf(fs, "\n# most recent\n");
+    for (int p = TRACE_HANDSHAKE; p < TRACE_POINT_COUNT; p++) {
+        fprintf(fs, "%10s ", point_name[p]);
+    }
+    fprintf(fs, "%10s\n", "total");
+    for (size_t i = 0; i < count && i < TRACE_RECENT; i++) {
+        for (int p = TRACE_HANDSHAKE; p < TRACE_POINT_COUNT; p++) {
+            uint64_t ns;
+            if (stage_duration(&copies[i], p, &ns)) {
+                fprintf(fs, "%10.1f ", ns / 1e3);
+            } else {
+                fprintf(fs, "%10s ", "-");
+            }
+        }
+        fprintf(fs, "%10.1f\n", (last_at(&copies[i]) - first_at(&copies[i])) / 1e3);
+    }
+    if (fclose(fs) != 0) {
+        free(text);
+        text = NULL;
+    }
+term:
+    free(copies);
+    free(durations);
+    debug_return text;
+}
+
+void trace_cleanup(void) {
+    debug_enter();
+    if (rings != NULL) {
+        munmap(rings, rings_count * sizeof(trace_ring_s));
+    }
+    rings = NULL;
+    rings_count = 0;
+    debug_return;
+}
+
+/**
+ * @brief Orders copied samples newest first, by the last point they reached.
+ */
+static int compare_copies(const void *a, const void *b) {
+    uint64_t x = last_at((const trace_copy_s *)a);
+    uint64_t y = last_at((const trace_copy_s *)b);
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief Orders durations, for qsort().
+ */
+static int compare_durations(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Returns the time of the first point a sample reached.
+ */
+static uint64_t first_at(const trace_copy_s *copy) {
+    for (int p = 0; p < TRACE_POINT_COUNT; p++) {
+        if (copy->at[p] != 0) {
+            return copy->at[p];
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the time of the last point a sample reached.
+ */
+static uint64_t last_at(const trace_copy_s *copy) {
+    for (int p = TRACE_POINT_COUNT - 1; p >= 0; p--) {
+        if (copy->at[p] != 0) {
+            return copy->at[p];
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Gets the time from the last point a sample reached before the
+ * given one to that point. Returns false if it reached neither.
+ */
+static bool stage_duration(const trace_copy_s *copy, int point, uint64_t *ns) {
+    if (copy->at[point] == 0) {
+        return false;
+    }
+    for (int p = point - 1; p >= 0; p--) {
+        if (copy->at[p] != 0) {
+            *ns = copy->at[point] > copy->at[p] ? copy->at[point] - copy->at[p] : 0;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file trace.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief tracing module declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Samples kept per worker. Older ones are overwritten.
+ */
+#define TRACE_SAMPLES 256
+
+/**
+ * @brief Points in the life of a request, in the order they are reached:
+ * the connection accepted, its TLS handshake done, the request read,
+ * parsed and looked up, the first byte of the response sent, the last
+ * byte sent, and the connection closed. A request on a persistent
+ * connection starts at the read, and one the connection outlives ends at
+ * done.
+ */
+typedef enum trace_point_e {
+    TRACE_ACCEPT,
+    TRACE_HANDSHAKE,
+    TRACE_READ,
+    TRACE_PARSE,
+    TRACE_LOOKUP,
+    TRACE_FIRST_BYTE,
+    TRACE_DONE,
+    TRACE_CLOSE,
+    TRACE_POINT_COUNT
+} trace_point_e;
+
+/**
+ * @brief A connection's trace of its current request. sampled says the
+ * request was picked for timing, and at then holds the CLOCK_MONOTONIC
+ * time in nanoseconds each point was reached, or 0 for points it hasn't
+ * reached or skipped.
+ */
+typedef struct trace_s {
+    bool sampled;
+    uint64_t at[TRACE_POINT_COUNT];
+} trace_s;
+
+/**
+ * @brief Sets the sampling rate and allocates a ring of samples for each
+ * worker, in a shared mapping like the metrics, so any worker process can
+ * format the whole server's samples.
+ * @param count Number of rings, one per worker across all processes.
+ * @param sample Time one request in this many, 0 for none.
+ * @return 0 on success.
+ */
+extern int trace_init(int count, unsigned sample);
+
+/**
+ * @brief Attaches the calling thread to a ring. Samples taken by a thread
+ * that isn't attached are dropped.
+ * @param slot Ring number, below the count given to trace_init().
+ * @return nothing
+ */
+extern void trace_attach(int slot);
+
+/**
+ * @brief Starts a connection's trace of a new request, picking it for
+ * timing if it is the calling thread's turn.
+ * @param trace The connection's trace.
+ * @return nothing
+ */
+extern void trace_begin(trace_s *trace);
+
+/**
+ * @brief Ends a connection's trace of its request, adding it to the calling
+ * thread's ring if it was sampled and got as far as being read.
+ * @param trace The connection's trace.
+ * @return nothing
+ */
+extern void trace_commit(trace_s *trace);
+
+/**
+ * @brief Formats a breakdown of the sampled requests: percentiles of the
+ * time from each point to the next, and the most recent requests.
+ * @param len Contains the length of the returned text.
+ * @return The text, allocated, which the caller frees, or NULL on no
+ * memory.
+ */
+extern char *trace_format(size_t *len);
+
+/**
+ * @brief Unmaps the rings. No thread may be tracing.
+ * @return nothing
+ */
+extern void trace_cleanup(void);
+
+/**
+ * @brief Marks a point in a connection's request. Builds with <sys/sdt.h>
+ * also fire the USDT probe nvhttpd:point with the point and the 
+ * connection's trace as arguments, which costs a no-op unless a tracer is
+ * attached. Requests that weren't sampled cost a branch.
+ * @param trace The connection's trace.
+ * @param point The point reached.
+ * @return nothing
+ */
+extern void trace_point(trace_s *trace, trace_point_e point);
+
+#endif // TRACE_H
@@ -0,0 +1,322 @@
+/**
+ * @file uring.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief io_uring ring implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "uring.h"
+
+/**
+ * @brief Features the server relies on: completions are never dropped,
+ * waits take a timeout, and successful completions can be skipped. Any
+ * kernel with these also has multishot accept and provided buffer rings.
+ */
+#define URING_FEATURES (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_CQE_SKIP)
+
+#define URING_REGISTER_ENABLE_RINGS 12
+
+static int enter(uring_s *ring, unsigned submit, unsigned wait, unsigned flags, int timeout_ms);
+static void *map_ring(int fd, size_t size, off_t offset);
+static unsigned publish(uring_s *ring);
+
+int uring_init(uring_s *ring, unsigned entries, unsigned buffer_count, size_t buffer_size) {
+    debug_enter();
+    memset(ring, 0, sizeof(uring_s));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_R_DISABLED;
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring->fd < 0) {
+        debug_return -1;
+    }
+    int err = 0;
+    if ((params.features & URING_FEATURES) != URING_FEATURES) {
+        err = ENOTSUP;
+        goto error;
+    }
+    ring->flags = params.flags;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+    if ((ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING)) == NULL) {
+        err = errno;
+        goto error;
+    }
+    if (ring->cq_ring_size == 0) {
+        ring->cq_ring = ring->sq_ring;
+    } else if ((ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING)) == NULL) {
+        err = errno;
+        goto error;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if ((ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES)) == NULL) {
+        err = errno;
+        goto error;
+    }
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    // Submission slot i always holds sqes[i], so the array is filled once.
+    for (unsigned i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    // The buffer ring must be page aligned, so it and the buffers are
+    // mapped rather than allocated.
+    long page = sysconf(_SC_PAGESIZE);
+    ring->buffer_ring_size = (buffer_count * sizeof(struct io_uring_buf) + page - 1) & ~(page - 1);
+    ring->buffer_ring = mmap(NULL, ring->buffer_ring_size + buffer_count * buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffer_ring == MAP_FAILED) {
+        ring->buffer_ring = NULL;
+        err = errno;
+        goto error;
+    }
+    ring->buffers = (char *)ring->buffer_ring + ring->buffer_ring_size;
+    ring->buffer_count = buffer_count;
+    ring->buffer_size = buffer_size;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buffer_ring;
+    reg.ring_entries = buffer_count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        err = errno;
+        goto error;
+    }
+    for (unsigned i = 0; i < buffer_count; i++) {
+        uring_buffer_put(ring, i);
+    }
+    debug_return 0;
+error:
+    uring_free(ring);
+    errno = err;
+    debug_return -1;
+}
+
+int uring_enable(uring_s *ring) {
+    if (!(ring->flags & IORING_SETUP_R_DISABLED)) {
+        return 0;
+    }
+    if (syscall(__NR_io_uring_register, ring->fd, URING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+        return -1;
+    }
+    ring->flags &= ~IORING_SETUP_R_DISABLED;
+    return 0;
+}
+
+void uring_free(uring_s *ring) {
+    debug_enter();
+    if (ring->fd >= 0) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    ring->cq_ring = NULL;
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        ring->sq_ring = NULL;
+    }
+    if (ring->buffer_ring != NULL) {
+        munmap(ring->buffer_ring, ring->buffer_ring_size + ring->buffer_count * ring->buffer_size);
+        ring->buffer_ring = NULL;
+    }
+    debug_return;
+}
+
+int uring_reserve(uring_s *ring, unsigned count) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (*ring->sq_tail + ring->sq_queued - head + count <= ring->sq_entries) {
+        return 0;
+    }
+    return enter(ring, publish(ring), 0, 0, -1) < 0 ? -1 : 0;
+}
+
+struct io_uring_sqe *uring_sqe(uring_s *ring) {
+    if (uring_reserve(ring, 1) != 0) {
+        return NULL;
+    }
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_queued;
+    if (tail - head >= ring->sq_entries) {
+        // The kernel left some unsubmitted, which only a bad submission
+        // does.
+        errno = EBUSY;
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_queued++;
+    return sqe;
+}
+
+int uring_submit(uring_s *ring, int timeout_ms) {
+    return enter(ring, publish(ring), timeout_ms >= 0 ? 1 : 0, IORING_ENTER_GETEVENTS, timeout_ms) < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_cqe(uring_s *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_s *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *uring_buffer(uring_s *ring, unsigned id) {
+    return ring->buffers + (size_t)id * ring->buffer_size;
+}
+
+void uring_buffer_put(uring_s *ring, unsigned id) {
+    // The ring's tail overlays the reserved field of its first entry, so
+    // entries are written field by field.
+    unsigned short tail = ring->buffer_ring->tail;
+    struct io_uring_buf *buf = &ring->buffer_ring->bufs[tail & (ring->buffer_count - 1)];
+    buf->addr = (uintptr_t)uring_buffer(ring, id);
+    buf->len = ring->buffer_size;
+    buf->bid = id;
+    __atomic_store_n(&ring->buffer_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *uring_accept(uring_s *ring, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = data;
+    }
+    return sqe;
+}
+
+struct io_uring_sqe *uring_cancel(uring_s *ring, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = data;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = 0;
+    }
+    return sqe;
+}
+
+struct io_uring_sqe *uring_close(uring_s *ring, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->user_data = data;
+    }
+    return sqe;
+}
+
+struct io_uring_sqe *uring_poll(uring_s *ring, int fd, unsigned events, bool multishot, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+        sqe->user_data = data;
+    }
+    return sqe;
+}
+
+struct io_uring_sqe *uring_recv(uring_s *ring, int fd, size_t len, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->len = len < ring->buffer_size ? len : ring->buffer_size;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = data;
+    }
+    return sqe;
+}
+
+struct io_uring_sqe *uring_sendmsg(uring_s *ring, int fd, const struct msghdr *msg, int flags, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        sqe->user_data = data;
+    }
+    return sqe;
+}
+
+/**
+ * @brief Calls io_uring_enter(), waiting for wait completions for up to
+ * timeout_ms when it is not -1. Running out of time or being interrupted
+ * is not an error.
+ */
+static int enter(uring_s *ring, unsigned submit, unsigned wait, unsigned flags, int timeout_ms) {
+    struct __kernel_timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = timeout_ms >= 0 ? (uintptr_t)&ts : 0;
+    int ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret < 0 && (errno == ETIME || errno == EINTR)) {
+        return 0;
+    }
+    return ret;
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/**
+ * @brief Makes the queued submissions visible to the kernel and returns
+ * how many it has yet to take, counting any it left from the last call.
+ */
+static unsigned publish(uring_s *ring) {
+    if (ring->sq_queued > 0) {
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_queued, __ATOMIC_RELEASE);
+        ring->sq_queued = 0;
+    }
+    return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,220 @@
+/**
+ * @file uring.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief io_uring ring declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * @brief Group id of the ring's provided receive buffers.
+ */
+#define URING_BUFFER_GROUP 0
+
+/**
+ * @brief An io_uring instance driven through the raw system calls: the
+ * submission and completion rings mapped from the kernel, and a ring of
+ * provided buffers the kernel picks from for receives, buffer_count
+ * buffers of buffer_size bytes in buffers. Submissions are queued with
+ * uring_sqe() and the helpers built on it, and handed to the kernel by
+ * uring_submit(). A ring set up disabled, as uring_init() does, must be
+ * enabled with uring_enable() by the one thread that will use it.
+ */
+typedef struct uring_s {
+    int fd;
+    unsigned flags;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_queued;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buffer_ring;
+    size_t buffer_ring_size;
+    char *buffers;
+    unsigned buffer_count;
+    size_t buffer_size;
+} uring_s;
+
+/**
+ * @brief Sets up a ring of entries submissions, disabled, with
+ * buffer_count receive buffers of buffer_size bytes each. The ring is made
+ * for a single thread that runs the kernel's completion work only when it
+ * waits; kernels without that fall back to an ordinary ring. Kernels
+ * without the features the server relies on (multishot accept, provided
+ * buffer rings, skipped completions) are refused.
+ * @param ring The ring.
+ * @param entries Submission queue size, a power of 2.
+ * @param buffer_count Number of receive buffers, a power of 2 up to 32768.
+ * @param buffer_size Size of each receive buffer.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+extern int uring_init(uring_s *ring, unsigned entries, unsigned buffer_count, size_t buffer_size);
+
+/**
+ * @brief Enables a ring set up by uring_init(), making the calling thread
+ * the only one that may submit to it.
+ * @param ring The ring.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+extern int uring_enable(uring_s *ring);
+
+/**
+ * @brief Closes the ring, which cancels whatever it still has in flight,
+ * and unmaps it. Memory the cancelled operations referred to may be freed
+ * once this returns.
+ * @param ring The ring.
+ * @return nothing
+ */
+extern void uring_free(uring_s *ring);
+
+/**
+ * @brief Makes sure count submissions can be queued without any of them
+ * being handed to the kernel early, as linked submissions must be; hands
+ * over what is queued if the queue is too full.
+ * @param ring The ring.
+ * @param count Number of submissions about to be queued.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+extern int uring_reserve(uring_s *ring, unsigned count);
+
+/**
+ * @brief Queues a cleared submission, handing over what is queued first if
+ * the queue is full.
+ * @param ring The ring.
+ * @return The submission to fill in, or NULL with errno set on failure.
+ */
+extern struct io_uring_sqe *uring_sqe(uring_s *ring);
+
+/**
+ * @brief Hands the queued submissions to the kernel and waits up to
+ * timeout_ms for a completion, unless one is already waiting. A timeout
+ * of -1 doesn't wait at all but still delivers completed work.
+ * @param ring The ring.
+ * @param timeout_ms Longest wait, in milliseconds, or -1.
+ * @return 0 on success or timeout, -1 with errno set on failure.
+ */
+extern int uring_submit(uring_s *ring, int timeout_ms);
+
+/**
+ * @brief Returns the oldest completion not yet seen, which stays valid
+ * until uring_cqe_seen().
+ * @param ring The ring.
+ * @return The completion, or NULL if there is none.
+ */
+extern struct io_uring_cqe *uring_cqe(uring_s *ring);
+
+/**
+ * @brief Releases the completion returned by uring_cqe().
+ * @param ring The ring.
+ * @return nothing
+ */
+extern void uring_cqe_seen(uring_s *ring);
+
+/**
+ * @brief Returns a receive buffer picked by the kernel, by the id in the
+ * completion's flags.
+ * @param ring The ring.
+ * @param id Buffer id.
+ * @return The buffer, buffer_size bytes.
+ */
+extern char *uring_buffer(uring_s *ring, unsigned id);
+
+/**
+ * @brief Gives a receive buffer back to the kernel.
+ * @param ring The ring.
+ * @param id Buffer id.
+ * @return nothing
+ */
+extern void uring_buffer_put(uring_s *ring, unsigned id);
+
+/**
+ * @brief Queues a multishot accept on a listening socket, completing once
+ * for each connection with its socket, non-blocking and close-on-exec,
+ * until a completion without IORING_CQE_F_MORE ends it.
+ * @param ring The ring.
+ * @param fd The listening socket.
+ * @param data User data for the completions.
+ * @return The submission, or NULL with errno set on failure.
+ */
+extern struct io_uring_sqe *uring_accept(uring_s *ring, int fd, uint64_t data);
+
+/**
+ * @brief Queues a cancellation of the operations submitted with the given
+ * user data. Its own completion is only posted if it fails, with user data
+ * 0.
+ * @param ring The ring.
+ * @param data User data of the operations to cancel.
+ * @return The submission, or NULL with errno set on failure.
+ */
+extern struct io_uring_sqe *uring_cancel(uring_s *ring, uint64_t data);
+
+/**
+ * @brief Queues a close of a file descriptor.
+ * @param ring The ring.
+ * @param fd The file descriptor.
+ * @param data User data for the completion.
+ * @return The submission, or NULL with errno set on failure.
+ */
+extern struct io_uring_sqe *uring_close(uring_s *ring, int fd, uint64_t data);
+
+/**
+ * @brief Queues a poll for the given events, which completes once they are
+ * ready or, multishot, each time they become ready again.
+ * @param ring The ring.
+ * @param fd The file descriptor.
+ * @param events Poll events, such as POLLIN.
+ * @param multishot Whether to keep polling after the first completion.
+ * @param data User data for the completions.
+ * @return The submission, or NULL with errno set on failure.
+ */
+extern struct io_uring_sqe *uring_poll(uring_s *ring, int fd, unsigned events, bool multishot, uint64_t data);
+
+/**
+ * @brief Queues a receive of up to len bytes into a buffer the kernel picks
+ * from the ring's provided buffers once data has arrived, so nothing is
+ * tied up by a connection that is only waiting. The completion carries
+ * IORING_CQE_F_BUFFER and the buffer id, which must be given back with
+ * uring_buffer_put(), or fails with -ENOBUFS if every buffer was in use.
+ * @param ring The ring.
+ * @param fd The socket.
+ * @param len Most bytes to receive, at most buffer_size.
+ * @param data User data for the completion.
+ * @return The submission, or NULL with errno set on failure.
+ */
+extern struct io_uring_sqe *uring_recv(uring_s *ring, int fd, size_t len, uint64_t data);
+
+/**
+ * @brief Queues a sendmsg(). msg and the memory it points to must stay
+ * valid until the completion; with MSG_WAITALL the kernel keeps sending
+ * until all of it has gone or the send fails.
+ * @param ring The ring.
+ * @param fd The socket.
+ * @param msg The message.
+ * @param flags sendmsg() flags.
+ * @param data User data for the completion.
+ * @return The submission, or NULL with errno set on failure.
+ */
+extern struct io_uring_sqe *uring_sendmsg(uring_s *ring, int fd, const struct msghdr *msg, int flags, uint64_t data);
+
+#endif // URING_H
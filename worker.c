@@ -0,0 +1,1193 @@
+/**
+ * @file worker.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief event loop worker pool implementation.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "access.h"
+#include "cache.h"
+#include "debug.h"
+#include "h2.h"
+#include "http.h"
+#include "limit.h"
+#include "log.h"
+#include "metrics.h"
+#include "request.h"
+#include "response.h"
+#include "timer.h"
+#include "trace.h"
+#include "uring.h"
+#include "worker.h"
+
+#define WORKER_EVENTS_MAX 256
+#define WORKER_TICK_MS 1000
+#define WORKER_SPARE_MAX 256
+
+/**
+ * @brief Size of a worker's ring, and its receive buffers: each waiting 
+ * connection only takes one while its data is copied into the request.
+ */
+#define WORKER_RING_ENTRIES 256
+#define WORKER_RING_BUFFERS 128
+
+/**
+ * @brief Largest last send of a response that is linked to the close of 
+ * the connection. A linked send must go out whole, which for a big one 
+ * could take a slow client past the send timeout.
+ */
+#define WORKER_LINK_MAX 65536
+
+/**
+ * @brief Ring operations, kept in the low bits of their user data beside 
+ * the connection, listener or worker they are for, all of which are 
+ * aligned. A close carries the file descriptor in place of a pointer, as
+ * its connection may have been reused by the time it completes.
+ */
+typedef enum worker_op_e {
+    WORKER_OP_NONE,
+    WORKER_OP_ACCEPT,
+    WORKER_OP_CLOSE,
+    WORKER_OP_EPOLL,
+    WORKER_OP_POLL,
+    WORKER_OP_RECV,
+    WORKER_OP_SEND
+} worker_op_e;
+
+#define WORKER_OP_BITS 3
+#define WORKER_OP_MASK ((1 << WORKER_OP_BITS) - 1)
+#define WORKER_OP_DATA(ptr, op) ((uint64_t)(uintptr_t)(ptr) | (op))
+
+/**
+ * @brief Storage for one connection: the client and its request in a 
+ * single allocation, recycled through the worker's spare list. client must
+ * stay first so a connection can be found from its http_client_s. limit is
+ * the connection's share of its client address's limits, if tracked. timer
+ * is the connection's one timeout on the worker's wheel, for whichever 
+ * phase it is in, and idle says it is waiting for another request on a 
+ * persistent connection. The rest is for connections served through the 
+ * worker's ring, which uring says this is: reading, sending and polling
+ * say which operations the ring has in flight for it, and closed that the
+ * connection has been closed and is waiting for them on the zombie list.
+ * A completed receive leaves received set with its result and the id of
+ * its buffer, or -1; a failed send leaves error. linked says the last 
+ * send was linked to the close of the socket. msg and iov describe the 
+ * send in flight.
+ */
+typedef struct worker_connection_s {
+    http_client_s client;
+    request_s request;
+    limit_client_s *limit;
+    timer_s timer;
+    bool idle;
+    bool uring;
+    bool reading;
+    bool sending;
+    bool polling;
+    bool closed;
+    bool received;
+    bool linked;
+    int result;
+    int buffer;
+    int error;
+    struct msghdr msg;
+    struct iovec iov[RESPONSE_IOV_MAX];
+    struct worker_connection_s *next;
+} worker_connection_s;
+
+static void accept_clients(worker_s *worker, http_server_s *server);
+static void accept_uring(worker_s *worker, http_server_s *server, int fd);
+static int admit_client(worker_s *worker, http_server_s *server, worker_connection_s *connection);
+static void cancel_uring(worker_s *worker, worker_connection_s *connection);
+static void close_client(worker_s *worker, http_client_s *client);
+static void close_worker(worker_s *worker);
+static void complete_connection(worker_s *worker, worker_connection_s *connection, worker_op_e op, const struct io_uring_cqe *cqe);
+static worker_connection_s *connection_get(worker_s *worker);
+static void connection_put(worker_s *worker, worker_connection_s *connection);
+static void drain_worker(worker_s *worker);
+static void expire_client(timer_s *timer, void *arg);
+static http_server_s *find_listener(worker_pool_s *pool, void *ptr);
+static void handle_completion(worker_s *worker, const struct io_uring_cqe *cqe);
+static void handle_events(worker_s *worker, struct epoll_event *events, int n);
+static bool in_flight(worker_connection_s *connection);
+static void link_client(http_client_s **list, http_client_s *client);
+static time_t monotonic_now(void);
+static void poll_epoll(worker_s *worker);
+static void process_client(worker_s *worker, http_client_s *client);
+static request_read_e read_uring(worker_s *worker, worker_connection_s *connection);
+static void reap_zombies(worker_s *worker);
+static int recv_uring(worker_s *worker, worker_connection_s *connection);
+static http_io_e send_client(worker_s *worker, worker_connection_s *connection);
+static http_io_e send_uring(worker_s *worker, worker_connection_s *connection);
+static void set_timeout(worker_s *worker, http_client_s *client, int seconds);
+static void unlink_client(http_client_s **list, http_client_s *client);
+static int wait_for(worker_s *worker, http_client_s *client, uint32_t events);
+static void *worker_run(void *arg);
+
+worker_pool_s *worker_pool_start(http_server_s *server, const worker_config_s *config, worker_handler_f *handler) {
+    debug_enter();
+    log_s *log = server->log;
+    int count = worker_pool_size(config->workers);
+    worker_pool_s *pool = malloc(sizeof(worker_pool_s));
+    if (pool == NULL) {
+        log_error(log, "malloc failed: %s", strerror(errno));
+        debug_return NULL;
+    }
+    pool->server = server;
+    pool->handler = handler;
+    pool->count = 0;
+    pool->config = *config;
+    atomic_init(&pool->connections, 0);
+    atomic_init(&pool->running, 0);
+    atomic_init(&pool->drain, false);
+    atomic_init(&pool->stop, false);
+    pool->workers = calloc(count, sizeof(worker_s));
+    if (pool->workers == NULL) {
+        log_error(log, "calloc failed: %s", strerror(errno));
+        free(pool);
+        debug_return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        worker_s *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        worker->clients = NULL;
+        worker->spare = NULL;
+        worker->spare_count = 0;
+        worker->draining = false;
+        worker->zombies = NULL;
+        worker->now = monotonic_now();
+        worker->swept = worker->now;
+        timer_wheel_init(&worker->timers, worker->now);
+        worker->event_fd = -1;
+        worker->epoll_fd = -1;
+        // The ring is set up here but only enabled by the worker thread, 
+        // the one thread allowed to submit to it. Until then submissions
+        // are just queued.
+        worker->uring = false;
+        if (config->uring) {
+            if (uring_init(&worker->ring, WORKER_RING_ENTRIES, WORKER_RING_BUFFERS, REQUEST_BUFFER_SIZE) == 0) {
+                worker->uring = true;
+            } else {
+                log_warn(log, "io_uring unavailable for worker %d, using epoll: %s", i, strerror(errno));
+            }
+        }
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->epoll_fd < 0) {
+            log_error(log, "epoll_create1 failed: %s", strerror(errno));
+            close_worker(worker);
+            goto error;
+        }
+        worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (worker->event_fd < 0) {
+            log_error(log, "eventfd failed: %s", strerror(errno));
+            close_worker(worker);
+            goto error;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = worker };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &ev) < 0) {
+            log_error(log, "epoll_ctl failed: %s", strerror(errno));
+            close_worker(worker);
+            goto error;
+        }
+        if (worker->uring && uring_poll(&worker->ring, worker->epoll_fd, POLLIN, true, WORKER_OP_DATA(worker, WORKER_OP_EPOLL)) == NULL) {
+            log_error(log, "io_uring poll failed: %s", strerror(errno));
+            close_worker(worker);
+            goto error;
+        }
+        // Shared sockets use EPOLLEXCLUSIVE so only one worker is woken 
+        // per connection; a SO_REUSEPORT shard is only watched by its own
+        // worker. Plaintext listeners on a ring get a multishot accept 
+        // instead, whose waits are exclusive too.
+        bool added = true;
+        for (http_server_s *listener = server; listener != NULL && added; listener = listener->next) {
+            if (listener->shard >= 0 && listener->shard % count != i) {
+                continue;
+            }
+            if (worker->uring && listener->ssl_ctx == NULL) {
+                if (uring_accept(&worker->ring, listener->fd, WORKER_OP_DATA(listener, WORKER_OP_ACCEPT)) == NULL) {
+                    log_error(log, "io_uring accept failed: %s", strerror(errno));
+                    added = false;
+                }
+                continue;
+            }
+            ev.events = listener->shard >= 0 ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = listener;
+            if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, listener->fd, &ev) < 0) {
+                log_error(log, "epoll_ctl failed: %s", strerror(errno));
+                added = false;
+            }
+        }
+        if (!added) {
+            close_worker(worker);
+            goto error;
+        }
+        atomic_fetch_add(&pool->running, 1);
+        if (pthread_create(&worker->thread, NULL, worker_run, worker) != 0) {
+            log_error(log, "pthread_create failed: %s", strerror(errno));
+            atomic_fetch_sub(&pool->running, 1);
+            close_worker(worker);
+            goto error;
+        }
+        pool->count++;
+    }
+    log_info(log, "started %d workers, maximum connections %d, %s", pool->count, pool->config.max_connections, pool->count > 0 && pool->workers[0].uring ? "io_uring" : "epoll");
+    debug_return pool;
+error:
+    worker_pool_stop(pool);
+    debug_return NULL;
+}
+
+void worker_pool_drain(worker_pool_s *pool) {
+    debug_enter();
+    atomic_store(&pool->drain, true);
+    for (int i = 0; i < pool->count; i++) {
+        uint64_t one = 1;
+        if (write(pool->workers[i].event_fd, &one, sizeof(one)) != sizeof(one)) {
+            log_error(pool->server->log, "unable to wake worker %d: %s", i, strerror(errno));
+        }
+    }
+    debug_return;
+}
+
+bool worker_pool_drained(worker_pool_s *pool) {
+    return atomic_load(&pool->running) == 0;
+}
+
+int worker_pool_size(int workers) {
+    if (workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers <= 0) {
+            workers = 1;
+        }
+    }
+    return workers;
+}
+
+void worker_pool_stop(worker_pool_s *pool) {
+    debug_enter();
+    if (pool == NULL) {
+        debug_return;
+    }
+    atomic_store(&pool->stop, true);
+    for (int i = 0; i < pool->count; i++) {
+        uint64_t one = 1;
+        if (write(pool->workers[i].event_fd, &one, sizeof(one)) != sizeof(one)) {
+            log_error(pool->server->log, "unable to wake worker %d: %s", i, strerror(errno));
+        }
+    }
+    for (int i = 0; i < pool->count; i++) {
+        worker_s *worker = &pool->workers[i];
+        pthread_join(worker->thread, NULL);
+        close_worker(worker);
+    }
+    free(pool->workers);
+    free(pool);
+    debug_return;
+}
+
+static void accept_clients(worker_s *worker, http_server_s *server) {
+    debug_enter();
+    worker_pool_s *pool = worker->pool;
+    log_s *log = pool->server->log;
+    while (1) {
+        worker_connection_s *connection = connection_get(worker);
+        if (connection == NULL) {
+            break;
+        }
+        http_client_s *client = &connection->client;
+        if (http_accept(server, client) != 0) {
+            connection_put(worker, connection);
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        if (admit_client(worker, server, connection) != 0) {
+            continue;
+        }
+        client->events = EPOLLIN;
+        struct epoll_event ev = { .events = client->events, .data.ptr = client };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client->fd, &ev) < 0) {
+            log_error(log, "epoll_ctl failed: %s", strerror(errno));
+            close_client(worker, client);
+            continue;
+        }
+        log_debug(log, "worker %d accepted client %s, active connections: %d", worker->id, client->ip, atomic_load(&pool->connections));
+    }
+    debug_return;
+}
+
+/**
+ * @brief Takes on a connection accepted by the ring. Its first receive is
+ * queued at once, so the request is read as soon as it arrives.
+ */
+static void accept_uring(worker_s *worker, http_server_s *server, int fd) {
+    debug_enter();
+    worker_pool_s *pool = worker->pool;
+    worker_connection_s *connection = connection_get(worker);
+    if (connection == NULL) {
+        close(fd);
+        debug_return;
+    }
+    http_client_s *client = &connection->client;
+    if (http_accept_fd(server, client, fd) != 0) {
+        connection_put(worker, connection);
+        debug_return;
+    }
+    if (admit_client(worker, server, connection) != 0) {
+        debug_return;
+    }
+    connection->uring = true;
+    if (recv_uring(worker, connection) != 0) {
+        close_client(worker, client);
+        debug_return;
+    }
+    log_debug(pool->server->log, "worker %d accepted client %s, active connections: %d", worker->id, client->ip, atomic_load(&pool->connections));
+    debug_return;
+}
+
+/**
+ * @brief Counts a newly accepted connection and applies the per-client 
+ * limits and max_connections to it. An admitted connection is set up and
+ * linked; a rejected one is closed and its storage put back. Returns 0 if 
+ * the connection was admitted.
+ */
+static int admit_client(worker_s *worker, http_server_s *server, worker_connection_s *connection) {
+    worker_pool_s *pool = worker->pool;
+    log_s *log = pool->server->log;
+    http_client_s *client = &connection->client;
+    metrics_add(METRICS_CONNECTIONS_ACCEPTED, 1);
+    // Per-client limits are checked before anything else is spent on
+    // the connection. They are logged at debug level only, since a 
+    // client being limited is likely to keep trying.
+    connection->limit = NULL;
+    limit_result_e limited = server->admin ? LIMIT_OK : limit_acquire(&client->addr, &connection->limit);
+    if (limited != LIMIT_OK) {
+        metrics_add(limited == LIMIT_CONNECTIONS ? METRICS_CONNECTIONS_LIMITED : METRICS_CONNECTIONS_RATE_LIMITED, 1);
+        log_debug(log, "rejecting connection from %s, %s", client->ip, limited == LIMIT_CONNECTIONS ? "too many connections" : "connecting too fast");
+        http_client_close(client);
+        connection_put(worker, connection);
+        return -1;
+    }
+    if (atomic_fetch_add(&pool->connections, 1) >= pool->config.max_connections) {
+        atomic_fetch_sub(&pool->connections, 1);
+        metrics_add(METRICS_CONNECTIONS_REJECTED, 1);
+        log_warn(log, "Max connections (%d) reached, rejecting connection from %s", pool->config.max_connections, client->ip);
+        limit_release(connection->limit);
+        http_client_close(client);
+        connection_put(worker, connection);
+        return -1;
+    }
+    request_init(&connection->request, client);
+    client->request = &connection->request;
+    client->response.fd = -1;
+    client->prev = NULL;
+    client->next = NULL;
+    link_client(&worker->clients, client);
+    // The handshake and the first request share the request timeout.
+    timer_init(&connection->timer);
+    connection->idle = false;
+    connection->uring = false;
+    connection->reading = false;
+    connection->sending = false;
+    connection->polling = false;
+    connection->closed = false;
+    connection->received = false;
+    connection->linked = false;
+    connection->buffer = -1;
+    connection->error = 0;
+    trace_begin(&client->trace);
+    trace_point(&client->trace, TRACE_ACCEPT);
+    set_timeout(worker, client, pool->config.request_timeout);
+    return 0;
+}
+
+/**
+ * @brief Cancels whatever the ring has in flight for a connection being 
+ * closed. The cancellations complete the operations, with -ECANCELED if
+ * they hadn't completed already.
+ */
+static void cancel_uring(worker_s *worker, worker_connection_s *connection) {
+    const worker_op_e ops[] = { WORKER_OP_RECV, WORKER_OP_SEND, WORKER_OP_POLL };
+    const bool pending[] = { connection->reading, connection->sending, connection->polling };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (pending[i] && uring_cancel(&worker->ring, WORKER_OP_DATA(connection, ops[i])) == NULL) {
+            log_error(worker->pool->server->log, "io_uring cancel failed: %s", strerror(errno));
+        }
+    }
+}
+
+static void close_client(worker_s *worker, http_client_s *client) {
+    debug_enter();
+    worker_pool_s *pool = worker->pool;
+    worker_connection_s *connection = (worker_connection_s *)client;
+    trace_point(&client->trace, TRACE_CLOSE);
+    trace_commit(&client->trace);
+    timer_cancel(&worker->timers, &connection->timer);
+    unlink_client(&worker->clients, client);
+    h2_free(client);
+    if (connection->linked) {
+        // The close linked to the last send owns the socket now.
+        client->fd = -1;
+    }
+    request_cleanup(client->request);
+    http_client_close(client);
+    limit_release(connection->limit);
+    if (in_flight(connection)) {
+        // The response stays referenced until a send in flight is done 
+        // with it, and the storage until the ring no longer names it.
+        response_hold(&client->response);
+        cancel_uring(worker, connection);
+        connection->closed = true;
+        link_client(&worker->zombies, client);
+    } else {
+        response_reset(&client->response);
+        connection_put(worker, connection);
+    }
+    metrics_add(METRICS_CONNECTIONS_CLOSED, 1);
+    int active = atomic_fetch_sub(&pool->connections, 1) - 1;
+    log_debug(pool->server->log, "Connection closed, active connections: %d", active);
+    debug_return;
+}
+
+/**
+ * @brief Releases a worker's event fd, epoll set and ring.
+ */
+static void close_worker(worker_s *worker) {
+    if (worker->event_fd >= 0) {
+        close(worker->event_fd);
+        worker->event_fd = -1;
+    }
+    if (worker->epoll_fd >= 0) {
+        close(worker->epoll_fd);
+        worker->epoll_fd = -1;
+    }
+    if (worker->uring) {
+        uring_free(&worker->ring);
+        worker->uring = false;
+    }
+}
+
+/**
+ * @brief Records the completion of a receive, send or poll for a 
+ * connection and carries on with it, or, for a closed connection, frees 
+ * its storage once nothing is left in flight.
+ */
+static void complete_connection(worker_s *worker, worker_connection_s *connection, worker_op_e op, const struct io_uring_cqe *cqe) {
+    http_client_s *client = &connection->client;
+    switch (op) {
+        case WORKER_OP_RECV:
+            connection->reading = false;
+            connection->received = true;
+            connection->result = cqe->res;
+            connection->buffer = cqe->flags & IORING_CQE_F_BUFFER ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+            break;
+        case WORKER_OP_SEND:
+            connection->sending = false;
+            if (cqe->res < 0) {
+                connection->error = -cqe->res;
+            } else {
+                if (client->response.sent == 0 && cqe->res > 0) {
+                    trace_point(&client->trace, TRACE_FIRST_BYTE);
+                }
+                client->response.sent += cqe->res;
+            }
+            break;
+        default:
+            connection->polling = false;
+            break;
+    }
+    if (!connection->closed) {
+        process_client(worker, client);
+        return;
+    }
+    if (connection->buffer >= 0) {
+        uring_buffer_put(&worker->ring, connection->buffer);
+        connection->buffer = -1;
+    }
+    if (!in_flight(connection)) {
+        unlink_client(&worker->zombies, client);
+        response_reset(&client->response);
+        connection_put(worker, connection);
+    }
+}
+
+/**
+ * @brief Takes connection storage from the worker's spare list, or 
+ * allocates it if the list is empty.
+ */
+static worker_connection_s *connection_get(worker_s *worker) {
+    worker_connection_s *connection = worker->spare;
+    if (connection != NULL) {
+        worker->spare = connection->next;
+        worker->spare_count--;
+        return connection;
+    }
+    connection = malloc(sizeof(worker_connection_s));
+    if (connection == NULL) {
+        log_error(worker->pool->server->log, "malloc failed: %s", strerror(errno));
+    }
+    return connection;
+}
+
+/**
+ * @brief Returns connection storage to the worker's spare list, or frees it
+ * if the list is full.
+ */
+static void connection_put(worker_s *worker, worker_connection_s *connection) {
+    if (worker->spare_count >= WORKER_SPARE_MAX) {
+        free(connection);
+        return;
+    }
+    connection->next = worker->spare;
+    worker->spare = connection;
+    worker->spare_count++;
+}
+
+/**
+ * @brief Stops the worker accepting and closes its idle persistent 
+ * connections; the others close as their responses finish. HTTP/2 
+ * connections are sent GOAWAY and close once their open streams are done.
+ * Listeners the worker doesn't watch are simply not found in its epoll 
+ * set, or by the cancellation of its ring's accepts.
+ */
+static void drain_worker(worker_s *worker) {
+    debug_enter();
+    worker_pool_s *pool = worker->pool;
+    worker->draining = true;
+    for (http_server_s *listener = pool->server; listener != NULL; listener = listener->next) {
+        if (worker->uring && listener->ssl_ctx == NULL) {
+            uring_cancel(&worker->ring, WORKER_OP_DATA(listener, WORKER_OP_ACCEPT));
+        } else {
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, listener->fd, NULL);
+        }
+    }
+    http_client_s *client = worker->clients;
+    while (client != NULL) {
+        http_client_s *next = client->next;
+        if (client->state == HTTP_CLIENT_H2) {
+            h2_goaway(client);
+            process_client(worker, client);
+        } else if (((worker_connection_s *)client)->idle) {
+            close_client(worker, client);
+        }
+        client = next;
+    }
+    log_debug(pool->server->log, "worker %d draining", worker->id);
+    debug_return;
+}
+
+/**
+ * @brief Closes a connection whose timeout fired. Only timeouts in the 
+ * middle of a request or response are counted; closing a persistent 
+ * connection that has gone quiet is routine.
+ */
+static void expire_client(timer_s *timer, void *arg) {
+    worker_s *worker = arg;
+    worker_connection_s *connection = (worker_connection_s *)((char *)timer - offsetof(worker_connection_s, timer));
+    http_client_s *client = &connection->client;
+    if (connection->idle) {
+        log_debug(worker->pool->server->log, "closing idle connection from %s", client->ip);
+    } else {
+        metrics_add(METRICS_CONNECTIONS_TIMED_OUT, 1);
+        log_debug(worker->pool->server->log, "closing connection from %s, %s timed out", client->ip, client->state == HTTP_CLIENT_WRITE || client->state == HTTP_CLIENT_H2 ? "response" : "request");
+    }
+    close_client(worker, client);
+}
+
+/**
+ * @brief Returns the listener an event is for, or NULL if it is for a 
+ * client. There are only a few listeners, so they are simply compared.
+ */
+static http_server_s *find_listener(worker_pool_s *pool, void *ptr) {
+    for (http_server_s *listener = pool->server; listener != NULL; listener = listener->next) {
+        if (ptr == listener) {
+            return listener;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Passes a completion from the worker's ring to whatever it is for.
+ * A multishot accept or poll that has ended is queued again, unless the 
+ * worker is draining.
+ */
+static void handle_completion(worker_s *worker, const struct io_uring_cqe *cqe) {
+    log_s *log = worker->pool->server->log;
+    worker_op_e op = cqe->user_data & WORKER_OP_MASK;
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)WORKER_OP_MASK);
+    switch (op) {
+        case WORKER_OP_ACCEPT: {
+            http_server_s *listener = ptr;
+            if (cqe->res >= 0) {
+                accept_uring(worker, listener, cqe->res);
+            } else if (cqe->res != -ECANCELED) {
+                log_error(log, "accept failed: %s", strerror(-cqe->res));
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE) && !worker->draining) {
+                if (uring_accept(&worker->ring, listener->fd, cqe->user_data) == NULL) {
+                    log_error(log, "io_uring accept failed: %s", strerror(errno));
+                }
+            }
+            break;
+        }
+        case WORKER_OP_CLOSE:
+            // Only a close cancelled by the failure of the send linked to
+            // it completes; the socket is still open then.
+            if (cqe->res == -ECANCELED) {
+                close((int)(cqe->user_data >> WORKER_OP_BITS));
+            }
+            break;
+        case WORKER_OP_EPOLL:
+            poll_epoll(worker);
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                if (uring_poll(&worker->ring, worker->epoll_fd, POLLIN, true, cqe->user_data) == NULL) {
+                    log_error(log, "io_uring poll failed: %s", strerror(errno));
+                }
+            }
+            break;
+        case WORKER_OP_POLL:
+        case WORKER_OP_RECV:
+        case WORKER_OP_SEND:
+            complete_connection(worker, ptr, op, cqe);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief Handles a batch of events from the worker's epoll set.
+ */
+static void handle_events(worker_s *worker, struct epoll_event *events, int n) {
+    worker_pool_s *pool = worker->pool;
+    http_server_s *listener;
+    for (int i = 0; i < n; i++) {
+        void *ptr = events[i].data.ptr;
+        if (ptr == worker) {
+            uint64_t value;
+            if (read(worker->event_fd, &value, sizeof(value)) < 0) {
+                debug("eventfd read failed\n");
+            }
+        } else if ((listener = find_listener(pool, ptr)) != NULL) {
+            accept_clients(worker, listener);
+        } else {
+            process_client(worker, (http_client_s *)ptr);
+        }
+    }
+}
+
+/**
+ * @brief Whether the ring has operations in flight for a connection.
+ */
+static bool in_flight(worker_connection_s *connection) {
+    return connection->reading || connection->sending || connection->polling;
+}
+
+/**
+ * @brief Adds a client to one of the worker's lists of connections: the 
+ * open ones, which is only walked to close them all at shutdown, or the 
+ * zombies.
+ */
+static void link_client(http_client_s **list, http_client_s *client) {
+    client->prev = NULL;
+    client->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = client;
+    }
+    *list = client;
+}
+
+static time_t monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * @brief Handles what is ready in the epoll set of a worker on a ring, 
+ * once the ring's poll of it has fired. A full batch may not be all there
+ * is, so the set is checked again.
+ */
+static void poll_epoll(worker_s *worker) {
+    struct epoll_event events[WORKER_EVENTS_MAX];
+    int n;
+    do {
+        n = epoll_wait(worker->epoll_fd, events, WORKER_EVENTS_MAX, 0);
+        if (n > 0) {
+            handle_events(worker, events, n);
+        }
+    } while (n == WORKER_EVENTS_MAX);
+}
+
+/**
+ * @brief Drives a client through its states until it has to wait for the
+ * socket or is closed.
+ */
+static void process_client(worker_s *worker, http_client_s *client) {
+    debug_enter();
+    worker_pool_s *pool = worker->pool;
+    worker_connection_s *connection = (worker_connection_s *)client;
+    while (1) {
+        switch (client->state) {
+            case HTTP_CLIENT_HANDSHAKE:
+                switch (http_handshake(client)) {
+                    case HTTP_IO_OK:
+                        trace_point(&client->trace, TRACE_HANDSHAKE);
+                        if (!http_is_h2(client)) {
+                            client->state = HTTP_CLIENT_READ;
+                            break;
+                        }
+                        // HTTP/2 streams aren't traced, so the
+                        // connection's sample ends unrecorded.
+                        trace_commit(&client->trace);
+                        if (h2_init(client) != 0) {
+                            client->state = HTTP_CLIENT_CLOSE;
+                            break;
+                        }
+                        client->state = HTTP_CLIENT_H2;
+                        if (worker->draining) {
+                            h2_goaway(client);
+                        }
+                        break;
+                    case HTTP_IO_WANT_READ:
+                        if (wait_for(worker, client, EPOLLIN) != 0) {
+                            client->state = HTTP_CLIENT_CLOSE;
+                            break;
+                        }
+                        debug_return;
+                    case HTTP_IO_WANT_WRITE:
+                        if (wait_for(worker, client, EPOLLOUT) != 0) {
+                            client->state = HTTP_CLIENT_CLOSE;
+                            break;
+                        }
+                        debug_return;
+                    default:
+                        metrics_add(METRICS_TLS_HANDSHAKE_FAILURES, 1);
+                        client->state = HTTP_CLIENT_CLOSE;
+                        break;
+                }
+                break;
+            case HTTP_CLIENT_READ:
+                switch (connection->uring ? read_uring(worker, connection) : request_read(client->request)) {
+                    case REQUEST_READ_AGAIN:
+                        // The first bytes of the next request end the 
+                        // keep-alive wait; the rest of it must arrive 
+                        // within the request timeout, however the client
+                        // paces it.
+                        if (connection->idle && client->request->buffer_len > 0) {
+                            connection->idle = false;
+                            set_timeout(worker, client, pool->config.request_timeout);
+                        }
+                        if ((connection->uring ? recv_uring(worker, connection) : wait_for(worker, client, EPOLLIN)) != 0) {
+                            client->state = HTTP_CLIENT_CLOSE;
+                            break;
+                        }
+                        debug_return;
+                    case REQUEST_READ_COMPLETE:
+                    case REQUEST_READ_TOO_LARGE:
+                        clock_gettime(CLOCK_MONOTONIC, &client->request_start);
+                        trace_point(&client->trace, TRACE_READ);
+                        if (pool->handler(client, client->request, &client->response) != 0) {
+                            client->state = HTTP_CLIENT_CLOSE;
+                        } else {
+                            clock_gettime(CLOCK_MONOTONIC, &client->response_start);
+                            client->state = HTTP_CLIENT_WRITE;
+                        }
+                        break;
+                    default:
+                        client->state = HTTP_CLIENT_CLOSE;
+                        break;
+                }
+                break;
+            case HTTP_CLIENT_WRITE:
+                switch (send_client(worker, connection)) {
+                    case HTTP_IO_OK: {
+                        struct timespec now;
+                        clock_gettime(CLOCK_MONOTONIC, &now);
+                        metrics_time(METRICS_STAGE_SEND, &client->response_start, &now);
+                        metrics_response(client->response.code, client->response.sent);
+                        client->requests++;
+                        access_write(client, client->request, &client->response, &client->request_start);
+                        response_reset(&client->response);
+                        trace_point(&client->trace, TRACE_DONE);
+                        if (client->keep_alive && !worker->draining) {
+                            trace_commit(&client->trace);
+                            trace_begin(&client->trace);
+                            request_reset(client->request);
+                            client->keep_alive = false;
+                            client->state = HTTP_CLIENT_READ;
+                            connection->idle = true;
+                            set_timeout(worker, client, pool->config.keepalive_timeout);
+                        } else {
+                            client->state = HTTP_CLIENT_CLOSE;
+                        }
+                        break;
+                    }
+                    case HTTP_IO_WANT_WRITE:
+                        // The send timeout runs from the last time the
+                        // client took some of the response. On the ring
+                        // the send or poll is already in flight. Either 
+                        // way the response outlives this pass.
+                        response_hold(&client->response);
+                        set_timeout(worker, client, pool->config.send_timeout);
+                        if (!connection->uring && wait_for(worker, client, EPOLLOUT) != 0) {
+                            client->state = HTTP_CLIENT_CLOSE;
+                            break;
+                        }
+                        debug_return;
+                    default:
+                        client->keep_alive = false;
+                        metrics_add(METRICS_BYTES_SENT, client->response.sent);
+                        access_write(client, client->request, &client->response, &client->request_start);
+                        client->state = HTTP_CLIENT_CLOSE;
+                        break;
+                }
+                break;
+            case HTTP_CLIENT_H2: {
+                int served = client->requests;
+                switch (h2_process(client, pool->handler)) {
+                    case HTTP_IO_WANT_READ:
+                        // Open streams wait on the client taking their
+                        // responses; a connection with none is idle from
+                        // the moment its last response was written.
+                        if (h2_streams(client) > 0) {
+                            connection->idle = false;
+                            set_timeout(worker, client, pool->config.send_timeout);
+                        } else if (client->requests > 0 && (!connection->idle || client->requests != served)) {
+                            connection->idle = true;
+                            set_timeout(worker, client, pool->config.keepalive_timeout);
+                        }
+                        if (wait_for(worker, client, EPOLLIN) != 0) {
+                            client->state = HTTP_CLIENT_CLOSE;
+                            break;
+                        }
+                        debug_return;
+                    case HTTP_IO_WANT_WRITE:
+                        connection->idle = false;
+                        set_timeout(worker, client, pool->config.send_timeout);
+                        if (wait_for(worker, client, EPOLLOUT) != 0) {
+                            client->state = HTTP_CLIENT_CLOSE;
+                            break;
+                        }
+                        debug_return;
+                    default:
+                        client->state = HTTP_CLIENT_CLOSE;
+                        break;
+                }
+                break;
+            }
+            case HTTP_CLIENT_CLOSE:
+            default:
+                close_client(worker, client);
+                debug_return;
+        }
+    }
+}
+
+/**
+ * @brief Adds what the last receive on the ring brought to the request, 
+ * handing its buffer back, or checks what is already buffered if nothing
+ * was received.
+ */
+static request_read_e read_uring(worker_s *worker, worker_connection_s *connection) {
+    request_s *request = &connection->request;
+    if (!connection->received) {
+        return request_append(request, NULL, 0);
+    }
+    connection->received = false;
+    request_read_e result;
+    if (connection->result > 0) {
+        result = request_append(request, uring_buffer(&worker->ring, connection->buffer), connection->result);
+    } else if (connection->result == 0) {
+        result = REQUEST_READ_EOF;
+    } else if (connection->result == -ENOBUFS) {
+        // Every buffer was taken when the data arrived; it is still 
+        // waiting for the next receive.
+        result = REQUEST_READ_AGAIN;
+    } else {
+        log_error(worker->pool->server->log, "recv failed for client %s: %s", connection->client.ip, strerror(-connection->result));
+        result = REQUEST_READ_ERROR;
+    }
+    if (connection->buffer >= 0) {
+        uring_buffer_put(&worker->ring, connection->buffer);
+        connection->buffer = -1;
+    }
+    return result;
+}
+
+/**
+ * @brief Waits a little for the ring to finish with the worker's closed 
+ * connections when it stops, so their storage can be freed. Operations 
+ * were cancelled when their connections closed, so this doesn't usually 
+ * take long; storage still named after that is freed anyway, before the 
+ * ring is closed. Connections accepted meanwhile are dropped.
+ */
+static void reap_zombies(worker_s *worker) {
+    for (http_server_s *listener = worker->pool->server; listener != NULL; listener = listener->next) {
+        if (listener->ssl_ctx == NULL) {
+            uring_cancel(&worker->ring, WORKER_OP_DATA(listener, WORKER_OP_ACCEPT));
+        }
+    }
+    for (int i = 0; i < 10 && worker->zombies != NULL; i++) {
+        if (uring_submit(&worker->ring, 100) != 0) {
+            break;
+        }
+        struct io_uring_cqe *next;
+        while ((next = uring_cqe(&worker->ring)) != NULL) {
+            struct io_uring_cqe cqe = *next;
+            uring_cqe_seen(&worker->ring);
+            worker_op_e op = cqe.user_data & WORKER_OP_MASK;
+            void *ptr = (void *)(uintptr_t)(cqe.user_data & ~(uint64_t)WORKER_OP_MASK);
+            if (op == WORKER_OP_ACCEPT && cqe.res >= 0) {
+                close(cqe.res);
+            } else if (op == WORKER_OP_CLOSE) {
+                handle_completion(worker, &cqe);
+            } else if (op == WORKER_OP_POLL || op == WORKER_OP_RECV || op == WORKER_OP_SEND) {
+                complete_connection(worker, ptr, op, &cqe);
+            }
+        }
+    }
+    while (worker->zombies != NULL) {
+        http_client_s *client = worker->zombies;
+        unlink_client(&worker->zombies, client);
+        response_reset(&client->response);
+        free(client);
+    }
+}
+
+/**
+ * @brief Queues a receive for a connection on the ring, unless one is in 
+ * flight already. It asks for no more than the request buffer can still 
+ * take, so a request that fits is never refused for bytes that follow it.
+ */
+static int recv_uring(worker_s *worker, worker_connection_s *connection) {
+    if (connection->reading) {
+        return 0;
+    }
+    size_t len = REQUEST_BUFFER_MAX - connection->request.buffer_len;
+    if (uring_recv(&worker->ring, connection->client.fd, len, WORKER_OP_DATA(connection, WORKER_OP_RECV)) == NULL) {
+        log_error(worker->pool->server->log, "io_uring recv failed: %s", strerror(errno));
+        return 1;
+    }
+    connection->reading = true;
+    return 0;
+}
+
+/**
+ * @brief Sends what it can of a client's response, on the ring or 
+ * directly, marking the first byte for the trace if it goes out.
+ */
+static http_io_e send_client(worker_s *worker, worker_connection_s *connection) {
+    http_client_s *client = &connection->client;
+    size_t sent = client->response.sent;
+    http_io_e rc = connection->uring ? send_uring(worker, connection) : response_send(client, &client->response);
+    if (sent == 0 && client->response.sent > 0) {
+        trace_point(&client->trace, TRACE_FIRST_BYTE);
+    }
+    return rc;
+}
+
+/**
+ * @brief Carries on sending a response through the ring: checks how the 
+ * last send went, then queues a sendmsg() of the header and body pieces 
+ * in memory. When that is the end of the response and the connection 
+ * closes after it, the close is linked to the send so both are done in 
+ * one submission, and report back as one completion. Body parts in files
+ * are still sent with sendfile(), polling the ring for the socket to take
+ * more, as sending them through the ring would mean reading them into 
+ * memory first.
+ */
+static http_io_e send_uring(worker_s *worker, worker_connection_s *connection) {
+    http_client_s *client = &connection->client;
+    http_response_s *response = &client->response;
+    log_s *log = worker->pool->server->log;
+    if (connection->linked) {
+        connection->linked = false;
+        client->fd = -1;
+    }
+    if (connection->error != 0) {
+        log_error(log, "Error sending response to client %s: %s", client->ip, strerror(connection->error));
+        connection->error = 0;
+        return HTTP_IO_ERROR;
+    }
+    size_t total = response->header_len + response->body_len;
+    if (response->sent >= total) {
+        return HTTP_IO_OK;
+    }
+    if (client->fd < 0) {
+        log_error(log, "Error sending response to client %s: connection closed with %zu bytes unsent", client->ip, total - response->sent);
+        return HTTP_IO_ERROR;
+    }
+    off_t file_offset;
+    size_t file_len;
+    int iovcnt = response_iov(response, connection->iov, &file_offset, &file_len);
+    if (iovcnt == 0) {
+        http_io_e result = response_send(client, response);
+        if (result == HTTP_IO_WANT_WRITE) {
+            if (uring_poll(&worker->ring, client->fd, POLLOUT, false, WORKER_OP_DATA(connection, WORKER_OP_POLL)) == NULL) {
+                log_error(log, "io_uring poll failed: %s", strerror(errno));
+                return HTTP_IO_ERROR;
+            }
+            connection->polling = true;
+        }
+        return result;
+    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += connection->iov[i].iov_len;
+    }
+    bool link = response->sent + len == total && len <= WORKER_LINK_MAX && (!client->keep_alive || worker->draining);
+    // A linked pair must go to the kernel in the same submission.
+    if (uring_reserve(&worker->ring, 2) != 0) {
+        log_error(log, "io_uring submit failed: %s", strerror(errno));
+        return HTTP_IO_ERROR;
+    }
+    memset(&connection->msg, 0, sizeof(connection->msg));
+    connection->msg.msg_iov = connection->iov;
+    connection->msg.msg_iovlen = iovcnt;
+    struct io_uring_sqe *sqe = uring_sendmsg(&worker->ring, client->fd, &connection->msg, MSG_NOSIGNAL | (link ? MSG_WAITALL : 0), WORKER_OP_DATA(connection, WORKER_OP_SEND));
+    if (sqe == NULL) {
+        log_error(log, "io_uring sendmsg failed: %s", strerror(errno));
+        return HTTP_IO_ERROR;
+    }
+    connection->sending = true;
+    if (link) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = uring_close(&worker->ring, client->fd, ((uint64_t)client->fd << WORKER_OP_BITS) | WORKER_OP_CLOSE);
+        sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+        connection->linked = true;
+        client->keep_alive = false;
+    }
+    return HTTP_IO_WANT_WRITE;
+}
+
+/**
+ * @brief Schedules the client's timeout the given number of seconds from
+ * now, replacing the one for its previous phase.
+ */
+static void set_timeout(worker_s *worker, http_client_s *client, int seconds) {
+    worker_connection_s *connection = (worker_connection_s *)client;
+    timer_schedule(&worker->timers, &connection->timer, worker->now + seconds);
+}
+
+static void unlink_client(http_client_s **list, http_client_s *client) {
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else if (*list == client) {
+        *list = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    }
+    client->prev = NULL;
+    client->next = NULL;
+}
+
+/**
+ * @brief Sets the events the worker waits for on a client socket, touching
+ * the epoll set only when they change.
+ */
+static int wait_for(worker_s *worker, http_client_s *client, uint32_t events) {
+    if (client->events == events) {
+        return 0;
+    }
+    struct epoll_event ev = { .events = events, .data.ptr = client };
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev) < 0) {
+        log_error(worker->pool->server->log, "epoll_ctl failed: %s", strerror(errno));
+        return 1;
+    }
+    client->events = events;
+    return 0;
+}
+
+static void *worker_run(void *arg) {
+    worker_s *worker = (worker_s *)arg;
+    worker_pool_s *pool = worker->pool;
+    log_s *log = pool->server->log;
+    struct epoll_event events[WORKER_EVENTS_MAX];
+    // pool->count is still growing while the first workers start.
+    int workers = worker_pool_size(pool->config.workers);
+    metrics_attach(pool->config.metrics_base + worker->id);
+    trace_attach(pool->config.metrics_base + worker->id);
+    log_debug(log, "worker %d running", worker->id);
+    bool failed = worker->uring && uring_enable(&worker->ring) != 0;
+    if (failed) {
+        log_error(log, "io_uring enable failed in worker %d: %s", worker->id, strerror(errno));
+    }
+    while (!failed && !atomic_load(&pool->stop)) {
+        if (worker->uring) {
+            // One call hands the kernel everything queued since the last
+            // pass and waits for what completes.
+            if (uring_submit(&worker->ring, WORKER_TICK_MS) != 0 && errno != EAGAIN && errno != EBUSY) {
+                log_error(log, "io_uring_enter failed in worker %d: %s", worker->id, strerror(errno));
+                break;
+            }
+            worker->now = monotonic_now();
+            cache_pass_begin();
+            struct io_uring_cqe *next;
+            while ((next = uring_cqe(&worker->ring)) != NULL) {
+                struct io_uring_cqe cqe = *next;
+                uring_cqe_seen(&worker->ring);
+                handle_completion(worker, &cqe);
+            }
+        } else {
+            int n = epoll_wait(worker->epoll_fd, events, WORKER_EVENTS_MAX, WORKER_TICK_MS);
+            worker->now = monotonic_now();
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                log_error(log, "epoll_wait failed in worker %d: %s", worker->id, strerror(errno));
+                break;
+            }
+            cache_pass_begin();
+            handle_events(worker, events, n);
+        }
+        timer_advance(&worker->timers, worker->now, expire_client, worker);
+        if (worker->now != worker->swept) {
+            worker->swept = worker->now;
+            limit_sweep(worker->id, workers);
+        }
+        if (atomic_load_explicit(&pool->drain, memory_order_relaxed) && !worker->draining) {
+            drain_worker(worker);
+        }
+        // Responses still waiting on their clients hold what they use by
+        // now; the rest of what this pass looked up may be freed.
+        cache_pass_end();
+        if (worker->draining && worker->clients == NULL) {
+            break;
+        }
+    }
+    while (worker->clients != NULL) {
+        close_client(worker, worker->clients);
+    }
+    if (worker->uring) {
+        reap_zombies(worker);
+    }
+    while (worker->spare != NULL) {
+        worker_connection_s *next = worker->spare->next;
+        free(worker->spare);
+        worker->spare = next;
+    }
+    worker->spare_count = 0;
+    log_debug(log, "worker %d stopped", worker->id);
+    atomic_fetch_sub(&pool->running, 1);
+    return NULL;
+}
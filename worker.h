@@ -0,0 +1,158 @@
+/**
+ * @file worker.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief event loop worker pool declarations.
+ * @version 0.1.0
+ * @date 2026-10-14
+ * @copyright Copyright (c) 2026
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "http.h"
+#include "timer.h"
+#include "uring.h"
+
+/**
+ * @brief Called by a worker once a complete request has been read from a 
+ * client. The handler parses request, sets up response for the worker to 
+ * send and sets client->keep_alive if the connection should stay open for
+ * another request afterwards. On HTTP/1 they are client->request and 
+ * client->response; an HTTP/2 connection passes each stream's own.
+ * @param client The client connection with a request ready to parse.
+ * @param request The request.
+ * @param response The response to set up.
+ * @return 0 if a response was prepared, non-zero to close the connection
+ * (on HTTP/2, to reset the stream).
+ */
+typedef int (worker_handler_f)(http_client_s *client, struct request_s *request, http_response_s *response);
+
+/**
+ * @brief Worker pool settings. workers <= 0 starts one worker per online CPU.
+ * Connections beyond max_connections are closed as soon as they are 
+ * accepted. Timeouts are in seconds: a connection is closed if the TLS 
+ * handshake and a complete request header take longer than 
+ * request_timeout, counted from the accept or the first byte of the 
+ * request; if the client takes none of a response for send_timeout; or if
+ * no new request starts within keepalive_timeout of the last response.
+ * Worker i counts its metrics in slot metrics_base + i, so the pools of 
+ * several processes can share the metrics slots. With uring, workers serve
+ * plaintext listeners and connections through io_uring rather than epoll
+ * where the kernel allows it.
+ */
+typedef struct worker_config_s {
+    int workers;
+    int max_connections;
+    int request_timeout;
+    int send_timeout;
+    int keepalive_timeout;
+    int metrics_base;
+    bool uring;
+} worker_config_s;
+
+/**
+ * @brief Represents a single worker thread. Each worker runs its own epoll 
+ * loop and owns the connections it accepts, listed in clients. The event 
+ * fd is used to wake the loop on shutdown. timers holds each connection's
+ * timeout, in seconds of the monotonic clock, and is advanced to now on 
+ * every pass of the loop. spare holds up to WORKER_SPARE_MAX closed 
+ * connections for reuse, so a new connection usually costs no allocation.
+ * swept is when the worker last swept its share of the per-client limits 
+ * table. draining is set once the worker has stopped accepting to let its
+ * connections finish. A worker with uring set waits on ring instead of on
+ * its epoll set: plaintext listeners and connections are served through 
+ * the ring, and the epoll set, which keeps the event fd and anything on 
+ * TLS, is itself polled from the ring. zombies lists closed connections
+ * whose storage is kept until the ring has finished with it.
+ */
+typedef struct worker_s {
+    struct worker_pool_s *pool;
+    pthread_t thread;
+    int id;
+    int epoll_fd;
+    int event_fd;
+    time_t now;
+    time_t swept;
+    http_client_s *clients;
+    timer_wheel_s timers;
+    struct worker_connection_s *spare;
+    int spare_count;
+    bool draining;
+    bool uring;
+    uring_s ring;
+    http_client_s *zombies;
+} worker_s;
+
+/**
+ * @brief Represents the pool of workers. server is the list of listeners.
+ * All workers wait on each shared listening socket (with EPOLLEXCLUSIVE, so
+ * only one is woken per connection), and each on its own shards of 
+ * SO_REUSEPORT listeners. connections counts open connections across all 
+ * workers. running counts the workers still in their loops, which they 
+ * leave when stop is set, or when drain is set and their connections are 
+ * all closed.
+ */
+typedef struct worker_pool_s {
+    http_server_s *server;
+    worker_handler_f *handler;
+    worker_s *workers;
+    int count;
+    worker_config_s config;
+    atomic_int connections;
+    atomic_int running;
+    atomic_bool drain;
+    atomic_bool stop;
+} worker_pool_s;
+
+/**
+ * @brief Starts a pool of worker threads serving connections on the given
+ * listeners.
+ * @param server The first of the listeners to accept connections on.
+ * @param config Pool settings.
+ * @param handler Request handler called when a request has been read.
+ * @return Pointer to the running pool, or NULL on error.
+ */
+extern worker_pool_s *worker_pool_start(http_server_s *server, const worker_config_s *config, worker_handler_f *handler);
+
+/**
+ * @brief Stops the workers accepting and lets them finish the connections
+ * they have: idle persistent connections are closed, and the rest are 
+ * closed once their current response is sent, or by their timeouts. 
+ * Listening sockets stay open for whoever else accepts on them. Returns at
+ * once; worker_pool_drained() tells when the workers are done.
+ * @param pool The pool.
+ * @return nothing
+ */
+extern void worker_pool_drain(worker_pool_s *pool);
+
+/**
+ * @brief Whether all workers of a pool told to drain have closed their 
+ * connections and stopped. The pool must still be freed with
+ * worker_pool_stop().
+ * @param pool The pool.
+ * @return true once every worker has stopped.
+ */
+extern bool worker_pool_drained(worker_pool_s *pool);
+
+/**
+ * @brief Returns the number of workers a pool started with the given 
+ * workers setting runs, for opening one SO_REUSEPORT shard per worker.
+ * @param workers The workers setting; <= 0 is one per online CPU.
+ * @return The number of workers.
+ */
+extern int worker_pool_size(int workers);
+
+/**
+ * @brief Stops all workers, closes their connections and frees the pool.
+ * @param pool The pool to stop.
+ * @return nothing
+ */
+extern void worker_pool_stop(worker_pool_s *pool);
+
+#endif // WORKER_H